@@ -1,10 +1,20 @@
 #include "zidx.h"
 
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <zlib.h>
 #include <streamlike.h>
 
+#ifdef HAVE_ZLIB_NG
+#include <zlib-ng.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -23,6 +33,45 @@ extern "C" {
 uint8_t zx_magic_prefix[] = {'Z', 'I', 'D', 'X'};
 uint8_t zx_version_prefix[] = {0, 0};
 
+/**
+ * Index file flag denoting that each checkpoint has the length of its block
+ * header in metadata, and its block header following its window data.
+ */
+#define ZX_FLAG_BLOCK_HEADERS_ (0x1)
+
+/**
+ * Index file flag denoting that each checkpoint has the length of its
+ * compressed window in metadata, which is zero if window is not compressed.
+ */
+#define ZX_FLAG_COMPRESSED_WINDOWS_ (0x2)
+
+/**
+ * Index file flag denoting that each checkpoint has the number of ranges of
+ * its sparse window in metadata, and ranges preceding its window data.
+ */
+#define ZX_FLAG_SPARSE_WINDOWS_ (0x4)
+
+/**
+ * Index file flag denoting that offsets in checkpoint metadata are stored as
+ * variable length differences from those of previous checkpoint.
+ */
+#define ZX_FLAG_COMPACT_OFFSETS_ (0x8)
+
+/**
+ * Index file flag denoting that checkpoint metadata is followed by offsets of
+ * gzip members of indexed file.
+ */
+#define ZX_FLAG_MEMBERS_ (0x10)
+
+/** Maximum length of a variable length integer in index file. */
+#define ZX_VARINT_MAX_LENGTH_ (10)
+
+/**
+ * Round offset up to a multiple of alignment.
+ */
+#define ZX_ALIGN_(offset, alignment) \
+    (((offset) + (alignment) - 1) / (alignment) * (alignment))
+
 typedef enum zidx_stream_state
 {
     ZX_STATE_INVALID,
@@ -38,16 +87,164 @@ struct zidx_checkpoint_offset_s
     off_t comp;
     uint8_t comp_bits_count;
     uint8_t comp_byte;
+    uint8_t in_block;
 };
 
+typedef struct zidx_member_s
+{
+    off_t comp;
+    off_t uncomp;
+} zidx_member;
+
 struct zidx_checkpoint_s
 {
     zidx_checkpoint_offset offset;
     uint32_t checksum;
     uint16_t window_length;
+    uint16_t window_comp_length;
     uint8_t *window_data;
+    uint8_t is_window_sparse;
+    uint16_t window_ranges_count;
+    uint16_t *window_ranges;
+    uint16_t block_header_bits;
+    uint8_t *block_header;
+    off_t window_offset;
+    uint8_t is_window_lazy;
+    uint8_t is_window_mapped;
+    uint8_t is_window_stored;
+    uint8_t is_window_evicted;
+    uint8_t is_window_in_lru;
+    uint8_t is_window_in_arena;
+    int lru_prev;
+    int lru_next;
 };
 
+/**
+ * Elias-Fano encoded uncompressed offsets of checkpoints, which are used for
+ * looking up checkpoints. See search_lookup().
+ */
+typedef struct zidx_lookup_s
+{
+    /* Lower width bits of offsets, packed. */
+    uint64_t *low;
+
+    /* Higher bits of offsets, as set bits separated by unset bits. */
+    uint64_t *high;
+
+    /* Positions of every ZX_LOOKUP_BLOCK_th set and unset bit of high. */
+    size_t *ones;
+    size_t *zeros;
+
+    size_t high_bits;
+    size_t zeros_count;
+    int count;
+    int capacity;
+    int width;
+} zidx_lookup;
+
+typedef struct zidx_async_build_s zidx_async_build;
+typedef struct zidx_pread_pool_s zidx_pread_pool;
+typedef struct zidx_readahead_s zidx_readahead;
+
+/**
+ * Inflate implementation used for decoding. Functions have the same semantics
+ * with their zlib counterparts. In particular, inflate() should support
+ * Z_BLOCK and Z_TREES, and report block boundaries in data_type of z_stream.
+ */
+typedef struct zidx_inflate_backend_s
+{
+    zidx_inflate_backend_type type;
+    const char *name;
+    int (*init)(z_stream *zs, int window_bits);
+    int (*reset)(z_stream *zs, int window_bits);
+    int (*inflate)(z_stream *zs, int flush);
+    int (*prime)(z_stream *zs, int bits, int value);
+    int (*set_dictionary)(z_stream *zs, const Bytef *dictionary,
+                          uInt dict_length);
+    int (*get_dictionary)(z_stream *zs, Bytef *dictionary, uInt *dict_length);
+    long (*mark)(z_stream *zs);
+    int (*end)(z_stream *zs);
+} zidx_inflate_backend;
+
+/**
+ * Capacity of buffer used for collecting block headers. The longest dynamic
+ * block header is about 2300 bits.
+ */
+#define ZX_BLOCK_HEADER_CAPACITY_ (320)
+
+/**
+ * State of the deflate block being decoded, used for placing checkpoints
+ * inside blocks.
+ */
+typedef struct zidx_block_state_s
+{
+    /* Bits of block header, starting from the first bit of block. */
+    uint8_t header[ZX_BLOCK_HEADER_CAPACITY_];
+
+    /* Number of bits in header, or -1 if header of the current block is not
+     * known. */
+    int header_bits;
+
+    /* Whether the whole header is collected. */
+    char is_header_complete;
+
+    /* Whether inflate is fed byte by byte to find a checkpoint candidate. */
+    char is_stepping;
+
+    /* Uncompressed offset of the last candidate, or the block start. */
+    off_t last_uncomp;
+} zidx_block_state;
+
+typedef struct spacing_data_s
+{
+    zidx_checkpoint_offset last;
+    off_t blocks_count;
+    off_t spacing_length;
+    char is_uncompressed;
+    unsigned int comp_weight;
+    unsigned int uncomp_weight;
+    unsigned int block_weight;
+} spacing_data;
+
+/**
+ * Chunk of memory which windows are allocated from. Header of chunk is placed
+ * at its beginning, and windows follow it.
+ */
+typedef struct zidx_arena_chunk_s
+{
+    struct zidx_arena_chunk_s *next;
+    size_t size;
+    size_t used;
+} zidx_arena_chunk;
+
+/** Chunk of decoded data kept in read cache. */
+typedef struct zidx_cache_entry_s
+{
+    /* Uncompressed offset of the first byte of chunk. */
+    off_t start;
+
+    /* Number of bytes in chunk. */
+    unsigned int length;
+
+    /* Whether chunk ends at the end of file. */
+    char is_last;
+
+    uint8_t *data;
+
+    /* Next chunk in the same hash bucket. */
+    struct zidx_cache_entry_s *hash_next;
+
+    /* Neighbours in LRU list, whose head is the most recently used chunk. */
+    struct zidx_cache_entry_s *lru_prev;
+    struct zidx_cache_entry_s *lru_next;
+} zidx_cache_entry;
+
+/** Alignment of allocations from arena. */
+#define ZX_ARENA_ALIGNMENT_ (sizeof(void*))
+
+/** Size of huge pages, which arena chunks are rounded up to if requested. */
+#define ZX_HUGE_PAGE_SIZE_ ((size_t)1 << 21)
+
 struct zidx_index_s
 {
     streamlike_t *comp_stream;
@@ -68,8 +265,382 @@ struct zidx_index_s
     char inflate_initialized;
     off_t compressed_size;
     off_t uncompressed_size;
+    zidx_async_build *async;
+    pthread_mutex_t *stream_lock;
+    pthread_rwlock_t *list_lock;
+    off_t comp_stream_pos;
+    spacing_data auto_spacing;
+    unsigned int spacing_comp_weight;
+    unsigned int spacing_uncomp_weight;
+    unsigned int spacing_block_weight;
+    zidx_member *members;
+    int members_count;
+    int members_capacity;
+    signed char is_bgzf;
+    const zidx_inflate_backend *backend;
+    int intra_block_step;
+    zidx_block_state block_state;
+    zidx_window_compression window_compression;
+    int window_compression_level;
+    z_stream *window_deflate;
+    z_stream *window_inflate;
+    uint8_t *window_buffer;
+    char is_sparse_windows;
+    int sparse_analyzed_count;
+    off_t window_valid_until;
+    streamlike_t *window_stream;
+    uint8_t *map_data;
+    size_t map_length;
+    unsigned int export_alignment;
+    char is_export_compact;
+    size_t window_budget;
+    size_t window_memory;
+    unsigned long window_evictions;
+    int lru_head;
+    int lru_tail;
+    size_t arena_chunk_size;
+    char is_arena_huge;
+    zidx_arena_chunk *arena;
+    zidx_allocator allocator;
+    size_t cache_budget;
+    unsigned int cache_chunk_size;
+    zidx_cache_entry **cache_buckets;
+    unsigned int cache_buckets_count;
+    zidx_cache_entry *cache_head;
+    zidx_cache_entry *cache_tail;
+    size_t cache_memory;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    off_t cache_offset;
+    char is_cache_eof;
+    zidx_checkpoint *snapshots;
+    int snapshots_capacity;
+    int snapshots_count;
+    size_t snapshot_memory;
+    int snapshot_next;
+    off_t snapshot_spacing;
+    off_t snapshot_from;
+    char is_list_shared;
+    int cursors_count;
+    zidx_pread_pool *pread_pool;
+    zidx_readahead *readahead;
+    zidx_lookup lookup;
+    int lookup_hint;
+};
+
+static int auto_checkpoint_callback(void *context,
+                                    zidx_index *index,
+                                    zidx_checkpoint_offset *offset,
+                                    int is_last_block);
+
+static int snapshot_callback(void *context,
+                             zidx_index *index,
+                             zidx_checkpoint_offset *offset,
+                             int is_last_block);
+static void release_snapshots(zidx_index *index);
+static void release_pread_pool(zidx_index *index);
+static int is_index_shared(zidx_index *index);
+
+static int limit_sparse_output(zidx_index *index, unsigned int *length);
+
+static int read_from_cache(zidx_index *index, void *buffer, int nbytes);
+static void drop_cache_chunks(zidx_index *index, char only_last);
+
+static int read_ahead(zidx_index *index, void *buffer, int nbytes);
+static int seek_in_readahead(zidx_index *index, off_t offset);
+static void stop_readahead(zidx_index *index);
+
+static void release_lookup(zidx_index *index);
+static int find_checkpoint_idx(zidx_index *index, off_t offset, int *hint);
+
+static void* default_malloc(void *opaque, size_t size)
+{
+    return malloc(size);
+}
+
+static void* default_realloc(void *opaque, void *ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+static void default_free(void *opaque, void *ptr)
+{
+    free(ptr);
+}
+
+/** Allocator using standard library, which is used by default. */
+static const zidx_allocator default_allocator = {
+    default_malloc,
+    default_realloc,
+    default_free,
+    NULL
+};
+
+/**
+ * Allocate memory with allocator of index.
+ */
+static void* index_malloc(zidx_index *index, size_t size)
+{
+    return index->allocator.malloc_func(index->allocator.opaque, size);
+}
+
+/**
+ * Allocate zero-initialized memory for an array with allocator of index.
+ */
+static void* index_calloc(zidx_index *index, size_t count, size_t size)
+{
+    void *ptr;
+
+    if (size > 0 && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    ptr = index_malloc(index, count * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+/**
+ * Resize memory allocated with allocator of index.
+ */
+static void* index_realloc(zidx_index *index, void *ptr, size_t size)
+{
+    return index->allocator.realloc_func(index->allocator.opaque, ptr, size);
+}
+
+/**
+ * Release memory allocated with allocator of index. NULL is ignored.
+ */
+static void index_free(zidx_index *index, void *ptr)
+{
+    if (ptr != NULL) {
+        index->allocator.free_func(index->allocator.opaque, ptr);
+    }
+}
+
+/**
+ * zalloc function of z_streams, which allocates with allocator of index given
+ * as opaque.
+ */
+static voidpf index_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    return index_malloc((zidx_index*)opaque, (size_t)items * size);
+}
+
+/**
+ * zfree function of z_streams, which releases with allocator of index given
+ * as opaque.
+ */
+static void index_zfree(voidpf opaque, voidpf ptr)
+{
+    index_free((zidx_index*)opaque, ptr);
+}
+
+/**
+ * Make zlib allocate internal state of z_stream with allocator of index. It
+ * should be called before z_stream is initialized.
+ */
+static void set_stream_allocator(zidx_index *index, z_stream *zs)
+{
+    zs->zalloc = index_zalloc;
+    zs->zfree  = index_zfree;
+    zs->opaque = index;
+}
+
+/**
+ * Initialize zs with inflateInit2(), which is a macro in zlib.
+ */
+static int zlib_backend_init(z_stream *zs, int window_bits)
+{
+    return inflateInit2(zs, window_bits);
+}
+
+/** Backend using zlib. */
+static const zidx_inflate_backend zlib_backend = {
+    ZX_BACKEND_ZLIB,
+    "zlib",
+    zlib_backend_init,
+    inflateReset2,
+    inflate,
+    inflatePrime,
+    inflateSetDictionary,
+    inflateGetDictionary,
+    inflateMark,
+    inflateEnd
+};
+
+#ifdef HAVE_ZLIB_NG
+/*
+ * zlib-ng backend keeps a zng_stream in state field of z_stream, which is not
+ * used otherwise, since zlib functions are never called on a z_stream driven
+ * by this backend. Buffer pointers are copied between two streams around each
+ * call.
+ */
+
+#define ZX_ZNG_STREAM_(zs) ((zng_stream*)(zs)->state)
+
+static void zng_backend_sync_in(z_stream *zs)
+{
+    zng_stream *zng = ZX_ZNG_STREAM_(zs);
+    zng->next_in   = zs->next_in;
+    zng->avail_in  = zs->avail_in;
+    zng->next_out  = zs->next_out;
+    zng->avail_out = zs->avail_out;
+}
+
+static void zng_backend_sync_out(z_stream *zs)
+{
+    zng_stream *zng = ZX_ZNG_STREAM_(zs);
+    zs->next_in   = (Bytef*)zng->next_in;
+    zs->avail_in  = zng->avail_in;
+    zs->next_out  = zng->next_out;
+    zs->avail_out = zng->avail_out;
+    zs->total_in  = zng->total_in;
+    zs->total_out = zng->total_out;
+    zs->data_type = zng->data_type;
+    zs->msg       = (char*)zng->msg;
+}
+
+/**
+ * Release zng_stream allocated by zng_backend_init().
+ */
+static void zng_backend_free(z_stream *zs, zng_stream *zng)
+{
+    if (zs->zfree != Z_NULL) {
+        zs->zfree(zs->opaque, zng);
+    } else {
+        free(zng);
+    }
+}
+
+static int zng_backend_init(z_stream *zs, int window_bits)
+{
+    zng_stream *zng;
+    int z_ret;
+
+    /* zng_stream is allocated with allocation functions of z_stream, which
+     * are used for its internal state as well. */
+    if (zs->zalloc != Z_NULL) {
+        zng = zs->zalloc(zs->opaque, 1, sizeof(zng_stream));
+        if (zng != NULL) {
+            memset(zng, 0, sizeof(zng_stream));
+        }
+    } else {
+        zng = calloc(1, sizeof(zng_stream));
+    }
+    if (zng == NULL) {
+        return Z_MEM_ERROR;
+    }
+    zng->zalloc = zs->zalloc;
+    zng->zfree  = zs->zfree;
+    zng->opaque = zs->opaque;
+    z_ret = zng_inflateInit2(zng, window_bits);
+    if (z_ret != Z_OK) {
+        zng_backend_free(zs, zng);
+        return z_ret;
+    }
+    zs->state = (struct internal_state*)zng;
+    zs->msg   = NULL;
+    return Z_OK;
+}
+
+static int zng_backend_reset(z_stream *zs, int window_bits)
+{
+    int z_ret = zng_inflateReset2(ZX_ZNG_STREAM_(zs), window_bits);
+    zng_backend_sync_out(zs);
+    return z_ret;
+}
+
+static int zng_backend_inflate(z_stream *zs, int flush)
+{
+    int z_ret;
+
+    zng_backend_sync_in(zs);
+    z_ret = zng_inflate(ZX_ZNG_STREAM_(zs), flush);
+    zng_backend_sync_out(zs);
+    return z_ret;
+}
+
+static int zng_backend_prime(z_stream *zs, int bits, int value)
+{
+    return zng_inflatePrime(ZX_ZNG_STREAM_(zs), bits, value);
+}
+
+static int zng_backend_set_dictionary(z_stream *zs, const Bytef *dictionary,
+                                      uInt dict_length)
+{
+    return zng_inflateSetDictionary(ZX_ZNG_STREAM_(zs), dictionary,
+                                    dict_length);
+}
+
+static int zng_backend_get_dictionary(z_stream *zs, Bytef *dictionary,
+                                      uInt *dict_length)
+{
+    uint32_t length;
+    int z_ret;
+
+    z_ret = zng_inflateGetDictionary(ZX_ZNG_STREAM_(zs), dictionary, &length);
+    *dict_length = length;
+    return z_ret;
+}
+
+static long zng_backend_mark(z_stream *zs)
+{
+    return zng_inflateMark(ZX_ZNG_STREAM_(zs));
+}
+
+static int zng_backend_end(z_stream *zs)
+{
+    int z_ret;
+
+    z_ret = zng_inflateEnd(ZX_ZNG_STREAM_(zs));
+    zng_backend_free(zs, ZX_ZNG_STREAM_(zs));
+    zs->state = NULL;
+    return z_ret;
+}
+
+/** Backend using native API of zlib-ng. */
+static const zidx_inflate_backend zng_backend = {
+    ZX_BACKEND_ZLIB_NG,
+    "zlib-ng",
+    zng_backend_init,
+    zng_backend_reset,
+    zng_backend_inflate,
+    zng_backend_prime,
+    zng_backend_set_dictionary,
+    zng_backend_get_dictionary,
+    zng_backend_mark,
+    zng_backend_end
 };
 
+#undef ZX_ZNG_STREAM_
+#endif
+
+/**
+ * Get backend of given type.
+ *
+ * \param type Backend type.
+ *
+ * \return Backend if it's available in this build, NULL otherwise.
+ */
+static const zidx_inflate_backend* get_inflate_backend(
+        zidx_inflate_backend_type type)
+{
+    switch (type) {
+        case ZX_BACKEND_ZLIB:
+            return &zlib_backend;
+#ifdef HAVE_ZLIB_NG
+        case ZX_BACKEND_ZLIB_NG:
+            return &zng_backend;
+#endif
+        default:
+            /* ISA-L and libdeflate can't stop at block boundaries or resume
+             * from a bit offset, which checkpoints depend on. */
+            return NULL;
+    }
+}
+
 /**
  * Return number of unused bits count in the last byte consumed by inflate().
  *
@@ -120,6 +691,21 @@ static inline int is_on_block_boundary(z_stream *zs)
     return zs->data_type & 128;
 }
 
+/**
+ * Check if zlib stream is at the end of a block header.
+ *
+ * This function should be used after a call to inflate with Z_TREES. See the
+ * documentation of inflate() in zlib manual for more details.
+ *
+ * \param zs zlib stream.
+ *
+ * \return 256 if inflate stopped at the end of a block header, 0 otherwise.
+ */
+static inline int is_after_block_header(z_stream *zs)
+{
+    return zs->data_type & 256;
+}
+
 /**
  * Inflate using buffers from zs, and update index->offset accordingly.
  *
@@ -168,8 +754,16 @@ static int inflate_and_update_offset(zidx_index* index, z_stream* zs,
      * setting index->offset.comp_byte may underflow while updating offset. */
     if (available_comp_bytes == 0) return Z_OK;
 
-    /* Use zlib to inflate data. */
-    z_ret = inflate(zs, flush);
+    /* Use backend to inflate data. */
+    z_ret = index->backend->inflate(zs, flush);
+
+    /* With Z_TREES, inflate may stop at a block boundary or at the end of a
+     * block header without any progress, e.g. after header of an empty stored
+     * block, or if a block header is already held by inflate. */
+    if (z_ret == Z_BUF_ERROR && flush == Z_TREES
+            && (is_on_block_boundary(zs) || is_after_block_header(zs))) {
+        z_ret = Z_OK;
+    }
     if (z_ret != Z_OK && z_ret != Z_STREAM_END) {
         ZX_LOG("ERROR: inflate (%d).", z_ret);
         return z_ret;
@@ -208,54 +802,329 @@ static int inflate_and_update_offset(zidx_index* index, z_stream* zs,
 }
 
 /**
- * Initialize zs using inflateInit2() if this is first time. Otherwise use
- * inflateReset2().
- *
- * \param index       Index data.
- * \param zs          zlib stream data.
- * \param window_bits Parameter to pass as a second argument to
- *                    inflateInit2() or inflateReset2()
+ * Start collecting header of the block beginning at current offset of index.
+ * Unused bits of the byte shared with the previous block are the first bits of
+ * the header.
  *
- * \return The return value of inflateInit2() or inflateReset2().
+ * \param index Index data.
+ */
+static void start_block_header(zidx_index *index)
+{
+    zidx_block_state *state = &index->block_state;
+
+    memset(state->header, 0, sizeof(state->header));
+    state->header[0] = index->offset.comp_byte
+                           >> (8 - index->offset.comp_bits_count);
+    state->header_bits        = index->offset.comp_bits_count;
+    state->is_header_complete = 0;
+    state->is_stepping        = 0;
+    state->last_uncomp        = index->offset.uncomp;
+}
+
+/**
+ * Append bytes consumed by inflate to the block header being collected.
+ * Collecting is given up if the header doesn't fit into the buffer.
  *
- * \todo  It is reduntant to pass zs, as it should be same with
- *        index->z_stream. Consider removing second argument.
- * */
-static int initialize_inflate(zidx_index* index, z_stream* zs, int window_bits)
+ * \param state  Block state.
+ * \param data   Consumed bytes.
+ * \param length Number of consumed bytes.
+ */
+static void append_block_header(zidx_block_state *state,
+                                const uint8_t *data,
+                                int length)
 {
-    int z_ret;
+    int shift;
+    int i;
 
-    /* Sanity checks. */
-    if (index == NULL) {
-        ZX_LOG("ERROR: index is NULL.");
-        return ZX_ERR_PARAMS;
+    if (state->header_bits < 0 || state->is_header_complete) {
+        return;
     }
-    if (zs == NULL) {
-        ZX_LOG("ERROR: z_stream argument zs is NULL.");
-        return ZX_ERR_PARAMS;
+    if (state->header_bits + 8 * length >= 8 * ZX_BLOCK_HEADER_CAPACITY_) {
+        ZX_LOG("WARNING: Block header is too long to be collected.");
+        state->header_bits = -1;
+        return;
     }
 
-    if (!index->inflate_initialized) {
-        z_ret = inflateInit2(zs, window_bits);
-        if (z_ret == Z_OK) {
-            index->inflate_initialized = 1;
-            ZX_LOG("Initialized inflate successfully.");
-        } else {
-            ZX_LOG("ERROR: inflateInit2 returned error (%d).", z_ret);
-        }
-    } else {
-        z_ret = inflateReset2(zs, window_bits);
-        if (z_ret == Z_OK) {
-            ZX_LOG("Reset inflate successfully.");
-        } else {
-            ZX_LOG("ERROR: inflateReset2 returned error (%d).", z_ret);
+    shift = state->header_bits % 8;
+    for (i = 0; i < length; i++) {
+        state->header[state->header_bits / 8] |= data[i] << shift;
+        if (shift > 0) {
+            state->header[state->header_bits / 8 + 1] = data[i] >> (8 - shift);
         }
+        state->header_bits += 8;
     }
-    return z_ret;
 }
 
 /**
- * Read headers of a gzip or zlib file.
+ * Inflate while keeping track of the current deflate block, so checkpoints
+ * can be placed inside blocks. Inflate stops at the end of block headers as
+ * well as block boundaries, and bytes of block headers are collected. At most
+ * intra_block_step bytes are produced in a call after the header, and input is
+ * fed byte by byte while looking for a checkpoint candidate.
+ *
+ * \param index Index data.
+ * \param zs    zlib stream data.
+ *
+ * \return The return value of inflate_and_update_offset().
+ */
+static int inflate_in_blocks(zidx_index* index, z_stream* zs)
+{
+    /* Input and output bytes held back from inflate in this call. */
+    uInt held_in  = 0;
+    uInt held_out = 0;
+
+    /* Used for storing return value of zlib calls. */
+    int z_ret;
+
+    /* Aliases. */
+    zidx_block_state *state = &index->block_state;
+    const uint8_t *next_in  = zs->next_in;
+
+    if (state->is_stepping && zs->avail_in > 1) {
+        held_in      = zs->avail_in - 1;
+        zs->avail_in = 1;
+    }
+    if (state->is_header_complete
+            && zs->avail_out > (uInt)index->intra_block_step) {
+        held_out      = zs->avail_out - index->intra_block_step;
+        zs->avail_out = index->intra_block_step;
+    }
+
+    z_ret = inflate_and_update_offset(index, zs, Z_TREES);
+
+    zs->avail_in  += held_in;
+    zs->avail_out += held_out;
+
+    if (z_ret != Z_OK && z_ret != Z_STREAM_END) {
+        return z_ret;
+    }
+
+    if (is_on_block_boundary(zs)) {
+        start_block_header(index);
+    } else if (!state->is_header_complete && state->header_bits >= 0) {
+        append_block_header(state, next_in, zs->next_in - next_in);
+        if (is_after_block_header(zs) && state->header_bits >= 0) {
+            /* Unused bits of the last consumed byte belong to block data. */
+            state->header_bits       -= get_unused_bits_count(zs);
+            state->is_header_complete = 1;
+            state->last_uncomp        = index->offset.uncomp;
+        }
+    }
+
+    return z_ret;
+}
+
+/**
+ * Get offset of the point inflate stopped at, if decoding can be resumed from
+ * it with the block header. These are the points between two codes in
+ * compressed blocks, and any point in stored blocks.
+ *
+ * \param index  Index data.
+ * \param zs     zlib stream data.
+ * \param offset Offset to fill in.
+ *
+ * \return 1 if decoding can be resumed from the point, 0 otherwise.
+ */
+static int get_intra_block_offset(zidx_index *index,
+                                  z_stream *zs,
+                                  zidx_checkpoint_offset *offset)
+{
+    /* See inflateMark() in zlib manual. Zero means no code is being
+     * processed, values between -65536 and 0 mean inflate is in a stored
+     * block. */
+    long mark;
+
+    /* Number of bits held by inflate. It can be more than 7 while waiting for
+     * a code. */
+    int held_bits;
+
+    mark = index->backend->mark(zs);
+    if (mark != 0 && (mark >= 0 || mark <= -65536)) {
+        return 0;
+    }
+
+    /* The byte shared with block data should be in input buffer. */
+    held_bits = zs->data_type & 63;
+    if (held_bits >= 8
+            || (held_bits > 0 && zs->next_in == index->comp_data_buffer)) {
+        return 0;
+    }
+
+    *offset = index->offset;
+    offset->comp_bits_count = held_bits;
+    offset->comp_byte       = held_bits > 0 ? *(zs->next_in - 1) : 0;
+    offset->in_block        = 1;
+    return 1;
+}
+
+/**
+ * Call block callback inside a deflate block if intra_block_step bytes are
+ * decoded since the last call or the beginning of the block. Input is fed
+ * byte by byte until a point which decoding can be resumed from is found.
+ *
+ * \param index            Index data.
+ * \param zs               zlib stream data.
+ * \param block_callback   Block callback.
+ * \param callback_context Context passed to block callback.
+ *
+ * \return ZX_RET_OK, or the return value of block callback if it's nonzero.
+ */
+static int visit_block_data(zidx_index *index,
+                            z_stream *zs,
+                            zidx_block_callback block_callback,
+                            void *callback_context)
+{
+    zidx_checkpoint_offset offset;
+    zidx_block_state *state = &index->block_state;
+
+    if (!state->is_stepping) {
+        if (index->offset.uncomp - state->last_uncomp
+                < index->intra_block_step) {
+            return ZX_RET_OK;
+        }
+        state->is_stepping = 1;
+    }
+    if (!get_intra_block_offset(index, zs, &offset)) {
+        return ZX_RET_OK;
+    }
+
+    state->is_stepping = 0;
+    state->last_uncomp = offset.uncomp;
+
+    ZX_LOG("Calling block callback inside block (comp: %jd, uncomp: %jd).",
+           (intmax_t)offset.comp, (intmax_t)offset.uncomp);
+    return (*block_callback)(callback_context, index, &offset, 0);
+}
+
+/**
+ * Read from compressed stream of index.
+ *
+ * If the stream is shared with a background build, the stream is locked and
+ * repositioned to where this index left it before reading.
+ *
+ * \param index Index data.
+ * \param buf   Buffer to read data into.
+ * \param len   Number of bytes to read.
+ *
+ * \return Number of bytes read if successful.
+ *         ZX_ERR_STREAM_SEEK if the stream couldn't be repositioned.
+ *         ZX_ERR_STREAM_READ if an error happens while reading from stream.
+ */
+static int read_comp_stream(zidx_index *index, void *buf, int len)
+{
+    /* Used for storing number of bytes read from stream. */
+    int s_read_len;
+
+    /* Used for storing return value of stream functions. */
+    int s_ret;
+
+    if (index->stream_lock != NULL) {
+        pthread_mutex_lock(index->stream_lock);
+        s_ret = sl_seek(index->comp_stream, index->comp_stream_pos,
+                        SL_SEEK_SET);
+        if (s_ret != 0) {
+            pthread_mutex_unlock(index->stream_lock);
+            ZX_LOG("ERROR: Couldn't seek in stream (%d).", s_ret);
+            return ZX_ERR_STREAM_SEEK;
+        }
+    }
+
+    s_read_len = sl_read(index->comp_stream, buf, len);
+    s_ret = sl_error(index->comp_stream);
+
+    if (index->stream_lock != NULL) {
+        pthread_mutex_unlock(index->stream_lock);
+    }
+
+    if (s_ret) {
+        ZX_LOG("ERROR: Reading from stream (%d).", s_ret);
+        return ZX_ERR_STREAM_READ;
+    }
+
+    index->comp_stream_pos += s_read_len;
+    return s_read_len;
+}
+
+/**
+ * Seek in compressed stream of index.
+ *
+ * \param index  Index data.
+ * \param offset Offset from the beginning of compressed stream.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_STREAM_SEEK if the stream couldn't be repositioned.
+ */
+static int seek_comp_stream(zidx_index *index, off_t offset)
+{
+    /* Used for storing return value of stream functions. */
+    int s_ret;
+
+    if (index->stream_lock != NULL) {
+        pthread_mutex_lock(index->stream_lock);
+    }
+    s_ret = sl_seek(index->comp_stream, offset, SL_SEEK_SET);
+    if (index->stream_lock != NULL) {
+        pthread_mutex_unlock(index->stream_lock);
+    }
+
+    if (s_ret != 0) {
+        ZX_LOG("ERROR: Couldn't seek in stream (%d).", s_ret);
+        return ZX_ERR_STREAM_SEEK;
+    }
+
+    index->comp_stream_pos = offset;
+    return ZX_RET_OK;
+}
+
+/**
+ * Initialize zs using inflateInit2() if this is first time. Otherwise use
+ * inflateReset2().
+ *
+ * \param index       Index data.
+ * \param zs          zlib stream data.
+ * \param window_bits Parameter to pass as a second argument to
+ *                    inflateInit2() or inflateReset2()
+ *
+ * \return The return value of inflateInit2() or inflateReset2().
+ *
+ * \todo  It is reduntant to pass zs, as it should be same with
+ *        index->z_stream. Consider removing second argument.
+ * */
+static int initialize_inflate(zidx_index* index, z_stream* zs, int window_bits)
+{
+    int z_ret;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (zs == NULL) {
+        ZX_LOG("ERROR: z_stream argument zs is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+
+    if (!index->inflate_initialized) {
+        z_ret = index->backend->init(zs, window_bits);
+        if (z_ret == Z_OK) {
+            index->inflate_initialized = 1;
+            ZX_LOG("Initialized inflate successfully.");
+        } else {
+            ZX_LOG("ERROR: inflateInit2 returned error (%d).", z_ret);
+        }
+    } else {
+        z_ret = index->backend->reset(zs, window_bits);
+        if (z_ret == Z_OK) {
+            ZX_LOG("Reset inflate successfully.");
+        } else {
+            ZX_LOG("ERROR: inflateReset2 returned error (%d).", z_ret);
+        }
+    }
+    return z_ret;
+}
+
+/**
+ * Read headers of a gzip or zlib file.
  *
  * \param index Index data.
  *
@@ -293,27 +1162,24 @@ static int read_headers(zidx_index* index,
     }
 
     /* Aliases for frequently used members of index. */
-    streamlike_t* stream = index->comp_stream;
     z_stream* zs = index->z_stream;
     uint8_t* buf = index->comp_data_buffer;
     int buf_len  = index->comp_data_buffer_size;
 
-    zs->next_in   = buf;
-    zs->avail_in  = 0;
+    /* Input buffer isn't reset here, since it may keep the header of the next
+     * member of a gzip file. */
 
     header_completed = 0;
     while (!header_completed) {
         /* Read from stream if no data is available in buffer. */
         if (zs->avail_in == 0) {
-            s_read_len = sl_read(stream, buf, buf_len);
-            s_ret = sl_error(stream);
-            if (s_ret) {
-                ZX_LOG("ERROR: Reading from stream (%d).", s_ret);
-                return ZX_ERR_STREAM_READ;
+            s_read_len = read_comp_stream(index, buf, buf_len);
+            if (s_read_len < 0) {
+                ZX_LOG("ERROR: Reading from stream (%d).", s_read_len);
+                return s_read_len;
             }
             if (s_read_len == 0) {
-                ZX_LOG("ERROR: Unexpected EOF while reading file header (%d).",
-                       s_ret);
+                ZX_LOG("ERROR: Unexpected EOF while reading file header.");
                 return ZX_ERR_STREAM_EOF;
             }
             zs->next_in  = buf;
@@ -377,25 +1243,29 @@ static int read_deflate_blocks(zidx_index* index,
     }
 
     /* Aliases for frequently used members of index. */
-    streamlike_t* stream = index->comp_stream;
     z_stream* zs = index->z_stream;
     uint8_t* buf = index->comp_data_buffer;
     int buf_len  = index->comp_data_buffer_size;
 
+    /* Blocks are passed without noticing their headers, unless checkpoints are
+     * placed inside blocks. */
+    if (block_callback == NULL || index->intra_block_step == 0) {
+        index->block_state.header_bits        = -1;
+        index->block_state.is_header_complete = 0;
+    }
+
     reading_completed = 0;
     while (!reading_completed) {
         /* Read from stream if no data is available in buffer. */
         if(zs->avail_in == 0) {
-            s_read_len = sl_read(stream, buf, buf_len);
-            s_ret = sl_error(stream);
-            if (s_ret) {
-                ZX_LOG("ERROR: Reading from stream (%d).",
-                       s_ret);
-                return ZX_ERR_STREAM_READ;
+            s_read_len = read_comp_stream(index, buf, buf_len);
+            if (s_read_len < 0) {
+                ZX_LOG("ERROR: Reading from stream (%d).", s_read_len);
+                return s_read_len;
             }
             if (s_read_len == 0) {
-                ZX_LOG("ERROR: Unexpected EOF while reading file "
-                       "header. (%d).", s_ret);
+                ZX_LOG("ERROR: Unexpected EOF while reading deflate "
+                       "blocks.");
                 return ZX_ERR_STREAM_EOF;
             }
 
@@ -404,10 +1274,23 @@ static int read_deflate_blocks(zidx_index* index,
         }
         if (block_callback == NULL) {
             z_ret = inflate_and_update_offset(index, zs, Z_SYNC_FLUSH);
-        } else {
+        } else if (index->intra_block_step == 0) {
             z_ret = inflate_and_update_offset(index, zs, Z_BLOCK);
+        } else {
+            z_ret = inflate_in_blocks(index, zs);
         }
         if (z_ret == Z_OK || z_ret == Z_STREAM_END) {
+            if (!is_on_block_boundary(zs)
+                    && index->block_state.is_header_complete
+                    && index->block_state.header_bits >= 0) {
+                s_ret = visit_block_data(index, zs, block_callback,
+                                         callback_context);
+                if (s_ret != 0) {
+                    ZX_LOG("WARNING: Callback returned non-zero (%d). "
+                           "Returning from function.", s_ret);
+                    return s_ret;
+                }
+            }
             if (is_on_block_boundary(zs)) {
                 ZX_LOG("On block boundary.");
                 if (is_last_deflate_block(zs)) {
@@ -472,7 +1355,6 @@ static int read_gzip_trailer(zidx_index* index)
     }
 
     /* Aliases. */
-    streamlike_t* stream = index->comp_stream;
     z_stream* zs = index->z_stream;
 
     /* Number of bytes already read into buffer. */
@@ -487,12 +1369,12 @@ static int read_gzip_trailer(zidx_index* index)
     /* If there are more data to be read for trailer... */
     if (read_bytes < 8) {
         /* ...read it from stream. */
-        s_read_len = sl_read(stream, trailer, 8 - read_bytes);
+        s_read_len = read_comp_stream(index, trailer, 8 - read_bytes);
 
-        if (sl_error(stream) != 0) {
+        if (s_read_len < 0) {
             ZX_LOG("ERROR: Error while reading remaining %d bytes of trailer "
                    " from stream.", 8 - read_bytes);
-            return ZX_ERR_STREAM_READ;
+            return s_read_len;
         }
         index->offset.comp += s_read_len;
         if (s_read_len != 8 - read_bytes) {
@@ -503,71 +1385,317 @@ static int read_gzip_trailer(zidx_index* index)
     return ZX_RET_OK;
 }
 
-zidx_index* zidx_index_create()
+/**
+ * Add a member to member list of index. The list is kept sorted, and a member
+ * is ignored if it's already in the list.
+ *
+ * \param index  Index data.
+ * \param comp   Compressed offset of the member header.
+ * \param uncomp Uncompressed offset of the member data.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_MEMORY if list couldn't be extended.
+ */
+static int add_member(zidx_index *index, off_t comp, off_t uncomp)
 {
-    zidx_index *index;
-    index = (zidx_index*) malloc(sizeof(zidx_index));
-    return index;
-}
+    zidx_member *new_members;
+    int new_capacity;
+    int idx;
 
-int zidx_index_init(zidx_index *index,
-                    streamlike_t *comp_stream)
-{
-    return zidx_index_init_ex(index,
-                              comp_stream,
-                              ZX_STREAM_GZIP_OR_ZLIB,
-                              ZX_CHECKSUM_DEFAULT,
-                              NULL,
-                              ZX_DEFAULT_INITIAL_LIST_CAPACITY,
-                              ZX_DEFAULT_WINDOW_SIZE,
-                              ZX_DEFAULT_COMPRESSED_DATA_BUFFER_SIZE,
-                              ZX_DEFAULT_SEEKING_DATA_BUFFER_SIZE);
+    /* Members are mostly added in order, so search from the end. */
+    idx = index->members_count;
+    while (idx > 0 && index->members[idx - 1].comp > comp) {
+        idx--;
+    }
+    if (idx > 0 && index->members[idx - 1].comp == comp) {
+        return ZX_RET_OK;
+    }
+
+    if (index->members_count == index->members_capacity) {
+        new_capacity = index->members_capacity * 2 + 1;
+        new_members = (zidx_member*)index_realloc(index, index->members,
+                                                  sizeof(zidx_member)
+                                                      * new_capacity);
+        if (new_members == NULL) {
+            ZX_LOG("ERROR: Couldn't allocate memory for member list.");
+            return ZX_ERR_MEMORY;
+        }
+        index->members          = new_members;
+        index->members_capacity = new_capacity;
+    }
+
+    ZX_LOG("Added member %d (comp: %jd, uncomp: %jd).", idx, (intmax_t)comp,
+           (intmax_t)uncomp);
+    memmove(&index->members[idx + 1], &index->members[idx],
+            sizeof(zidx_member) * (index->members_count - idx));
+    index->members[idx].comp   = comp;
+    index->members[idx].uncomp = uncomp;
+    index->members_count++;
+    return ZX_RET_OK;
 }
 
-int zidx_index_init_ex(zidx_index *index,
-                       streamlike_t *comp_stream,
-                       zidx_stream_type stream_type,
-                       zidx_checksum_option checksum_option,
-                       z_stream* z_stream_ptr,
-                       int initial_capacity,
-                       int window_size,
-                       int comp_data_buffer_size,
-                       int seeking_data_buffer_size)
+/**
+ * Check whether another gzip member follows the trailer which is just read.
+ *
+ * At least first two bytes of the next member are kept in the input buffer of
+ * z_stream if there is one.
+ *
+ * \param index Index data.
+ *
+ * \return 1 if there is another member, 0 if there isn't, or negative error
+ *         code.
+ */
+static int read_next_member(zidx_index* index)
 {
-    /* Temporary variables that will be used to initialize corresponding
-     * members of index. These are not modified directly on index, because we
-     * don't want to modify it in case of a failure. */
-    zidx_checkpoint *list;
-    uint8_t* comp_data_buffer;
-    uint8_t* seeking_data_buffer;
-    int window_bits;
+    /* Used for storing number of bytes read from stream. */
+    int s_read_len;
 
-    /* Flag used to indicate whether z_stream_ptr argument should be released
-     * in case of a failure. */
-    int free_zs_on_failure;
+    /* Aliases. */
+    z_stream* zs = index->z_stream;
+    uint8_t* buf = index->comp_data_buffer;
+    int buf_len  = index->comp_data_buffer_size;
 
-    /* Sanity checks. */
-    if (index == NULL || comp_stream == NULL) {
-        ZX_LOG("ERROR: index or comp_stream is null.");
-        return ZX_ERR_PARAMS;
+    /* Make sure that magic bytes are in buffer. */
+    while (zs->avail_in < 2) {
+        if (zs->avail_in > 0) {
+            memmove(buf, zs->next_in, zs->avail_in);
+        }
+        zs->next_in = buf;
+        s_read_len = read_comp_stream(index, buf + zs->avail_in,
+                                      buf_len - zs->avail_in);
+        if (s_read_len < 0) {
+            ZX_LOG("ERROR: Reading from stream (%d).", s_read_len);
+            return s_read_len;
+        }
+        if (s_read_len == 0) {
+            break;
+        }
+        zs->avail_in += s_read_len;
     }
-    if (stream_type != ZX_STREAM_GZIP && stream_type != ZX_STREAM_DEFLATE
-            && stream_type != ZX_STREAM_GZIP_OR_ZLIB) {
-        ZX_LOG("ERROR: Unknown stream_type (%d).", (int) stream_type);
-        return ZX_ERR_PARAMS;
+
+    if (zs->avail_in == 0) {
+        ZX_LOG("No more members.");
+        return 0;
     }
-    if (checksum_option != ZX_CHECKSUM_DISABLED
-            && checksum_option != ZX_CHECKSUM_DEFAULT
-            && checksum_option != ZX_CHECKSUM_FORCE_CRC32
-            && checksum_option != ZX_CHECKSUM_FORCE_ADLER32) {
-        ZX_LOG("ERROR: Unknown checksum_option (%d).", (int) stream_type);
-        return ZX_ERR_PARAMS;
+    if (zs->avail_in < 2 || zs->next_in[0] != 0x1f || zs->next_in[1] != 0x8b) {
+        ZX_LOG("WARNING: Ignoring trailing data after the last member.");
+        return 0;
     }
-    if (initial_capacity < 0) {
-        ZX_LOG("ERROR: initial_capacity is negative.");
-        return ZX_ERR_PARAMS;
+    return 1;
+}
+
+/** Length of the fixed part of gzip member header. */
+#define ZX_GZIP_HEADER_LENGTH_ (12)
+
+/**
+ * Parse the fixed part of a gzip member header, and get length of its extra
+ * field if it's a BGZF member. BGZF members only have an extra field, which
+ * keeps compressed size of the member.
+ *
+ * \param header    First ZX_GZIP_HEADER_LENGTH_ bytes of the member.
+ * \param extra_len Length of extra field.
+ *
+ * \return 1 if header can be a BGZF member header, 0 otherwise.
+ */
+static int parse_bgzf_header(const uint8_t *header, int *extra_len)
+{
+    /* Magic bytes, deflate method, and FEXTRA as the only flag. */
+    if (header[0] != 0x1f || header[1] != 0x8b || header[2] != 8
+            || header[3] != 4) {
+        return 0;
     }
-    if (window_size <= 0) {
+    *extra_len = header[10] | (header[11] << 8);
+    return 1;
+}
+
+/**
+ * Find BC subfield in extra field of a BGZF member.
+ *
+ * \param extra       Extra field.
+ * \param extra_len   Length of extra field.
+ * \param member_size Total size of member, including its header and trailer.
+ *
+ * \return 1 if BC subfield is found, 0 otherwise.
+ */
+static int parse_bgzf_extra(const uint8_t *extra, int extra_len,
+                            off_t *member_size)
+{
+    int sub_len;
+    int i;
+
+    for (i = 0; i + 4 <= extra_len; i += 4 + sub_len) {
+        sub_len = extra[i + 2] | (extra[i + 3] << 8);
+        if (extra[i] == 'B' && extra[i + 1] == 'C' && sub_len == 2
+                && i + 6 <= extra_len) {
+            *member_size = (extra[i + 4] | (extra[i + 5] << 8)) + 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Check whether compressed stream is in BGZF format by looking at the header
+ * of the first member, if it's not checked yet. Stream is positioned back to
+ * where it was. Streams which can't be seeked are assumed not to be BGZF.
+ *
+ * \param index Index data.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_STREAM_READ if an error happens while reading from stream.
+ *         ZX_ERR_STREAM_SEEK if the stream couldn't be repositioned.
+ */
+static int detect_bgzf(zidx_index *index)
+{
+    /* Fixed part of header followed by a usual BGZF extra field. */
+    uint8_t header[ZX_GZIP_HEADER_LENGTH_ + 64];
+    off_t member_size;
+    off_t position;
+    int extra_len;
+    int s_read_len;
+    int s_seek_ret;
+    int read_error;
+
+    if (index->is_bgzf >= 0) {
+        return ZX_RET_OK;
+    }
+
+    /* Stream may be shared with cursors. */
+    if (index->stream_lock != NULL) pthread_mutex_lock(index->stream_lock);
+    position = sl_tell(index->comp_stream);
+    if (position < 0 || sl_seek(index->comp_stream, 0, SL_SEEK_SET) != 0) {
+        if (index->stream_lock != NULL) {
+            pthread_mutex_unlock(index->stream_lock);
+        }
+        ZX_LOG("WARNING: Stream can't be seeked, assuming it's not BGZF.");
+        index->is_bgzf = 0;
+        return ZX_RET_OK;
+    }
+    s_read_len = sl_read(index->comp_stream, header, sizeof(header));
+    read_error = sl_error(index->comp_stream);
+    s_seek_ret = sl_seek(index->comp_stream, position, SL_SEEK_SET);
+    if (index->stream_lock != NULL) pthread_mutex_unlock(index->stream_lock);
+    if (s_seek_ret != 0) {
+        ZX_LOG("ERROR: Couldn't reposition stream.");
+        return ZX_ERR_STREAM_SEEK;
+    }
+    if (read_error) {
+        ZX_LOG("ERROR: Reading from stream.");
+        return ZX_ERR_STREAM_READ;
+    }
+
+    index->is_bgzf = 0;
+    if (s_read_len >= ZX_GZIP_HEADER_LENGTH_
+            && parse_bgzf_header(header, &extra_len)
+            && ZX_GZIP_HEADER_LENGTH_ + extra_len <= s_read_len
+            && parse_bgzf_extra(header + ZX_GZIP_HEADER_LENGTH_, extra_len,
+                                &member_size)) {
+        ZX_LOG("Stream is in BGZF format.");
+        index->is_bgzf = 1;
+    }
+    return ZX_RET_OK;
+}
+
+/**
+ * Check whether current block boundary is where a gzip member other than the
+ * first one starts. Window is empty in this case.
+ *
+ * \param index  Index data.
+ * \param offset Offset of the block boundary.
+ *
+ * \return Nonzero if block boundary is right after a member header.
+ */
+static inline int is_member_start(const zidx_index *index,
+                                  const zidx_checkpoint_offset *offset)
+{
+    return index->stream_state == ZX_STATE_FILE_HEADERS && offset->uncomp > 0;
+}
+
+zidx_index* zidx_index_create()
+{
+    return zidx_index_create_ex(NULL);
+}
+
+zidx_index* zidx_index_create_ex(const zidx_allocator *allocator)
+{
+    zidx_index *index;
+
+    if (allocator == NULL) {
+        allocator = &default_allocator;
+    }
+    if (allocator->malloc_func == NULL || allocator->realloc_func == NULL
+            || allocator->free_func == NULL) {
+        ZX_LOG("ERROR: Allocator functions can't be NULL.");
+        return NULL;
+    }
+
+    index = (zidx_index*) allocator->malloc_func(allocator->opaque,
+                                                 sizeof(zidx_index));
+    if (index != NULL) {
+        index->allocator = *allocator;
+    }
+    return index;
+}
+
+int zidx_index_init(zidx_index *index,
+                    streamlike_t *comp_stream)
+{
+    return zidx_index_init_ex(index,
+                              comp_stream,
+                              ZX_STREAM_GZIP_OR_ZLIB,
+                              ZX_CHECKSUM_DEFAULT,
+                              NULL,
+                              ZX_DEFAULT_INITIAL_LIST_CAPACITY,
+                              ZX_DEFAULT_WINDOW_SIZE,
+                              ZX_DEFAULT_COMPRESSED_DATA_BUFFER_SIZE,
+                              ZX_DEFAULT_SEEKING_DATA_BUFFER_SIZE);
+}
+
+int zidx_index_init_ex(zidx_index *index,
+                       streamlike_t *comp_stream,
+                       zidx_stream_type stream_type,
+                       zidx_checksum_option checksum_option,
+                       z_stream* z_stream_ptr,
+                       int initial_capacity,
+                       int window_size,
+                       int comp_data_buffer_size,
+                       int seeking_data_buffer_size)
+{
+    /* Temporary variables that will be used to initialize corresponding
+     * members of index. These are not modified directly on index, because we
+     * don't want to modify it in case of a failure. */
+    zidx_checkpoint *list;
+    uint8_t* comp_data_buffer;
+    uint8_t* seeking_data_buffer;
+    int window_bits;
+    signed char is_bgzf;
+
+    /* Flag used to indicate whether z_stream_ptr argument should be released
+     * in case of a failure. */
+    int free_zs_on_failure;
+
+    /* Sanity checks. */
+    if (index == NULL || comp_stream == NULL) {
+        ZX_LOG("ERROR: index or comp_stream is null.");
+        return ZX_ERR_PARAMS;
+    }
+    if (stream_type != ZX_STREAM_GZIP && stream_type != ZX_STREAM_DEFLATE
+            && stream_type != ZX_STREAM_GZIP_OR_ZLIB) {
+        ZX_LOG("ERROR: Unknown stream_type (%d).", (int) stream_type);
+        return ZX_ERR_PARAMS;
+    }
+    if (checksum_option != ZX_CHECKSUM_DISABLED
+            && checksum_option != ZX_CHECKSUM_DEFAULT
+            && checksum_option != ZX_CHECKSUM_FORCE_CRC32
+            && checksum_option != ZX_CHECKSUM_FORCE_ADLER32) {
+        ZX_LOG("ERROR: Unknown checksum_option (%d).", (int) stream_type);
+        return ZX_ERR_PARAMS;
+    }
+    if (initial_capacity < 0) {
+        ZX_LOG("ERROR: initial_capacity is negative.");
+        return ZX_ERR_PARAMS;
+    }
+    if (window_size <= 0) {
         ZX_LOG("ERROR: window_size is nonpositive.");
         return ZX_ERR_PARAMS;
     }
@@ -593,6 +1721,11 @@ int zidx_index_init_ex(zidx_index *index,
         return ZX_ERR_PARAMS;
     }
 
+    /* BGZF members keep their sizes, so index can be built without
+     * decompressing them. It's detected when it's first needed, so stream
+     * isn't touched here. */
+    is_bgzf = stream_type == ZX_STREAM_DEFLATE ? 0 : -1;
+
     /* Assign NULL to anything to be freed in case of a failure. */
     list                = NULL;
     comp_data_buffer    = NULL;
@@ -604,7 +1737,7 @@ int zidx_index_init_ex(zidx_index *index,
     if (z_stream_ptr) {
         free_zs_on_failure = 0;
     } else {
-        z_stream_ptr = (z_stream*) malloc(sizeof(z_stream));
+        z_stream_ptr = (z_stream*) index_malloc(index, sizeof(z_stream));
         if (!z_stream_ptr) goto memory_fail;
 
         z_stream_ptr->zalloc = Z_NULL;
@@ -613,13 +1746,18 @@ int zidx_index_init_ex(zidx_index *index,
 
         free_zs_on_failure = 1;
     }
+    /* Internal state is allocated by index, unless allocation functions are
+     * provided. */
+    if (z_stream_ptr->zalloc == Z_NULL && z_stream_ptr->zfree == Z_NULL) {
+        set_stream_allocator(index, z_stream_ptr);
+    }
     z_stream_ptr->avail_in = 0;
     z_stream_ptr->next_in  = Z_NULL;
 
     /* Initialize list if initial_capacity is not zero. */
     if (initial_capacity > 0) {
-        list = (zidx_checkpoint*)malloc(sizeof(zidx_checkpoint)
-                                            * initial_capacity);
+        list = (zidx_checkpoint*)index_malloc(index, sizeof(zidx_checkpoint)
+                                                  * initial_capacity);
         if (!list) {
             ZX_LOG("ERROR: Couldn't allocate memory for checkpoint list.");
             goto memory_fail;
@@ -627,14 +1765,15 @@ int zidx_index_init_ex(zidx_index *index,
     }
 
     /* Initialize compressed data buffer. */
-    comp_data_buffer = (uint8_t*) malloc(comp_data_buffer_size);
+    comp_data_buffer = (uint8_t*) index_malloc(index, comp_data_buffer_size);
     if (!comp_data_buffer) {
         ZX_LOG("ERROR: Couldn't allocate memory for compression data buffer.");
         goto memory_fail;
     }
 
     /* Initialize seeking data buffer. */
-    seeking_data_buffer = (uint8_t*) malloc(seeking_data_buffer_size);
+    seeking_data_buffer = (uint8_t*) index_malloc(index,
+                                                  seeking_data_buffer_size);
     if (!seeking_data_buffer) {
         ZX_LOG("ERROR: Couldn't allocate memory for seeking data buffer.");
         goto memory_fail;
@@ -668,6 +1807,7 @@ int zidx_index_init_ex(zidx_index *index,
     index->offset.comp_bits_count = 0;
     index->offset.comp_byte       = 0;
     index->offset.uncomp          = 0;
+    index->offset.in_block        = 0;
 
     /* Set stream options. */
     index->z_stream            = z_stream_ptr;
@@ -682,18 +1822,208 @@ int zidx_index_init_ex(zidx_index *index,
     index->compressed_size = -1;
     index->uncompressed_size = -1;
 
+    /* No background build is running. */
+    index->async           = NULL;
+    index->stream_lock     = NULL;
+    index->list_lock       = NULL;
+    index->comp_stream_pos = 0;
+
+    /* Set weights of decoding cost. */
+    index->spacing_comp_weight   = ZX_DEFAULT_SPACING_COMP_WEIGHT;
+    index->spacing_uncomp_weight = ZX_DEFAULT_SPACING_UNCOMP_WEIGHT;
+    index->spacing_block_weight  = ZX_DEFAULT_SPACING_BLOCK_WEIGHT;
+
+    /* Checkpoints are not captured while reading by default. */
+    memset(&index->auto_spacing, 0, sizeof(index->auto_spacing));
+
+    /* Members are added as they are read. */
+    index->members          = NULL;
+    index->members_count    = 0;
+    index->members_capacity = 0;
+    index->is_bgzf          = is_bgzf;
+
+    /* Checkpoints are placed only on block boundaries by default. */
+    index->intra_block_step               = 0;
+    index->block_state.header_bits        = -1;
+    index->block_state.is_header_complete = 0;
+    index->block_state.is_stepping        = 0;
+
+    /* Windows are kept uncompressed by default. */
+    index->window_compression       = ZX_WINDOW_RAW;
+    index->window_compression_level = ZX_DEFAULT_WINDOW_COMPRESSION_LEVEL;
+    index->window_deflate           = NULL;
+    index->window_inflate           = NULL;
+    index->window_buffer            = NULL;
+
+    /* Windows are kept whole by default. */
+    index->is_sparse_windows     = 0;
+    index->sparse_analyzed_count = 0;
+    index->window_valid_until    = -1;
+
+    /* Windows are loaded along with checkpoints by default. */
+    index->window_stream = NULL;
+    index->map_data      = NULL;
+    index->map_length    = 0;
+
+    /* Window data is exported without padding by default. */
+    index->export_alignment  = 1;
+    index->is_export_compact = 0;
+
+    /* Memory used by windows is not limited by default. */
+    index->window_budget    = 0;
+    index->window_memory    = 0;
+    index->window_evictions = 0;
+    index->lru_head         = -1;
+    index->lru_tail         = -1;
+
+    /* Windows are allocated separately by default. */
+    index->arena_chunk_size = 0;
+    index->is_arena_huge    = 0;
+    index->arena            = NULL;
+
+    /* Decoded data is not cached by default. */
+    index->cache_budget        = 0;
+    index->cache_chunk_size    = 0;
+    index->cache_buckets       = NULL;
+    index->cache_buckets_count = 0;
+    index->cache_head          = NULL;
+    index->cache_tail          = NULL;
+    index->cache_memory        = 0;
+    index->cache_hits          = 0;
+    index->cache_misses        = 0;
+    index->cache_offset        = -1;
+    index->is_cache_eof        = 0;
+
+    /* Decoder state is not snapshotted by default. */
+    index->snapshots          = NULL;
+    index->snapshots_capacity = 0;
+    index->snapshots_count    = 0;
+    index->snapshot_memory    = 0;
+    index->snapshot_next      = 0;
+    index->snapshot_spacing   = 0;
+    index->snapshot_from      = 0;
+
+    /* Checkpoint list is owned by index, unless it's a view of a cursor. */
+    index->is_list_shared = 0;
+    index->cursors_count  = 0;
+    index->pread_pool     = NULL;
+    index->readahead      = NULL;
+
+    /* Lookup keys are added with checkpoints. */
+    memset(&index->lookup, 0, sizeof(index->lookup));
+    index->lookup_hint = 0;
+
+    /* Use the fastest inflate available in this build. */
+    index->backend = get_inflate_backend(ZX_DEFAULT_INFLATE_BACKEND);
+    if (index->backend == NULL) {
+        index->backend = &zlib_backend;
+    }
+
     ZX_LOG("Initialization was successful.");
 
     return ZX_RET_OK;
 
 memory_fail:
-    if(free_zs_on_failure) free(z_stream_ptr);
-    free(list);
-    free(comp_data_buffer);
-    free(seeking_data_buffer);
+    if(free_zs_on_failure) index_free(index, z_stream_ptr);
+    index_free(index, list);
+    index_free(index, comp_data_buffer);
+    index_free(index, seeking_data_buffer);
     return ZX_ERR_MEMORY;
 }
 
+/**
+ * Release window, ranges and block header of checkpoint, unless they point to
+ * the mapped index file.
+ *
+ * \param index      Index data, whose allocator is used.
+ * \param checkpoint Checkpoint to release window of.
+ */
+static void release_window(zidx_index *index, zidx_checkpoint *checkpoint)
+{
+    if (!checkpoint->is_window_mapped && !checkpoint->is_window_in_arena) {
+        index_free(index, checkpoint->window_data);
+        index_free(index, checkpoint->window_ranges);
+        index_free(index, checkpoint->block_header);
+    }
+    checkpoint->window_data        = NULL;
+    checkpoint->window_ranges      = NULL;
+    checkpoint->block_header       = NULL;
+    checkpoint->is_window_mapped   = 0;
+    checkpoint->is_window_in_arena = 0;
+}
+
+/**
+ * Allocate memory from window arena of index. A new chunk is mapped if the
+ * current one doesn't have enough space left. Memory is released only by
+ * release_arena().
+ *
+ * \param index  Index data.
+ * \param length Number of bytes to allocate.
+ *
+ * \return Allocated memory, or NULL if memory couldn't be mapped.
+ */
+static void* arena_alloc(zidx_index *index, size_t length)
+{
+    zidx_arena_chunk *chunk;
+    size_t header_size;
+    size_t size;
+    void *ptr;
+
+    header_size = ZX_ALIGN_(sizeof(zidx_arena_chunk), ZX_ARENA_ALIGNMENT_);
+    length      = ZX_ALIGN_(length, ZX_ARENA_ALIGNMENT_);
+
+    chunk = index->arena;
+    if (chunk == NULL || chunk->size - chunk->used < length) {
+        size = header_size + length;
+        if (size < index->arena_chunk_size) {
+            size = index->arena_chunk_size;
+        }
+        if (index->is_arena_huge) {
+            size = ZX_ALIGN_(size, ZX_HUGE_PAGE_SIZE_);
+        }
+
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+            ZX_LOG("ERROR: Couldn't map %zu bytes for window arena.", size);
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (index->is_arena_huge && madvise(ptr, size, MADV_HUGEPAGE) != 0) {
+            ZX_LOG("WARNING: Huge pages are not available for window arena.");
+        }
+#endif
+
+        chunk        = (zidx_arena_chunk*)ptr;
+        chunk->next  = index->arena;
+        chunk->size  = size;
+        chunk->used  = header_size;
+        index->arena = chunk;
+    }
+
+    ptr = (uint8_t*)chunk + chunk->used;
+    chunk->used += length;
+    return ptr;
+}
+
+/**
+ * Unmap all chunks of window arena at once. Windows in arena should be
+ * released before with release_window().
+ *
+ * \param index Index data.
+ */
+static void release_arena(zidx_index *index)
+{
+    zidx_arena_chunk *chunk;
+    zidx_arena_chunk *next;
+
+    for (chunk = index->arena; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        munmap(chunk, chunk->size);
+    }
+    index->arena = NULL;
+}
+
 int zidx_index_destroy(zidx_index* index)
 {
     /* Return value for this function. */
@@ -732,21 +2062,32 @@ int zidx_index_destroy(zidx_index* index)
         return ZX_ERR_CORRUPTED;
     }
 
+    /* Stop background build if there is any. */
+    if (index->async != NULL) {
+        z_ret = zidx_build_index_async_cancel(index);
+        if (z_ret != ZX_RET_OK) {
+            ZX_LOG("WARNING: Background build failed (%d).", z_ret);
+        }
+    }
+
+    /* Stop readahead, since it uses checkpoints and stream of index. */
+    stop_readahead(index);
+
     /* Unless an error happens, okay will be returned. */
     ret = ZX_RET_OK;
 
     /* Since z_stream is not NULL, release internal buffers of z_stream. */
     if (index->inflate_initialized) {
-        z_ret = inflateEnd(index->z_stream);
+        z_ret = index->backend->end(index->z_stream);
         if (z_ret != Z_OK) {
-            ZX_LOG("ERROR: inflateEnd returned error (%d).", z_ret);
+            ZX_LOG("ERROR: Ending inflate returned error (%d).", z_ret);
             ret = ZX_ERR_ZLIB(z_ret);
         }
     }
     /* If internal buffers are released succesfully, release the z_stream
      * itself. */
     if (ret == ZX_RET_OK) {
-        free(index->z_stream);
+        index_free(index, index->z_stream);
         index->z_stream = NULL;
     }
 
@@ -755,9 +2096,9 @@ int zidx_index_destroy(zidx_index* index)
         /* Release window data on each checkpoint. */
         end = index->list + index->list_count;
         for (it = index->list; it < end; it++) {
-            free(it->window_data);
+            release_window(index, it);
         }
-        free(index->list);
+        index_free(index, index->list);
 
         /* These members are updated because user can call this function again
          * if it returns some error, so we are leaving index list in a valid
@@ -765,22 +2106,79 @@ int zidx_index_destroy(zidx_index* index)
         index->list = NULL;
         index->list_capacity = 0;
         index->list_count = 0;
+        index->window_memory = 0;
+        index->lru_head = -1;
+        index->lru_tail = -1;
     }
     /* Else is unnecessary, since this practically means capacity is zero and
      * list is NULL. Therefore, nothing to free.  */
 
+    /* Release window arena, decoder snapshots and cursors used for positional
+     * reads. */
+    release_arena(index);
+    release_snapshots(index);
+    release_pread_pool(index);
+    release_lookup(index);
+
+    /* Release read cache. */
+    if (index->cache_buckets != NULL) {
+        drop_cache_chunks(index, 0);
+        index_free(index, index->cache_buckets);
+        index->cache_buckets       = NULL;
+        index->cache_buckets_count = 0;
+        index->cache_budget        = 0;
+    }
+
+    /* Release member list. */
+    index_free(index, index->members);
+    index->members          = NULL;
+    index->members_count    = 0;
+    index->members_capacity = 0;
+
+    /* Release streams used for window compression. */
+    if (index->window_deflate != NULL) {
+        deflateEnd(index->window_deflate);
+        index_free(index, index->window_deflate);
+        index->window_deflate = NULL;
+    }
+    if (index->window_inflate != NULL) {
+        inflateEnd(index->window_inflate);
+        index_free(index, index->window_inflate);
+        index->window_inflate = NULL;
+    }
+
     /* Release buffers */
-    free(index->seeking_data_buffer);
+    index_free(index, index->seeking_data_buffer);
     index->seeking_data_buffer = NULL;
-    free(index->comp_data_buffer);
+    index_free(index, index->comp_data_buffer);
     index->comp_data_buffer = NULL;
+    index_free(index, index->window_buffer);
+    index->window_buffer = NULL;
+
+    /* Release mapping of index file, after windows pointing to it. */
+    if (index->map_data != NULL) {
+        munmap(index->map_data, index->map_length);
+        index->map_data   = NULL;
+        index->map_length = 0;
+    }
+    index->window_stream = NULL;
 
     return ret;
 }
 
 int zidx_read(zidx_index* index, void *buffer, int nbytes)
 {
-    /* Pass to explicit version without block callbacks. */
+    /* Serve from readahead buffer or cache of decoded chunks if enabled.
+     * Otherwise pass to explicit version without block callbacks, which checks
+     * arguments. */
+    if (index != NULL && buffer != NULL && nbytes >= 0
+            && index->readahead != NULL) {
+        return read_ahead(index, buffer, nbytes);
+    }
+    if (index != NULL && buffer != NULL && nbytes >= 0
+            && index->cache_budget > 0) {
+        return read_from_cache(index, buffer, nbytes);
+    }
     return zidx_read_ex(index, buffer, nbytes, NULL, NULL);
 }
 
@@ -790,8 +2188,6 @@ int zidx_read_ex(zidx_index* index,
                  zidx_block_callback block_callback,
                  void *callback_context)
 {
-    /* TODO: Implement support for concatanated gzip streams. */
-
     /* Return value for private (static) function calls. */
     int ret;
 
@@ -801,6 +2197,9 @@ int zidx_read_ex(zidx_index* index,
     /* Total number of bytes read. */
     int total_read = 0;
 
+    /* Number of bytes to be read at once from deflate blocks. */
+    unsigned int out_length;
+
     /* Window bits used for initializing inflate for headers. Window bits in
      * index can't be used for this purpose, because this variable will be used
      * for denoting stream type as well. */
@@ -822,137 +2221,213 @@ int zidx_read_ex(zidx_index* index,
         return ZX_ERR_PARAMS;
     }
 
+    /* Move decoder to where reading from cache is left. */
+    if (index->cache_offset >= 0) {
+        ret = zidx_seek_ex(index, index->cache_offset, block_callback,
+                           callback_context);
+        if (ret != ZX_RET_OK) {
+            return ret;
+        }
+    }
+
     /* Aliases. */
     z_stream *zs = index->z_stream;
 
-    ZX_LOG("Reading %d bytes at (comp: %jd, uncomp: %jd)", nbytes,
-           (intmax_t)index->offset.comp, (intmax_t)index->offset.uncomp);
+    /* Capture checkpoints if reading past the last checkpoint. Block boundaries
+     * are visited only in that case, since stopping at each of them slows
+     * down decompression. Background build adds checkpoints by itself. */
+    if (block_callback == NULL && index->auto_spacing.spacing_length > 0
+            && index->async == NULL
+            && (index->list_count == 0 || index->offset.uncomp
+                    >= index->list[index->list_count - 1].offset.uncomp)) {
+        block_callback = auto_checkpoint_callback;
+    }
 
-    switch (index->stream_state) {
-        case ZX_STATE_FILE_HEADERS:
-            /* Assign window_bits with respect to stream type. */
-            switch (index->stream_type) {
-                case ZX_STREAM_DEFLATE:
-                    window_bits = -index->window_bits;
-                    break;
-                case ZX_STREAM_GZIP:
-                    window_bits = 16 + index->window_bits;
-                    break;
-                case ZX_STREAM_GZIP_OR_ZLIB:
-                    window_bits = 32 + index->window_bits;
-                    break;
-            }
+    /* Otherwise, snapshot decoder state if reading may go far enough from
+     * where decoding is started. */
+    if (block_callback == NULL && index->snapshots != NULL
+            && index->offset.uncomp + nbytes
+                   >= index->snapshot_from + index->snapshot_spacing) {
+        block_callback = snapshot_callback;
+    }
 
-            /* Initialize inflate. Window bits should have been initialized by
-             * zidx_index_init() per stream type. */
-            z_ret = initialize_inflate(index, zs, window_bits);
-            if (z_ret != Z_OK) {
-                ZX_LOG("ERROR: inflate initialization returned error (%d).",
-                       z_ret);
-                index->stream_state = ZX_STATE_INVALID;
-                return ZX_ERR_ZLIB(z_ret);
-            }
+    ZX_LOG("Reading %d bytes at (comp: %jd, uncomp: %jd)", nbytes,
+           (intmax_t)index->offset.comp, (intmax_t)index->offset.uncomp);
 
-            if (index->stream_type != ZX_STREAM_DEFLATE) {
-                /* If stream type is not DEFLATE, then read headers. Since no
-                 * output will be produced avail_out will be 0. However,
-                 * assigning next_out to NULL causes error when calling
-                 * inflate, so leave it as a non-NULL value even if it's not
-                 * gonna be used. */
-                zs->next_out  = buffer;
-                zs->avail_out = 0;
+    /* Members of a concatenated gzip file are read one after another until
+     * buffer is filled. */
+    do {
+        switch (index->stream_state) {
+            case ZX_STATE_FILE_HEADERS:
+                /* Assign window_bits with respect to stream type. */
+                switch (index->stream_type) {
+                    case ZX_STREAM_DEFLATE:
+                        window_bits = -index->window_bits;
+                        break;
+                    case ZX_STREAM_GZIP:
+                        window_bits = 16 + index->window_bits;
+                        break;
+                    case ZX_STREAM_GZIP_OR_ZLIB:
+                        window_bits = 32 + index->window_bits;
+                        break;
+                    default:
+                        ZX_LOG("ERROR: Unknown stream type (%d).",
+                               (int)index->stream_type);
+                        index->stream_state = ZX_STATE_INVALID;
+                        return ZX_ERR_PARAMS;
+                }
 
-                ret = read_headers(index, block_callback, callback_context);
+                /* Record the member starting here. */
+                ret = add_member(index, index->offset.comp,
+                                 index->offset.uncomp);
                 if (ret != ZX_RET_OK) {
-                    ZX_LOG("ERROR: While reading headers (%d).", ret);
                     index->stream_state = ZX_STATE_INVALID;
                     return ret;
                 }
 
-                /* Then initialize inflate to be used for DEFLATE blocks. This
-                 * is preferable way because seeking messes with internal
-                 * checksum computation of zlib. Best way to disable it to
-                 * treat each gzip/zlib blocks as individual deflate blocks,
-                 * and control checksum in-house. index->window_bits used
-                 * intentionally instead of local variable window_bits, since
-                 * inflate will be initialized as deflate. */
-                z_ret = initialize_inflate(index, zs, -index->window_bits);
+                /* Initialize inflate. Window bits should have been
+                 * initialized by zidx_index_init() per stream type. */
+                z_ret = initialize_inflate(index, zs, window_bits);
                 if (z_ret != Z_OK) {
-                    ZX_LOG("ERROR: initialize_inflate returned error (%d).",
+                    ZX_LOG("ERROR: inflate initialization returned error (%d).",
                            z_ret);
                     index->stream_state = ZX_STATE_INVALID;
                     return ZX_ERR_ZLIB(z_ret);
                 }
-            }
-
-            ZX_LOG("Done reading header.");
-            index->stream_state = ZX_STATE_DEFLATE_BLOCKS;
 
-            /* Continue to next case to handle first deflate block. */
-
-        case ZX_STATE_DEFLATE_BLOCKS:
-            /* Input buffer (next_in, avail_in) shouldn't be modified here, as
-             * there could be data left from previous reading. */
+                if (index->stream_type != ZX_STREAM_DEFLATE) {
+                    /* If stream type is not DEFLATE, then read headers. Since
+                     * no output will be produced avail_out will be 0.
+                     * However, assigning next_out to NULL causes error when
+                     * calling inflate, so leave it as a non-NULL value even if
+                     * it's not gonna be used. */
+                    zs->next_out  = (uint8_t*)buffer + total_read;
+                    zs->avail_out = 0;
+
+                    ret = read_headers(index, block_callback, callback_context);
+                    if (ret != ZX_RET_OK) {
+                        ZX_LOG("ERROR: While reading headers (%d).", ret);
+                        index->stream_state = ZX_STATE_INVALID;
+                        return ret;
+                    }
 
-            /* Set output buffer and available bytes for output. */
-            zs->next_out  = buffer;
-            zs->avail_out = nbytes;
+                    /* Then initialize inflate to be used for DEFLATE blocks.
+                     * This is preferable way because seeking messes with
+                     * internal checksum computation of zlib. Best way to
+                     * disable it to treat each gzip/zlib blocks as individual
+                     * deflate blocks, and control checksum in-house.
+                     * index->window_bits used intentionally instead of local
+                     * variable window_bits, since inflate will be initialized
+                     * as deflate. */
+                    z_ret = initialize_inflate(index, zs, -index->window_bits);
+                    if (z_ret != Z_OK) {
+                        ZX_LOG("ERROR: initialize_inflate returned error (%d).",
+                               z_ret);
+                        index->stream_state = ZX_STATE_INVALID;
+                        return ZX_ERR_ZLIB(z_ret);
+                    }
+                }
 
-            ret = read_deflate_blocks(index, block_callback, callback_context);
-            if (ret != ZX_RET_OK) {
-                ZX_LOG("ERROR: While reading deflate blocks (%d).", ret);
-                index->stream_state = ZX_STATE_INVALID;
-                return ret;
-            }
+                ZX_LOG("Done reading header.");
+                index->stream_state = ZX_STATE_DEFLATE_BLOCKS;
+                start_block_header(index);
+
+                /* Continue to next case to handle first deflate block. */
+
+            case ZX_STATE_DEFLATE_BLOCKS:
+                /* Input buffer (next_in, avail_in) shouldn't be modified here,
+                 * as there could be data left from previous reading. */
+
+                do {
+                    /* Set output buffer and available bytes for output. Output
+                     * is split where a sparse window stops being valid. */
+                    out_length = nbytes - total_read;
+                    ret = limit_sparse_output(index, &out_length);
+                    if (ret != ZX_RET_OK) {
+                        ZX_LOG("ERROR: Couldn't move past sparse window (%d).",
+                               ret);
+                        index->stream_state = ZX_STATE_INVALID;
+                        return ret;
+                    }
+                    zs->next_out  = (uint8_t*)buffer + total_read;
+                    zs->avail_out = out_length;
+
+                    ret = read_deflate_blocks(index, block_callback,
+                                              callback_context);
+                    if (ret != ZX_RET_OK) {
+                        ZX_LOG("ERROR: While reading deflate blocks (%d).",
+                               ret);
+                        index->stream_state = ZX_STATE_INVALID;
+                        return ret;
+                    }
 
-            total_read = nbytes - zs->avail_out;
+                    total_read += out_length - zs->avail_out;
+                } while (zs->avail_out == 0 && total_read < nbytes
+                             && index->stream_state == ZX_STATE_DEFLATE_BLOCKS);
 
-            /* Done if buffer is filled. */
-            if (zs->avail_out == 0) {
-              break;
-            }
-            /* Otherwise ensure stream state is file trailer. */
-            if (index->stream_state != ZX_STATE_FILE_TRAILER) {
-                ZX_LOG("ERROR: Short read before end of the file.");
-                index->stream_state = ZX_STATE_INVALID;
-                return ZX_ERR_CORRUPTED;
-            }
-        case ZX_STATE_FILE_TRAILER:
-            /* TODO/BUG: Implement zlib separately. THIS IS TEMPORARY!!! */
-            if (index->stream_type != ZX_STREAM_DEFLATE) {
-                ret = read_gzip_trailer(index);
-                if (ret != ZX_RET_OK) {
-                    ZX_LOG("ERROR: While parsing gzip file trailer (%d).",
-                           ret);
+                /* Done if buffer is filled. */
+                if (total_read == nbytes) {
+                  break;
+                }
+                /* Otherwise ensure stream state is file trailer. */
+                if (index->stream_state != ZX_STATE_FILE_TRAILER) {
+                    ZX_LOG("ERROR: Short read before end of the file.");
                     index->stream_state = ZX_STATE_INVALID;
-                    return ret;
+                    return ZX_ERR_CORRUPTED;
                 }
-            }
-            index->stream_state = ZX_STATE_END_OF_FILE;
+            case ZX_STATE_FILE_TRAILER:
+                /* TODO/BUG: Implement zlib separately. THIS IS TEMPORARY!!! */
+                if (index->stream_type != ZX_STREAM_DEFLATE) {
+                    ret = read_gzip_trailer(index);
+                    if (ret != ZX_RET_OK) {
+                        ZX_LOG("ERROR: While parsing gzip file trailer (%d).",
+                               ret);
+                        index->stream_state = ZX_STATE_INVALID;
+                        return ret;
+                    }
 
-            /* Assign file sizes. */
-            index->compressed_size = index->offset.comp;
-            index->uncompressed_size = index->offset.uncomp;
-            ZX_LOG("Compressed/uncompressed size: %jd/%jd.",
-                   (intmax_t) index->compressed_size,
-                   (intmax_t) index->uncompressed_size);
-            break;
-        case ZX_STATE_INVALID:
-            /* TODO: Implement this. */
-            ZX_LOG("ERROR: The stream is in invalid state, corrupted due to "
-                   "some error.");
-            return ZX_ERR_CORRUPTED;
+                    /* Continue with the next member if there is one. */
+                    ret = read_next_member(index);
+                    if (ret < 0) {
+                        ZX_LOG("ERROR: While looking for next member (%d).",
+                               ret);
+                        index->stream_state = ZX_STATE_INVALID;
+                        return ret;
+                    }
+                    if (ret > 0) {
+                        ZX_LOG("Next member starts at %jd.",
+                               (intmax_t)index->offset.comp);
+                        index->stream_state = ZX_STATE_FILE_HEADERS;
+                        break;
+                    }
+                }
+                index->stream_state = ZX_STATE_END_OF_FILE;
+
+                /* Assign file sizes. */
+                index->compressed_size = index->offset.comp;
+                index->uncompressed_size = index->offset.uncomp;
+                ZX_LOG("Compressed/uncompressed size: %jd/%jd.",
+                       (intmax_t) index->compressed_size,
+                       (intmax_t) index->uncompressed_size);
+                break;
+            case ZX_STATE_INVALID:
+                /* TODO: Implement this. */
+                ZX_LOG("ERROR: The stream is in invalid state, corrupted due "
+                       "to some error.");
+                return ZX_ERR_CORRUPTED;
 
-        case ZX_STATE_END_OF_FILE:
-            ZX_LOG("No reading is made since state is end-of-file.");
-            return 0;
+            case ZX_STATE_END_OF_FILE:
+                ZX_LOG("No reading is made since state is end-of-file.");
+                return 0;
 
-        default:
-            ZX_LOG("ERROR: Unknown state (%d).", (int)index->stream_state);
-            index->stream_state = ZX_STATE_INVALID;
-            return ZX_ERR_CORRUPTED;
+            default:
+                ZX_LOG("ERROR: Unknown state (%d).", (int)index->stream_state);
+                index->stream_state = ZX_STATE_INVALID;
+                return ZX_ERR_CORRUPTED;
 
-    } /* end of switch(index->stream_state) */
+        } /* end of switch(index->stream_state) */
+    } while (index->stream_state == ZX_STATE_FILE_HEADERS
+                 && total_read < nbytes);
 
     ZX_LOG("Read %jd bytes.", (intmax_t)total_read);
 
@@ -960,344 +2435,6727 @@ int zidx_read_ex(zidx_index* index,
     return total_read;
 }
 
-int zidx_seek(zidx_index* index, off_t offset)
-{
-    return zidx_seek_ex(index, offset, NULL, NULL);
-}
-
-int zidx_seek_ex(zidx_index* index,
-                 off_t offset,
-                 zidx_block_callback block_callback,
-                 void *callback_context)
+/**
+ * Feed block header of a checkpoint to inflate, so decoding can be resumed in
+ * the middle of the block. Since inflate can hold 32 bits at most, header is
+ * primed byte by byte and inflate is called after each byte to consume it.
+ *
+ * \param index      Index data.
+ * \param zs         z_stream reset for raw inflate.
+ * \param checkpoint Checkpoint inside a block.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_CORRUPTED if block header is not valid.
+ *         ZX_ERR_ZLIB(...) if zlib returns an error.
+ */
+static int prime_block_header(zidx_index *index,
+                              z_stream *zs,
+                              const zidx_checkpoint *checkpoint)
 {
-    /* TODO: If this function fails to reset z_stream, it will leave z_stream
-     * in an invalid state. Must be handled. */
-
-    /* Used for storing number of bytes read from stream. */
-    int s_read_len;
-
-    /* Used for storing return value of stream functions. */
-    int s_ret;
-
     /* Used for storing return value of zlib calls. */
     int z_ret;
 
-    /* Used for storing return value of zidx calls. */
-    int zx_ret;
-
-    /* Used for storing shared byte between two blocks in the boundary, if they
-     * share any. */
-    uint8_t byte;
+    /* Number of bits primed. */
+    int bits;
+    int i;
 
-    /* Used for finding the checkpoint preceding offset. */
-    zidx_checkpoint *checkpoint;
-    int checkpoint_idx;
+    if (checkpoint->block_header == NULL || checkpoint->block_header_bits <= 0
+            || checkpoint->block_header_bits
+                   >= 8 * ZX_BLOCK_HEADER_CAPACITY_) {
+        ZX_LOG("ERROR: Checkpoint doesn't have a valid block header.");
+        return ZX_ERR_CORRUPTED;
+    }
 
-    /* Number of bytes remaining to arrive given offset. After seeking to
-     * checkpoint, the rest of offset is disposed using zidx_read. */
-    off_t num_bytes_remaining;
+    /* No input is consumed and no output is produced while decoding header,
+     * but inflate requires buffers to be set. */
+    zs->next_in   = index->comp_data_buffer;
+    zs->avail_in  = 0;
+    zs->next_out  = index->seeking_data_buffer;
+    zs->avail_out = 0;
 
-    /* Number of bytes to dispose for next zidx_read call. */
-    int num_bytes_next;
-
-    /* Sanity checks. */
-    if (index == NULL) {
-        ZX_LOG("ERROR: index is NULL.");
-        return ZX_ERR_PARAMS;
-    }
-    if (offset < 0) {
-        ZX_LOG("ERROR: offset (%jd) is negative.", (intmax_t)offset);
-        return ZX_ERR_PARAMS;
-    }
-
-    checkpoint_idx = zidx_get_checkpoint_idx(index, offset);
-    checkpoint = zidx_get_checkpoint(index, checkpoint_idx);
-
-    if (checkpoint == NULL) {
-        ZX_LOG("No checkpoint found.");
-
-        /* Seek to the beginning of file, if no checkpoint has been found. */
-        s_ret = sl_seek(index->comp_stream, 0, SL_SEEK_SET);
-        if (s_ret < 0) {
-            ZX_LOG("ERROR: Couldn't seek in stream (%d).", s_ret);
-            return ZX_ERR_STREAM_SEEK;
+    for (i = 0; i < checkpoint->block_header_bits; i += bits) {
+        bits = checkpoint->block_header_bits - i;
+        if (bits > 8) {
+            bits = 8;
         }
-
-        /* Reset stream states and offsets. TODO: It may be unnecessary to
-         * update comp_byte and comp_bits_count. */
-        index->stream_state           = ZX_STATE_FILE_HEADERS;
-        index->offset.comp            = 0;
-        index->offset.comp_byte       = 0;
-        index->offset.comp_bits_count = 0;
-        index->offset.uncomp          = 0;
-
-        /* Dispose if there's anything in input buffer. */
-        index->z_stream->avail_in = 0;
-    } else if (
-            index->offset.uncomp < checkpoint->offset.uncomp
-            || index->offset.uncomp > offset) {
-        /* If offset is between checkpoint and current index offset, jump to
-         * the checkpoint. */
-        ZX_LOG("Jumping to checkpoint (idx: %d, comp: %ld, uncomp: %ld).",
-                checkpoint_idx, checkpoint->offset.comp,
-                checkpoint->offset.uncomp);
-
-        /* Initialize as deflate. */
-        z_ret = initialize_inflate(index, index->z_stream,
-                                   -index->window_bits);
+        z_ret = index->backend->prime(zs, bits,
+                                      checkpoint->block_header[i / 8]
+                                          & ((1 << bits) - 1));
         if (z_ret != Z_OK) {
-            ZX_LOG("ERROR: inflate initialization returned error (%d).",
-                   z_ret);
+            ZX_LOG("ERROR: inflatePrime error (%d).", z_ret);
             return ZX_ERR_ZLIB(z_ret);
         }
 
-        /* Seek to the checkpoint offset in compressed stream. */
-        s_ret = sl_seek(index->comp_stream,
-                        checkpoint->offset.comp,
-                        SL_SEEK_SET);
-        if (s_ret != 0) {
-            ZX_LOG("ERROR: Couldn't seek in stream (%d).", s_ret);
-            return ZX_ERR_STREAM_SEEK;
-        }
-
-        /* Handle if there is a byte shared between two consecutive blocks. */
-        if (checkpoint->offset.comp_bits_count > 0) {
-            /* Higher bits of the byte should be pushed to zlib before calling
-             * inflate. */
-            byte = checkpoint->offset.comp_byte;
-            byte >>= (8 - checkpoint->offset.comp_bits_count);
-
-            /* Push these bits to zlib. */
-            z_ret = inflatePrime(index->z_stream,
-                                 checkpoint->offset.comp_bits_count,
-                                 byte);
-            if (z_ret != Z_OK) {
-                ZX_LOG("ERROR: inflatePrime error (%d).", z_ret);
-                return ZX_ERR_ZLIB(z_ret);
-            }
-        }
-
-        /* Copy window from checkpoint. */
-        z_ret = inflateSetDictionary(index->z_stream,
-                                     checkpoint->window_data,
-                                     checkpoint->window_length);
-        if (z_ret != Z_OK) {
-            ZX_LOG("ERROR: inflateSetDictionary error (%d).", z_ret);
+        /* Inflate stops at the end of header with Z_TREES. */
+        z_ret = index->backend->inflate(zs, Z_TREES);
+        if (z_ret != Z_OK && z_ret != Z_BUF_ERROR) {
+            ZX_LOG("ERROR: inflate (%d) while decoding block header.", z_ret);
             return ZX_ERR_ZLIB(z_ret);
         }
+    }
 
-        /* Set stream states and offsets. TODO: It may be unnecessary to update
-         * comp_byte and comp_bits_count. */
-        index->stream_state           = ZX_STATE_DEFLATE_BLOCKS;
-        index->offset.comp            = checkpoint->offset.comp;
-        index->offset.comp_byte       = byte;
-        index->offset.comp_bits_count = checkpoint->offset.comp_bits_count;
-        index->offset.uncomp          = checkpoint->offset.uncomp;
-
-        /* Dispose if there's anything in input buffer. */
-        index->z_stream->avail_in = 0;
-    } else {
-        ZX_LOG("No need to jump to checkpoint, since offset (%jd) is closer "
-               "to the current offset (%jd) than that of checkpoint (%jd).",
-               (intmax_t)offset, (intmax_t)index->offset.uncomp,
-               (intmax_t)checkpoint->offset.uncomp);
+    if (!is_after_block_header(zs)) {
+        ZX_LOG("ERROR: Block header of checkpoint is incomplete.");
+        return ZX_ERR_CORRUPTED;
     }
+    return ZX_RET_OK;
+}
 
-    /* Whether we jump to somewhere in file or not, we need to consume
-     * remaining bytes until the offset by decompressing. */
-    num_bytes_remaining = offset - index->offset.uncomp;
-    while (num_bytes_remaining > 0) {
-        /* Number of bytes going to consumed in next zidx read call is equal to
-         * min(num_bytes_remaining, seeking_data_buffer_size). */
-        num_bytes_next =
-            (num_bytes_remaining > index->seeking_data_buffer_size ?
-                index->seeking_data_buffer_size :
-                num_bytes_remaining);
+/**
+ * Feed bits preceding compressed offset of a checkpoint to inflate. These are
+ * block header if checkpoint is inside a block, followed by the bits of the
+ * byte shared with previous block or code.
+ *
+ * \param index      Index data.
+ * \param zs         z_stream reset for raw inflate.
+ * \param checkpoint Checkpoint to resume decoding from.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_CORRUPTED if block header is not valid.
+ *         ZX_ERR_ZLIB(...) if zlib returns an error.
+ */
+static int prime_checkpoint(zidx_index *index,
+                            z_stream *zs,
+                            const zidx_checkpoint *checkpoint)
+{
+    /* Used for storing return value of zlib calls. */
+    int z_ret;
 
-        /* Read next compressed data and decompress it using internal seeking
-         * buffer. */
-        s_read_len = zidx_read_ex(index,
-                                  index->seeking_data_buffer,
-                                  num_bytes_next,
-                                  block_callback,
-                                  callback_context);
-        /* Handle error. */
-        if (s_read_len < 0) {
-            ZX_LOG("ERROR: Couldn't decompress remaining data while "
-                   "seeking (%d).", s_read_len);
-            return s_read_len;
-        }
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
 
-        /* Handle end-of-file. */
-        if (s_read_len == 0) {
-            ZX_LOG("ERROR: Unexpected end-of-file while decompressing "
-                   "remaining data for seeking (%d).", s_read_len);
-            return ZX_ERR_STREAM_EOF;
+    /* Used for storing shared byte between two blocks in the boundary, if they
+     * share any. */
+    uint8_t byte;
+
+    /* Decode header of the block if checkpoint is inside the block. */
+    if (checkpoint->offset.in_block) {
+        zx_ret = prime_block_header(index, zs, checkpoint);
+        if (zx_ret != ZX_RET_OK) {
+            ZX_LOG("ERROR: Couldn't prime block header (%d).", zx_ret);
+            return zx_ret;
         }
+    }
 
-        /* Decrease number of bytes read. */
-        num_bytes_remaining -= s_read_len;
+    /* Handle if there is a byte shared between two consecutive blocks. */
+    if (checkpoint->offset.comp_bits_count > 0) {
+        /* Higher bits of the byte should be pushed to zlib before calling
+         * inflate. */
+        byte = checkpoint->offset.comp_byte;
+        byte >>= (8 - checkpoint->offset.comp_bits_count);
 
-        #ifdef ZX_DEBUG
-        /* Normally this should be unnecessary, since this function should not
-         * return more than buffer length, but anyway let's check it in
-         * debugging mode. */
-        if (num_bytes_remaining < 0) {
-            ZX_LOG("ERROR: Screwed number of bytes remaining while reading "
-                   "for seeking. Check the code. (num_bytes_remaining: %jd)",
-                   (intmax_t) num_bytes_remaining);
-            return ZX_ERR_CORRUPTED;
+        /* Push these bits to zlib. */
+        z_ret = index->backend->prime(zs, checkpoint->offset.comp_bits_count,
+                                      byte);
+        if (z_ret != Z_OK) {
+            ZX_LOG("ERROR: inflatePrime error (%d).", z_ret);
+            return ZX_ERR_ZLIB(z_ret);
         }
-        #endif
     }
 
     return ZX_RET_OK;
 }
 
-off_t zidx_tell(zidx_index* index)
+/**
+ * Check if ranges of a sparse window are in order, don't overlap and lie in
+ * the window.
+ *
+ * \param checkpoint Checkpoint with sparse window.
+ *
+ * \return 1 if ranges are valid, 0 otherwise.
+ */
+static int are_window_ranges_valid(const zidx_checkpoint *checkpoint)
 {
-    return index->offset.uncomp;
-}
+    unsigned int end = 0;
+    int i;
 
-int zidx_rewind(zidx_index* index)
-{
-    return zidx_seek(index, 0);
+    for (i = 0; i < checkpoint->window_ranges_count; i++) {
+        if (checkpoint->window_ranges[2 * i] < end
+                || checkpoint->window_ranges[2 * i + 1] == 0) {
+            return 0;
+        }
+        end = checkpoint->window_ranges[2 * i]
+                  + checkpoint->window_ranges[2 * i + 1];
+    }
+    return end <= checkpoint->window_length;
 }
 
-int zidx_eof(zidx_index* index)
+/**
+ * Get length of window content of a checkpoint, which is the total length of
+ * its ranges if window is sparse.
+ *
+ * \param checkpoint Checkpoint.
+ *
+ * \return Length of window content before compression.
+ */
+static unsigned int window_content_length(const zidx_checkpoint *checkpoint)
 {
-    return index->stream_state == ZX_STATE_END_OF_FILE;
-}
+    unsigned int length = 0;
+    int i;
 
-int zidx_error(zidx_index* index)
-{
-    /* TODO: Implement invalid state. */
-    return index->stream_state == ZX_STATE_INVALID;
+    if (!checkpoint->is_window_sparse) {
+        return checkpoint->window_length;
+    }
+    for (i = 0; i < checkpoint->window_ranges_count; i++) {
+        length += checkpoint->window_ranges[2 * i + 1];
+    }
+    return length;
 }
 
-int zidx_uncomp_size(zidx_index* index)
+/**
+ * Get length of window data of a checkpoint as it's stored.
+ *
+ * \param checkpoint Checkpoint.
+ *
+ * \return Length of compressed window if window is compressed, or length of
+ *         window content otherwise.
+ */
+static unsigned int stored_window_length(const zidx_checkpoint *checkpoint)
 {
-    return index->uncompressed_size;
+    if (checkpoint->window_comp_length > 0) {
+        return checkpoint->window_comp_length;
+    }
+    return window_content_length(checkpoint);
 }
 
-typedef struct spacing_data_s
-{
-    off_t last_offset;
-    off_t spacing_length;
-    char is_uncompressed;
-} spacing_data;
-
-static int spacing_callback(void *context,
-                            zidx_index *index,
-                            zidx_checkpoint_offset *offset,
-                            int is_last_block)
+/**
+ * Compress window of a checkpoint in place with raw deflate, if given
+ * compression type is ZX_WINDOW_DEFLATE. Window is kept as is if it doesn't
+ * shrink. Deflate stream of index is allocated on first use.
+ *
+ * \param index       Index data.
+ * \param checkpoint  Checkpoint with uncompressed window.
+ * \param compression Compression type to apply to window.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_MEMORY if memory couldn't be allocated.
+ *         ZX_ERR_ZLIB(...) if zlib returns an error.
+ */
+static int compress_window(zidx_index *index, zidx_checkpoint *checkpoint,
+                           zidx_window_compression compression)
 {
-    /* Used for storing return value of this function. */
-    int ret;
+    /* Used for storing return value of zlib calls. */
+    int z_ret;
 
-    /* Used for storing return value of zidx calls. */
-    int zx_ret;
+    /* Length of compressed window. */
+    unsigned int comp_length;
 
-    /* New checkpoint to be added. Should be freed in case of failure. */
-    zidx_checkpoint *ckp = NULL;
+    /* Length of window content to compress. */
+    unsigned int content_length;
 
-    /* Casted alias for context. */
-    spacing_data* data = context;
+    /* Used for shrinking window buffer. */
+    uint8_t *shrunk;
 
-    off_t current_offset;
+    z_stream *zs;
 
-    /* Determine which offsets to use. */
-    if (data->is_uncompressed) {
-        current_offset = offset->uncomp;
-    } else {
-        current_offset = offset->comp;
+    content_length = window_content_length(checkpoint);
+    if (compression != ZX_WINDOW_DEFLATE
+            || content_length == 0
+            || checkpoint->window_comp_length > 0) {
+        return ZX_RET_OK;
     }
 
-    /* If spacing_length bytes passed since last saved checkpoint... */
-    if (current_offset >= data->last_offset + data->spacing_length) {
-
-        /* Create a new checkpoint. */
-        ckp = zidx_create_checkpoint();
-        if (ckp == NULL) {
-            ZX_LOG("ERROR: Couldn't allocate memory for new checkpoint (%d).",
-                   zx_ret);
-            ret = zx_ret;
-            goto cleanup;
+    if (index->window_buffer == NULL) {
+        index->window_buffer = index_malloc(index, index->window_size);
+        if (index->window_buffer == NULL) {
+            ZX_LOG("ERROR: Couldn't allocate memory for window buffer.");
+            return ZX_ERR_MEMORY;
         }
+    }
 
-        /* Fill it in with current index and offset information. */
-        zx_ret = zidx_fill_checkpoint(index, ckp, offset);
-        if (zx_ret != ZX_RET_OK) {
-            ZX_LOG("ERROR: Couldn't fill new checkpoint (%d).", zx_ret);
-            ret = zx_ret;
-            goto cleanup;
+    zs = index->window_deflate;
+    if (zs == NULL) {
+        zs = index_calloc(index, 1, sizeof(z_stream));
+        if (zs == NULL) {
+            ZX_LOG("ERROR: Couldn't allocate memory for deflate stream.");
+            return ZX_ERR_MEMORY;
         }
-
-        /* Add checkpoint to the index list. */
-        zx_ret = zidx_add_checkpoint(index, ckp);
-        if (zx_ret != ZX_RET_OK) {
-            ZX_LOG("ERROR: Couldn't add new checkpoint (%d).", zx_ret);
-            ret = zx_ret;
-            goto cleanup;
+        set_stream_allocator(index, zs);
+        z_ret = deflateInit2(zs, index->window_compression_level, Z_DEFLATED,
+                             -index->window_bits, 8, Z_DEFAULT_STRATEGY);
+        if (z_ret != Z_OK) {
+            ZX_LOG("ERROR: deflateInit2 returned error (%d).", z_ret);
+            index_free(index, zs);
+            return ZX_ERR_ZLIB(z_ret);
+        }
+        index->window_deflate = zs;
+    } else {
+        z_ret = deflateReset(zs);
+        if (z_ret == Z_OK) {
+            z_ret = deflateParams(zs, index->window_compression_level,
+                                  Z_DEFAULT_STRATEGY);
         }
+        if (z_ret != Z_OK) {
+            ZX_LOG("ERROR: Couldn't reset deflate stream (%d).", z_ret);
+            return ZX_ERR_ZLIB(z_ret);
+        }
+    }
 
-        /* Set last_offset. */
-        data->last_offset = current_offset;
+    /* Output space is one byte less than window, so only windows which get
+     * smaller are compressed. */
+    zs->next_in   = checkpoint->window_data;
+    zs->avail_in  = content_length;
+    zs->next_out  = index->window_buffer;
+    zs->avail_out = content_length - 1;
+    z_ret = deflate(zs, Z_FINISH);
+    if (z_ret == Z_OK || z_ret == Z_BUF_ERROR) {
+        ZX_LOG("Window of %u bytes is incompressible.", content_length);
+        return ZX_RET_OK;
     }
+    if (z_ret != Z_STREAM_END) {
+        ZX_LOG("ERROR: deflate returned error (%d).", z_ret);
+        return ZX_ERR_ZLIB(z_ret);
+    }
+    comp_length = content_length - 1 - zs->avail_out;
+
+    memcpy(checkpoint->window_data, index->window_buffer, comp_length);
+    shrunk = index_realloc(index, checkpoint->window_data, comp_length);
+    if (shrunk != NULL) {
+        checkpoint->window_data = shrunk;
+    }
+    checkpoint->window_comp_length = comp_length;
 
     return ZX_RET_OK;
+}
 
-cleanup:
-    if (ckp != NULL) {
-        free(ckp);
+/**
+ * Move ranges of a sparse window from the beginning of buffer to their
+ * positions in window, and zero-fill gaps between them. Ranges are moved
+ * starting from the last one, so none of them is overwritten before moved.
+ *
+ * \param checkpoint Checkpoint with sparse window.
+ * \param buffer     Buffer with window content, which has space for the
+ *                   whole window.
+ */
+static void expand_sparse_window(const zidx_checkpoint *checkpoint,
+                                 uint8_t *buffer)
+{
+    const uint16_t *ranges = checkpoint->window_ranges;
+    unsigned int content_off = window_content_length(checkpoint);
+    unsigned int end;
+    int i;
+
+    for (i = checkpoint->window_ranges_count - 1; i >= 0; i--) {
+        content_off -= ranges[2 * i + 1];
+        memmove(buffer + ranges[2 * i], buffer + content_off,
+                ranges[2 * i + 1]);
     }
-    return ret;
-}
 
+    end = 0;
+    for (i = 0; i < checkpoint->window_ranges_count; i++) {
+        memset(buffer + end, 0, ranges[2 * i] - end);
+        end = ranges[2 * i] + ranges[2 * i + 1];
+    }
+    memset(buffer + end, 0, checkpoint->window_length - end);
+}
 
-int zidx_build_index(zidx_index* index,
-                     off_t spacing_length,
-                     char is_uncompressed)
+/**
+ * Get uncompressed window of a checkpoint. Compressed or sparse windows are
+ * restored to window buffer of index, which is valid until the next call.
+ * Inflate stream of index is allocated on first use.
+ *
+ * \param index      Index data.
+ * \param checkpoint Checkpoint to get window of.
+ * \param window     Set to uncompressed window.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_MEMORY if memory couldn't be allocated.
+ *         ZX_ERR_CORRUPTED if compressed window is not valid.
+ *         ZX_ERR_INVALID_OP if window is not loaded by ensure_window() yet.
+ */
+static int get_window(zidx_index *index,
+                      const zidx_checkpoint *checkpoint,
+                      const uint8_t **window)
 {
-    /* Context for spacing_callback. */
-    spacing_data data;
+    /* Used for storing return value of zlib calls. */
+    int z_ret;
 
-    /* Assign last uncompressed offset to 0, and pass spacing_length. */
-    data.last_offset = 0;
-    data.spacing_length = spacing_length;
-    data.is_uncompressed = is_uncompressed;
+    unsigned int content_length;
+    z_stream *zs;
 
-    return zidx_build_index_ex(index, spacing_callback, &data);
-}
+    if (checkpoint->is_window_lazy || checkpoint->is_window_evicted) {
+        ZX_LOG("ERROR: Window of checkpoint is not loaded.");
+        return ZX_ERR_INVALID_OP;
+    }
 
-int zidx_build_index_ex(zidx_index* index,
-                        zidx_block_callback next_block_callback,
-                        void *callback_context)
-{
-    /* Used for storing return value of zidx calls. */
-    int zx_ret;
+    if (checkpoint->window_comp_length == 0
+            && !checkpoint->is_window_sparse) {
+        *window = checkpoint->window_data;
+        return ZX_RET_OK;
+    }
 
-    /* Read as long as it's not end of stream. */
-    do {
-        zx_ret = zidx_read_ex(index,
-                              index->seeking_data_buffer,
-                              index->seeking_data_buffer_size,
-                              next_block_callback,
-                              callback_context);
-        if (zx_ret < 0) {
-            ZX_LOG("ERROR: While reading decompressed data (%d).", zx_ret);
+    if (checkpoint->window_length > index->window_size) {
+        ZX_LOG("ERROR: Window length (%u) is larger than window size (%u).",
+               (unsigned)checkpoint->window_length, index->window_size);
+        return ZX_ERR_CORRUPTED;
+    }
+
+    if (index->window_buffer == NULL) {
+        index->window_buffer = index_malloc(index, index->window_size);
+        if (index->window_buffer == NULL) {
+            ZX_LOG("ERROR: Couldn't allocate memory for window buffer.");
+            return ZX_ERR_MEMORY;
+        }
+    }
+
+    content_length = window_content_length(checkpoint);
+    if (checkpoint->window_comp_length == 0) {
+        memcpy(index->window_buffer, checkpoint->window_data, content_length);
+    } else {
+        zs = index->window_inflate;
+        if (zs == NULL) {
+            zs = index_calloc(index, 1, sizeof(z_stream));
+            if (zs == NULL) {
+                ZX_LOG("ERROR: Couldn't allocate memory for inflate stream.");
+                return ZX_ERR_MEMORY;
+            }
+            set_stream_allocator(index, zs);
+            z_ret = inflateInit2(zs, -index->window_bits);
+            if (z_ret != Z_OK) {
+                ZX_LOG("ERROR: inflateInit2 returned error (%d).", z_ret);
+                index_free(index, zs);
+                return ZX_ERR_ZLIB(z_ret);
+            }
+            index->window_inflate = zs;
+        } else {
+            z_ret = inflateReset(zs);
+            if (z_ret != Z_OK) {
+                ZX_LOG("ERROR: inflateReset returned error (%d).", z_ret);
+                return ZX_ERR_ZLIB(z_ret);
+            }
+        }
+
+        zs->next_in   = checkpoint->window_data;
+        zs->avail_in  = checkpoint->window_comp_length;
+        zs->next_out  = index->window_buffer;
+        zs->avail_out = content_length;
+        z_ret = inflate(zs, Z_FINISH);
+        if (z_ret != Z_STREAM_END || zs->avail_out != 0) {
+            ZX_LOG("ERROR: Compressed window is corrupted (%d).", z_ret);
+            return ZX_ERR_CORRUPTED;
+        }
+    }
+
+    if (checkpoint->is_window_sparse) {
+        expand_sparse_window(checkpoint, index->window_buffer);
+    }
+
+    *window = index->window_buffer;
+    return ZX_RET_OK;
+}
+
+/**
+ * Read exactly given number of bytes from stream.
+ *
+ * \param stream Stream to read from.
+ * \param buf    Buffer to read into.
+ * \param length Number of bytes to read.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_STREAM_EOF if stream ended before reading all bytes.
+ *         ZX_ERR_NOT_IMPLEMENTED if stream returned less bytes without
+ *         reaching its end.
+ *         Otherwise, error returned by sl_error().
+ */
+static int read_stream_exact(streamlike_t *stream, void *buf, size_t length)
+{
+    /* Used for storing return values of stream calls. */
+    size_t s_ret;
+    int s_err;
+
+    s_ret = sl_read(stream, buf, length);
+    if (s_ret < length) {
+        s_err = sl_error(stream);
+        if (s_err) {
+            ZX_LOG("ERROR: Couldn't read from stream (%d).", s_err);
+            return s_err;
+        } else if (sl_eof(stream)) {
+            ZX_LOG("ERROR: Unexpected end-of-file.");
+            return ZX_ERR_STREAM_EOF;
+        } else {
+            ZX_LOG("ERROR: Asynchronous read is not implemented.");
+            return ZX_ERR_NOT_IMPLEMENTED;
+        }
+    }
+    return ZX_RET_OK;
+}
+
+/**
+ * Read window section of checkpoint from index file. Ranges, window data and
+ * block header are read from the current position of stream, lengths of which
+ * are given in checkpoint metadata. Buffers are kept in checkpoint even if
+ * reading fails, so they should be released by the caller.
+ *
+ * \param index      Index data, whose allocator is used.
+ * \param stream     Stream of index file.
+ * \param checkpoint Checkpoint with its metadata read.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_MEMORY if memory couldn't be allocated.
+ *         ZX_ERR_CORRUPTED if window ranges are not valid.
+ *         Otherwise, error returned by read_stream_exact().
+ */
+static int read_checkpoint_window(zidx_index *index,
+                                  streamlike_t *stream,
+                                  zidx_checkpoint *checkpoint)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Number of bytes of ranges, window or block header. */
+    size_t length;
+
+    if (checkpoint->window_ranges_count > 0) {
+        length = 2 * sizeof(uint16_t) * checkpoint->window_ranges_count;
+        checkpoint->window_ranges = index_malloc(index, length);
+        if (checkpoint->window_ranges == NULL) {
+            ZX_LOG("ERROR: Couldn't allocate space for window ranges.");
+            return ZX_ERR_MEMORY;
+        }
+        zx_ret = read_stream_exact(stream, checkpoint->window_ranges, length);
+        if (zx_ret != ZX_RET_OK) {
             return zx_ret;
         }
-    } while(zx_ret > 0);
+        if (!are_window_ranges_valid(checkpoint)) {
+            ZX_LOG("ERROR: Window ranges are not valid.");
+            return ZX_ERR_CORRUPTED;
+        }
+    }
+    if (stored_window_length(checkpoint) > 0) {
+        /* Compressed windows are kept compressed. */
+        length = stored_window_length(checkpoint);
+        checkpoint->window_data = index_malloc(index, length);
+        if (checkpoint->window_data == NULL) {
+            ZX_LOG("ERROR: Couldn't allocate space for window data.");
+            return ZX_ERR_MEMORY;
+        }
+        zx_ret = read_stream_exact(stream, checkpoint->window_data, length);
+        if (zx_ret != ZX_RET_OK) {
+            return zx_ret;
+        }
+    } else {
+        ZX_LOG("No window data.");
+    }
+    if (checkpoint->block_header_bits > 0) {
+        length = (checkpoint->block_header_bits + 7) / 8;
+        checkpoint->block_header = index_malloc(index, length);
+        if (checkpoint->block_header == NULL) {
+            ZX_LOG("ERROR: Couldn't allocate space for block header.");
+            return ZX_ERR_MEMORY;
+        }
+        zx_ret = read_stream_exact(stream, checkpoint->block_header, length);
+        if (zx_ret != ZX_RET_OK) {
+            return zx_ret;
+        }
+    }
+    return ZX_RET_OK;
+}
+
+/**
+ * Load window of checkpoint from the index file it's lazily imported from.
+ * Window data evicted after it's loaded is read again. Nothing is done if
+ * window is already loaded.
+ *
+ * \param index      Index data.
+ * \param checkpoint Checkpoint in the list of index.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_STREAM_SEEK if index file couldn't be repositioned.
+ *         ZX_ERR_MEMORY if memory couldn't be allocated.
+ *         Otherwise, error returned by read_checkpoint_window().
+ */
+static int load_window(zidx_index *index, zidx_checkpoint *checkpoint)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    if (checkpoint->is_window_evicted && checkpoint->is_window_stored) {
+        ZX_LOG("Reloading window of checkpoint (uncomp: %jd).",
+               (intmax_t)checkpoint->offset.uncomp);
+        if (sl_seek(index->window_stream, checkpoint->window_offset
+                        + 2 * sizeof(uint16_t)
+                            * checkpoint->window_ranges_count,
+                    SL_SEEK_SET) != 0) {
+            ZX_LOG("ERROR: Couldn't seek to window in index file.");
+            return ZX_ERR_STREAM_SEEK;
+        }
+        checkpoint->window_data =
+            index_malloc(index, stored_window_length(checkpoint));
+        if (checkpoint->window_data == NULL) {
+            ZX_LOG("ERROR: Couldn't allocate space for window data.");
+            return ZX_ERR_MEMORY;
+        }
+        zx_ret = read_stream_exact(index->window_stream,
+                                   checkpoint->window_data,
+                                   stored_window_length(checkpoint));
+        if (zx_ret != ZX_RET_OK) {
+            index_free(index, checkpoint->window_data);
+            checkpoint->window_data = NULL;
+            return zx_ret;
+        }
+        checkpoint->is_window_evicted = 0;
+        return ZX_RET_OK;
+    }
+
+    if (!checkpoint->is_window_lazy) {
+        return ZX_RET_OK;
+    }
+
+    ZX_LOG("Loading window of checkpoint (uncomp: %jd) at offset %jd.",
+           (intmax_t)checkpoint->offset.uncomp,
+           (intmax_t)checkpoint->window_offset);
+    if (index->window_stream == NULL
+            || sl_seek(index->window_stream, checkpoint->window_offset,
+                       SL_SEEK_SET) != 0) {
+        ZX_LOG("ERROR: Couldn't seek to window in index file.");
+        return ZX_ERR_STREAM_SEEK;
+    }
+
+    zx_ret = read_checkpoint_window(index, index->window_stream,
+                                    checkpoint);
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't load window (%d).", zx_ret);
+        release_window(index, checkpoint);
+        return zx_ret;
+    }
+
+    checkpoint->is_window_lazy = 0;
+    return ZX_RET_OK;
+}
+
+/**
+ * Get memory used by windows of checkpoints and by decoding caches, which is
+ * limited by window budget. Decoding caches are window buffer, read cache and
+ * windows of decoder snapshots. Only windows of checkpoints are evicted for
+ * keeping within budget, while caches are limited by their own settings.
+ * Mapped windows are not counted.
+ *
+ * \param index Index data.
+ *
+ * \return Memory usage in bytes.
+ */
+static size_t get_window_memory(const zidx_index *index)
+{
+    return index->window_memory
+           + (index->window_buffer != NULL ? index->window_size : 0)
+           + index->cache_memory
+           + index->snapshot_memory;
+}
+
+/**
+ * Empty LRU list of windows, without releasing windows in it.
+ *
+ * \param index Index data.
+ */
+static void reset_window_lru(zidx_index *index)
+{
+    index->window_memory = 0;
+    index->lru_head      = -1;
+    index->lru_tail      = -1;
+}
+
+/**
+ * Remove window of checkpoint from LRU list.
+ *
+ * \param index Index data.
+ * \param idx   Index of checkpoint, which is in LRU list.
+ */
+static void unlink_window(zidx_index *index, int idx)
+{
+    zidx_checkpoint *ckp = &index->list[idx];
+
+    if (ckp->lru_prev >= 0) {
+        index->list[ckp->lru_prev].lru_next = ckp->lru_next;
+    } else {
+        index->lru_head = ckp->lru_next;
+    }
+    if (ckp->lru_next >= 0) {
+        index->list[ckp->lru_next].lru_prev = ckp->lru_prev;
+    } else {
+        index->lru_tail = ckp->lru_prev;
+    }
+}
+
+/**
+ * Mark window of checkpoint as the most recently used. Window is counted in
+ * memory usage when it's added to LRU list first. Mapped windows and
+ * checkpoints without window data are ignored.
+ *
+ * \param index Index data.
+ * \param idx   Index of checkpoint.
+ */
+static void touch_window(zidx_index *index, int idx)
+{
+    zidx_checkpoint *ckp = &index->list[idx];
+
+    if (ckp->is_window_in_lru) {
+        if (index->lru_head == idx) {
+            return;
+        }
+        unlink_window(index, idx);
+    } else {
+        if (ckp->window_data == NULL || ckp->is_window_mapped) {
+            return;
+        }
+        ckp->is_window_in_lru = 1;
+        index->window_memory += stored_window_length(ckp);
+    }
+
+    ckp->lru_prev = -1;
+    ckp->lru_next = index->lru_head;
+    if (index->lru_head >= 0) {
+        index->list[index->lru_head].lru_prev = idx;
+    } else {
+        index->lru_tail = idx;
+    }
+    index->lru_head = idx;
+}
+
+/**
+ * Release window data of checkpoint in LRU list. Ranges and block header are
+ * kept, so window can be restored by ensure_window().
+ *
+ * \param index Index data.
+ * \param idx   Index of checkpoint, which is in LRU list.
+ */
+static void evict_window(zidx_index *index, int idx)
+{
+    zidx_checkpoint *ckp = &index->list[idx];
+
+    ZX_LOG("Evicting window of checkpoint %d (uncomp: %jd).", idx,
+           (intmax_t)ckp->offset.uncomp);
+    unlink_window(index, idx);
+    index->window_memory -= stored_window_length(ckp);
+    index->window_evictions++;
+
+    index_free(index, ckp->window_data);
+    ckp->window_data       = NULL;
+    ckp->is_window_in_lru  = 0;
+    ckp->is_window_evicted = 1;
+}
+
+/**
+ * Evict least recently used windows until memory usage is within window
+ * budget. Nothing is done if there is no budget.
+ *
+ * \param index   Index data.
+ * \param protect Index of checkpoint whose window is not evicted, or -1.
+ */
+static void enforce_window_budget(zidx_index *index, int protect)
+{
+    int idx;
+    int prev;
+
+    if (index->window_budget == 0) {
+        return;
+    }
+
+    if (index->list_lock != NULL) pthread_rwlock_rdlock(index->list_lock);
+    idx = index->lru_tail;
+    while (idx >= 0 && get_window_memory(index) > index->window_budget) {
+        prev = index->list[idx].lru_prev;
+        if (idx != protect) {
+            evict_window(index, idx);
+        }
+        idx = prev;
+    }
+    if (index->list_lock != NULL) pthread_rwlock_unlock(index->list_lock);
+}
+
+/**
+ * Move window, ranges and block header of checkpoint to window arena, if
+ * arena is enabled. They are copied to a single allocation, so they are
+ * released along with arena. Windows in arena are not counted in window
+ * budget, and not evicted. Window is kept as is if arena can't be extended.
+ *
+ * \param index Index data.
+ * \param idx   Index of checkpoint.
+ */
+static void adopt_window(zidx_index *index, int idx)
+{
+    zidx_checkpoint *ckp = &index->list[idx];
+    size_t ranges_length;
+    size_t data_length;
+    size_t header_length;
+    uint8_t *ptr;
+
+    if (index->arena_chunk_size == 0 || ckp->is_window_in_arena
+            || ckp->is_window_mapped || ckp->is_window_lazy
+            || ckp->is_window_evicted
+            || (ckp->window_data == NULL && ckp->block_header == NULL)) {
+        return;
+    }
+
+    ranges_length = 2 * sizeof(uint16_t) * ckp->window_ranges_count;
+    data_length   = ckp->window_data != NULL ? stored_window_length(ckp) : 0;
+    header_length = (ckp->block_header_bits + 7) / 8;
+    ptr = arena_alloc(index, ranges_length + data_length + header_length);
+    if (ptr == NULL) {
+        return;
+    }
+
+    if (ckp->is_window_in_lru) {
+        unlink_window(index, idx);
+        index->window_memory -= stored_window_length(ckp);
+        ckp->is_window_in_lru = 0;
+    }
+
+    if (ranges_length > 0) {
+        memcpy(ptr, ckp->window_ranges, ranges_length);
+        index_free(index, ckp->window_ranges);
+        ckp->window_ranges = (uint16_t*)ptr;
+    }
+    if (ckp->window_data != NULL) {
+        memcpy(ptr + ranges_length, ckp->window_data, data_length);
+        index_free(index, ckp->window_data);
+        ckp->window_data = ptr + ranges_length;
+    }
+    if (ckp->block_header != NULL) {
+        memcpy(ptr + ranges_length + data_length, ckp->block_header,
+               header_length);
+        index_free(index, ckp->block_header);
+        ckp->block_header = ptr + ranges_length + data_length;
+    }
+    ckp->is_window_in_arena = 1;
+}
+
+/**
+ * Get uncompressed offset of the checkpoint following the one at the given
+ * offset.
+ *
+ * \param index  Index data.
+ * \param offset Uncompressed offset of a checkpoint.
+ *
+ * \return Offset of the next checkpoint, or -1 if there is none.
+ */
+static off_t get_next_checkpoint_offset(zidx_index *index, off_t offset)
+{
+    off_t next_offset = -1;
+    int idx;
+
+    if (index->list_lock != NULL) pthread_rwlock_rdlock(index->list_lock);
+    idx = find_checkpoint_idx(index, offset, &index->lookup_hint);
+    if (idx >= 0 && idx + 1 < index->list_count) {
+        next_offset = index->list[idx + 1].offset.uncomp;
+    }
+    if (index->list_lock != NULL) pthread_rwlock_unlock(index->list_lock);
+
+    return next_offset;
+}
+
+/**
+ * Move decompression state of index to a checkpoint.
+ *
+ * The compressed stream is positioned at the checkpoint, inflate is reset and
+ * primed with the bits of the byte shared with previous block, and window of
+ * the checkpoint is restored. For checkpoints inside blocks, block header is
+ * primed before the shared byte.
+ *
+ * \param index      Index data.
+ * \param checkpoint Checkpoint to jump to. If NULL, index is moved to the
+ *                   beginning of file.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_STREAM_SEEK if the stream couldn't be repositioned.
+ *         ZX_ERR_CORRUPTED if block header or compressed window of checkpoint
+ *         is not valid.
+ *         ZX_ERR_MEMORY if memory couldn't be allocated for window.
+ *         ZX_ERR_ZLIB(...) if zlib returns an error.
+ */
+static int jump_to_checkpoint(zidx_index *index,
+                              const zidx_checkpoint *checkpoint)
+{
+    /* Used for storing return value of stream functions. */
+    int s_ret;
+
+    /* Used for storing return value of zlib calls. */
+    int z_ret;
+
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Uncompressed window of checkpoint. */
+    const uint8_t *window;
+
+    /* Position left by reading from cache is dropped. */
+    index->cache_offset = -1;
+
+    /* Snapshots are spaced from where decoding is started. */
+    index->snapshot_from = checkpoint != NULL ? checkpoint->offset.uncomp : 0;
+
+    if (checkpoint == NULL) {
+        s_ret = seek_comp_stream(index, 0);
+        if (s_ret != ZX_RET_OK) {
+            ZX_LOG("ERROR: Couldn't seek in stream (%d).", s_ret);
+            return s_ret;
+        }
+
+        /* Reset stream states and offsets. */
+        index->stream_state           = ZX_STATE_FILE_HEADERS;
+        index->offset.comp            = 0;
+        index->offset.comp_byte       = 0;
+        index->offset.comp_bits_count = 0;
+        index->offset.uncomp          = 0;
+        index->offset.in_block        = 0;
+        index->window_valid_until     = -1;
+
+        /* Header of the first block is collected after file headers. */
+        index->block_state.header_bits        = -1;
+        index->block_state.is_header_complete = 0;
+
+        /* Dispose if there's anything in input buffer. */
+        index->z_stream->avail_in = 0;
+        return ZX_RET_OK;
+    }
+
+    /* Decompress window of checkpoint if it's compressed. */
+    zx_ret = get_window(index, checkpoint, &window);
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't get window of checkpoint (%d).", zx_ret);
+        return zx_ret;
+    }
+
+    /* Initialize as deflate. */
+    z_ret = initialize_inflate(index, index->z_stream, -index->window_bits);
+    if (z_ret != Z_OK) {
+        ZX_LOG("ERROR: inflate initialization returned error (%d).", z_ret);
+        return ZX_ERR_ZLIB(z_ret);
+    }
+
+    /* Seek to the checkpoint offset in compressed stream. */
+    s_ret = seek_comp_stream(index, checkpoint->offset.comp);
+    if (s_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't seek in stream (%d).", s_ret);
+        return s_ret;
+    }
+
+    /* Prime block header and the byte shared with previous block. */
+    zx_ret = prime_checkpoint(index, index->z_stream, checkpoint);
+    if (zx_ret != ZX_RET_OK) {
+        return zx_ret;
+    }
+
+    /* Copy window from checkpoint. Checkpoints at the beginning of gzip
+     * members don't have any window. */
+    if (checkpoint->window_length > 0) {
+        z_ret = index->backend->set_dictionary(index->z_stream, window,
+                                               checkpoint->window_length);
+        if (z_ret != Z_OK) {
+            ZX_LOG("ERROR: inflateSetDictionary error (%d).", z_ret);
+            return ZX_ERR_ZLIB(z_ret);
+        }
+    }
+
+    /* Set stream states and offsets. */
+    index->stream_state    = ZX_STATE_DEFLATE_BLOCKS;
+    index->offset          = checkpoint->offset;
+    index->offset.in_block = 0;
+
+    /* Window of a sparse checkpoint is valid until the next checkpoint. */
+    index->window_valid_until = -1;
+    if (checkpoint->is_window_sparse) {
+        index->window_valid_until = get_next_checkpoint_offset(index,
+                                        checkpoint->offset.uncomp);
+    }
+
+    /* Keep header of the block to place further checkpoints inside it. */
+    if (checkpoint->offset.in_block) {
+        memset(index->block_state.header, 0,
+               sizeof(index->block_state.header));
+        memcpy(index->block_state.header, checkpoint->block_header,
+               (checkpoint->block_header_bits + 7) / 8);
+        index->block_state.header_bits        = checkpoint->block_header_bits;
+        index->block_state.is_header_complete = 1;
+        index->block_state.is_stepping        = 0;
+        index->block_state.last_uncomp        = checkpoint->offset.uncomp;
+    } else {
+        start_block_header(index);
+    }
+
+    /* Dispose if there's anything in input buffer. */
+    index->z_stream->avail_in = 0;
+    return ZX_RET_OK;
+}
+
+/**
+ * Capture window of a checkpoint from inflate stream of index, which is
+ * positioned at the checkpoint. Window is stored in the same form as it is
+ * built, so it is compressed or made sparse again if needed.
+ *
+ * \param index Index data.
+ * \param idx   Index of checkpoint whose window is evicted.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_CORRUPTED if window length doesn't match the checkpoint.
+ *         ZX_ERR_MEMORY if memory couldn't be allocated.
+ *         ZX_ERR_ZLIB(...) if zlib returns an error.
+ */
+static int capture_window(zidx_index *index, int idx)
+{
+    /* Return value for this function. */
+    int ret;
+
+    /* Used for storing return value of zlib calls. */
+    int z_ret;
+
+    zidx_checkpoint *ckp;
+    zidx_window_compression compression;
+    unsigned int dict_length;
+    uint8_t *window;
+    uint16_t *ranges;
+    unsigned int content_off;
+    int i;
+
+    z_ret = index->backend->get_dictionary(index->z_stream, NULL,
+                                           &dict_length);
+    if (z_ret != Z_OK) {
+        ZX_LOG("ERROR: inflateGetDictionary returned error (%d).", z_ret);
+        return ZX_ERR_ZLIB(z_ret);
+    }
+    window = index_malloc(index, dict_length > 0 ? dict_length : 1);
+    if (window == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate memory for window data.");
+        return ZX_ERR_MEMORY;
+    }
+    z_ret = index->backend->get_dictionary(index->z_stream, window,
+                                           &dict_length);
+    if (z_ret != Z_OK) {
+        ZX_LOG("ERROR: inflateGetDictionary returned error (%d).", z_ret);
+        index_free(index, window);
+        return ZX_ERR_ZLIB(z_ret);
+    }
+
+    if (index->list_lock != NULL) pthread_rwlock_rdlock(index->list_lock);
+    ckp = &index->list[idx];
+    if (dict_length != ckp->window_length
+            || ckp->offset.uncomp != index->offset.uncomp) {
+        ZX_LOG("ERROR: Regenerated window doesn't match checkpoint %d.", idx);
+        index_free(index, window);
+        ret = ZX_ERR_CORRUPTED;
+        goto end;
+    }
+
+    /* Keep only ranges of sparse window. */
+    if (ckp->is_window_sparse) {
+        ranges = ckp->window_ranges;
+        content_off = 0;
+        for (i = 0; i < ckp->window_ranges_count; i++) {
+            memmove(window + content_off, window + ranges[2 * i],
+                    ranges[2 * i + 1]);
+            content_off += ranges[2 * i + 1];
+        }
+    }
+
+    /* Window is compressed only if it was, so its length is the same unless
+     * compression level is changed. */
+    compression = ckp->window_comp_length > 0 ? ZX_WINDOW_DEFLATE
+                                              : ZX_WINDOW_RAW;
+    ckp->window_data        = window;
+    ckp->window_comp_length = 0;
+    ckp->is_window_evicted  = 0;
+    ret = compress_window(index, ckp, compression);
+    if (ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't compress window (%d).", ret);
+        index_free(index, ckp->window_data);
+        ckp->window_data       = NULL;
+        ckp->is_window_evicted = 1;
+        goto end;
+    }
+    touch_window(index, idx);
+
+end:
+    if (index->list_lock != NULL) pthread_rwlock_unlock(index->list_lock);
+    return ret;
+}
+
+/**
+ * Make sure window of a checkpoint is in memory and mark it as the most
+ * recently used. Window is loaded from index file if it's imported lazily.
+ * Otherwise, evicted window is regenerated by decoding from the closest
+ * preceding checkpoint with a whole window available. Windows of checkpoints
+ * passed on the way are regenerated as well. Other windows may be evicted
+ * afterwards to stay within window budget.
+ *
+ * Decoding state of index is changed if window is regenerated.
+ *
+ * \param index Index data.
+ * \param idx   Index of checkpoint.
+ *
+ * \return ZX_RET_OK if successful, or negative error code.
+ */
+static int ensure_window(zidx_index *index, int idx)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Used for storing number of bytes decoded. */
+    int r_len;
+
+    zidx_checkpoint *ckp;
+    zidx_checkpoint checkpoint;
+    off_t until;
+    char is_evicted;
+    int start;
+    int i;
+
+    /* Checkpoint list of a cursor is shared with other cursors, so it's not
+     * modified. Windows are loaded when cursor is created. */
+    if (index->is_list_shared) {
+        if (index->list[idx].is_window_lazy
+                || index->list[idx].is_window_evicted) {
+            ZX_LOG("ERROR: Window of checkpoint %d is not loaded.", idx);
+            return ZX_ERR_INVALID_OP;
+        }
+        return ZX_RET_OK;
+    }
+
+    if (index->list_lock != NULL) pthread_rwlock_rdlock(index->list_lock);
+    ckp = &index->list[idx];
+    zx_ret = ZX_RET_OK;
+    start = idx;
+    if (ckp->is_window_evicted && !ckp->is_window_stored) {
+        /* Sparse windows don't have the whole history to regenerate windows
+         * following them. */
+        for (start = idx - 1; start >= 0; start--) {
+            ckp = &index->list[start];
+            if ((!ckp->is_window_evicted || ckp->is_window_stored)
+                    && !ckp->is_window_sparse) {
+                break;
+            }
+        }
+    } else {
+        zx_ret = load_window(index, ckp);
+        if (zx_ret == ZX_RET_OK) {
+            touch_window(index, idx);
+        }
+    }
+    if (index->list_lock != NULL) pthread_rwlock_unlock(index->list_lock);
+
+    if (zx_ret == ZX_RET_OK && start < idx) {
+        ZX_LOG("Regenerating window of checkpoint %d from %d.", idx, start);
+        if (start >= 0) {
+            zx_ret = ensure_window(index, start);
+            if (zx_ret != ZX_RET_OK) {
+                return zx_ret;
+            }
+            if (index->list_lock != NULL) {
+                pthread_rwlock_rdlock(index->list_lock);
+            }
+            memcpy(&checkpoint, &index->list[start], sizeof(checkpoint));
+            if (index->list_lock != NULL) {
+                pthread_rwlock_unlock(index->list_lock);
+            }
+        }
+        zx_ret = jump_to_checkpoint(index, start >= 0 ? &checkpoint : NULL);
+    }
+
+    for (i = start + 1; zx_ret == ZX_RET_OK && i <= idx; i++) {
+        if (index->list_lock != NULL) pthread_rwlock_rdlock(index->list_lock);
+        until = index->list[i].offset.uncomp;
+        is_evicted = index->list[i].is_window_evicted
+                         && !index->list[i].is_window_stored;
+        if (index->list_lock != NULL) pthread_rwlock_unlock(index->list_lock);
+
+        while (zx_ret == ZX_RET_OK && index->offset.uncomp < until) {
+            r_len = zidx_read_ex(index, index->seeking_data_buffer,
+                                 until - index->offset.uncomp
+                                     < index->seeking_data_buffer_size
+                                 ? until - index->offset.uncomp
+                                 : index->seeking_data_buffer_size,
+                                 NULL, NULL);
+            if (r_len <= 0) {
+                ZX_LOG("ERROR: Couldn't decode up to checkpoint (%d).",
+                       r_len);
+                zx_ret = r_len < 0 ? r_len : ZX_ERR_CORRUPTED;
+            }
+        }
+        if (zx_ret == ZX_RET_OK && is_evicted) {
+            zx_ret = capture_window(index, i);
+        }
+    }
+
+    if (zx_ret == ZX_RET_OK) {
+        enforce_window_budget(index, idx);
+    }
+    return zx_ret;
+}
+
+/** Number of synthetic windows used for finding references to a window. */
+#define ZX_SPARSE_VARIANTS_ (3)
+
+/**
+ * Minimum length of a gap between ranges of a sparse window. Shorter gaps are
+ * stored, since they take less space than a range.
+ */
+#define ZX_SPARSE_MIN_GAP_ (4)
+
+/**
+ * Find window bytes of a checkpoint referenced by data decoded after it.
+ *
+ * Data is decoded from the checkpoint with ZX_SPARSE_VARIANTS_ z_streams in
+ * lockstep, each having a synthetic window. Bytes copied from the window
+ * differ between variants and encode their position in the window, while
+ * literals are the same in every variant. Decoding stops at the given offset,
+ * when no byte copied from the window is left in reach of back-references, or
+ * at the end of deflate stream.
+ *
+ * \param index      Index data.
+ * \param checkpoint Checkpoint with a window.
+ * \param until      Uncompressed offset to stop at, or -1 if there is none.
+ * \param needed     Set to nonzero for each referenced byte of the window.
+ *                   It should be zero-filled and have window_length bytes.
+ *
+ * \return 1 if all references are found.
+ *         0 if window turned out to be referenced densely.
+ *         ZX_ERR_STREAM_EOF if stream ended before references to window did.
+ *         Other negative error codes on failure.
+ */
+static int find_needed_window(zidx_index *index,
+                              const zidx_checkpoint *checkpoint,
+                              off_t until,
+                              uint8_t *needed)
+{
+    /* Return value for this function. */
+    int ret;
+
+    /* Used for storing return value of zlib calls. */
+    int z_ret;
+
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Used for storing number of bytes read from stream. */
+    int s_read_len;
+
+    z_stream zs[ZX_SPARSE_VARIANTS_];
+    uint8_t *windows[ZX_SPARSE_VARIANTS_] = {NULL};
+    uint8_t *outs[ZX_SPARSE_VARIANTS_] = {NULL};
+    uint8_t *in_buf;
+    int num_initialized = 0;
+
+    /* Uncompressed offset of z_streams. */
+    off_t uncomp = checkpoint->offset.uncomp;
+
+    /* Number of bytes decoded since the last byte copied from window. */
+    unsigned int since_copied = 0;
+
+    /* Number of referenced bytes of window. */
+    unsigned int needed_count = 0;
+
+    unsigned int window_length = checkpoint->window_length;
+    unsigned int out_length;
+    unsigned int pos;
+    unsigned int p;
+    int i;
+
+    /* Variant windows and output buffers. */
+    in_buf = index_malloc(index, index->comp_data_buffer_size);
+    for (i = 0; i < ZX_SPARSE_VARIANTS_; i++) {
+        windows[i] = index_malloc(index, window_length);
+        outs[i] = index_malloc(index, index->window_size);
+    }
+    if (in_buf == NULL || windows[0] == NULL || windows[1] == NULL
+            || windows[2] == NULL || outs[0] == NULL || outs[1] == NULL
+            || outs[2] == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate buffers for window analysis.");
+        ret = ZX_ERR_MEMORY;
+        goto cleanup;
+    }
+    for (p = 0; p < window_length; p++) {
+        windows[0][p] = p & 0xFF;
+        windows[1][p] = (p >> 8) & 0xFF;
+        windows[2][p] = ~p & 0xFF;
+    }
+
+    for (i = 0; i < ZX_SPARSE_VARIANTS_; i++) {
+        memset(&zs[i], 0, sizeof(zs[i]));
+        set_stream_allocator(index, &zs[i]);
+        z_ret = index->backend->init(&zs[i], -index->window_bits);
+        if (z_ret != Z_OK) {
+            ZX_LOG("ERROR: inflate initialization returned error (%d).",
+                   z_ret);
+            ret = ZX_ERR_ZLIB(z_ret);
+            goto cleanup;
+        }
+        num_initialized++;
+
+        zx_ret = prime_checkpoint(index, &zs[i], checkpoint);
+        if (zx_ret != ZX_RET_OK) {
+            ret = zx_ret;
+            goto cleanup;
+        }
+        z_ret = index->backend->set_dictionary(&zs[i], windows[i],
+                                               window_length);
+        if (z_ret != Z_OK) {
+            ZX_LOG("ERROR: inflateSetDictionary error (%d).", z_ret);
+            ret = ZX_ERR_ZLIB(z_ret);
+            goto cleanup;
+        }
+        zs[i].avail_in = 0;
+    }
+
+    zx_ret = seek_comp_stream(index, checkpoint->offset.comp);
+    if (zx_ret != ZX_RET_OK) {
+        ret = zx_ret;
+        goto cleanup;
+    }
+
+    while (until < 0 || uncomp < until) {
+        if (zs[0].avail_in == 0) {
+            s_read_len = read_comp_stream(index, in_buf,
+                                          index->comp_data_buffer_size);
+            if (s_read_len < 0) {
+                ret = s_read_len;
+                goto cleanup;
+            }
+            if (s_read_len == 0) {
+                ZX_LOG("Stream ended before references to window did.");
+                ret = ZX_ERR_STREAM_EOF;
+                goto cleanup;
+            }
+            for (i = 0; i < ZX_SPARSE_VARIANTS_; i++) {
+                zs[i].next_in  = in_buf;
+                zs[i].avail_in = s_read_len;
+            }
+        }
+
+        out_length = index->window_size;
+        if (until >= 0 && until - uncomp < out_length) {
+            out_length = until - uncomp;
+        }
+        for (i = 0; i < ZX_SPARSE_VARIANTS_; i++) {
+            zs[i].next_out  = outs[i];
+            zs[i].avail_out = out_length;
+            z_ret = index->backend->inflate(&zs[i], Z_NO_FLUSH);
+            if (z_ret != Z_OK && z_ret != Z_STREAM_END
+                    && z_ret != Z_BUF_ERROR) {
+                ZX_LOG("ERROR: inflate returned error (%d).", z_ret);
+                ret = ZX_ERR_ZLIB(z_ret);
+                goto cleanup;
+            }
+            if (zs[i].avail_in != zs[0].avail_in
+                    || zs[i].avail_out != zs[0].avail_out) {
+                ZX_LOG("ERROR: Lockstep z_streams diverged.");
+                ret = ZX_ERR_CORRUPTED;
+                goto cleanup;
+            }
+        }
+
+        out_length -= zs[0].avail_out;
+        uncomp += out_length;
+        for (p = 0; p < out_length; p++) {
+            /* Literals are the same in every variant. */
+            if (outs[0][p] == outs[2][p]) {
+                since_copied++;
+                continue;
+            }
+            pos = outs[0][p] | (outs[1][p] << 8);
+            if (pos >= window_length) {
+                ZX_LOG("ERROR: Back-reference to %u is out of window.", pos);
+                ret = ZX_ERR_CORRUPTED;
+                goto cleanup;
+            }
+            if (!needed[pos]) {
+                needed[pos] = 1;
+                needed_count++;
+            }
+            since_copied = 0;
+        }
+
+        if (z_ret == Z_STREAM_END || since_copied >= index->window_size) {
+            break;
+        }
+        if (needed_count > window_length / 2) {
+            ZX_LOG("Window is referenced densely.");
+            ret = 0;
+            goto cleanup;
+        }
+    }
+    ret = 1;
+
+cleanup:
+    for (i = 0; i < num_initialized; i++) {
+        index->backend->end(&zs[i]);
+    }
+    for (i = 0; i < ZX_SPARSE_VARIANTS_; i++) {
+        index_free(index, windows[i]);
+        index_free(index, outs[i]);
+    }
+    index_free(index, in_buf);
+    return ret;
+}
+
+/**
+ * Replace window of a checkpoint with the ranges of it referenced by data
+ * decoded after it. Ranges closer than ZX_SPARSE_MIN_GAP_ bytes are merged.
+ * Window is kept as is if sparse window isn't smaller.
+ *
+ * \param index      Index data.
+ * \param checkpoint Checkpoint with a window.
+ * \param needed     Referenced bytes of window found by find_needed_window().
+ *
+ * \return ZX_RET_OK if successful, or negative error code.
+ */
+static int make_sparse_window(zidx_index *index,
+                              zidx_checkpoint *checkpoint,
+                              const uint8_t *needed)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    unsigned int window_length = checkpoint->window_length;
+    unsigned int content_length = 0;
+    int ranges_count = 0;
+    uint16_t *ranges = NULL;
+    uint8_t *content = NULL;
+    const uint8_t *window;
+    unsigned int start;
+    unsigned int end;
+    unsigned int p;
+    int i;
+
+    /* Count ranges. */
+    end = 0;
+    for (p = 0; p < window_length; p++) {
+        if (!needed[p]) {
+            continue;
+        }
+        if (ranges_count == 0 || p - end >= ZX_SPARSE_MIN_GAP_) {
+            ranges_count++;
+            content_length += 1;
+        } else {
+            content_length += p - end + 1;
+        }
+        end = p + 1;
+    }
+    if (content_length + 2 * sizeof(uint16_t) * ranges_count
+            >= window_length) {
+        return ZX_RET_OK;
+    }
+
+    if (ranges_count > 0) {
+        zx_ret = get_window(index, checkpoint, &window);
+        if (zx_ret != ZX_RET_OK) {
+            return zx_ret;
+        }
+
+        ranges = index_malloc(index, 2 * sizeof(uint16_t) * ranges_count);
+        content = index_malloc(index, content_length);
+        if (ranges == NULL || content == NULL) {
+            ZX_LOG("ERROR: Couldn't allocate memory for sparse window.");
+            index_free(index, ranges);
+            index_free(index, content);
+            return ZX_ERR_MEMORY;
+        }
+    }
+
+    /* Collect ranges and their content. */
+    i = -1;
+    end = 0;
+    content_length = 0;
+    for (p = 0; p < window_length; p++) {
+        if (!needed[p]) {
+            continue;
+        }
+        if (i < 0 || p - end >= ZX_SPARSE_MIN_GAP_) {
+            i++;
+            start = p;
+            ranges[2 * i] = p;
+        } else {
+            start = end;
+        }
+        memcpy(content + content_length, window + start, p + 1 - start);
+        content_length += p + 1 - start;
+        end = p + 1;
+        ranges[2 * i + 1] = end - ranges[2 * i];
+    }
+
+    ZX_LOG("Window at %jd has %d ranges of %u bytes.",
+           (intmax_t)checkpoint->offset.uncomp, ranges_count, content_length);
+
+    index_free(index, checkpoint->window_data);
+    checkpoint->window_data         = content;
+    checkpoint->window_comp_length  = 0;
+    checkpoint->is_window_sparse    = 1;
+    checkpoint->window_ranges       = ranges;
+    checkpoint->window_ranges_count = ranges_count;
+
+    return compress_window(index, checkpoint, index->window_compression);
+}
+
+/**
+ * Make windows of checkpoints sparse, if it's enabled for index. Only the
+ * references made before the next checkpoint are kept, unless checkpoint is
+ * the last one. Checkpoints already analyzed are skipped. Analysis is
+ * deferred to the next call if references to a window may continue after the
+ * end of available data. Position in compressed stream is restored afterwards.
+ *
+ * \param index Index data.
+ *
+ * \return ZX_RET_OK if successful, or negative error code.
+ */
+static int sparsify_windows(zidx_index *index)
+{
+    /* Return value for this function. */
+    int ret;
+
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Position in compressed stream to be restored. */
+    off_t comp_stream_pos;
+
+    /* Offset of the next checkpoint. */
+    off_t until;
+
+    zidx_checkpoint *ckp;
+    uint8_t *needed;
+
+    if (!index->is_sparse_windows) {
+        return ZX_RET_OK;
+    }
+
+    needed = index_malloc(index, index->window_size);
+    if (needed == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate memory for window analysis.");
+        return ZX_ERR_MEMORY;
+    }
+
+    comp_stream_pos = index->comp_stream_pos;
+    ret = ZX_RET_OK;
+    while (index->sparse_analyzed_count < index->list_count) {
+        ckp = &index->list[index->sparse_analyzed_count];
+        /* Windows not loaded from index file yet, or mapped from it, are
+         * kept as exported. Windows evicted already, or moved to arena, are
+         * kept whole. */
+        if (ckp->window_length > 0 && !ckp->is_window_sparse
+                && !ckp->is_window_lazy && !ckp->is_window_mapped
+                && !ckp->is_window_evicted && !ckp->is_window_in_arena) {
+            until = -1;
+            if (index->sparse_analyzed_count + 1 < index->list_count) {
+                until = (ckp + 1)->offset.uncomp;
+            }
+            memset(needed, 0, ckp->window_length);
+            zx_ret = find_needed_window(index, ckp, until, needed);
+            if (zx_ret == ZX_ERR_STREAM_EOF) {
+                /* More data may be appended. Try it again later. */
+                break;
+            }
+            if (zx_ret < 0) {
+                ZX_LOG("ERROR: Couldn't analyze window (%d).", zx_ret);
+                ret = zx_ret;
+                break;
+            }
+            if (zx_ret == 1) {
+                if (ckp->is_window_in_lru) {
+                    index->window_memory -= stored_window_length(ckp);
+                }
+                zx_ret = make_sparse_window(index, ckp, needed);
+                if (ckp->is_window_in_lru) {
+                    index->window_memory += stored_window_length(ckp);
+                }
+                if (zx_ret != ZX_RET_OK) {
+                    ret = zx_ret;
+                    break;
+                }
+            }
+        }
+        /* Window is in its final form now. */
+        adopt_window(index, index->sparse_analyzed_count);
+        index->sparse_analyzed_count++;
+    }
+    index_free(index, needed);
+
+    zx_ret = seek_comp_stream(index, comp_stream_pos);
+    if (zx_ret != ZX_RET_OK && ret == ZX_RET_OK) {
+        ret = zx_ret;
+    }
+    return ret;
+}
+
+/**
+ * Limit length of output decoded at once, so that decoding stops where window
+ * restored from a sparse checkpoint stops being valid. Decoding is moved to
+ * the next checkpoint if it's already there.
+ *
+ * \param index  Index data.
+ * \param length Length of output, which is limited if needed.
+ *
+ * \return ZX_RET_OK if successful, or the error returned by
+ *         ensure_window() or jump_to_checkpoint().
+ */
+static int limit_sparse_output(zidx_index *index, unsigned int *length)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Checkpoint to jump to, and its copy made while list is locked, same as
+     * in zidx_seek_ex(). */
+    zidx_checkpoint *next;
+    zidx_checkpoint checkpoint;
+    int next_idx;
+
+    while (index->window_valid_until >= 0
+               && index->offset.uncomp >= index->window_valid_until) {
+        ZX_LOG("Window of sparse checkpoint is no longer valid at %jd.",
+               (intmax_t)index->offset.uncomp);
+        if (index->list_lock != NULL) {
+            pthread_rwlock_rdlock(index->list_lock);
+        }
+        next_idx = find_checkpoint_idx(index, index->offset.uncomp,
+                                       &index->lookup_hint);
+        if (index->list_lock != NULL) {
+            pthread_rwlock_unlock(index->list_lock);
+        }
+        if (next_idx >= 0) {
+            zx_ret = ensure_window(index, next_idx);
+            if (zx_ret != ZX_RET_OK) {
+                return zx_ret;
+            }
+        }
+        if (index->list_lock != NULL) {
+            pthread_rwlock_rdlock(index->list_lock);
+        }
+        next = zidx_get_checkpoint(index, next_idx);
+        if (next != NULL) {
+            memcpy(&checkpoint, next, sizeof(checkpoint));
+        }
+        if (index->list_lock != NULL) {
+            pthread_rwlock_unlock(index->list_lock);
+        }
+        if (next == NULL
+                || checkpoint.offset.uncomp != index->offset.uncomp) {
+            ZX_LOG("ERROR: Checkpoint following sparse window is missing.");
+            return ZX_ERR_CORRUPTED;
+        }
+        zx_ret = jump_to_checkpoint(index, &checkpoint);
+        if (zx_ret != ZX_RET_OK) {
+            return zx_ret;
+        }
+    }
+
+    if (index->window_valid_until >= 0
+            && index->window_valid_until - index->offset.uncomp < *length) {
+        *length = index->window_valid_until - index->offset.uncomp;
+    }
+    return ZX_RET_OK;
+}
+
+/**
+ * Get hash bucket of a decoded chunk in read cache.
+ *
+ * \param index Index data.
+ * \param start Uncompressed offset of the first byte of chunk.
+ *
+ * \return Index of bucket.
+ */
+static unsigned int get_cache_bucket(zidx_index *index, off_t start)
+{
+    /* Fibonacci hashing. Number of buckets is a power of two. */
+    return (unsigned int)(((uint64_t)start * 0x9E3779B97F4A7C15ULL) >> 32)
+           & (index->cache_buckets_count - 1);
+}
+
+/**
+ * Find decoded chunk in read cache.
+ *
+ * \param index Index data.
+ * \param start Uncompressed offset of the first byte of chunk.
+ *
+ * \return Chunk starting at the given offset, or NULL if it's not cached.
+ */
+static zidx_cache_entry* find_cache_chunk(zidx_index *index, off_t start)
+{
+    zidx_cache_entry *chunk;
+
+    chunk = index->cache_buckets[get_cache_bucket(index, start)];
+    while (chunk != NULL && chunk->start != start) {
+        chunk = chunk->hash_next;
+    }
+    return chunk;
+}
+
+/**
+ * Remove decoded chunk from LRU list of read cache.
+ *
+ * \param index Index data.
+ * \param chunk Chunk in LRU list.
+ */
+static void unlink_cache_chunk(zidx_index *index, zidx_cache_entry *chunk)
+{
+    if (chunk->lru_prev != NULL) {
+        chunk->lru_prev->lru_next = chunk->lru_next;
+    } else {
+        index->cache_head = chunk->lru_next;
+    }
+    if (chunk->lru_next != NULL) {
+        chunk->lru_next->lru_prev = chunk->lru_prev;
+    } else {
+        index->cache_tail = chunk->lru_prev;
+    }
+}
+
+/**
+ * Mark decoded chunk as the most recently used. Chunk is added to LRU list if
+ * it's not in it yet.
+ *
+ * \param index    Index data.
+ * \param chunk    Chunk to mark.
+ * \param is_added Whether chunk is in LRU list already.
+ */
+static void touch_cache_chunk(zidx_index *index,
+                              zidx_cache_entry *chunk,
+                              char is_added)
+{
+    if (is_added) {
+        if (index->cache_head == chunk) {
+            return;
+        }
+        unlink_cache_chunk(index, chunk);
+    }
+    chunk->lru_prev = NULL;
+    chunk->lru_next = index->cache_head;
+    if (index->cache_head != NULL) {
+        index->cache_head->lru_prev = chunk;
+    } else {
+        index->cache_tail = chunk;
+    }
+    index->cache_head = chunk;
+}
+
+/**
+ * Remove decoded chunk from read cache and release it.
+ *
+ * \param index Index data.
+ * \param chunk Chunk in read cache.
+ */
+static void remove_cache_chunk(zidx_index *index, zidx_cache_entry *chunk)
+{
+    zidx_cache_entry **link;
+
+    link = &index->cache_buckets[get_cache_bucket(index, chunk->start)];
+    while (*link != chunk) {
+        link = &(*link)->hash_next;
+    }
+    *link = chunk->hash_next;
+    unlink_cache_chunk(index, chunk);
+
+    index->cache_memory -= chunk->length;
+    index_free(index, chunk->data);
+    index_free(index, chunk);
+}
+
+/**
+ * Remove decoded chunks from read cache.
+ *
+ * \param index     Index data.
+ * \param only_last Whether only chunks ending at the end of file are removed,
+ *                  since they may grow if file is appended.
+ */
+static void drop_cache_chunks(zidx_index *index, char only_last)
+{
+    zidx_cache_entry *chunk;
+    zidx_cache_entry *next;
+
+    for (chunk = index->cache_head; chunk != NULL; chunk = next) {
+        next = chunk->lru_next;
+        if (!only_last || chunk->is_last) {
+            remove_cache_chunk(index, chunk);
+        }
+    }
+}
+
+/**
+ * Get decoded chunk covering an offset from read cache, decoding it if it's
+ * not cached. Chunks are aligned to the checkpoint preceding them, and don't
+ * span over the next checkpoint, so each is decoded from its checkpoint.
+ * Decoder is moved to the beginning of chunk, unless it's there already while
+ * reading sequentially. Least recently used chunks are evicted afterwards to
+ * stay within cache budget.
+ *
+ * \param index  Index data.
+ * \param offset Uncompressed offset.
+ * \param entry  Pointer to chunk to be returned.
+ *
+ * \return ZX_RET_OK if successful, or negative error code.
+ */
+static int load_cache_chunk(zidx_index *index,
+                            off_t offset,
+                            zidx_cache_entry **entry)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Used for storing number of bytes decoded. */
+    int r_len;
+
+    zidx_cache_entry *chunk;
+    off_t base;
+    off_t next;
+    off_t start;
+    unsigned int length;
+    unsigned int filled;
+    int idx;
+
+    base = 0;
+    next = -1;
+    if (index->list_lock != NULL) pthread_rwlock_rdlock(index->list_lock);
+    idx = find_checkpoint_idx(index, offset, &index->lookup_hint);
+    if (idx >= 0) {
+        base = index->list[idx].offset.uncomp;
+    } else {
+        idx = -1;
+    }
+    if (idx + 1 < index->list_count) {
+        next = index->list[idx + 1].offset.uncomp;
+    }
+    if (index->list_lock != NULL) pthread_rwlock_unlock(index->list_lock);
+
+    start  = base + (offset - base) / index->cache_chunk_size
+                    * index->cache_chunk_size;
+    length = index->cache_chunk_size;
+    if (next >= 0 && next - start < length) {
+        length = next - start;
+    }
+
+    chunk = find_cache_chunk(index, start);
+    if (chunk != NULL) {
+        index->cache_hits++;
+        touch_cache_chunk(index, chunk, 1);
+        *entry = chunk;
+        return ZX_RET_OK;
+    }
+    index->cache_misses++;
+
+    ZX_LOG("Decoding chunk of %u bytes at %jd to cache.", length,
+           (intmax_t)start);
+    index->cache_offset = -1;
+    if (index->offset.uncomp != start
+            || index->stream_state == ZX_STATE_INVALID) {
+        zx_ret = zidx_seek_ex(index, start, NULL, NULL);
+        if (zx_ret != ZX_RET_OK) {
+            ZX_LOG("ERROR: Couldn't seek to chunk (%d).", zx_ret);
+            return zx_ret;
+        }
+    }
+
+    chunk = index_calloc(index, 1, sizeof(zidx_cache_entry));
+    if (chunk == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate memory for cached chunk.");
+        return ZX_ERR_MEMORY;
+    }
+    chunk->data = index_malloc(index, length > 0 ? length : 1);
+    if (chunk->data == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate memory for cached chunk.");
+        index_free(index, chunk);
+        return ZX_ERR_MEMORY;
+    }
+    for (filled = 0; filled < length; filled += r_len) {
+        r_len = zidx_read_ex(index, chunk->data + filled, length - filled,
+                             NULL, NULL);
+        if (r_len < 0) {
+            ZX_LOG("ERROR: Couldn't decode chunk (%d).", r_len);
+            index_free(index, chunk->data);
+            index_free(index, chunk);
+            return r_len;
+        }
+        if (r_len == 0) {
+            break;
+        }
+    }
+    chunk->start   = start;
+    chunk->length  = filled;
+    chunk->is_last = filled < length;
+
+    /* Add to cache, and evict others if needed. */
+    chunk->hash_next = index->cache_buckets[get_cache_bucket(index, start)];
+    index->cache_buckets[get_cache_bucket(index, start)] = chunk;
+    touch_cache_chunk(index, chunk, 0);
+    index->cache_memory += chunk->length;
+    while (index->cache_memory > index->cache_budget
+            && index->cache_tail != chunk) {
+        remove_cache_chunk(index, index->cache_tail);
+    }
+    enforce_window_budget(index, -1);
+
+    *entry = chunk;
+    return ZX_RET_OK;
+}
+
+/**
+ * Read decoded data through read cache. Decoder is moved only when a chunk is
+ * not cached, and reading position is kept separately.
+ *
+ * \param index  Index data.
+ * \param buffer Buffer to read to.
+ * \param nbytes Number of bytes to read.
+ *
+ * \return Number of bytes read, or negative error code.
+ */
+static int read_from_cache(zidx_index *index, void *buffer, int nbytes)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    zidx_cache_entry *chunk;
+    off_t offset;
+    off_t available;
+    int length;
+    int total;
+
+    offset = zidx_tell(index);
+    index->is_cache_eof = 0;
+    for (total = 0; total < nbytes; total += length) {
+        zx_ret = load_cache_chunk(index, offset, &chunk);
+        if (zx_ret != ZX_RET_OK) {
+            index->cache_offset = offset;
+            return zx_ret;
+        }
+
+        available = chunk->start + chunk->length - offset;
+        length = available < nbytes - total ? available : nbytes - total;
+        memcpy((uint8_t*)buffer + total, chunk->data + (offset - chunk->start),
+               length);
+        offset += length;
+        if (length == available && chunk->is_last) {
+            index->is_cache_eof = 1;
+            total += length;
+            break;
+        }
+    }
+    index->cache_offset = offset;
+
+    return total;
+}
+
+/**
+ * Seek through read cache. Chunk covering offset is decoded if it's not
+ * cached, so reading from offset is served from cache.
+ *
+ * \param index  Index data.
+ * \param offset Uncompressed offset.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_STREAM_EOF if offset is beyond the end of file.
+ *         Otherwise, error returned by load_cache_chunk().
+ */
+static int seek_in_cache(zidx_index *index, off_t offset)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    zidx_cache_entry *chunk;
+
+    zx_ret = load_cache_chunk(index, offset, &chunk);
+    if (zx_ret != ZX_RET_OK) {
+        return zx_ret;
+    }
+    if (offset > chunk->start + chunk->length) {
+        ZX_LOG("ERROR: Offset (%jd) is beyond the end of file.",
+               (intmax_t)offset);
+        return ZX_ERR_STREAM_EOF;
+    }
+
+    index->cache_offset = offset;
+    index->is_cache_eof = chunk->is_last
+                          && offset == chunk->start + chunk->length;
+    return ZX_RET_OK;
+}
+
+int zidx_seek(zidx_index* index, off_t offset)
+{
+    /* Seek in readahead buffer or cache of decoded chunks if enabled. */
+    if (index != NULL && offset >= 0 && index->readahead != NULL) {
+        return seek_in_readahead(index, offset);
+    }
+    if (index != NULL && offset >= 0 && index->cache_budget > 0) {
+        return seek_in_cache(index, offset);
+    }
+    return zidx_seek_ex(index, offset, NULL, NULL);
+}
+
+/**
+ * Release decoder snapshots of index.
+ *
+ * \param index Index data.
+ */
+static void release_snapshots(zidx_index *index)
+{
+    int i;
+
+    if (index->snapshots == NULL) {
+        return;
+    }
+    for (i = 0; i < index->snapshots_capacity; i++) {
+        index_free(index, index->snapshots[i].window_data);
+    }
+    index_free(index, index->snapshots);
+    index->snapshots          = NULL;
+    index->snapshots_capacity = 0;
+    index->snapshots_count    = 0;
+    index->snapshot_memory    = 0;
+    index->snapshot_next      = 0;
+}
+
+/**
+ * Block callback snapshotting decoder state at block boundaries while reading,
+ * so later seeks nearby can start from there instead of the checkpoint.
+ * Snapshots are kept in a ring, replacing the oldest one, and only in memory.
+ * They are taken when reading goes at least snapshot spacing away from where
+ * decoding is started, and only if window is complete.
+ *
+ * \param context       Not used.
+ * \param index         Index data.
+ * \param offset        Offset of the block boundary.
+ * \param is_last_block Whether this is the last block.
+ *
+ * \return ZX_RET_OK if successful, or negative error code.
+ */
+static int snapshot_callback(void *context,
+                             zidx_index *index,
+                             zidx_checkpoint_offset *offset,
+                             int is_last_block)
+{
+    /* Used for storing return value of zlib calls. */
+    int z_ret;
+
+    zidx_checkpoint *snapshot;
+    unsigned int dict_length;
+    int i;
+
+    /* Last block of a gzip member is followed by its trailer, and window of a
+     * sparse checkpoint is not complete. */
+    if ((is_last_block && index->stream_type != ZX_STREAM_DEFLATE)
+            || offset->in_block || index->window_valid_until >= 0
+            || offset->uncomp - index->snapshot_from
+                   < index->snapshot_spacing) {
+        return ZX_RET_OK;
+    }
+
+    /* Same boundary is visited again when reading after a backward seek. */
+    index->snapshot_from = offset->uncomp;
+    for (i = 0; i < index->snapshots_count; i++) {
+        if (index->snapshots[i].offset.uncomp == offset->uncomp) {
+            return ZX_RET_OK;
+        }
+    }
+
+    z_ret = index->backend->get_dictionary(index->z_stream, NULL,
+                                           &dict_length);
+    if (z_ret != Z_OK) {
+        ZX_LOG("ERROR: inflateGetDictionary returned error (%d).", z_ret);
+        return ZX_ERR_ZLIB(z_ret);
+    }
+    if (dict_length > index->window_size) {
+        ZX_LOG("ERROR: Window length (%u) is larger than window size (%u).",
+               dict_length, index->window_size);
+        return ZX_ERR_CORRUPTED;
+    }
+
+    /* Window buffer of each snapshot is allocated once and reused. */
+    snapshot = &index->snapshots[index->snapshot_next];
+    if (snapshot->window_data == NULL) {
+        snapshot->window_data = index_malloc(index, index->window_size);
+        if (snapshot->window_data == NULL) {
+            ZX_LOG("ERROR: Couldn't allocate memory for snapshot window.");
+            return ZX_ERR_MEMORY;
+        }
+        index->snapshot_memory += index->window_size;
+        enforce_window_budget(index, -1);
+    }
+    z_ret = index->backend->get_dictionary(index->z_stream,
+                                           snapshot->window_data,
+                                           &dict_length);
+    if (z_ret != Z_OK) {
+        ZX_LOG("ERROR: inflateGetDictionary returned error (%d).", z_ret);
+        return ZX_ERR_ZLIB(z_ret);
+    }
+    snapshot->offset        = *offset;
+    snapshot->window_length = dict_length;
+
+    ZX_LOG("Snapshotted decoder at (comp: %jd, uncomp: %jd).",
+           (intmax_t)offset->comp, (intmax_t)offset->uncomp);
+    index->snapshot_next = (index->snapshot_next + 1)
+                           % index->snapshots_capacity;
+    if (index->snapshots_count < index->snapshots_capacity) {
+        index->snapshots_count++;
+    }
+    return ZX_RET_OK;
+}
+
+/**
+ * Find the closest decoder snapshot preceding an offset.
+ *
+ * \param index  Index data.
+ * \param offset Uncompressed offset.
+ * \param after  Snapshots at or before this offset are ignored, since a
+ *               checkpoint is closer.
+ *
+ * \return Snapshot to start decoding from, or NULL if there is none.
+ */
+static const zidx_checkpoint* find_snapshot(zidx_index *index,
+                                            off_t offset,
+                                            off_t after)
+{
+    const zidx_checkpoint *found;
+    int i;
+
+    found = NULL;
+    for (i = 0; i < index->snapshots_count; i++) {
+        if (index->snapshots[i].offset.uncomp <= offset
+                && index->snapshots[i].offset.uncomp > after
+                && (found == NULL || index->snapshots[i].offset.uncomp
+                                         > found->offset.uncomp)) {
+            found = &index->snapshots[i];
+        }
+    }
+    return found;
+}
+
+int zidx_seek_ex(zidx_index* index,
+                 off_t offset,
+                 zidx_block_callback block_callback,
+                 void *callback_context)
+{
+    /* TODO: If this function fails to reset z_stream, it will leave z_stream
+     * in an invalid state. Must be handled. */
+
+    /* Used for storing number of bytes read from stream. */
+    int s_read_len;
+
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Used for finding the checkpoint preceding offset. */
+    zidx_checkpoint *checkpoint;
+    zidx_checkpoint checkpoint_copy;
+    int checkpoint_idx;
+
+    /* Decoder snapshot closer to offset than the checkpoint, if any. */
+    const zidx_checkpoint *snapshot;
+
+    /* Number of bytes remaining to arrive given offset. After seeking to
+     * checkpoint, the rest of offset is disposed using zidx_read. */
+    off_t num_bytes_remaining;
+
+    /* Number of bytes to dispose for next zidx_read call. */
+    int num_bytes_next;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (offset < 0) {
+        ZX_LOG("ERROR: offset (%jd) is negative.", (intmax_t)offset);
+        return ZX_ERR_PARAMS;
+    }
+
+    /* Decoder is moved, so position left by reading from cache is dropped. */
+    index->cache_offset = -1;
+
+    /* A background build may reallocate the list while adding checkpoints,
+     * so the checkpoint is copied while the list is locked. Window data of
+     * checkpoints are not moved. */
+    if (index->list_lock != NULL) pthread_rwlock_rdlock(index->list_lock);
+    checkpoint_idx = find_checkpoint_idx(index, offset, &index->lookup_hint);
+    checkpoint = zidx_get_checkpoint(index, checkpoint_idx);
+    if (checkpoint != NULL) {
+        memcpy(&checkpoint_copy, checkpoint, sizeof(checkpoint_copy));
+        checkpoint = &checkpoint_copy;
+    }
+    if (index->list_lock != NULL) pthread_rwlock_unlock(index->list_lock);
+    snapshot = find_snapshot(index, offset,
+                             checkpoint != NULL ? checkpoint->offset.uncomp
+                                                : -1);
+
+    if (snapshot != NULL) {
+        /* Snapshot is used same as a checkpoint, but its window is always in
+         * memory. */
+        if (index->offset.uncomp < snapshot->offset.uncomp
+                || index->offset.uncomp > offset
+                || index->stream_state == ZX_STATE_INVALID) {
+            ZX_LOG("Jumping to snapshot (comp: %jd, uncomp: %jd).",
+                   (intmax_t)snapshot->offset.comp,
+                   (intmax_t)snapshot->offset.uncomp);
+            zx_ret = jump_to_checkpoint(index, snapshot);
+            if (zx_ret != ZX_RET_OK) {
+                ZX_LOG("ERROR: Couldn't jump to snapshot (%d).", zx_ret);
+                return zx_ret;
+            }
+        }
+    } else if (checkpoint == NULL) {
+        ZX_LOG("No checkpoint found.");
+
+        /* Seek to the beginning of file, if no checkpoint has been found. */
+        zx_ret = jump_to_checkpoint(index, NULL);
+        if (zx_ret != ZX_RET_OK) {
+            ZX_LOG("ERROR: Couldn't jump to the beginning (%d).", zx_ret);
+            return zx_ret;
+        }
+    } else if (
+            index->offset.uncomp < checkpoint->offset.uncomp
+            || index->offset.uncomp > offset
+            || index->stream_state == ZX_STATE_INVALID) {
+        /* If offset is between checkpoint and current index offset, jump to
+         * the checkpoint. */
+        ZX_LOG("Jumping to checkpoint (idx: %d, comp: %ld, uncomp: %ld).",
+                checkpoint_idx, checkpoint->offset.comp,
+                checkpoint->offset.uncomp);
+
+        /* Window is loaded into the list if it's not in memory, so it's read
+         * once. It's copied again since it may be changed. */
+        zx_ret = ensure_window(index, checkpoint_idx);
+        if (zx_ret != ZX_RET_OK) {
+            ZX_LOG("ERROR: Couldn't load window of checkpoint (%d).", zx_ret);
+            return zx_ret;
+        }
+        if (index->list_lock != NULL) pthread_rwlock_rdlock(index->list_lock);
+        memcpy(&checkpoint_copy, zidx_get_checkpoint(index, checkpoint_idx),
+               sizeof(checkpoint_copy));
+        if (index->list_lock != NULL) pthread_rwlock_unlock(index->list_lock);
+
+        zx_ret = jump_to_checkpoint(index, checkpoint);
+        if (zx_ret != ZX_RET_OK) {
+            ZX_LOG("ERROR: Couldn't jump to checkpoint (%d).", zx_ret);
+            return zx_ret;
+        }
+    } else {
+        ZX_LOG("No need to jump to checkpoint, since offset (%jd) is closer "
+               "to the current offset (%jd) than that of checkpoint (%jd).",
+               (intmax_t)offset, (intmax_t)index->offset.uncomp,
+               (intmax_t)checkpoint->offset.uncomp);
+    }
+
+    /* Whether we jump to somewhere in file or not, we need to consume
+     * remaining bytes until the offset by decompressing. */
+    num_bytes_remaining = offset - index->offset.uncomp;
+    while (num_bytes_remaining > 0) {
+        /* Number of bytes going to consumed in next zidx read call is equal to
+         * min(num_bytes_remaining, seeking_data_buffer_size). */
+        num_bytes_next =
+            (num_bytes_remaining > index->seeking_data_buffer_size ?
+                index->seeking_data_buffer_size :
+                num_bytes_remaining);
+
+        /* Read next compressed data and decompress it using internal seeking
+         * buffer. */
+        s_read_len = zidx_read_ex(index,
+                                  index->seeking_data_buffer,
+                                  num_bytes_next,
+                                  block_callback,
+                                  callback_context);
+        /* Handle error. */
+        if (s_read_len < 0) {
+            ZX_LOG("ERROR: Couldn't decompress remaining data while "
+                   "seeking (%d).", s_read_len);
+            return s_read_len;
+        }
+
+        /* Handle end-of-file. */
+        if (s_read_len == 0) {
+            ZX_LOG("ERROR: Unexpected end-of-file while decompressing "
+                   "remaining data for seeking (%d).", s_read_len);
+            return ZX_ERR_STREAM_EOF;
+        }
+
+        /* Decrease number of bytes read. */
+        num_bytes_remaining -= s_read_len;
+
+        #ifdef ZX_DEBUG
+        /* Normally this should be unnecessary, since this function should not
+         * return more than buffer length, but anyway let's check it in
+         * debugging mode. */
+        if (num_bytes_remaining < 0) {
+            ZX_LOG("ERROR: Screwed number of bytes remaining while reading "
+                   "for seeking. Check the code. (num_bytes_remaining: %jd)",
+                   (intmax_t) num_bytes_remaining);
+            return ZX_ERR_CORRUPTED;
+        }
+        #endif
+    }
+
+    return ZX_RET_OK;
+}
+
+off_t zidx_tell(zidx_index* index)
+{
+    if (index->cache_offset >= 0) {
+        return index->cache_offset;
+    }
+    return index->offset.uncomp;
+}
+
+int zidx_rewind(zidx_index* index)
+{
+    return zidx_seek(index, 0);
+}
+
+int zidx_eof(zidx_index* index)
+{
+    if (index->cache_offset >= 0) {
+        return index->is_cache_eof;
+    }
+    return index->stream_state == ZX_STATE_END_OF_FILE;
+}
+
+int zidx_error(zidx_index* index)
+{
+    /* TODO: Implement invalid state. */
+    return index->stream_state == ZX_STATE_INVALID;
+}
+
+int zidx_uncomp_size(zidx_index* index)
+{
+    return index->uncompressed_size;
+}
+
+int zidx_is_bgzf(zidx_index* index)
+{
+    if (detect_bgzf(index) != ZX_RET_OK) {
+        return 0;
+    }
+    return index->is_bgzf;
+}
+
+int zidx_set_inflate_backend(zidx_index* index,
+                             zidx_inflate_backend_type backend_type)
+{
+    const zidx_inflate_backend *backend;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (index->inflate_initialized || index->async != NULL) {
+        ZX_LOG("ERROR: Backend can't be changed after inflate is "
+               "initialized.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    backend = get_inflate_backend(backend_type);
+    if (backend == NULL) {
+        ZX_LOG("ERROR: Inflate backend (%d) is not available.",
+               (int)backend_type);
+        return ZX_ERR_NOT_IMPLEMENTED;
+    }
+
+    ZX_LOG("Using %s inflate backend.", backend->name);
+    index->backend = backend;
+    return ZX_RET_OK;
+}
+
+zidx_inflate_backend_type zidx_get_inflate_backend(zidx_index* index)
+{
+    return index->backend->type;
+}
+
+/**
+ * Initialize spacing policy data. Decoding cost weights are taken from index.
+ *
+ * \param data            Spacing policy data.
+ * \param index           Index data.
+ * \param spacing_length  Spacing between checkpoints.
+ * \param is_uncompressed One of zidx_spacing_option values.
+ */
+static void spacing_init(spacing_data *data,
+                         const zidx_index *index,
+                         off_t spacing_length,
+                         char is_uncompressed)
+{
+    memset(data, 0, sizeof(*data));
+    data->spacing_length  = spacing_length;
+    data->is_uncompressed = is_uncompressed;
+    data->comp_weight     = index->spacing_comp_weight;
+    data->uncomp_weight   = index->spacing_uncomp_weight;
+    data->block_weight    = index->spacing_block_weight;
+}
+
+/**
+ * Check whether a checkpoint should be placed at the given offset with respect
+ * to the spacing policy. This function should be called once on each block
+ * boundary, since it counts blocks passed since the last checkpoint. Offsets
+ * inside blocks aren't counted as blocks.
+ *
+ * \param data   Spacing policy data.
+ * \param offset Offset of the block boundary.
+ *
+ * \return Nonzero if spacing_length bytes or units of decoding cost passed
+ *         since the last checkpoint.
+ */
+static inline int spacing_should_add(spacing_data *data,
+                                     const zidx_checkpoint_offset *offset)
+{
+    off_t distance;
+
+    if (!offset->in_block) {
+        data->blocks_count++;
+    }
+
+    /* Determine which offsets to use. */
+    switch (data->is_uncompressed) {
+        case ZX_SPACING_COMPRESSED:
+            distance = offset->comp - data->last.comp;
+            break;
+        case ZX_SPACING_DECODE_COST:
+            distance = data->comp_weight * (offset->comp - data->last.comp)
+                + data->uncomp_weight * (offset->uncomp - data->last.uncomp)
+                + data->block_weight * data->blocks_count;
+            break;
+        default:
+            distance = offset->uncomp - data->last.uncomp;
+            break;
+    }
+    return distance >= data->spacing_length;
+}
+
+/**
+ * Record that a checkpoint is placed at the given offset.
+ *
+ * \param data   Spacing policy data.
+ * \param offset Offset of the added checkpoint.
+ */
+static inline void spacing_update(spacing_data *data,
+                                  const zidx_checkpoint_offset *offset)
+{
+    data->last         = *offset;
+    data->blocks_count = 0;
+}
+
+static int spacing_callback(void *context,
+                            zidx_index *index,
+                            zidx_checkpoint_offset *offset,
+                            int is_last_block)
+{
+    /* Used for storing return value of this function. */
+    int ret;
+
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* New checkpoint to be added. Should be freed in case of failure. */
+    zidx_checkpoint *ckp = NULL;
+
+    /* Casted alias for context. */
+    spacing_data* data = context;
+
+    /* Last block of a gzip member is followed by its trailer, so it can't be
+     * used as a checkpoint. */
+    if (is_last_block && index->stream_type != ZX_STREAM_DEFLATE) {
+        return ZX_RET_OK;
+    }
+
+    /* Skip offsets already covered by index. */
+    if (index->list_count > 0 && offset->uncomp
+            <= index->list[index->list_count - 1].offset.uncomp) {
+        return ZX_RET_OK;
+    }
+
+    /* If spacing_length bytes passed since last saved checkpoint, or a gzip
+     * member starts here, which doesn't need a window... */
+    if (spacing_should_add(data, offset) || is_member_start(index, offset)) {
+
+        /* Create a new checkpoint. */
+        ckp = index_calloc(index, 1, sizeof(zidx_checkpoint));
+        if (ckp == NULL) {
+            ZX_LOG("ERROR: Couldn't allocate memory for new checkpoint.");
+            return ZX_ERR_MEMORY;
+        }
+
+        /* Fill it in with current index and offset information. */
+        zx_ret = zidx_fill_checkpoint(index, ckp, offset);
+        if (zx_ret != ZX_RET_OK) {
+            ZX_LOG("ERROR: Couldn't fill new checkpoint (%d).", zx_ret);
+            ret = zx_ret;
+            goto cleanup;
+        }
+
+        /* Add checkpoint to the index list. */
+        zx_ret = zidx_add_checkpoint(index, ckp);
+        if (zx_ret != ZX_RET_OK) {
+            ZX_LOG("ERROR: Couldn't add new checkpoint (%d).", zx_ret);
+            ret = zx_ret;
+            goto cleanup;
+        }
+
+        /* Set last checkpoint offset. */
+        spacing_update(data, offset);
+
+        /* Checkpoint is copied to the list. */
+        index_free(index, ckp);
+    }
+
+    return ZX_RET_OK;
+
+cleanup:
+    if (ckp != NULL) {
+        index_free(index, ckp);
+    }
+    return ret;
+}
+
+/**
+ * Block callback used for capturing checkpoints while reading. Places
+ * checkpoints past the last checkpoint with respect to the spacing policy
+ * set by zidx_set_auto_checkpoint().
+ *
+ * \param context       Not used.
+ * \param index         Index data.
+ * \param offset        Offset of the block boundary.
+ * \param is_last_block Whether this is the last block.
+ *
+ * \return The return value of spacing_callback().
+ */
+static int auto_checkpoint_callback(void *context,
+                                    zidx_index *index,
+                                    zidx_checkpoint_offset *offset,
+                                    int is_last_block)
+{
+    /* Spacing is measured from the last checkpoint in the list. */
+    spacing_data *data = &index->auto_spacing;
+    zidx_checkpoint *last;
+
+    if (index->list_count > 0) {
+        last = &index->list[index->list_count - 1];
+        if (offset->uncomp <= last->offset.uncomp) {
+            return ZX_RET_OK;
+        }
+        if (data->last.uncomp != last->offset.uncomp) {
+            spacing_update(data, &last->offset);
+        }
+    }
+
+    return spacing_callback(data, index, offset, is_last_block);
+}
+
+int zidx_set_auto_checkpoint(zidx_index* index,
+                             off_t spacing_length,
+                             char is_uncompressed)
+{
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (spacing_length < 0) {
+        ZX_LOG("ERROR: spacing_length (%jd) is negative.",
+               (intmax_t)spacing_length);
+        return ZX_ERR_PARAMS;
+    }
+
+    spacing_init(&index->auto_spacing, index, spacing_length,
+                 is_uncompressed);
+
+    return ZX_RET_OK;
+}
+
+int zidx_set_spacing_cost(zidx_index* index,
+                          unsigned int comp_weight,
+                          unsigned int uncomp_weight,
+                          unsigned int block_weight)
+{
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (comp_weight == 0 && uncomp_weight == 0 && block_weight == 0) {
+        ZX_LOG("ERROR: All weights are zero.");
+        return ZX_ERR_PARAMS;
+    }
+
+    index->spacing_comp_weight   = comp_weight;
+    index->spacing_uncomp_weight = uncomp_weight;
+    index->spacing_block_weight  = block_weight;
+
+    index->auto_spacing.comp_weight   = comp_weight;
+    index->auto_spacing.uncomp_weight = uncomp_weight;
+    index->auto_spacing.block_weight  = block_weight;
+
+    return ZX_RET_OK;
+}
+
+int zidx_set_intra_block_checkpoints(zidx_index* index, int step_length)
+{
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (step_length < 0) {
+        ZX_LOG("ERROR: step_length (%d) is negative.", step_length);
+        return ZX_ERR_PARAMS;
+    }
+    if (index->async != NULL) {
+        ZX_LOG("ERROR: Index is being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    index->intra_block_step = step_length;
+
+    return ZX_RET_OK;
+}
+
+int zidx_set_window_compression(zidx_index* index,
+                                zidx_window_compression compression,
+                                int level)
+{
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (level < 1 || level > 9) {
+        ZX_LOG("ERROR: Compression level (%d) is not in range 1-9.", level);
+        return ZX_ERR_PARAMS;
+    }
+    if (index->async != NULL) {
+        ZX_LOG("ERROR: Index is being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    switch (compression) {
+        case ZX_WINDOW_RAW:
+        case ZX_WINDOW_DEFLATE:
+            break;
+        default:
+            ZX_LOG("ERROR: Unknown window compression (%d).",
+                   (int)compression);
+            return ZX_ERR_PARAMS;
+    }
+
+    index->window_compression       = compression;
+    index->window_compression_level = level;
+
+    return ZX_RET_OK;
+}
+
+int zidx_set_sparse_windows(zidx_index* index, char is_sparse)
+{
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (index->async != NULL) {
+        ZX_LOG("ERROR: Index is being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    index->is_sparse_windows = is_sparse;
+
+    return ZX_RET_OK;
+}
+
+int zidx_set_export_alignment(zidx_index* index, unsigned int alignment)
+{
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        ZX_LOG("ERROR: Alignment (%u) is not a power of two.", alignment);
+        return ZX_ERR_PARAMS;
+    }
+
+    index->export_alignment = alignment;
+
+    return ZX_RET_OK;
+}
+
+int zidx_set_export_compact_offsets(zidx_index* index, char is_compact)
+{
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+
+    index->is_export_compact = is_compact;
+
+    return ZX_RET_OK;
+}
+
+int zidx_set_window_budget(zidx_index* index, size_t budget)
+{
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+
+    /* Cursors of readahead expect windows to stay loaded, so readahead isn't
+     * used with a budget. */
+    if (budget > 0 && index->readahead != NULL) {
+        ZX_LOG("ERROR: Readahead is enabled.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    /* Windows are shared by cursors and pool of positional reads without
+     * locking, so they can't be evicted while index has them. */
+    if (budget > 0 && is_index_shared(index)) {
+        ZX_LOG("ERROR: Index has cursors or positional reads.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    /* Read cache and snapshots are counted in budget as well, but only
+     * windows of checkpoints are evicted for it. */
+    index->window_budget = budget;
+    enforce_window_budget(index, -1);
+
+    return ZX_RET_OK;
+}
+
+int zidx_set_window_arena(zidx_index* index,
+                          size_t chunk_size,
+                          char use_huge_pages)
+{
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (index->async != NULL) {
+        ZX_LOG("ERROR: Index is being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    /* Windows already in arena stay there until index is destroyed. */
+    index->arena_chunk_size = chunk_size;
+    index->is_arena_huge    = use_huge_pages;
+
+    return ZX_RET_OK;
+}
+
+int zidx_set_read_cache(zidx_index* index,
+                        size_t budget,
+                        unsigned int chunk_size)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    zidx_cache_entry **buckets;
+    size_t buckets_count;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (budget > 0 && (chunk_size == 0 || chunk_size > INT_MAX
+                       || chunk_size > budget)) {
+        ZX_LOG("ERROR: Chunk size (%u) is not valid for budget (%zu).",
+               chunk_size, budget);
+        return ZX_ERR_PARAMS;
+    }
+
+    /* Keep about two buckets per chunk fitting in budget. */
+    buckets = NULL;
+    buckets_count = 0;
+    if (budget > 0) {
+        for (buckets_count = 16; buckets_count < budget / chunk_size * 2
+                                 && buckets_count < (1U << 30);
+                buckets_count <<= 1);
+        buckets = index_calloc(index, buckets_count,
+                               sizeof(zidx_cache_entry*));
+        if (buckets == NULL) {
+            ZX_LOG("ERROR: Couldn't allocate memory for read cache.");
+            return ZX_ERR_MEMORY;
+        }
+    }
+
+    /* Flush existing cache. Decoder is moved to reading position if it was
+     * kept separately. */
+    if (index->cache_offset >= 0) {
+        zx_ret = zidx_seek_ex(index, index->cache_offset, NULL, NULL);
+        if (zx_ret != ZX_RET_OK) {
+            ZX_LOG("ERROR: Couldn't move decoder to reading position (%d).",
+                   zx_ret);
+            index_free(index, buckets);
+            return zx_ret;
+        }
+    }
+    if (index->cache_buckets != NULL) {
+        drop_cache_chunks(index, 0);
+        index_free(index, index->cache_buckets);
+    }
+
+    index->cache_budget        = budget;
+    index->cache_chunk_size    = chunk_size;
+    index->cache_buckets       = buckets;
+    index->cache_buckets_count = buckets_count;
+    index->cache_memory        = 0;
+    index->cache_hits          = 0;
+    index->cache_misses        = 0;
+
+    return ZX_RET_OK;
+}
+
+int zidx_set_seek_snapshots(zidx_index* index,
+                            int count,
+                            off_t spacing_length)
+{
+    zidx_checkpoint *snapshots;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (count < 0 || (count > 0 && spacing_length <= 0)) {
+        ZX_LOG("ERROR: Snapshot count (%d) or spacing (%jd) is not valid.",
+               count, (intmax_t)spacing_length);
+        return ZX_ERR_PARAMS;
+    }
+
+    snapshots = NULL;
+    if (count > 0) {
+        snapshots = index_calloc(index, count, sizeof(zidx_checkpoint));
+        if (snapshots == NULL) {
+            ZX_LOG("ERROR: Couldn't allocate memory for snapshots.");
+            return ZX_ERR_MEMORY;
+        }
+    }
+
+    release_snapshots(index);
+    index->snapshots          = snapshots;
+    index->snapshots_capacity = count;
+    index->snapshot_spacing   = spacing_length;
+
+    return ZX_RET_OK;
+}
+
+int zidx_get_read_cache_stats(zidx_index* index,
+                              size_t *memory_usage,
+                              unsigned long *hits,
+                              unsigned long *misses)
+{
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+
+    if (memory_usage != NULL) {
+        *memory_usage = index->cache_memory;
+    }
+    if (hits != NULL) {
+        *hits = index->cache_hits;
+    }
+    if (misses != NULL) {
+        *misses = index->cache_misses;
+    }
+
+    return ZX_RET_OK;
+}
+
+int zidx_get_window_stats(zidx_index* index,
+                          size_t *memory_usage,
+                          unsigned long *evictions)
+{
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+
+    if (index->list_lock != NULL) pthread_rwlock_rdlock(index->list_lock);
+    if (memory_usage != NULL) {
+        *memory_usage = get_window_memory(index);
+    }
+    if (evictions != NULL) {
+        *evictions = index->window_evictions;
+    }
+    if (index->list_lock != NULL) pthread_rwlock_unlock(index->list_lock);
+
+    return ZX_RET_OK;
+}
+
+/**
+ * Build index of a BGZF stream without decompressing it, by walking member
+ * headers and trailers. A windowless checkpoint is placed at the beginning of
+ * each member, same as zidx_build_index() does for gzip members. Spacing
+ * policy only decides whether there is a checkpoint at the beginning of file.
+ *
+ * \param index Index data.
+ * \param data  Spacing policy data.
+ *
+ * \return ZX_RET_OK if successful, or negative error code.
+ */
+static int build_bgzf_index(zidx_index *index, spacing_data *data)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Used for storing number of bytes read from stream. */
+    int s_read_len;
+
+    uint8_t header[ZX_GZIP_HEADER_LENGTH_];
+    uint8_t isize[4];
+    int extra_len;
+    off_t member_size;
+
+    /* Checkpoint to be added. Copied to the list when added. */
+    zidx_checkpoint ckp;
+
+    /* Offsets of the member being walked. */
+    off_t comp = 0;
+    off_t uncomp = 0;
+
+    /* Aliases. */
+    uint8_t* buf = index->comp_data_buffer;
+    int buf_len  = index->comp_data_buffer_size;
+
+    if (index->async != NULL) {
+        ZX_LOG("ERROR: Index is being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    zx_ret = jump_to_checkpoint(index, NULL);
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't rewind index (%d).", zx_ret);
+        return zx_ret;
+    }
+
+    memset(&ckp, 0, sizeof(ckp));
+    for (;;) {
+        /* Read fixed part of header. */
+        zx_ret = seek_comp_stream(index, comp);
+        if (zx_ret != ZX_RET_OK) {
+            return zx_ret;
+        }
+        s_read_len = read_comp_stream(index, header, sizeof(header));
+        if (s_read_len < 0) {
+            return s_read_len;
+        }
+        if (s_read_len == 0) {
+            break;
+        }
+        if (s_read_len < (int)sizeof(header) || header[0] != 0x1f
+                || header[1] != 0x8b) {
+            ZX_LOG("WARNING: Ignoring trailing data after the last member.");
+            break;
+        }
+        if (!parse_bgzf_header(header, &extra_len) || extra_len > buf_len) {
+            ZX_LOG("ERROR: Member at %jd is not a BGZF member.",
+                   (intmax_t)comp);
+            return ZX_ERR_CORRUPTED;
+        }
+
+        /* Find size of member in extra field. */
+        s_read_len = read_comp_stream(index, buf, extra_len);
+        if (s_read_len < 0) {
+            return s_read_len;
+        }
+        if (s_read_len < extra_len) {
+            ZX_LOG("ERROR: File ended before header ends.");
+            return ZX_ERR_STREAM_EOF;
+        }
+        if (!parse_bgzf_extra(buf, extra_len, &member_size)
+                || member_size < ZX_GZIP_HEADER_LENGTH_ + extra_len + 8) {
+            ZX_LOG("ERROR: Member at %jd doesn't have a valid BC subfield.",
+                   (intmax_t)comp);
+            return ZX_ERR_CORRUPTED;
+        }
+
+        /* Uncompressed size of member is in the last 4 bytes of trailer. */
+        zx_ret = seek_comp_stream(index, comp + member_size - 4);
+        if (zx_ret != ZX_RET_OK) {
+            return zx_ret;
+        }
+        s_read_len = read_comp_stream(index, isize, 4);
+        if (s_read_len < 0) {
+            return s_read_len;
+        }
+        if (s_read_len < 4) {
+            ZX_LOG("ERROR: File ended before trailer ends.");
+            return ZX_ERR_STREAM_EOF;
+        }
+
+        zx_ret = add_member(index, comp, uncomp);
+        if (zx_ret != ZX_RET_OK) {
+            return zx_ret;
+        }
+
+        /* Deflate blocks of the member start with an empty window. */
+        ckp.offset.comp            = comp + ZX_GZIP_HEADER_LENGTH_ + extra_len;
+        ckp.offset.comp_bits_count = 0;
+        ckp.offset.comp_byte       = 0;
+        ckp.offset.uncomp          = uncomp;
+        if ((index->list_count == 0 || uncomp
+                    > index->list[index->list_count - 1].offset.uncomp)
+                && (uncomp > 0 || spacing_should_add(data, &ckp.offset))) {
+            zx_ret = zidx_add_checkpoint(index, &ckp);
+            if (zx_ret != ZX_RET_OK) {
+                ZX_LOG("ERROR: Couldn't add new checkpoint (%d).", zx_ret);
+                return zx_ret;
+            }
+            spacing_update(data, &ckp.offset);
+        }
+
+        comp   += member_size;
+        uncomp += isize[0] | (isize[1] << 8) | (isize[2] << 16)
+                      | ((uint32_t)isize[3] << 24);
+    }
+
+    if (comp == 0) {
+        ZX_LOG("ERROR: Unexpected EOF while reading file header.");
+        return ZX_ERR_STREAM_EOF;
+    }
+
+    /* Leave index at the end of file, as zidx_build_index() does. */
+    index->offset.comp            = comp;
+    index->offset.comp_bits_count = 0;
+    index->offset.comp_byte       = 0;
+    index->offset.uncomp          = uncomp;
+    index->stream_state           = ZX_STATE_END_OF_FILE;
+    index->compressed_size        = comp;
+    index->uncompressed_size      = uncomp;
+    ZX_LOG("Compressed/uncompressed size: %jd/%jd.", (intmax_t)comp,
+           (intmax_t)uncomp);
+    return ZX_RET_OK;
+}
+
+int zidx_build_index(zidx_index* index,
+                     off_t spacing_length,
+                     char is_uncompressed)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Context for spacing_callback. */
+    spacing_data data;
+
+    /* Sanity check. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (index->readahead != NULL) {
+        ZX_LOG("ERROR: Readahead is enabled.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    /* Start from offset 0, and pass spacing_length. */
+    spacing_init(&data, index, spacing_length, is_uncompressed);
+
+    zx_ret = detect_bgzf(index);
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't detect stream format (%d).", zx_ret);
+        return zx_ret;
+    }
+    if (index->is_bgzf) {
+        return build_bgzf_index(index, &data);
+    }
+    zx_ret = zidx_build_index_ex(index, spacing_callback, &data);
+    if (zx_ret != ZX_RET_OK) {
+        return zx_ret;
+    }
+    return sparsify_windows(index);
+}
+
+int zidx_build_index_ex(zidx_index* index,
+                        zidx_block_callback next_block_callback,
+                        void *callback_context)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (index->async != NULL) {
+        ZX_LOG("ERROR: Index is being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+    if (index->readahead != NULL) {
+        ZX_LOG("ERROR: Readahead is enabled.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    /* Read as long as it's not end of stream. */
+    do {
+        zx_ret = zidx_read_ex(index,
+                              index->seeking_data_buffer,
+                              index->seeking_data_buffer_size,
+                              next_block_callback,
+                              callback_context);
+        if (zx_ret < 0) {
+            ZX_LOG("ERROR: While reading decompressed data (%d).", zx_ret);
+            return zx_ret;
+        }
+    } while(zx_ret > 0);
+
+    return ZX_RET_OK;
+}
+
+int zidx_update_index(zidx_index* index,
+                      off_t spacing_length,
+                      char is_uncompressed)
+{
+    /* Return value for this function. */
+    int ret;
+
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Context for spacing_callback. */
+    spacing_data data;
+
+    /* Checkpoint to resume from. NULL if list is empty. */
+    zidx_checkpoint *last;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (index->async != NULL) {
+        ZX_LOG("ERROR: Index is being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+    if (index->readahead != NULL) {
+        ZX_LOG("ERROR: Readahead is enabled.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    /* Chunks at the end of file may grow. */
+    if (index->cache_buckets != NULL) {
+        drop_cache_chunks(index, 1);
+    }
+
+    /* Resume from the last checkpoint. Spacing is measured from it. */
+    spacing_init(&data, index, spacing_length, is_uncompressed);
+    last = zidx_get_checkpoint(index, index->list_count - 1);
+    if (last != NULL) {
+        ZX_LOG("Resuming from checkpoint (comp: %jd, uncomp: %jd).",
+               (intmax_t)last->offset.comp, (intmax_t)last->offset.uncomp);
+        spacing_update(&data, &last->offset);
+        zx_ret = ensure_window(index, index->list_count - 1);
+        if (zx_ret != ZX_RET_OK) {
+            ZX_LOG("ERROR: Couldn't load window of the last checkpoint (%d).",
+                   zx_ret);
+            return zx_ret;
+        }
+    }
+
+    zx_ret = jump_to_checkpoint(index, last);
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't jump to the last checkpoint (%d).", zx_ret);
+        return zx_ret;
+    }
+
+    ret = zidx_build_index_ex(index, spacing_callback, &data);
+    if (ret == ZX_RET_OK) {
+        return sparsify_windows(index);
+    }
+    if (ret != ZX_ERR_STREAM_EOF) {
+        return ret;
+    }
+
+    /* Stream ended before deflate stream does. It may be still growing, so
+     * leave index at the last checkpoint to be resumed later. */
+    ZX_LOG("Reached the end of available data.");
+    last = zidx_get_checkpoint(index, index->list_count - 1);
+    if (last != NULL) {
+        zx_ret = ensure_window(index, index->list_count - 1);
+        if (zx_ret != ZX_RET_OK) {
+            ZX_LOG("ERROR: Couldn't load window of the last checkpoint (%d).",
+                   zx_ret);
+            return zx_ret;
+        }
+    }
+    zx_ret = jump_to_checkpoint(index, last);
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't jump to the last checkpoint (%d).", zx_ret);
+        return zx_ret;
+    }
+    return sparsify_windows(index);
+}
+
+int zidx_follow_index(zidx_index* index,
+                      off_t spacing_length,
+                      char is_uncompressed,
+                      unsigned int poll_interval,
+                      zidx_follow_callback follow_callback,
+                      void *callback_context)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Used for storing return value of stream functions. */
+    int s_ret;
+
+    /* Length of compressed stream when it's last indexed. */
+    off_t comp_length;
+    off_t last_comp_length = -1;
+
+    /* Time to wait between polls. */
+    struct timespec delay;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (index->readahead != NULL) {
+        ZX_LOG("ERROR: Readahead is enabled.");
+        return ZX_ERR_INVALID_OP;
+    }
+    if (poll_interval == 0 && follow_callback == NULL) {
+        ZX_LOG("ERROR: Polling without interval needs a callback to wait.");
+        return ZX_ERR_PARAMS;
+    }
+
+    for (;;) {
+        /* Find length of compressed stream. Position in stream is restored by
+         * zidx_update_index(). */
+        s_ret = sl_seek(index->comp_stream, 0, SL_SEEK_END);
+        if (s_ret != 0) {
+            ZX_LOG("ERROR: Couldn't seek to the end of stream (%d).", s_ret);
+            return ZX_ERR_STREAM_SEEK;
+        }
+        comp_length = sl_tell(index->comp_stream);
+        if (comp_length < 0) {
+            ZX_LOG("ERROR: Couldn't tell the length of stream.");
+            return ZX_ERR_STREAM_SEEK;
+        }
+
+        /* Index only if stream has grown. */
+        if (comp_length != last_comp_length) {
+            zx_ret = zidx_update_index(index, spacing_length,
+                                       is_uncompressed);
+            if (zx_ret != ZX_RET_OK) {
+                ZX_LOG("ERROR: Couldn't update index (%d).", zx_ret);
+                return zx_ret;
+            }
+            last_comp_length = comp_length;
+
+            if (zidx_eof(index)) {
+                ZX_LOG("Reached the end of deflate stream.");
+                return ZX_RET_OK;
+            }
+        }
+
+        if (follow_callback != NULL) {
+            zx_ret = (*follow_callback)(callback_context, index);
+            if (zx_ret != 0) {
+                ZX_LOG("Callback returned non-zero (%d). Returning from "
+                       "function.", zx_ret);
+                return zx_ret;
+            }
+        }
+
+        if (poll_interval > 0) {
+            delay.tv_sec  = poll_interval / 1000;
+            delay.tv_nsec = (long)(poll_interval % 1000) * 1000000;
+            nanosleep(&delay, NULL);
+        }
+    }
+}
+
+/*
+ * Parallel index building.
+ *
+ * The compressed stream is split into consecutive ranges, one for each thread.
+ * Every thread looks for a deflate block boundary in its range and decodes
+ * from there without knowing the window preceding it. Block structure of
+ * deflate data doesn't depend on the contents of the window, so block
+ * boundaries and uncompressed lengths found this way are exact. Only contents
+ * of the windows are unknown.
+ *
+ * To resolve contents, speculative ranges are decoded by three z_streams in
+ * lockstep. Each of them is primed with a different synthetic window encoding
+ * positions of its bytes. Comparing resulting windows tells, for every byte,
+ * whether it is a literal or a back-reference to some position in the unknown
+ * initial window. A serial fix-up pass chains the ranges, resolves initial
+ * window of each range from the final window of the preceding one, and selects
+ * checkpoints using the spacing policy. Lastly, ranges are decoded once more in
+ * parallel with their actual windows to fill the selected checkpoints.
+ */
+
+/** Number of z_streams decoding a speculative chunk in lockstep. */
+#define ZX_PARALLEL_VARIANTS_ (3)
+
+/** Number of bytes kept after a candidate block boundary for checking it. */
+#define ZX_PARALLEL_CANDIDATE_MARGIN_ (1024)
+
+/**
+ * Number of blocks decoded after a candidate block boundary before accepting
+ * it. Random data may occasionally decode as a single valid block.
+ */
+#define ZX_PARALLEL_CANDIDATE_BLOCKS_ (8)
+
+typedef struct parallel_build_s parallel_build;
+
+/** Block boundary visited while decoding a chunk. */
+typedef struct parallel_boundary_s
+{
+    zidx_checkpoint_offset offset;
+
+    /* Compressed offset of the gzip member header preceding the boundary, or
+     * -1 if the boundary isn't the beginning of a member. */
+    off_t member_comp;
+
+    char is_last_block;
+} parallel_boundary;
+
+typedef struct parallel_chunk_s
+{
+    /* Shared build data. */
+    parallel_build *build;
+
+    /* Range of compressed stream searched for the first block boundary. */
+    off_t range_begin;
+    off_t range_end;
+
+    /* Bit offset of the first block boundary of the chunk, -1 if there isn't
+     * any in the range. */
+    int64_t start_bit;
+
+    /* Whether the boundary at start_bit is reported to the spacing policy.
+     * Serial build doesn't report the beginning of raw deflate streams. */
+    char report_start;
+
+    /* Compressed offset of the gzip member header if the chunk starts at the
+     * beginning of a member, otherwise -1. Such chunks have an empty initial
+     * window, so they are independent of preceding chunks. */
+    off_t member_comp;
+
+    /* Member header offset of the boundary being reported by
+     * parallel_decode(), or -1 if it's not the beginning of a member. */
+    off_t boundary_member_comp;
+
+    /* Member header offset of the boundary where this chunk stopped decoding,
+     * or -1 if it's not the beginning of a member. */
+    off_t end_member_comp;
+
+    /* Number of z_streams decoding this chunk in lockstep. It is 1 if the
+     * initial window is known to be empty. */
+    int num_variants;
+
+    /* Index of the chunk starting where this chunk stopped decoding, or -1 if
+     * this chunk reached to the end of deflate stream. */
+    int next_chunk;
+
+    /* Compressed offset right after the last deflate block. Only meaningful if
+     * next_chunk is -1. */
+    off_t deflate_end;
+
+    /* Whether decoding the chunk has completed without any errors. */
+    char is_decoded;
+
+    /* Block boundaries visited while decoding. Uncompressed offsets are
+     * relative to the beginning of the chunk until the fix-up pass. */
+    parallel_boundary *boundaries;
+    int boundaries_count;
+    int boundaries_capacity;
+
+    /* Number of uncompressed bytes decoded in the chunk. */
+    off_t uncomp_length;
+
+    /* Final window of every variant. */
+    uint8_t *end_windows[ZX_PARALLEL_VARIANTS_];
+    unsigned int end_window_length;
+
+    /* Actual initial window of the chunk. Set by the fix-up pass. */
+    uint8_t *start_window;
+    unsigned int start_window_length;
+
+    /* Indices of boundaries selected as checkpoints and their counterparts
+     * filled by the last pass. */
+    int *selected;
+    zidx_checkpoint *checkpoints;
+    int selected_count;
+    int selected_capacity;
+
+    /* Number of boundaries visited and checkpoints filled in the last pass. */
+    int visited_count;
+    int filled_count;
+
+    /* Return value of the last worker run on this chunk. */
+    int ret;
+} parallel_chunk;
+
+struct parallel_build_s
+{
+    zidx_index *index;
+
+    /* Guards seeking and reading of index->comp_stream. */
+    pthread_mutex_t stream_lock;
+
+    parallel_chunk *chunks;
+    int num_chunks;
+
+    /* Whether gzip members may follow each other in the stream. */
+    char multi_member;
+
+    /* Inflate backend of index. */
+    const zidx_inflate_backend *backend;
+
+    /* Synthetic windows of each variant. */
+    uint8_t *variant_windows[ZX_PARALLEL_VARIANTS_];
+};
+
+/**
+ * Callback called by parallel_decode() on every block boundary.
+ *
+ * \return 0 to continue decoding, positive value to stop, or negative value in
+ *         case of an error.
+ */
+typedef int (*parallel_boundary_callback)(parallel_chunk *chunk,
+                                          z_stream *zs,
+                                          zidx_checkpoint_offset *offset,
+                                          int64_t bit_offset,
+                                          int is_last_block);
+
+/**
+ * Read from the compressed stream at given offset. Stream is shared among all
+ * workers, so seeking and reading is done under a lock.
+ *
+ * \return Number of bytes read if successful, or negative error code.
+ */
+static int parallel_read(parallel_build *build, off_t offset, uint8_t *buf,
+                         int len)
+{
+    streamlike_t *stream = build->index->comp_stream;
+    int s_read_len;
+    int s_ret;
+
+    pthread_mutex_lock(&build->stream_lock);
+    if (sl_seek(stream, offset, SL_SEEK_SET) != 0) {
+        pthread_mutex_unlock(&build->stream_lock);
+        ZX_LOG("ERROR: Couldn't seek to %jd in stream.", (intmax_t)offset);
+        return ZX_ERR_STREAM_SEEK;
+    }
+    s_read_len = sl_read(stream, buf, len);
+    s_ret = sl_error(stream);
+    pthread_mutex_unlock(&build->stream_lock);
+
+    if (s_ret) {
+        ZX_LOG("ERROR: Reading from stream (%d).", s_ret);
+        return ZX_ERR_STREAM_READ;
+    }
+    return s_read_len;
+}
+
+/**
+ * Find where deflate blocks start by reading the header at given offset.
+ *
+ * \param build         Shared build data.
+ * \param zs            z_stream used for reading header.
+ * \param window_bits   Window bits denoting header type, as passed to
+ *                      inflateReset2().
+ * \param comp          Compressed offset of the header.
+ * \param deflate_start Compressed offset right after the header.
+ *
+ * \return ZX_RET_OK if successful, or negative error code.
+ */
+static int parallel_read_header_at(parallel_build *build,
+                                   z_stream *zs,
+                                   int window_bits,
+                                   off_t comp,
+                                   off_t *deflate_start)
+{
+    uint8_t buf[512];
+    uint8_t out;
+    int s_read_len;
+    int z_ret;
+
+    z_ret = build->backend->reset(zs, window_bits);
+    if (z_ret != Z_OK) {
+        return ZX_ERR_ZLIB(z_ret);
+    }
+
+    do {
+        s_read_len = parallel_read(build, comp, buf, sizeof(buf));
+        if (s_read_len < 0) {
+            return s_read_len;
+        }
+        if (s_read_len == 0) {
+            ZX_LOG("ERROR: Unexpected EOF while reading file header.");
+            return ZX_ERR_STREAM_EOF;
+        }
+        zs->next_in   = buf;
+        zs->avail_in  = s_read_len;
+        zs->next_out  = &out;
+        zs->avail_out = 0;
+        z_ret = build->backend->inflate(zs, Z_BLOCK);
+        if (z_ret != Z_OK) {
+            ZX_LOG("ERROR: Reading header (%d).", z_ret);
+            return ZX_ERR_ZLIB(z_ret);
+        }
+        comp += s_read_len - zs->avail_in;
+    } while (!is_on_block_boundary(zs));
+
+    *deflate_start = comp;
+    return ZX_RET_OK;
+}
+
+/**
+ * Move z_streams to the beginning of the next gzip member, if there is one
+ * after the trailer following the last block.
+ *
+ * \param chunk       Chunk being decoded.
+ * \param zs          Array of num_streams z_streams.
+ * \param num_streams Number of z_streams.
+ * \param offset      Offset of the last block boundary. Updated to the
+ *                    beginning of deflate blocks of the next member.
+ *
+ * \return 1 if the next member is found, 0 if there isn't any, or negative
+ *         error code.
+ */
+static int parallel_cross_member(parallel_chunk *chunk,
+                                 z_stream *zs,
+                                 int num_streams,
+                                 zidx_checkpoint_offset *offset)
+{
+    parallel_build *build = chunk->build;
+    int window_bits = build->index->window_bits;
+    off_t member_comp;
+    off_t deflate_start;
+    uint8_t magic[2];
+    int s_read_len;
+    int zx_ret;
+    int z_ret;
+    int i;
+
+    member_comp = offset->comp + 8;
+    s_read_len = parallel_read(build, member_comp, magic, 2);
+    if (s_read_len < 0) {
+        return s_read_len;
+    }
+    if (s_read_len < 2 || magic[0] != 0x1f || magic[1] != 0x8b) {
+        return 0;
+    }
+
+    zx_ret = parallel_read_header_at(build, &zs[0], 16 + window_bits,
+                                     member_comp, &deflate_start);
+    if (zx_ret != ZX_RET_OK) {
+        return zx_ret;
+    }
+
+    /* Members start with an empty window. */
+    for (i = 0; i < num_streams; i++) {
+        z_ret = build->backend->reset(&zs[i], -window_bits);
+        if (z_ret != Z_OK) {
+            return ZX_ERR_ZLIB(z_ret);
+        }
+    }
+
+    offset->comp            = deflate_start;
+    offset->comp_bits_count = 0;
+    offset->comp_byte       = 0;
+    offset->in_block        = 0;
+    chunk->boundary_member_comp = member_comp;
+    return 1;
+}
+
+/**
+ * Decode deflate blocks starting from a block boundary using num_streams
+ * z_streams in lockstep, and call boundary_callback on every block boundary,
+ * including the starting one.
+ *
+ * \param chunk             Chunk being decoded.
+ * \param zs                Array of num_streams z_streams initialized as raw
+ *                          inflate.
+ * \param num_streams       Number of z_streams.
+ * \param windows           Initial window for each z_stream.
+ * \param window_length     Length of initial windows.
+ * \param start_bit         Bit offset of the block boundary to start from.
+ * \param report_start      Whether boundary_callback is called for the
+ *                          starting boundary.
+ * \param boundary_callback Callback for block boundaries.
+ *
+ * Decoding continues with the next gzip member after the last block if the
+ * stream may have multiple members.
+ *
+ * \return ZX_RET_OK if decoding stopped by callback or at the end of deflate
+ *         stream, or negative error code.
+ */
+static int parallel_decode(parallel_chunk *chunk,
+                           z_stream *zs,
+                           int num_streams,
+                           uint8_t **windows,
+                           unsigned int window_length,
+                           int64_t start_bit,
+                           int report_start,
+                           parallel_boundary_callback boundary_callback)
+{
+    /* Return value for this function. */
+    int ret;
+
+    /* Used for storing return value of zlib calls. */
+    int z_ret;
+
+    /* Used for storing return value of callbacks and reads. */
+    int cb_ret;
+    int s_read_len;
+
+    /* Offset of the z_streams. Uncompressed offset is relative to start_bit. */
+    zidx_checkpoint_offset offset;
+
+    /* Next compressed offset to read from stream. */
+    off_t read_offset;
+
+    /* Last byte of the previous input buffer. Needed if a block boundary is
+     * reached before consuming any bytes of the current input buffer. */
+    uint8_t last_byte = 0;
+
+    /* Number of bytes available and consumed/produced by inflate. */
+    unsigned int avail_in;
+    unsigned int comp_bytes_inflated;
+    unsigned int uncomp_bytes_inflated;
+
+    uint8_t byte;
+    int i;
+
+    /* Input buffer shared by all streams, and discarded output buffers. */
+    uint8_t *in_buf = NULL;
+    uint8_t *out_buf = NULL;
+    int in_buf_size = chunk->build->index->comp_data_buffer_size;
+    int out_buf_size = chunk->build->index->seeking_data_buffer_size;
+    int window_bits = chunk->build->index->window_bits;
+    const zidx_inflate_backend *backend = chunk->build->backend;
+
+    in_buf = index_malloc(chunk->build->index, in_buf_size);
+    out_buf = index_malloc(chunk->build->index,
+                           (size_t)out_buf_size * num_streams);
+    if (in_buf == NULL || out_buf == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate buffers for decoding chunk.");
+        ret = ZX_ERR_MEMORY;
+        goto cleanup;
+    }
+
+    offset.comp            = start_bit >> 3;
+    offset.uncomp          = 0;
+    offset.comp_bits_count = 0;
+    offset.comp_byte       = 0;
+    offset.in_block        = 0;
+    read_offset            = offset.comp;
+
+    /* Read the byte shared with the previous block, if there is any. */
+    if (start_bit & 7) {
+        s_read_len = parallel_read(chunk->build, read_offset, &byte, 1);
+        if (s_read_len < 0) {
+            ret = s_read_len;
+            goto cleanup;
+        }
+        if (s_read_len == 0) {
+            ret = ZX_ERR_STREAM_EOF;
+            goto cleanup;
+        }
+        read_offset++;
+        offset.comp++;
+        offset.comp_bits_count = 8 - (start_bit & 7);
+        offset.comp_byte       = byte;
+        last_byte              = byte;
+    }
+
+    for (i = 0; i < num_streams; i++) {
+        z_ret = backend->reset(&zs[i], -window_bits);
+        if (z_ret == Z_OK && window_length > 0) {
+            z_ret = backend->set_dictionary(&zs[i], windows[i],
+                                            window_length);
+        }
+        if (z_ret == Z_OK && offset.comp_bits_count > 0) {
+            z_ret = backend->prime(&zs[i], offset.comp_bits_count,
+                                   byte >> (8 - offset.comp_bits_count));
+        }
+        if (z_ret != Z_OK) {
+            ZX_LOG("ERROR: Couldn't prepare inflate for chunk (%d).", z_ret);
+            ret = ZX_ERR_ZLIB(z_ret);
+            goto cleanup;
+        }
+        zs[i].next_in  = in_buf;
+        zs[i].avail_in = 0;
+    }
+
+    if (report_start) {
+        chunk->boundary_member_comp = chunk->member_comp;
+        cb_ret = boundary_callback(chunk, zs, &offset, start_bit, 0);
+        chunk->boundary_member_comp = -1;
+        if (cb_ret != 0) {
+            ret = cb_ret < 0 ? cb_ret : ZX_RET_OK;
+            goto cleanup;
+        }
+    }
+
+    for (;;) {
+        /* Read from stream if no data is available in buffer. */
+        if (zs[0].avail_in == 0) {
+            if (zs[0].next_in != NULL && zs[0].next_in > in_buf) {
+                last_byte = *(zs[0].next_in - 1);
+            }
+            s_read_len = parallel_read(chunk->build, read_offset, in_buf,
+                                       in_buf_size);
+            if (s_read_len < 0) {
+                ret = s_read_len;
+                goto cleanup;
+            }
+            if (s_read_len == 0) {
+                ZX_LOG("ERROR: Unexpected EOF while decoding chunk.");
+                ret = ZX_ERR_STREAM_EOF;
+                goto cleanup;
+            }
+            read_offset += s_read_len;
+            for (i = 0; i < num_streams; i++) {
+                zs[i].next_in  = in_buf;
+                zs[i].avail_in = s_read_len;
+            }
+        }
+
+        avail_in = zs[0].avail_in;
+        for (i = 0; i < num_streams; i++) {
+            zs[i].next_out  = out_buf + (size_t)i * out_buf_size;
+            zs[i].avail_out = out_buf_size;
+            z_ret = backend->inflate(&zs[i], Z_BLOCK);
+            if (z_ret != Z_OK && z_ret != Z_STREAM_END) {
+                ZX_LOG("ERROR: inflate returned error while decoding chunk "
+                       "(%d).", z_ret);
+                ret = ZX_ERR_ZLIB(z_ret);
+                goto cleanup;
+            }
+            /* Block structure doesn't depend on window contents, so all
+             * streams should progress exactly the same. */
+            if (zs[i].avail_in != zs[0].avail_in
+                    || zs[i].avail_out != zs[0].avail_out
+                    || zs[i].data_type != zs[0].data_type) {
+                ZX_LOG("ERROR: Lockstep z_streams diverged.");
+                ret = ZX_ERR_CORRUPTED;
+                goto cleanup;
+            }
+        }
+
+        comp_bytes_inflated   = avail_in - zs[0].avail_in;
+        uncomp_bytes_inflated = out_buf_size - zs[0].avail_out;
+        offset.comp   += comp_bytes_inflated;
+        offset.uncomp += uncomp_bytes_inflated;
+
+        if (is_on_block_boundary(&zs[0])) {
+            offset.comp_bits_count = get_unused_bits_count(&zs[0]);
+            if (offset.comp_bits_count == 0) {
+                offset.comp_byte = 0;
+            } else if (zs[0].next_in > in_buf) {
+                offset.comp_byte = *(zs[0].next_in - 1);
+            } else {
+                offset.comp_byte = last_byte;
+            }
+
+            cb_ret = boundary_callback(chunk, zs, &offset,
+                                       offset.comp * 8
+                                           - offset.comp_bits_count,
+                                       is_last_deflate_block(&zs[0]));
+            if (cb_ret != 0) {
+                ret = cb_ret < 0 ? cb_ret : ZX_RET_OK;
+                goto cleanup;
+            }
+            if (is_last_deflate_block(&zs[0])) {
+                if (chunk->build->multi_member) {
+                    cb_ret = parallel_cross_member(chunk, zs, num_streams,
+                                                   &offset);
+                    if (cb_ret < 0) {
+                        ret = cb_ret;
+                        goto cleanup;
+                    }
+                }
+                if (!chunk->build->multi_member || cb_ret == 0) {
+                    chunk->next_chunk  = -1;
+                    chunk->deflate_end = offset.comp;
+                    break;
+                }
+
+                /* Continue from the beginning of the next member. */
+                read_offset = offset.comp;
+                for (i = 0; i < num_streams; i++) {
+                    zs[i].avail_in = 0;
+                }
+                cb_ret = boundary_callback(chunk, zs, &offset,
+                                           offset.comp * 8, 0);
+                chunk->boundary_member_comp = -1;
+                if (cb_ret != 0) {
+                    ret = cb_ret < 0 ? cb_ret : ZX_RET_OK;
+                    goto cleanup;
+                }
+            }
+        } else if (z_ret == Z_STREAM_END) {
+            /* Z_BLOCK stops after the last block, so this is unexpected. */
+            ZX_LOG("ERROR: Stream ended without a block boundary.");
+            ret = ZX_ERR_CORRUPTED;
+            goto cleanup;
+        }
+    }
+
+    ret = ZX_RET_OK;
+
+cleanup:
+    chunk->uncomp_length = offset.uncomp;
+    index_free(chunk->build->index, in_buf);
+    index_free(chunk->build->index, out_buf);
+    return ret;
+}
+
+/**
+ * Boundary callback used while checking a candidate boundary. Stops after
+ * ZX_PARALLEL_CANDIDATE_BLOCKS_ blocks are decoded.
+ */
+static int parallel_check_candidate_cb(parallel_chunk *chunk,
+                                       z_stream *zs,
+                                       zidx_checkpoint_offset *offset,
+                                       int64_t bit_offset,
+                                       int is_last_block)
+{
+    chunk->visited_count++;
+    return chunk->visited_count == ZX_PARALLEL_CANDIDATE_BLOCKS_;
+}
+
+/**
+ * Check whether there is a deflate block starting at given bit of buf.
+ *
+ * This function only accepts stored and dynamic Huffman blocks. Fixed Huffman
+ * blocks have too short headers to tell them apart from random data reliably.
+ *
+ * \param chunk  Chunk searched for a boundary.
+ * \param zs     z_stream initialized as raw inflate.
+ * \param buf    Buffer keeping compressed data.
+ * \param length Length of data in buf after the candidate byte.
+ * \param bit    Bit offset of the candidate in buf.
+ * \param base   Compressed offset of buf.
+ *
+ * \return 1 if there is a block boundary, 0 if not.
+ */
+static int parallel_check_candidate(parallel_chunk *chunk,
+                                    z_stream *zs,
+                                    uint8_t *buf,
+                                    int length,
+                                    int64_t bit,
+                                    off_t base)
+{
+    /* Header bits starting from candidate bit. */
+    uint64_t header;
+
+    /* Stored block length and its complement. */
+    unsigned int len, nlen;
+    int aligned;
+
+    uint8_t out;
+    int z_ret;
+    int i;
+
+    int byte = bit >> 3;
+    int shift = bit & 7;
+
+    const zidx_inflate_backend *backend = chunk->build->backend;
+
+    header = 0;
+    for (i = 4; i >= 0; i--) {
+        header = (header << 8) | buf[byte + i];
+    }
+    header >>= shift;
+
+    switch ((header >> 1) & 3) {
+        case 0:
+            /* Stored block. LEN and NLEN should complement each other. */
+            aligned = (bit + 3 + 7) >> 3;
+            len  = buf[aligned] | (buf[aligned + 1] << 8);
+            nlen = buf[aligned + 2] | (buf[aligned + 3] << 8);
+            if (len != (~nlen & 0xFFFF)) {
+                return 0;
+            }
+            break;
+        case 2:
+            /* Dynamic Huffman block. HLIT and HDIST can't be more than 29. */
+            if (((header >> 3) & 31) > 29 || ((header >> 8) & 31) > 29) {
+                return 0;
+            }
+            /* Let zlib decode block header and stop right after it. */
+            if (backend->reset(zs, -chunk->build->index->window_bits)
+                    != Z_OK) {
+                return 0;
+            }
+            if (shift > 0 && backend->prime(zs, 8 - shift,
+                                            buf[byte] >> shift) != Z_OK) {
+                return 0;
+            }
+            zs->next_in   = buf + byte + (shift > 0);
+            zs->avail_in  = length - (shift > 0);
+            zs->next_out  = &out;
+            zs->avail_out = 1;
+            z_ret = backend->inflate(zs, Z_TREES);
+            if (z_ret != Z_OK || !(zs->data_type & 256)) {
+                return 0;
+            }
+            break;
+        default:
+            return 0;
+    }
+
+    /* Finally, decode some blocks with a dummy window. Decoding stops earlier
+     * if the end of deflate stream is reached. */
+    chunk->visited_count = 0;
+    z_ret = parallel_decode(chunk, zs, 1, chunk->build->variant_windows,
+                            chunk->build->index->window_size,
+                            (int64_t)(base + byte) * 8 + shift, 0,
+                            parallel_check_candidate_cb);
+    chunk->visited_count = 0;
+    return z_ret == ZX_RET_OK;
+}
+
+/**
+ * Find the first block boundary in range of the chunk.
+ *
+ * \return ZX_RET_OK if search completed, whether or not a boundary is found,
+ *         or negative error code.
+ */
+static int parallel_find_boundary(parallel_chunk *chunk, z_stream *zs)
+{
+    /* Buffer and its size. Last ZX_PARALLEL_CANDIDATE_MARGIN_ bytes of buffer
+     * are only used for checking candidates, and searched in the next round.
+     * */
+    uint8_t *buf;
+    int buf_size = chunk->build->index->comp_data_buffer_size
+                    + ZX_PARALLEL_CANDIDATE_MARGIN_;
+
+    off_t base;
+    int s_read_len;
+    int searchable;
+    int64_t bit;
+
+    buf = index_calloc(chunk->build->index, 1, buf_size);
+    if (buf == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate buffer for boundary search.");
+        return ZX_ERR_MEMORY;
+    }
+
+    chunk->start_bit = -1;
+    for (base = chunk->range_begin; base < chunk->range_end;
+            base += searchable) {
+        s_read_len = parallel_read(chunk->build, base, buf, buf_size);
+        if (s_read_len < 0) {
+            index_free(chunk->build->index, buf);
+            return s_read_len;
+        }
+        searchable = s_read_len - ZX_PARALLEL_CANDIDATE_MARGIN_;
+        if (searchable > chunk->range_end - base) {
+            searchable = chunk->range_end - base;
+        }
+        if (searchable <= 0) {
+            break;
+        }
+        for (bit = 0; bit < (int64_t)searchable * 8; bit++) {
+            if (parallel_check_candidate(chunk, zs, buf, s_read_len - (bit >> 3),
+                                         bit, base)) {
+                chunk->start_bit = (int64_t)base * 8 + bit;
+                ZX_LOG("Found block boundary at bit %jd.",
+                       (intmax_t)chunk->start_bit);
+                index_free(chunk->build->index, buf);
+                return ZX_RET_OK;
+            }
+        }
+    }
+
+    ZX_LOG("No block boundary found in range %jd-%jd.",
+           (intmax_t)chunk->range_begin, (intmax_t)chunk->range_end);
+    index_free(chunk->build->index, buf);
+    return ZX_RET_OK;
+}
+
+/**
+ * Find where the first deflate block starts by reading file headers.
+ *
+ * \return ZX_RET_OK if successful, or negative error code.
+ */
+static int parallel_read_headers(parallel_chunk *chunk, z_stream *zs)
+{
+    zidx_index *index = chunk->build->index;
+    off_t deflate_start;
+    int window_bits;
+    int zx_ret;
+
+    if (index->stream_type == ZX_STREAM_DEFLATE) {
+        chunk->start_bit = 0;
+        return ZX_RET_OK;
+    }
+    window_bits = index->window_bits
+                    + (index->stream_type == ZX_STREAM_GZIP ? 16 : 32);
+    zx_ret = parallel_read_header_at(chunk->build, zs, window_bits, 0,
+                                     &deflate_start);
+    if (zx_ret != ZX_RET_OK) {
+        return zx_ret;
+    }
+
+    chunk->start_bit = deflate_start * 8;
+    return ZX_RET_OK;
+}
+
+/**
+ * Check whether a gzip member starts at given offset, by reading its header
+ * and decoding some blocks with an empty window.
+ *
+ * \param chunk  Chunk searched for a member.
+ * \param zs     z_stream initialized as raw inflate.
+ * \param comp   Compressed offset of the candidate header.
+ * \param deflate_start Compressed offset right after the header, if found.
+ *
+ * \return 1 if there is a member, 0 if not.
+ */
+static int parallel_check_member(parallel_chunk *chunk,
+                                 z_stream *zs,
+                                 off_t comp,
+                                 off_t *deflate_start)
+{
+    int z_ret;
+
+    if (parallel_read_header_at(chunk->build, zs,
+                                16 + chunk->build->index->window_bits, comp,
+                                deflate_start) != ZX_RET_OK) {
+        return 0;
+    }
+
+    /* Back-references to the empty window fail, so checking a member this way
+     * is more reliable than checking a block boundary. */
+    chunk->visited_count = 0;
+    z_ret = parallel_decode(chunk, zs, 1, NULL, 0, *deflate_start * 8, 0,
+                            parallel_check_candidate_cb);
+    chunk->visited_count = 0;
+    return z_ret == ZX_RET_OK;
+}
+
+/**
+ * Find the first gzip member header in range of the chunk. Chunks starting at
+ * a member can be decoded independently with an empty window.
+ *
+ * \return ZX_RET_OK if search completed, whether or not a member is found,
+ *         or negative error code.
+ */
+static int parallel_find_member(parallel_chunk *chunk, z_stream *zs)
+{
+    /* Last two bytes of buffer are only used for checking magic bytes, and
+     * searched in the next round. */
+    uint8_t *buf;
+    int buf_size = chunk->build->index->comp_data_buffer_size + 2;
+
+    off_t base;
+    off_t deflate_start;
+    int s_read_len;
+    int searchable;
+    int i;
+
+    buf = index_malloc(chunk->build->index, buf_size);
+    if (buf == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate buffer for member search.");
+        return ZX_ERR_MEMORY;
+    }
+
+    chunk->start_bit = -1;
+    for (base = chunk->range_begin; base < chunk->range_end;
+            base += searchable) {
+        s_read_len = parallel_read(chunk->build, base, buf, buf_size);
+        if (s_read_len < 0) {
+            index_free(chunk->build->index, buf);
+            return s_read_len;
+        }
+        searchable = s_read_len - 2;
+        if (searchable > chunk->range_end - base) {
+            searchable = chunk->range_end - base;
+        }
+        if (searchable <= 0) {
+            break;
+        }
+        for (i = 0; i < searchable; i++) {
+            /* Magic bytes followed by deflate compression method. */
+            if (buf[i] != 0x1f || buf[i + 1] != 0x8b || buf[i + 2] != 8) {
+                continue;
+            }
+            if (parallel_check_member(chunk, zs, base + i, &deflate_start)) {
+                chunk->start_bit    = deflate_start * 8;
+                chunk->member_comp  = base + i;
+                chunk->num_variants = 1;
+                ZX_LOG("Found member at %jd.", (intmax_t)chunk->member_comp);
+                index_free(chunk->build->index, buf);
+                return ZX_RET_OK;
+            }
+        }
+    }
+
+    index_free(chunk->build->index, buf);
+    return ZX_RET_OK;
+}
+
+/**
+ * Initialize given number of z_streams as raw inflate.
+ */
+static int parallel_init_streams(parallel_build *build, z_stream *zs,
+                                 int count)
+{
+    int z_ret;
+    int i;
+
+    memset(zs, 0, sizeof(z_stream) * count);
+    for (i = 0; i < count; i++) {
+        set_stream_allocator(build->index, &zs[i]);
+        z_ret = build->backend->init(&zs[i], -build->index->window_bits);
+        if (z_ret != Z_OK) {
+            while (i-- > 0) {
+                build->backend->end(&zs[i]);
+            }
+            return ZX_ERR_ZLIB(z_ret);
+        }
+    }
+    return ZX_RET_OK;
+}
+
+/**
+ * Release given number of z_streams.
+ */
+static void parallel_end_streams(parallel_build *build, z_stream *zs,
+                                 int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        build->backend->end(&zs[i]);
+    }
+}
+
+static void* parallel_find_worker(void *arg)
+{
+    parallel_chunk *chunk = arg;
+    z_stream zs;
+
+    chunk->ret = parallel_init_streams(chunk->build, &zs, 1);
+    if (chunk->ret != ZX_RET_OK) {
+        return NULL;
+    }
+    if (chunk == chunk->build->chunks) {
+        chunk->ret = parallel_read_headers(chunk, &zs);
+    } else {
+        /* Prefer starting at a member, then at any block boundary. */
+        chunk->ret = ZX_RET_OK;
+        if (chunk->build->multi_member) {
+            chunk->ret = parallel_find_member(chunk, &zs);
+        }
+        if (chunk->ret == ZX_RET_OK && chunk->start_bit < 0) {
+            chunk->ret = parallel_find_boundary(chunk, &zs);
+        }
+    }
+    parallel_end_streams(chunk->build, &zs, 1);
+    return NULL;
+}
+
+/**
+ * Boundary callback for recording block boundaries of a chunk. Stops when the
+ * start of another chunk is reached.
+ */
+static int parallel_record_cb(parallel_chunk *chunk,
+                              z_stream *zs,
+                              zidx_checkpoint_offset *offset,
+                              int64_t bit_offset,
+                              int is_last_block)
+{
+    parallel_build *build = chunk->build;
+    parallel_boundary *new_boundaries;
+    parallel_boundary *boundary;
+    int new_capacity;
+
+    if (bit_offset != chunk->start_bit) {
+        /* Skip chunks which are passed over, their start is not a block
+         * boundary. */
+        while (chunk->next_chunk < build->num_chunks
+                && build->chunks[chunk->next_chunk].start_bit < bit_offset) {
+            ZX_LOG("Passed over the start of chunk %d at bit %jd.",
+                   chunk->next_chunk, (intmax_t)bit_offset);
+            chunk->next_chunk++;
+        }
+        if (chunk->next_chunk < build->num_chunks
+                && build->chunks[chunk->next_chunk].start_bit == bit_offset) {
+            ZX_LOG("Reached to the start of chunk %d.", chunk->next_chunk);
+            chunk->end_member_comp = chunk->boundary_member_comp;
+            return 1;
+        }
+    }
+
+    if (chunk->boundaries_count == chunk->boundaries_capacity) {
+        new_capacity = chunk->boundaries_capacity * 2 + 16;
+        new_boundaries = index_realloc(chunk->build->index, chunk->boundaries,
+                                       sizeof(parallel_boundary)
+                                           * new_capacity);
+        if (new_boundaries == NULL) {
+            ZX_LOG("ERROR: Couldn't allocate space for block boundaries.");
+            return ZX_ERR_MEMORY;
+        }
+        chunk->boundaries          = new_boundaries;
+        chunk->boundaries_capacity = new_capacity;
+    }
+    boundary = &chunk->boundaries[chunk->boundaries_count++];
+    boundary->offset        = *offset;
+    boundary->member_comp   = chunk->boundary_member_comp;
+    boundary->is_last_block = is_last_block;
+    return 0;
+}
+
+static void* parallel_decode_worker(void *arg)
+{
+    parallel_chunk *chunk = arg;
+    parallel_build *build = chunk->build;
+    z_stream zs[ZX_PARALLEL_VARIANTS_];
+    unsigned int window_length;
+    int z_ret;
+    int i;
+
+    if (chunk->start_bit < 0) {
+        chunk->ret = ZX_ERR_NOT_FOUND;
+        return NULL;
+    }
+
+    chunk->ret = parallel_init_streams(build, zs, chunk->num_variants);
+    if (chunk->ret != ZX_RET_OK) {
+        return NULL;
+    }
+
+    chunk->next_chunk = (chunk - build->chunks) + 1;
+    window_length = chunk->num_variants == 1 ? 0 : build->index->window_size;
+    chunk->ret = parallel_decode(chunk, zs, chunk->num_variants,
+                                 build->variant_windows, window_length,
+                                 chunk->start_bit, chunk->report_start,
+                                 parallel_record_cb);
+    if (chunk->ret != ZX_RET_OK) {
+        ZX_LOG("Decoding chunk %d failed (%d).", (int)(chunk - build->chunks),
+               chunk->ret);
+        goto cleanup;
+    }
+
+    /* Save final windows for resolving. */
+    for (i = 0; i < chunk->num_variants; i++) {
+        chunk->end_windows[i] = index_malloc(build->index,
+                                             build->index->window_size);
+        if (chunk->end_windows[i] == NULL) {
+            chunk->ret = ZX_ERR_MEMORY;
+            goto cleanup;
+        }
+        z_ret = build->backend->get_dictionary(&zs[i],
+                                               chunk->end_windows[i],
+                                               &chunk->end_window_length);
+        if (z_ret != Z_OK) {
+            chunk->ret = ZX_ERR_ZLIB(z_ret);
+            goto cleanup;
+        }
+    }
+    chunk->is_decoded = 1;
+
+cleanup:
+    parallel_end_streams(build, zs, chunk->num_variants);
+    return NULL;
+}
+
+/**
+ * Boundary callback filling the selected checkpoints of a chunk. Stops when all
+ * of them are filled.
+ */
+static int parallel_fill_cb(parallel_chunk *chunk,
+                            z_stream *zs,
+                            zidx_checkpoint_offset *offset,
+                            int64_t bit_offset,
+                            int is_last_block)
+{
+    zidx_checkpoint *ckp;
+    unsigned int dict_length;
+    int idx;
+    int z_ret;
+
+    idx = chunk->visited_count++;
+    if (idx != chunk->selected[chunk->filled_count]) {
+        return 0;
+    }
+
+    ckp = &chunk->checkpoints[chunk->filled_count];
+    ckp->offset = chunk->boundaries[idx].offset;
+
+    z_ret = chunk->build->backend->get_dictionary(zs, NULL, &dict_length);
+    if (z_ret != Z_OK) {
+        return ZX_ERR_ZLIB(z_ret);
+    }
+    if (dict_length > 0) {
+        ckp->window_data = index_malloc(chunk->build->index, dict_length);
+        if (ckp->window_data == NULL) {
+            return ZX_ERR_MEMORY;
+        }
+        z_ret = chunk->build->backend->get_dictionary(zs, ckp->window_data,
+                                                      &dict_length);
+        if (z_ret != Z_OK) {
+            return ZX_ERR_ZLIB(z_ret);
+        }
+    }
+    ckp->window_length = dict_length;
+
+    chunk->filled_count++;
+    return chunk->filled_count == chunk->selected_count;
+}
+
+static void* parallel_fill_worker(void *arg)
+{
+    parallel_chunk *chunk = arg;
+    parallel_build *build = chunk->build;
+    z_stream zs;
+
+    if (chunk->selected_count == 0) {
+        chunk->ret = ZX_RET_OK;
+        return NULL;
+    }
+
+    chunk->ret = parallel_init_streams(build, &zs, 1);
+    if (chunk->ret != ZX_RET_OK) {
+        return NULL;
+    }
+    chunk->ret = parallel_decode(chunk, &zs, 1, &chunk->start_window,
+                                 chunk->start_window_length, chunk->start_bit,
+                                 chunk->report_start, parallel_fill_cb);
+    parallel_end_streams(build, &zs, 1);
+    return NULL;
+}
+
+/**
+ * Run worker on every chunk in a separate thread and wait for them. If a
+ * thread can't be created, worker is run on the calling thread instead.
+ */
+static void parallel_run(parallel_build *build, void* (*worker)(void*))
+{
+    pthread_t *threads;
+    char *created;
+    int i;
+
+    threads = index_malloc(build->index,
+                           sizeof(pthread_t) * build->num_chunks);
+    created = index_calloc(build->index, build->num_chunks, 1);
+    for (i = 0; i < build->num_chunks; i++) {
+        if (threads != NULL && created != NULL
+                && pthread_create(&threads[i], NULL, worker,
+                                  &build->chunks[i]) == 0) {
+            created[i] = 1;
+        } else {
+            ZX_LOG("WARNING: Couldn't create thread, running on caller.");
+            worker(&build->chunks[i]);
+        }
+    }
+    for (i = 0; i < build->num_chunks; i++) {
+        if (created != NULL && created[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    index_free(build->index, threads);
+    index_free(build->index, created);
+}
+
+/**
+ * Resolve final window of a chunk using its actual initial window.
+ *
+ * \param index  Index data.
+ * \param chunk  Decoded chunk with a known start window.
+ * \param result Resolved window, allocated by this function.
+ * \param length Length of resolved window.
+ *
+ * \return ZX_RET_OK if successful, or negative error code.
+ */
+static int parallel_resolve_window(zidx_index *index,
+                                   parallel_chunk *chunk,
+                                   uint8_t **result,
+                                   unsigned int *length)
+{
+    /* Variant windows of the chunk at its end. */
+    uint8_t *lo   = chunk->end_windows[0];
+    uint8_t *hi   = chunk->end_windows[1];
+    uint8_t *comp = chunk->end_windows[2];
+
+    /* Synthetic windows have full window size, while actual window can be
+     * shorter, in which case it is aligned to the end. */
+    unsigned int padding = index->window_size - chunk->start_window_length;
+
+    unsigned int actual_length;
+    unsigned int first;
+    unsigned int pos;
+    unsigned int j;
+    uint8_t *window;
+
+    actual_length = chunk->end_window_length;
+    if (chunk->start_window_length + chunk->uncomp_length < actual_length) {
+        actual_length = chunk->start_window_length + chunk->uncomp_length;
+    }
+    first = chunk->end_window_length - actual_length;
+
+    *result = NULL;
+    *length = 0;
+    if (actual_length == 0) {
+        return ZX_RET_OK;
+    }
+
+    window = index_malloc(index, actual_length);
+    if (window == NULL) {
+        return ZX_ERR_MEMORY;
+    }
+
+    for (j = first; j < chunk->end_window_length; j++) {
+        /* Literals are the same in every variant. */
+        if (chunk->num_variants == 1 || lo[j] == comp[j]) {
+            window[j - first] = lo[j];
+            continue;
+        }
+        pos = lo[j] | (hi[j] << 8);
+        if (pos < padding || pos >= index->window_size) {
+            ZX_LOG("ERROR: Back-reference to %u is out of window.", pos);
+            index_free(index, window);
+            return ZX_ERR_CORRUPTED;
+        }
+        window[j - first] = chunk->start_window[pos - padding];
+    }
+
+    *result = window;
+    *length = actual_length;
+    return ZX_RET_OK;
+}
+
+/**
+ * Chain decoded chunks starting from the first one, resolve their windows,
+ * make offsets absolute, select checkpoints, and record members.
+ *
+ * \return Index of the last chunk if successful, or negative error code.
+ */
+static int parallel_fix_up(parallel_build *build, spacing_data *spacing)
+{
+    zidx_index *index = build->index;
+    parallel_chunk *chunk;
+    parallel_boundary *boundary;
+    uint8_t *window;
+    unsigned int window_length;
+    off_t uncomp = 0;
+    off_t last_uncomp = -1;
+    off_t member_comp = -1;
+    int zx_ret;
+    int t = 0;
+    int i;
+
+    /* First member starts at the beginning of stream. */
+    zx_ret = add_member(index, 0, 0);
+    if (zx_ret != ZX_RET_OK) {
+        return zx_ret;
+    }
+
+    window = NULL;
+    window_length = 0;
+    for (;;) {
+        chunk = &build->chunks[t];
+        if (!chunk->is_decoded) {
+            ZX_LOG("ERROR: Chunk %d on decoding chain failed (%d).", t,
+                   chunk->ret);
+            index_free(build->index, window);
+            return chunk->ret < 0 ? chunk->ret : ZX_ERR_CORRUPTED;
+        }
+
+        /* Chunk starts at a member if it's found so, or if the previous
+         * chunk stopped at a member. Window is empty then. */
+        if (chunk->member_comp < 0 && member_comp >= 0
+                && chunk->boundaries_count > 0) {
+            chunk->member_comp = member_comp;
+            chunk->boundaries[0].member_comp = member_comp;
+        }
+        if (chunk->member_comp >= 0) {
+            index_free(build->index, window);
+            window = NULL;
+            window_length = 0;
+        }
+
+        chunk->start_window        = window;
+        chunk->start_window_length = window_length;
+
+        zx_ret = parallel_resolve_window(index, chunk, &window,
+                                         &window_length);
+        if (zx_ret != ZX_RET_OK) {
+            return zx_ret;
+        }
+
+        for (i = 0; i < chunk->boundaries_count; i++) {
+            boundary = &chunk->boundaries[i];
+            boundary->offset.uncomp += uncomp;
+
+            if (boundary->member_comp >= 0) {
+                zx_ret = add_member(index, boundary->member_comp,
+                                    boundary->offset.uncomp);
+                if (zx_ret != ZX_RET_OK) {
+                    index_free(build->index, window);
+                    return zx_ret;
+                }
+            }
+
+            /* Same policy with spacing_callback(). */
+            if (boundary->is_last_block && build->multi_member) {
+                continue;
+            }
+            if (boundary->offset.uncomp <= last_uncomp) {
+                continue;
+            }
+            if (!spacing_should_add(spacing, &boundary->offset)
+                    && !(boundary->member_comp >= 0
+                            && boundary->offset.uncomp > 0)) {
+                continue;
+            }
+            spacing_update(spacing, &boundary->offset);
+            last_uncomp = boundary->offset.uncomp;
+            if (chunk->selected_count == chunk->selected_capacity) {
+                int *selected;
+                chunk->selected_capacity = chunk->selected_capacity * 2 + 16;
+                selected = index_realloc(build->index, chunk->selected,
+                                         sizeof(int)
+                                             * chunk->selected_capacity);
+                if (selected == NULL) {
+                    index_free(build->index, window);
+                    return ZX_ERR_MEMORY;
+                }
+                chunk->selected = selected;
+            }
+            chunk->selected[chunk->selected_count++] = i;
+        }
+        if (chunk->selected_count > 0) {
+            chunk->checkpoints = index_calloc(build->index,
+                                              chunk->selected_count,
+                                              sizeof(zidx_checkpoint));
+            if (chunk->checkpoints == NULL) {
+                index_free(build->index, window);
+                return ZX_ERR_MEMORY;
+            }
+        }
+
+        uncomp += chunk->uncomp_length;
+        if (chunk->next_chunk < 0) {
+            break;
+        }
+        member_comp = chunk->end_member_comp;
+        t = chunk->next_chunk;
+    }
+    index_free(build->index, window);
+
+    index->uncompressed_size = uncomp;
+    return t;
+}
+
+/**
+ * Check the gzip trailer after the deflate stream, and set compressed size of
+ * index.
+ */
+static int parallel_read_trailer(parallel_build *build, off_t deflate_end)
+{
+    zidx_index *index = build->index;
+    uint8_t header[2];
+    uint8_t trailer[8];
+    uint32_t isize;
+    off_t member_uncomp;
+    int s_read_len;
+
+    if (index->stream_type == ZX_STREAM_DEFLATE) {
+        index->compressed_size = deflate_end;
+        return ZX_RET_OK;
+    }
+
+    /* TODO/BUG: Same with zidx_read_ex, zlib trailer is not handled
+     * separately. Only gzip trailer is verified. */
+    index->compressed_size = deflate_end + 8;
+
+    s_read_len = parallel_read(build, 0, header, 2);
+    if (s_read_len < 0) {
+        return s_read_len;
+    }
+    if (s_read_len < 2 || header[0] != 0x1f || header[1] != 0x8b) {
+        return ZX_RET_OK;
+    }
+
+    s_read_len = parallel_read(build, deflate_end, trailer, 8);
+    if (s_read_len < 0) {
+        return s_read_len;
+    }
+    if (s_read_len < 8) {
+        ZX_LOG("ERROR: File ended before trailer ends.");
+        return ZX_ERR_STREAM_EOF;
+    }
+    /* ISIZE is the size of the last member. */
+    member_uncomp = index->uncompressed_size
+                        - index->members[index->members_count - 1].uncomp;
+    isize = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16)
+                | ((uint32_t)trailer[7] << 24);
+    if (isize != (uint32_t)member_uncomp) {
+        ZX_LOG("ERROR: Uncompressed size of member (%jd) doesn't match ISIZE "
+               "(%u).", (intmax_t)member_uncomp, isize);
+        return ZX_ERR_CORRUPTED;
+    }
+    return ZX_RET_OK;
+}
+
+int zidx_build_index_parallel(zidx_index* index,
+                              off_t spacing_length,
+                              char is_uncompressed,
+                              int num_threads)
+{
+    /* Return value for this function. */
+    int ret;
+
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Context for spacing policy. */
+    spacing_data data;
+
+    /* Shared build data. */
+    parallel_build build;
+    parallel_chunk *chunk;
+
+    /* Length of compressed stream. */
+    off_t comp_length;
+
+    unsigned int p;
+    int i, j;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+
+    if (index->async != NULL) {
+        ZX_LOG("ERROR: Index is being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+    if (index->readahead != NULL) {
+        ZX_LOG("ERROR: Readahead is enabled.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    if (num_threads <= 0) {
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    /* Find length of compressed stream. */
+    if (sl_seek(index->comp_stream, 0, SL_SEEK_END) != 0) {
+        ZX_LOG("ERROR: Couldn't seek to the end of stream.");
+        return ZX_ERR_STREAM_SEEK;
+    }
+    comp_length = sl_tell(index->comp_stream);
+    if (comp_length < 0) {
+        ZX_LOG("ERROR: Couldn't tell the length of stream.");
+        return ZX_ERR_STREAM_SEEK;
+    }
+
+    /* Don't split stream into chunks smaller than the minimum. */
+    if (num_threads > comp_length / ZX_DEFAULT_PARALLEL_MIN_CHUNK_SIZE) {
+        num_threads = comp_length / ZX_DEFAULT_PARALLEL_MIN_CHUNK_SIZE;
+    }
+
+    /* Position of index in compressed stream is messed above. */
+    zx_ret = zidx_rewind(index);
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't rewind index (%d).", zx_ret);
+        return zx_ret;
+    }
+
+    zx_ret = detect_bgzf(index);
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't detect stream format (%d).", zx_ret);
+        return zx_ret;
+    }
+    if (num_threads <= 1 || index->is_bgzf || index->intra_block_step > 0) {
+        ZX_LOG("Building index serially.");
+        return zidx_build_index(index, spacing_length, is_uncompressed);
+    }
+
+    memset(&build, 0, sizeof(build));
+    build.index        = index;
+    build.num_chunks   = num_threads;
+    build.multi_member = index->stream_type != ZX_STREAM_DEFLATE;
+    build.backend      = index->backend;
+
+    if (pthread_mutex_init(&build.stream_lock, NULL) != 0) {
+        ZX_LOG("ERROR: Couldn't initialize mutex.");
+        return ZX_ERR_MEMORY;
+    }
+
+    build.chunks = index_calloc(index, build.num_chunks,
+                                sizeof(parallel_chunk));
+    if (build.chunks == NULL) {
+        ret = ZX_ERR_MEMORY;
+        goto cleanup;
+    }
+    for (i = 0; i < build.num_chunks; i++) {
+        chunk = &build.chunks[i];
+        chunk->build        = &build;
+        chunk->range_begin  = comp_length * i / build.num_chunks;
+        chunk->range_end    = comp_length * (i + 1) / build.num_chunks;
+        chunk->report_start = 1;
+        chunk->num_variants = ZX_PARALLEL_VARIANTS_;
+        chunk->member_comp          = -1;
+        chunk->boundary_member_comp = -1;
+        chunk->end_member_comp      = -1;
+    }
+    /* First chunk starts with an empty window. */
+    build.chunks[0].num_variants = 1;
+    build.chunks[0].report_start = index->stream_type != ZX_STREAM_DEFLATE;
+
+    /* Synthetic windows encoding low and high bits of positions, and
+     * complement of low bits. */
+    for (i = 0; i < ZX_PARALLEL_VARIANTS_; i++) {
+        build.variant_windows[i] = index_malloc(index, index->window_size);
+        if (build.variant_windows[i] == NULL) {
+            ret = ZX_ERR_MEMORY;
+            goto cleanup;
+        }
+    }
+    for (p = 0; p < index->window_size; p++) {
+        build.variant_windows[0][p] = p & 0xFF;
+        build.variant_windows[1][p] = (p >> 8) & 0xFF;
+        build.variant_windows[2][p] = ~p & 0xFF;
+    }
+
+    ZX_LOG("Building index with %d threads.", build.num_chunks);
+
+    /* Find starting boundaries of chunks. */
+    parallel_run(&build, parallel_find_worker);
+    for (i = 0; i < build.num_chunks; i++) {
+        if (build.chunks[i].ret != ZX_RET_OK) {
+            ret = build.chunks[i].ret;
+            goto cleanup;
+        }
+    }
+
+    /* Decode chunks speculatively. */
+    parallel_run(&build, parallel_decode_worker);
+
+    /* Chain them and select checkpoints. */
+    spacing_init(&data, index, spacing_length, is_uncompressed);
+    zx_ret = parallel_fix_up(&build, &data);
+    if (zx_ret < 0) {
+        ret = zx_ret;
+        goto cleanup;
+    }
+
+    zx_ret = parallel_read_trailer(&build, build.chunks[zx_ret].deflate_end);
+    if (zx_ret != ZX_RET_OK) {
+        ret = zx_ret;
+        goto cleanup;
+    }
+
+    /* Fill selected checkpoints. */
+    parallel_run(&build, parallel_fill_worker);
+    for (i = 0; i < build.num_chunks; i++) {
+        if (build.chunks[i].ret != ZX_RET_OK
+                && build.chunks[i].selected_count > 0) {
+            ret = build.chunks[i].ret;
+            goto cleanup;
+        }
+    }
+
+    /* Add checkpoints in order. Chunks off the chain don't have any. */
+    for (i = 0; i < build.num_chunks; i++) {
+        chunk = &build.chunks[i];
+        for (j = 0; j < chunk->selected_count; j++) {
+            zx_ret = compress_window(index, &chunk->checkpoints[j],
+                                     index->window_compression);
+            if (zx_ret != ZX_RET_OK) {
+                ZX_LOG("ERROR: Couldn't compress window (%d).", zx_ret);
+                ret = zx_ret;
+                goto cleanup;
+            }
+            zx_ret = zidx_add_checkpoint(index, &chunk->checkpoints[j]);
+            if (zx_ret != ZX_RET_OK) {
+                ZX_LOG("ERROR: Couldn't add new checkpoint (%d).", zx_ret);
+                ret = zx_ret;
+                goto cleanup;
+            }
+            /* Window is owned by index now. */
+            chunk->checkpoints[j].window_data = NULL;
+        }
+    }
+
+    ret = sparsify_windows(index);
+
+cleanup:
+    if (build.chunks != NULL) {
+        for (i = 0; i < build.num_chunks; i++) {
+            chunk = &build.chunks[i];
+            index_free(index, chunk->boundaries);
+            for (j = 0; j < ZX_PARALLEL_VARIANTS_; j++) {
+                index_free(index, chunk->end_windows[j]);
+            }
+            index_free(index, chunk->start_window);
+            if (chunk->checkpoints != NULL) {
+                for (j = 0; j < chunk->selected_count; j++) {
+                    index_free(index, chunk->checkpoints[j].window_data);
+                }
+            }
+            index_free(index, chunk->checkpoints);
+            index_free(index, chunk->selected);
+        }
+    }
+    index_free(index, build.chunks);
+    for (i = 0; i < ZX_PARALLEL_VARIANTS_; i++) {
+        index_free(index, build.variant_windows[i]);
+    }
+    pthread_mutex_destroy(&build.stream_lock);
+
+    /* Workers moved the position of compressed stream. */
+    zx_ret = zidx_rewind(index);
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't rewind index (%d).", zx_ret);
+        if (ret == ZX_RET_OK) ret = zx_ret;
+    }
+    return ret;
+}
+
+/*
+ * Background index building.
+ *
+ * A worker thread decodes the compressed stream using a shadow index, which has
+ * its own z_stream and buffers, and publishes checkpoints to the index. Both
+ * indexes share the compressed stream. Reads from it are serialized with
+ * stream_lock and each index keeps its own position in the stream. The
+ * checkpoint list is guarded with list_lock, so zidx_seek() and zidx_read()
+ * can use checkpoints already published while the build is in progress. Other
+ * functions modifying or traversing the list should not be used until the
+ * build is finished with zidx_build_index_async_wait() or canceled with
+ * zidx_build_index_async_cancel().
+ */
+
+struct zidx_async_build_s
+{
+    /* Index which checkpoints are published to. */
+    zidx_index *index;
+
+    /* Index used by worker for decoding the stream. */
+    zidx_index shadow;
+
+    pthread_t thread;
+    pthread_mutex_t stream_lock;
+    pthread_rwlock_t list_lock;
+
+    /* Guards progress, canceled, finished and ret. */
+    pthread_mutex_t state_lock;
+
+    spacing_data spacing;
+    zidx_checkpoint_offset progress;
+    char canceled;
+    char finished;
+    int ret;
+};
+
+/**
+ * Block callback used by worker of background build. Publishes checkpoints
+ * with respect to the spacing policy, and reports progress.
+ *
+ * \param context       Background build data.
+ * \param shadow        Shadow index used by worker.
+ * \param offset        Offset of the block boundary.
+ * \param is_last_block Whether this is the last block.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_CANCELED if the build is canceled.
+ */
+static int async_build_callback(void *context,
+                                zidx_index *shadow,
+                                zidx_checkpoint_offset *offset,
+                                int is_last_block)
+{
+    /* Return value for this function. */
+    int ret;
+
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Checkpoint to be published. Copied to the list when added. */
+    zidx_checkpoint *ckp = NULL;
+
+    /* Aliases. */
+    zidx_async_build *async = context;
+    zidx_index *index = async->index;
+
+    char canceled;
+
+    pthread_mutex_lock(&async->state_lock);
+    async->progress = *offset;
+    canceled = async->canceled;
+    pthread_mutex_unlock(&async->state_lock);
+
+    if (canceled) {
+        ZX_LOG("Background build is canceled.");
+        return ZX_ERR_CANCELED;
+    }
+
+    if (is_last_block && shadow->stream_type != ZX_STREAM_DEFLATE) {
+        return ZX_RET_OK;
+    }
+    if (!spacing_should_add(&async->spacing, offset)
+            && !is_member_start(shadow, offset)) {
+        return ZX_RET_OK;
+    }
+
+    ckp = index_calloc(shadow, 1, sizeof(zidx_checkpoint));
+    if (ckp == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate memory for new checkpoint.");
+        return ZX_ERR_MEMORY;
+    }
+
+    zx_ret = zidx_fill_checkpoint(shadow, ckp, offset);
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't fill new checkpoint (%d).", zx_ret);
+        ret = zx_ret;
+        goto cleanup;
+    }
+
+    pthread_rwlock_wrlock(&async->list_lock);
+    if (index->list_count > 0 && offset->uncomp
+            <= index->list[index->list_count - 1].offset.uncomp) {
+        /* Index already covers this offset. */
+        zx_ret = ZX_RET_OK;
+    } else {
+        zx_ret = zidx_add_checkpoint(index, ckp);
+        if (zx_ret == ZX_RET_OK) {
+            /* Window and block header are owned by index now. */
+            ckp->window_data  = NULL;
+            ckp->block_header = NULL;
+        }
+    }
+    pthread_rwlock_unlock(&async->list_lock);
+
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't add new checkpoint (%d).", zx_ret);
+        ret = zx_ret;
+        goto cleanup;
+    }
+
+    spacing_update(&async->spacing, offset);
+    ret = ZX_RET_OK;
+
+cleanup:
+    index_free(shadow, ckp->window_data);
+    index_free(shadow, ckp->block_header);
+    index_free(shadow, ckp);
+    return ret;
+}
+
+static void* async_build_worker(void *arg)
+{
+    zidx_async_build *async = arg;
+    int zx_ret;
+
+    zx_ret = zidx_build_index_ex(&async->shadow, async_build_callback, async);
+
+    pthread_mutex_lock(&async->state_lock);
+    async->ret      = zx_ret;
+    async->finished = 1;
+    pthread_mutex_unlock(&async->state_lock);
+
+    return NULL;
+}
+
+int zidx_build_index_async(zidx_index* index,
+                           off_t spacing_length,
+                           char is_uncompressed)
+{
+    /* Return value for this function. */
+    int ret;
+
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Current position of index in compressed stream. */
+    off_t comp_stream_pos;
+
+    zidx_async_build *async;
+
+    /* Flags for releasing resources in case of a failure. */
+    int shadow_initialized = 0;
+    int stream_lock_initialized = 0;
+    int list_lock_initialized = 0;
+    int state_lock_initialized = 0;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (index->async != NULL) {
+        ZX_LOG("ERROR: Index is already being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+    if (index->readahead != NULL) {
+        ZX_LOG("ERROR: Readahead is enabled.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    /* Position of index in the stream should be restored before each read
+     * after this point. */
+    comp_stream_pos = sl_tell(index->comp_stream);
+    if (comp_stream_pos < 0) {
+        ZX_LOG("ERROR: Couldn't tell the position in stream.");
+        return ZX_ERR_STREAM_SEEK;
+    }
+
+    async = index_calloc(index, 1, sizeof(zidx_async_build));
+    if (async == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate memory for background build.");
+        return ZX_ERR_MEMORY;
+    }
+
+    async->shadow.allocator = index->allocator;
+    zx_ret = zidx_index_init_ex(&async->shadow,
+                                index->comp_stream,
+                                index->stream_type,
+                                index->checksum_option,
+                                NULL,
+                                0,
+                                index->window_size,
+                                index->comp_data_buffer_size,
+                                index->seeking_data_buffer_size);
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't initialize shadow index (%d).", zx_ret);
+        ret = zx_ret;
+        goto cleanup;
+    }
+    async->shadow.backend                  = index->backend;
+    async->shadow.intra_block_step         = index->intra_block_step;
+    async->shadow.window_compression       = index->window_compression;
+    async->shadow.window_compression_level = index->window_compression_level;
+    shadow_initialized = 1;
+
+    if (pthread_mutex_init(&async->stream_lock, NULL) != 0) {
+        ret = ZX_ERR_MEMORY;
+        goto cleanup;
+    }
+    stream_lock_initialized = 1;
+    if (pthread_rwlock_init(&async->list_lock, NULL) != 0) {
+        ret = ZX_ERR_MEMORY;
+        goto cleanup;
+    }
+    list_lock_initialized = 1;
+    if (pthread_mutex_init(&async->state_lock, NULL) != 0) {
+        ret = ZX_ERR_MEMORY;
+        goto cleanup;
+    }
+    state_lock_initialized = 1;
+
+    async->index              = index;
+    async->shadow.stream_lock = &async->stream_lock;
+    spacing_init(&async->spacing, index, spacing_length, is_uncompressed);
+
+    index->async           = async;
+    index->stream_lock     = &async->stream_lock;
+    index->list_lock       = &async->list_lock;
+    index->comp_stream_pos = comp_stream_pos;
+
+    if (pthread_create(&async->thread, NULL, async_build_worker, async) != 0) {
+        ZX_LOG("ERROR: Couldn't create background build thread.");
+        index->async       = NULL;
+        index->stream_lock = NULL;
+        index->list_lock   = NULL;
+        ret = ZX_ERR_MEMORY;
+        goto cleanup;
+    }
+
+    ZX_LOG("Started building index in background.");
+    return ZX_RET_OK;
+
+cleanup:
+    if (state_lock_initialized) pthread_mutex_destroy(&async->state_lock);
+    if (list_lock_initialized) pthread_rwlock_destroy(&async->list_lock);
+    if (stream_lock_initialized) pthread_mutex_destroy(&async->stream_lock);
+    if (shadow_initialized) zidx_index_destroy(&async->shadow);
+    index_free(index, async);
+    return ret;
+}
+
+int zidx_build_index_async_progress(zidx_index* index,
+                                    off_t *comp_offset,
+                                    off_t *uncomp_offset)
+{
+    /* Return value for this function. */
+    int ret;
+
+    zidx_async_build *async;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (index->async == NULL) {
+        ZX_LOG("ERROR: Index is not being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    async = index->async;
+
+    pthread_mutex_lock(&async->state_lock);
+    if (comp_offset != NULL) *comp_offset = async->progress.comp;
+    if (uncomp_offset != NULL) *uncomp_offset = async->progress.uncomp;
+    if (!async->finished) {
+        ret = 1;
+    } else {
+        ret = async->ret;
+    }
+    pthread_mutex_unlock(&async->state_lock);
+
+    return ret;
+}
+
+int zidx_build_index_async_wait(zidx_index* index)
+{
+    /* Return value for this function. */
+    int ret;
+
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    zidx_async_build *async;
+    int i;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (index->async == NULL) {
+        ZX_LOG("ERROR: Index is not being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    async = index->async;
+
+    pthread_join(async->thread, NULL);
+    ret = async->ret;
+
+    ZX_LOG("Background build is finished (%d).", ret);
+
+    /* Sizes are known if worker has reached the end of stream. */
+    if (ret == ZX_RET_OK && index->compressed_size < 0) {
+        index->compressed_size   = async->shadow.compressed_size;
+        index->uncompressed_size = async->shadow.uncompressed_size;
+    }
+
+    /* Take over members found by worker. */
+    for (i = 0; i < async->shadow.members_count; i++) {
+        zx_ret = add_member(index, async->shadow.members[i].comp,
+                            async->shadow.members[i].uncomp);
+        if (zx_ret != ZX_RET_OK) {
+            ZX_LOG("ERROR: Couldn't copy member list (%d).", zx_ret);
+            if (ret == ZX_RET_OK) ret = zx_ret;
+            break;
+        }
+    }
+
+    index->async       = NULL;
+    index->stream_lock = NULL;
+    index->list_lock   = NULL;
+
+    /* Worker moved the position in stream. */
+    zx_ret = seek_comp_stream(index, index->comp_stream_pos);
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't restore position in stream (%d).", zx_ret);
+        if (ret == ZX_RET_OK) ret = zx_ret;
+    }
+
+    zx_ret = zidx_index_destroy(&async->shadow);
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't destroy shadow index (%d).", zx_ret);
+        if (ret == ZX_RET_OK) ret = zx_ret;
+    }
+    pthread_mutex_destroy(&async->state_lock);
+    pthread_rwlock_destroy(&async->list_lock);
+    pthread_mutex_destroy(&async->stream_lock);
+    index_free(index, async);
+
+    return ret;
+}
+
+int zidx_build_index_async_cancel(zidx_index* index)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (index->async == NULL) {
+        ZX_LOG("ERROR: Index is not being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    pthread_mutex_lock(&index->async->state_lock);
+    index->async->canceled = 1;
+    pthread_mutex_unlock(&index->async->state_lock);
+
+    zx_ret = zidx_build_index_async_wait(index);
+    if (zx_ret == ZX_ERR_CANCELED) {
+        zx_ret = ZX_RET_OK;
+    }
+    return zx_ret;
+}
+
+/*
+ * Cursors.
+ *
+ * A cursor reads from an index with its own decoder, buffers and compressed
+ * stream. It decodes using a view, which is an index borrowing the checkpoint
+ * list of the original index without modifying it, so cursors can be used from
+ * different threads without locking. Index shouldn't be modified while it has
+ * cursors.
+ */
+
+struct zidx_cursor_s
+{
+    /* Index whose checkpoints are used. */
+    zidx_index *index;
+
+    /* Index used by cursor for decoding the stream. */
+    zidx_index view;
+};
+
+/** Guards count of cursors of indexes, since cursors can be created from
+ * different threads. */
+static pthread_mutex_t cursors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Check whether index has live cursors or a pool for positional reads, which
+ * share its windows.
+ *
+ * \param index Index data.
+ *
+ * \return 1 if windows of index are shared, 0 otherwise.
+ */
+static int is_index_shared(zidx_index *index)
+{
+    int is_shared;
+
+    pthread_mutex_lock(&cursors_lock);
+    is_shared = index->cursors_count > 0 || index->pread_pool != NULL;
+    pthread_mutex_unlock(&cursors_lock);
+
+    return is_shared;
+}
+
+/**
+ * Load windows of index which are not in memory, so views sharing its
+ * checkpoint list don't need to. Index is not modified if they are loaded
+ * already, so cursors of such index can be created from different threads.
+ *
+ * \param index Index data.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_INVALID_OP if windows may be evicted later.
+ *         Otherwise, error returned by ensure_window().
+ */
+static int load_shared_windows(zidx_index *index)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    int i;
+
+    if (index->window_budget > 0) {
+        ZX_LOG("ERROR: Windows of index may be evicted while it's shared.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    for (i = 0; i < index->list_count; i++) {
+        if (!index->list[i].is_window_lazy
+                && !index->list[i].is_window_evicted) {
+            continue;
+        }
+        zx_ret = ensure_window(index, i);
+        if (zx_ret != ZX_RET_OK) {
+            ZX_LOG("ERROR: Couldn't load window of checkpoint %d (%d).", i,
+                   zx_ret);
+            return zx_ret;
+        }
+    }
+    return ZX_RET_OK;
+}
+
+zidx_cursor* zidx_cursor_create(zidx_index* index, streamlike_t* comp_stream)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    zidx_cursor *cursor;
+    int i;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return NULL;
+    }
+    if (comp_stream == NULL) {
+        ZX_LOG("ERROR: comp_stream is NULL.");
+        return NULL;
+    }
+    if (index->async != NULL) {
+        ZX_LOG("ERROR: Index is being built in background.");
+        return NULL;
+    }
+    if (load_shared_windows(index) != ZX_RET_OK) {
+        return NULL;
+    }
+
+    cursor = index_calloc(index, 1, sizeof(zidx_cursor));
+    if (cursor == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate memory for cursor.");
+        return NULL;
+    }
+
+    cursor->view.allocator = index->allocator;
+    zx_ret = zidx_index_init_ex(&cursor->view,
+                                comp_stream,
+                                index->stream_type,
+                                index->checksum_option,
+                                NULL,
+                                0,
+                                index->window_size,
+                                index->comp_data_buffer_size,
+                                index->seeking_data_buffer_size);
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't initialize view of cursor (%d).", zx_ret);
+        index_free(index, cursor);
+        return NULL;
+    }
+    cursor->index = index;
+    cursor->view.is_bgzf           = index->is_bgzf;
+    cursor->view.backend           = index->backend;
+    cursor->view.compressed_size   = index->compressed_size;
+    cursor->view.uncompressed_size = index->uncompressed_size;
+
+    /* Members are copied, since view adds members it comes across. */
+    for (i = 0; i < index->members_count; i++) {
+        zx_ret = add_member(&cursor->view, index->members[i].comp,
+                            index->members[i].uncomp);
+        if (zx_ret != ZX_RET_OK) {
+            zidx_index_destroy(&cursor->view);
+            index_free(index, cursor);
+            return NULL;
+        }
+    }
+
+    cursor->view.list           = index->list;
+    cursor->view.list_count     = index->list_count;
+    cursor->view.list_capacity  = index->list_count;
+    cursor->view.is_list_shared = 1;
+
+    /* Lookup keys are borrowed along with list. */
+    cursor->view.lookup = index->lookup;
+
+    pthread_mutex_lock(&cursors_lock);
+    index->cursors_count++;
+    pthread_mutex_unlock(&cursors_lock);
+
+    return cursor;
+}
+
+int zidx_cursor_destroy(zidx_cursor* cursor)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Sanity checks. */
+    if (cursor == NULL) {
+        ZX_LOG("ERROR: cursor is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+
+    /* Borrowed list and lookup keys are detached, so they are not released
+     * with view. */
+    cursor->view.list          = NULL;
+    cursor->view.list_count    = 0;
+    cursor->view.list_capacity = 0;
+    memset(&cursor->view.lookup, 0, sizeof(cursor->view.lookup));
+
+    zx_ret = zidx_index_destroy(&cursor->view);
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't destroy view of cursor (%d).", zx_ret);
+        return zx_ret;
+    }
+
+    pthread_mutex_lock(&cursors_lock);
+    cursor->index->cursors_count--;
+    pthread_mutex_unlock(&cursors_lock);
+    index_free(cursor->index, cursor);
+
+    return ZX_RET_OK;
+}
+
+int zidx_cursor_read(zidx_cursor* cursor, void *buffer, int nbytes)
+{
+    if (cursor == NULL) {
+        ZX_LOG("ERROR: cursor is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    return zidx_read(&cursor->view, buffer, nbytes);
+}
+
+int zidx_cursor_seek(zidx_cursor* cursor, off_t offset)
+{
+    if (cursor == NULL) {
+        ZX_LOG("ERROR: cursor is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    return zidx_seek(&cursor->view, offset);
+}
+
+off_t zidx_cursor_tell(zidx_cursor* cursor)
+{
+    if (cursor == NULL) {
+        ZX_LOG("ERROR: cursor is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    return zidx_tell(&cursor->view);
+}
+
+int zidx_cursor_eof(zidx_cursor* cursor)
+{
+    if (cursor == NULL) {
+        ZX_LOG("ERROR: cursor is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    return zidx_eof(&cursor->view);
+}
+
+/*
+ * Positional reads.
+ *
+ * zidx_pread() reads using cursors kept in a pool of index, so it can be
+ * called from different threads. Cursors share the compressed stream of
+ * index, which is locked while reading from it, and each of them keeps its own
+ * position in the stream, same as in background build. Idle cursor closest
+ * before the offset is used, so decoding continues from there if possible.
+ */
+
+/** Maximum number of idle cursors kept in pool. */
+#define ZX_PREAD_POOL_SIZE_ (8)
+
+struct zidx_pread_pool_s
+{
+    /* Guards idle cursors, and list and list_count. */
+    pthread_mutex_t lock;
+
+    /* Guards compressed stream shared by index and cursors. */
+    pthread_mutex_t stream_lock;
+
+    zidx_cursor *idle[ZX_PREAD_POOL_SIZE_];
+    int idle_count;
+
+    /* Checkpoint list when windows are loaded last time. */
+    zidx_checkpoint *list;
+    int list_count;
+};
+
+/** Guards creation of pools. */
+static pthread_mutex_t pread_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Release cursors of positional reads.
+ *
+ * \param index Index data.
+ */
+static void release_pread_pool(zidx_index *index)
+{
+    zidx_pread_pool *pool = index->pread_pool;
+    int i;
+
+    if (pool == NULL) {
+        return;
+    }
+    for (i = 0; i < pool->idle_count; i++) {
+        zidx_cursor_destroy(pool->idle[i]);
+    }
+    if (index->stream_lock == &pool->stream_lock) {
+        index->stream_lock = NULL;
+    }
+    pthread_mutex_destroy(&pool->stream_lock);
+    pthread_mutex_destroy(&pool->lock);
+    index_free(index, pool);
+    index->pread_pool = NULL;
+}
+
+/**
+ * Get pool of cursors for positional reads, creating it if needed.
+ *
+ * \param index Index data.
+ *
+ * \return Pool of index, or NULL if it couldn't be created.
+ */
+static zidx_pread_pool* get_pread_pool(zidx_index *index)
+{
+    zidx_pread_pool *pool;
+
+    pthread_mutex_lock(&pread_pool_lock);
+    pool = index->pread_pool;
+    if (pool == NULL) {
+        pool = index_calloc(index, 1, sizeof(zidx_pread_pool));
+        if (pool == NULL) {
+            ZX_LOG("ERROR: Couldn't allocate memory for cursor pool.");
+        } else if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+            index_free(index, pool);
+            pool = NULL;
+        } else if (pthread_mutex_init(&pool->stream_lock, NULL) != 0) {
+            pthread_mutex_destroy(&pool->lock);
+            index_free(index, pool);
+            pool = NULL;
+        }
+        index->pread_pool = pool;
+    }
+    pthread_mutex_unlock(&pread_pool_lock);
+
+    return pool;
+}
+
+/**
+ * Take a cursor from pool for reading at an offset. Idle cursor positioned
+ * closest before offset is preferred. A new cursor is created if there is no
+ * idle cursor.
+ *
+ * \param index  Index data.
+ * \param pool   Pool of index.
+ * \param offset Uncompressed offset to read at.
+ * \param cursor Pointer to cursor to be returned.
+ *
+ * \return ZX_RET_OK if successful, or negative error code.
+ */
+static int acquire_pread_cursor(zidx_index *index,
+                                zidx_pread_pool *pool,
+                                off_t offset,
+                                zidx_cursor **cursor)
+{
+    /* Return value for this function. */
+    int ret;
+
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    zidx_cursor *found;
+    zidx_index *view;
+    int found_idx;
+    int i;
+
+    ret = ZX_RET_OK;
+    pthread_mutex_lock(&pool->lock);
+
+    /* Stream of index is shared with cursors from now on. Background build
+     * unsets the lock when it's finished. */
+    if (index->stream_lock == NULL) {
+        index->comp_stream_pos = sl_tell(index->comp_stream);
+        index->stream_lock     = &pool->stream_lock;
+    }
+
+    /* Windows added since the last read are loaded. */
+    if (pool->list != index->list || pool->list_count != index->list_count) {
+        zx_ret = load_shared_windows(index);
+        if (zx_ret != ZX_RET_OK) {
+            ret = zx_ret;
+            goto end;
+        }
+        pool->list       = index->list;
+        pool->list_count = index->list_count;
+    }
+
+    found_idx = -1;
+    for (i = 0; i < pool->idle_count; i++) {
+        view = &pool->idle[i]->view;
+        if (view->stream_state != ZX_STATE_INVALID
+                && view->offset.uncomp <= offset
+                && (found_idx < 0 || view->offset.uncomp
+                        > pool->idle[found_idx]->view.offset.uncomp)) {
+            found_idx = i;
+        }
+    }
+    if (found_idx < 0 && pool->idle_count > 0) {
+        found_idx = pool->idle_count - 1;
+    }
+
+    if (found_idx >= 0) {
+        found = pool->idle[found_idx];
+        pool->idle[found_idx] = pool->idle[--pool->idle_count];
+    } else {
+        found = zidx_cursor_create(index, index->comp_stream);
+        if (found == NULL) {
+            ZX_LOG("ERROR: Couldn't create cursor for reading.");
+            ret = ZX_ERR_MEMORY;
+            goto end;
+        }
+        found->view.stream_lock = &pool->stream_lock;
+    }
+
+    /* Checkpoint list and its lookup keys may be reallocated since cursor is
+     * used. */
+    found->view.list              = index->list;
+    found->view.list_count        = index->list_count;
+    found->view.list_capacity     = index->list_count;
+    found->view.lookup            = index->lookup;
+    found->view.compressed_size   = index->compressed_size;
+    found->view.uncompressed_size = index->uncompressed_size;
+    *cursor = found;
+
+end:
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+/**
+ * Return a cursor to pool. Cursor is destroyed if pool is full.
+ *
+ * \param pool   Pool of index.
+ * \param cursor Cursor taken from pool.
+ */
+static void release_pread_cursor(zidx_pread_pool *pool, zidx_cursor *cursor)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->idle_count < ZX_PREAD_POOL_SIZE_) {
+        pool->idle[pool->idle_count++] = cursor;
+        cursor = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (cursor != NULL) {
+        zidx_cursor_destroy(cursor);
+    }
+}
+
+int zidx_pread(zidx_index* index, void *buffer, int nbytes, off_t offset)
+{
+    /* Return value for this function. */
+    int ret;
+
+    /* Used for storing number of bytes read. */
+    int r_len;
+
+    zidx_pread_pool *pool;
+    zidx_cursor *cursor;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (buffer == NULL) {
+        ZX_LOG("ERROR: buffer is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (nbytes < 0 || offset < 0) {
+        ZX_LOG("ERROR: nbytes (%d) or offset (%jd) is negative.", nbytes,
+               (intmax_t)offset);
+        return ZX_ERR_PARAMS;
+    }
+    if (index->async != NULL) {
+        ZX_LOG("ERROR: Index is being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    pool = get_pread_pool(index);
+    if (pool == NULL) {
+        return ZX_ERR_MEMORY;
+    }
+    ret = acquire_pread_cursor(index, pool, offset, &cursor);
+    if (ret != ZX_RET_OK) {
+        return ret;
+    }
+
+    ret = zidx_cursor_seek(cursor, offset);
+    if (ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't seek to %jd (%d).", (intmax_t)offset, ret);
+        goto end;
+    }
+    for (ret = 0; ret < nbytes; ret += r_len) {
+        r_len = zidx_cursor_read(cursor, (uint8_t*)buffer + ret,
+                                 nbytes - ret);
+        if (r_len < 0) {
+            ret = r_len;
+            goto end;
+        }
+        if (r_len == 0) {
+            break;
+        }
+    }
+
+end:
+    release_pread_cursor(pool, cursor);
+    return ret;
+}
+
+/**
+ * Ranges of a batch read by one cursor, in increasing order of offsets.
+ */
+typedef struct batch_part_s
+{
+    zidx_index *index;
+    zidx_read_request **requests;
+    int count;
+} batch_part;
+
+/**
+ * Compare read requests by offset. Longer one comes first if they start at
+ * the same offset, so the others are copied from it.
+ */
+static int compare_read_requests(const void *a, const void *b)
+{
+    const zidx_read_request *r1 = *(zidx_read_request* const*)a;
+    const zidx_read_request *r2 = *(zidx_read_request* const*)b;
+
+    if (r1->offset != r2->offset) {
+        return r1->offset < r2->offset ? -1 : 1;
+    }
+    return r2->length - r1->length;
+}
+
+/**
+ * Read ranges of a batch with a cursor from pool. Since ranges are sorted,
+ * cursor only moves forward, and decodes each checkpoint interval once.
+ * Overlapping parts of ranges are copied from the range read before.
+ *
+ * \param arg Part of batch.
+ *
+ * \return NULL.
+ */
+static void* read_batch_part(void *arg)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Used for storing number of bytes read. */
+    int r_len;
+
+    batch_part *part = arg;
+    zidx_read_request *req;
+    zidx_read_request *covering;
+    zidx_cursor *cursor;
+    off_t covering_end;
+    int done;
+    int i;
+
+    zx_ret = acquire_pread_cursor(part->index, part->index->pread_pool,
+                                  part->requests[0]->offset, &cursor);
+    if (zx_ret != ZX_RET_OK) {
+        for (i = 0; i < part->count; i++) {
+            part->requests[i]->result = zx_ret;
+        }
+        return NULL;
+    }
+
+    covering = NULL;
+    covering_end = -1;
+    for (i = 0; i < part->count; i++) {
+        req = part->requests[i];
+
+        /* Copy the part read already. */
+        done = 0;
+        if (req->offset < covering_end) {
+            done = covering_end - req->offset < req->length
+                   ? covering_end - req->offset : req->length;
+            memcpy(req->buffer, (uint8_t*)covering->buffer
+                                    + (req->offset - covering->offset),
+                   done);
+        }
+
+        if (done < req->length) {
+            zx_ret = zidx_cursor_seek(cursor, req->offset + done);
+            if (zx_ret != ZX_RET_OK) {
+                ZX_LOG("ERROR: Couldn't seek to %jd (%d).",
+                       (intmax_t)(req->offset + done), zx_ret);
+                req->result = zx_ret;
+                continue;
+            }
+        }
+        while (done < req->length) {
+            r_len = zidx_cursor_read(cursor, (uint8_t*)req->buffer + done,
+                                     req->length - done);
+            if (r_len <= 0) {
+                break;
+            }
+            done += r_len;
+        }
+        if (done < req->length && r_len < 0) {
+            req->result = r_len;
+            continue;
+        }
+        req->result = done;
+
+        if (req->offset + done > covering_end) {
+            covering     = req;
+            covering_end = req->offset + done;
+        }
+    }
+
+    release_pread_cursor(part->index->pread_pool, cursor);
+    return NULL;
+}
+
+int zidx_read_batch(zidx_index* index,
+                    zidx_read_request *requests,
+                    int count,
+                    int num_threads)
+{
+    /* Return value for this function. */
+    int ret;
+
+    zidx_read_request **sorted;
+    batch_part *parts;
+    pthread_t *threads;
+    char *created;
+    int num_parts;
+    int valid_count;
+    int part_size;
+    int start;
+    int i;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (requests == NULL || count < 0) {
+        ZX_LOG("ERROR: requests is NULL or count (%d) is negative.", count);
+        return ZX_ERR_PARAMS;
+    }
+    if (index->async != NULL) {
+        ZX_LOG("ERROR: Index is being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+    if (get_pread_pool(index) == NULL) {
+        return ZX_ERR_MEMORY;
+    }
+
+    sorted = index_malloc(index, sizeof(zidx_read_request*)
+                                     * (count > 0 ? count : 1));
+    if (sorted == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate memory for sorting requests.");
+        return ZX_ERR_MEMORY;
+    }
+
+    /* Invalid requests are marked, and others are sorted by offset. */
+    valid_count = 0;
+    for (i = 0; i < count; i++) {
+        if (requests[i].offset < 0 || requests[i].length < 0
+                || (requests[i].buffer == NULL && requests[i].length > 0)) {
+            ZX_LOG("ERROR: Request %d is not valid.", i);
+            requests[i].result = ZX_ERR_PARAMS;
+        } else {
+            sorted[valid_count++] = &requests[i];
+        }
+    }
+    qsort(sorted, valid_count, sizeof(zidx_read_request*),
+          compare_read_requests);
+
+    if (num_threads <= 0) {
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (num_threads > valid_count) {
+        num_threads = valid_count;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+
+    parts = index_calloc(index, num_threads, sizeof(batch_part));
+    if (parts == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate memory for batch parts.");
+        index_free(index, sorted);
+        return ZX_ERR_MEMORY;
+    }
+
+    /* Split sorted requests into parts of about the same size, so that ranges
+     * in the same checkpoint interval are read by the same cursor. */
+    part_size = (valid_count + num_threads - 1) / num_threads;
+    num_parts = 0;
+    for (start = 0; start < valid_count; start = i) {
+        i = start + part_size < valid_count ? start + part_size : valid_count;
+        while (i < valid_count
+                && zidx_get_checkpoint_idx(index, sorted[i]->offset)
+                       == zidx_get_checkpoint_idx(index,
+                                                  sorted[i - 1]->offset)) {
+            i++;
+        }
+        parts[num_parts].index    = index;
+        parts[num_parts].requests = sorted + start;
+        parts[num_parts].count    = i - start;
+        num_parts++;
+    }
+    ZX_LOG("Reading %d ranges in %d parts.", valid_count, num_parts);
+
+    /* First part is read on the calling thread. If a thread can't be created,
+     * its part is read on the calling thread as well. */
+    threads = index_malloc(index, sizeof(pthread_t) * num_threads);
+    created = index_calloc(index, num_threads, 1);
+    for (i = 1; i < num_parts; i++) {
+        if (threads != NULL && created != NULL
+                && pthread_create(&threads[i], NULL, read_batch_part,
+                                  &parts[i]) == 0) {
+            created[i] = 1;
+        } else {
+            ZX_LOG("WARNING: Couldn't create thread, running on caller.");
+            read_batch_part(&parts[i]);
+        }
+    }
+    if (num_parts > 0) {
+        read_batch_part(&parts[0]);
+    }
+    for (i = 1; i < num_parts; i++) {
+        if (created != NULL && created[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    index_free(index, threads);
+    index_free(index, created);
+    index_free(index, parts);
+    index_free(index, sorted);
+
+    /* Return the first error, if there is any. */
+    ret = ZX_RET_OK;
+    for (i = 0; i < count && ret == ZX_RET_OK; i++) {
+        if (requests[i].result < 0) {
+            ret = requests[i].result;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Readahead.
+ *
+ * A worker thread decodes ahead of reading position of index into a ring
+ * buffer, using a cursor from the pool of zidx_pread(). zidx_read() copies
+ * from the buffer, and reading position is kept separately from the decoder
+ * of index, same as in reading from cache. Buffer is refilled from the new
+ * position if reading position is moved outside of it.
+ *
+ * Worker keeps the checkpoint list it started with, so calls changing the list
+ * are rejected while readahead is enabled. It should be disabled to update the
+ * index of a growing file, and enabled again afterwards.
+ */
+
+/** Maximum number of bytes decoded at once by readahead worker. */
+#define ZX_READAHEAD_STEP_ (65536)
+
+struct zidx_readahead_s
+{
+    zidx_index *index;
+    pthread_t thread;
+
+    /* Guards the rest of members. */
+    pthread_mutex_t lock;
+
+    /* Signaled when data is added, or end of file or an error is reached. */
+    pthread_cond_t filled_cond;
+
+    /* Signaled when space is freed, or worker should restart or stop. */
+    pthread_cond_t space_cond;
+
+    uint8_t *buffer;
+    size_t capacity;
+    size_t head;
+    size_t filled;
+
+    /* Uncompressed offset of data at head. */
+    off_t start;
+
+    char is_eof;
+    int error;
+    char restart;
+    char stop;
+
+    /* Incremented on restart, so data decoded before it is dropped. */
+    unsigned long generation;
+};
+
+/**
+ * Drop buffered data and make readahead worker continue from an offset. Lock
+ * of readahead should be held.
+ *
+ * \param ra     Readahead data.
+ * \param offset Uncompressed offset.
+ */
+static void restart_readahead(zidx_readahead *ra, off_t offset)
+{
+    ZX_LOG("Restarting readahead at %jd.", (intmax_t)offset);
+    ra->start   = offset;
+    ra->head    = 0;
+    ra->filled  = 0;
+    ra->is_eof  = 0;
+    ra->error   = ZX_RET_OK;
+    ra->restart = 1;
+    ra->generation++;
+    pthread_cond_signal(&ra->space_cond);
+}
+
+/**
+ * Decode into readahead buffer until stopped.
+ *
+ * \param arg Readahead data.
+ *
+ * \return NULL.
+ */
+static void* readahead_worker(void *arg)
+{
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
+    /* Used for storing number of bytes decoded. */
+    int r_len;
+
+    zidx_readahead *ra = arg;
+    zidx_index *index = ra->index;
+    zidx_cursor *cursor;
+    unsigned long generation;
+    off_t offset;
+    size_t tail;
+    size_t length;
+
+    cursor = NULL;
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->stop) {
+        if (ra->restart) {
+            ra->restart = 0;
+            generation  = ra->generation;
+            offset      = ra->start;
+            pthread_mutex_unlock(&ra->lock);
+
+            zx_ret = ZX_RET_OK;
+            if (cursor == NULL) {
+                zx_ret = acquire_pread_cursor(index, index->pread_pool,
+                                              offset, &cursor);
+                if (zx_ret != ZX_RET_OK) {
+                    cursor = NULL;
+                }
+            }
+            if (zx_ret == ZX_RET_OK) {
+                zx_ret = zidx_cursor_seek(cursor, offset);
+            }
+
+            pthread_mutex_lock(&ra->lock);
+            if (generation == ra->generation && zx_ret != ZX_RET_OK) {
+                ra->error = zx_ret;
+                pthread_cond_signal(&ra->filled_cond);
+            }
+            continue;
+        }
+        if (ra->is_eof || ra->error != ZX_RET_OK
+                || ra->filled == ra->capacity) {
+            pthread_cond_wait(&ra->space_cond, &ra->lock);
+            continue;
+        }
+
+        /* Consumer only frees space, so tail doesn't move until it's filled
+         * here. */
+        tail   = (ra->head + ra->filled) % ra->capacity;
+        length = ra->capacity - ra->filled;
+        if (length > ra->capacity - tail) {
+            length = ra->capacity - tail;
+        }
+        if (length > ZX_READAHEAD_STEP_) {
+            length = ZX_READAHEAD_STEP_;
+        }
+        generation = ra->generation;
+        pthread_mutex_unlock(&ra->lock);
+
+        r_len = zidx_cursor_read(cursor, ra->buffer + tail, length);
+
+        pthread_mutex_lock(&ra->lock);
+        if (generation != ra->generation) {
+            continue;
+        }
+        if (r_len < 0) {
+            ra->error = r_len;
+        } else if (r_len == 0) {
+            ra->is_eof = 1;
+        } else {
+            ra->filled += r_len;
+        }
+        pthread_cond_signal(&ra->filled_cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    if (cursor != NULL) {
+        release_pread_cursor(index->pread_pool, cursor);
+    }
+    return NULL;
+}
+
+/**
+ * Read decoded data from readahead buffer, waiting for worker if it's empty.
+ *
+ * \param index  Index data.
+ * \param buffer Buffer to read to.
+ * \param nbytes Number of bytes to read.
+ *
+ * \return Number of bytes read, or negative error code.
+ */
+static int read_ahead(zidx_index *index, void *buffer, int nbytes)
+{
+    /* Return value for this function. */
+    int ret;
+
+    zidx_readahead *ra = index->readahead;
+    off_t offset;
+    size_t length;
+    size_t first;
+    int total;
+
+    ret = ZX_RET_OK;
+    offset = zidx_tell(index);
+
+    pthread_mutex_lock(&ra->lock);
+    if (offset != ra->start) {
+        restart_readahead(ra, offset);
+    }
+    for (total = 0; total < nbytes; total += length) {
+        while (ra->filled == 0 && !ra->is_eof && ra->error == ZX_RET_OK) {
+            pthread_cond_wait(&ra->filled_cond, &ra->lock);
+        }
+        if (ra->filled == 0) {
+            if (ra->error != ZX_RET_OK && total == 0) {
+                ret = ra->error;
+            }
+            break;
+        }
+
+        /* Worker doesn't write to filled part, so it's copied unlocked. */
+        length = nbytes - total;
+        if (length > ra->filled) {
+            length = ra->filled;
+        }
+        first  = length < ra->capacity - ra->head
+                 ? length : ra->capacity - ra->head;
+        pthread_mutex_unlock(&ra->lock);
+        memcpy((uint8_t*)buffer + total, ra->buffer + ra->head, first);
+        memcpy((uint8_t*)buffer + total + first, ra->buffer, length - first);
+        pthread_mutex_lock(&ra->lock);
+
+        ra->head    = (ra->head + length) % ra->capacity;
+        ra->filled -= length;
+        ra->start  += length;
+        pthread_cond_signal(&ra->space_cond);
+    }
+    index->cache_offset = ra->start;
+    index->is_cache_eof = ra->is_eof && ra->filled == 0;
+    pthread_mutex_unlock(&ra->lock);
+
+    return ret != ZX_RET_OK ? ret : total;
+}
+
+/**
+ * Seek using readahead buffer. Buffered data before offset is skipped if
+ * offset is in buffer. Otherwise buffer is refilled from offset.
+ *
+ * \param index  Index data.
+ * \param offset Uncompressed offset.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_STREAM_EOF if offset is known to be beyond the end of file.
+ */
+static int seek_in_readahead(zidx_index *index, off_t offset)
+{
+    zidx_readahead *ra = index->readahead;
+    size_t skipped;
+
+    if (index->uncompressed_size >= 0 && offset > index->uncompressed_size) {
+        ZX_LOG("ERROR: Offset (%jd) is beyond the end of file.",
+               (intmax_t)offset);
+        return ZX_ERR_STREAM_EOF;
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    if (offset >= ra->start && offset <= ra->start + (off_t)ra->filled) {
+        skipped     = offset - ra->start;
+        ra->head    = (ra->head + skipped) % ra->capacity;
+        ra->filled -= skipped;
+        ra->start   = offset;
+        pthread_cond_signal(&ra->space_cond);
+    } else {
+        restart_readahead(ra, offset);
+    }
+    index->cache_offset = offset;
+    index->is_cache_eof = ra->is_eof && ra->filled == 0;
+    pthread_mutex_unlock(&ra->lock);
+
+    return ZX_RET_OK;
+}
+
+/**
+ * Stop readahead worker and release its buffer. Reading position is kept.
+ *
+ * \param index Index data.
+ */
+static void stop_readahead(zidx_index *index)
+{
+    zidx_readahead *ra = index->readahead;
+
+    if (ra == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    pthread_cond_signal(&ra->space_cond);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->thread, NULL);
+
+    pthread_cond_destroy(&ra->space_cond);
+    pthread_cond_destroy(&ra->filled_cond);
+    pthread_mutex_destroy(&ra->lock);
+    index_free(index, ra->buffer);
+    index_free(index, ra);
+    index->readahead = NULL;
+}
+
+int zidx_set_readahead(zidx_index* index, size_t buffer_size)
+{
+    /* Return value for this function. */
+    int ret;
+
+    zidx_readahead *ra;
+
+    /* Flags for releasing resources in case of a failure. */
+    int lock_initialized = 0;
+    int filled_cond_initialized = 0;
+    int space_cond_initialized = 0;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (index->async != NULL) {
+        ZX_LOG("ERROR: Index is being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    stop_readahead(index);
+    if (buffer_size == 0) {
+        return ZX_RET_OK;
+    }
+
+    if (get_pread_pool(index) == NULL) {
+        return ZX_ERR_MEMORY;
+    }
+
+    ra = index_calloc(index, 1, sizeof(zidx_readahead));
+    if (ra == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate memory for readahead.");
+        return ZX_ERR_MEMORY;
+    }
+    ra->buffer = index_malloc(index, buffer_size);
+    if (ra->buffer == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate memory for readahead buffer.");
+        ret = ZX_ERR_MEMORY;
+        goto cleanup;
+    }
+
+    if (pthread_mutex_init(&ra->lock, NULL) != 0) {
+        ret = ZX_ERR_MEMORY;
+        goto cleanup;
+    }
+    lock_initialized = 1;
+    if (pthread_cond_init(&ra->filled_cond, NULL) != 0) {
+        ret = ZX_ERR_MEMORY;
+        goto cleanup;
+    }
+    filled_cond_initialized = 1;
+    if (pthread_cond_init(&ra->space_cond, NULL) != 0) {
+        ret = ZX_ERR_MEMORY;
+        goto cleanup;
+    }
+    space_cond_initialized = 1;
+
+    /* Worker starts decoding from reading position. */
+    ra->index    = index;
+    ra->capacity = buffer_size;
+    ra->start    = zidx_tell(index);
+    ra->restart  = 1;
+
+    if (pthread_create(&ra->thread, NULL, readahead_worker, ra) != 0) {
+        ZX_LOG("ERROR: Couldn't create readahead thread.");
+        ret = ZX_ERR_MEMORY;
+        goto cleanup;
+    }
+
+    index->cache_offset = ra->start;
+    index->is_cache_eof = 0;
+    index->readahead    = ra;
+    return ZX_RET_OK;
+
+cleanup:
+    if (space_cond_initialized) pthread_cond_destroy(&ra->space_cond);
+    if (filled_cond_initialized) pthread_cond_destroy(&ra->filled_cond);
+    if (lock_initialized) pthread_mutex_destroy(&ra->lock);
+    index_free(index, ra->buffer);
+    index_free(index, ra);
+    return ret;
+}
+
+/*
+ * Parallel reading.
+ *
+ * zidx_read_parallel() splits a range at checkpoints, and intervals between
+ * them are decoded independently by worker threads with cursors from the pool
+ * of zidx_pread(). Each worker decodes its whole interval in pieces of
+ * ZX_PARALLEL_READ_BUFFER_ bytes into a queue of the interval, and waits while
+ * the queue is full. Pieces are passed to callback in order on the calling
+ * thread, which decodes the next interval itself if no worker has taken it
+ * yet. Workers decode at most num_threads intervals ahead of the one being
+ * passed, so memory usage is bounded by that many queues.
+ */
+
+/** Maximum number of bytes of an interval passed to callback at once. */
+#define ZX_PARALLEL_READ_BUFFER_ (1 << 20)
+
+/** Number of decoded pieces queued for an interval. */
+#define ZX_PARALLEL_READ_QUEUE_ (2)
+
+/**
+ * Interval decoded by a worker.
+ */
+typedef struct parallel_scan_unit_s
+{
+    off_t start;
+
+    /* End of interval, or -1 if it ends at the end of file. */
+    off_t end;
+
+    /* Offset of the next piece to be passed to callback. */
+    off_t offset;
+
+    /* Ring of decoded pieces. Buffers are allocated on first use and reused
+     * after their pieces are passed. */
+    uint8_t *pieces[ZX_PARALLEL_READ_QUEUE_];
+    size_t lengths[ZX_PARALLEL_READ_QUEUE_];
+    int head;
+    int count;
+
+    int ret;
+    char is_done;
+} parallel_scan_unit;
+
+typedef struct parallel_scan_s
+{
+    zidx_index *index;
+
+    /* Guards the rest of members, and queues and status of intervals. */
+    pthread_mutex_t lock;
+
+    /* Signaled when a piece is queued or passed to callback, or an interval is
+     * decoded. */
+    pthread_cond_t cond;
+
+    parallel_scan_unit *units;
+    int units_count;
+    int next_unit;
+    int delivered;
+    int max_ahead;
+    char stop;
+} parallel_scan;
+
+/**
+ * Decode an interval with a cursor from pool. Pieces are queued in interval
+ * unless a callback is given, in which case they are passed to callback as
+ * they are decoded. Lock shouldn't be held.
+ *
+ * \param pr               Parallel read data.
+ * \param unit             Interval to decode.
+ * \param callback         Callback to pass pieces to, or NULL to queue them.
+ * \param callback_context Context passed to callback.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_STREAM_EOF if file ends before interval.
+ *         ZX_ERR_MEMORY if memory couldn't be allocated.
+ *         Otherwise, error returned by cursor or callback.
+ */
+static int decode_scan_unit(parallel_scan *pr,
+                            parallel_scan_unit *unit,
+                            zidx_chunk_callback callback,
+                            void *callback_context)
+{
+    /* Return value for this function. */
+    int ret;
+
+    /* Used for storing number of bytes decoded. */
+    int r_len;
+
+    zidx_index *index = pr->index;
+    zidx_cursor *cursor;
+    size_t capacity;
+    size_t length;
+    off_t offset;
+    char is_stopped;
+    int slot;
+
+    ret = acquire_pread_cursor(index, index->pread_pool, unit->start, &cursor);
+    if (ret != ZX_RET_OK) {
+        return ret;
+    }
+    ret = zidx_cursor_seek(cursor, unit->start);
+    if (ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't seek to %jd (%d).", (intmax_t)unit->start,
+               ret);
+        goto end;
+    }
+
+    offset = unit->start;
+    do {
+        /* Wait for a free slot in queue. */
+        slot = 0;
+        if (callback == NULL) {
+            pthread_mutex_lock(&pr->lock);
+            while (!pr->stop && unit->count == ZX_PARALLEL_READ_QUEUE_) {
+                pthread_cond_wait(&pr->cond, &pr->lock);
+            }
+            slot = (unit->head + unit->count) % ZX_PARALLEL_READ_QUEUE_;
+            is_stopped = pr->stop;
+            pthread_mutex_unlock(&pr->lock);
+            if (is_stopped) {
+                goto end;
+            }
+        }
+
+        /* Short intervals don't need the whole buffer. */
+        capacity = ZX_PARALLEL_READ_BUFFER_;
+        if (unit->end >= 0 && unit->end - offset < (off_t)capacity) {
+            capacity = unit->end - offset;
+        }
+        if (unit->pieces[slot] == NULL) {
+            unit->pieces[slot] = index_malloc(index,
+                                              capacity > 0 ? capacity : 1);
+            if (unit->pieces[slot] == NULL) {
+                ZX_LOG("ERROR: Couldn't allocate memory for decoded "
+                       "interval.");
+                ret = ZX_ERR_MEMORY;
+                goto end;
+            }
+        }
+
+        for (length = 0; length < capacity; length += r_len) {
+            r_len = zidx_cursor_read(cursor, unit->pieces[slot] + length,
+                                     capacity - length);
+            if (r_len < 0) {
+                ret = r_len;
+                goto end;
+            }
+            if (r_len == 0) {
+                break;
+            }
+        }
+
+        if (length > 0 && callback != NULL) {
+            ret = callback(callback_context, index, unit->pieces[slot],
+                           length, offset);
+            if (ret != ZX_RET_OK) {
+                goto end;
+            }
+        } else if (length > 0) {
+            pthread_mutex_lock(&pr->lock);
+            unit->lengths[slot] = length;
+            unit->count++;
+            pthread_cond_broadcast(&pr->cond);
+            pthread_mutex_unlock(&pr->lock);
+        }
+        offset += length;
+
+    /* An interval ending at the end of file continues until nothing is
+     * decoded. */
+    } while (length == capacity && (unit->end < 0 || offset < unit->end));
+
+    if (unit->end >= 0 && offset < unit->end) {
+        ZX_LOG("ERROR: Unexpected end of file at %jd.", (intmax_t)offset);
+        ret = ZX_ERR_STREAM_EOF;
+    }
+
+end:
+    release_pread_cursor(index->pread_pool, cursor);
+    return ret;
+}
+
+/**
+ * Release buffers of an interval.
+ *
+ * \param index Index data.
+ * \param unit  Interval.
+ */
+static void release_scan_unit(zidx_index *index, parallel_scan_unit *unit)
+{
+    int i;
+
+    for (i = 0; i < ZX_PARALLEL_READ_QUEUE_; i++) {
+        index_free(index, unit->pieces[i]);
+        unit->pieces[i] = NULL;
+    }
+}
+
+/**
+ * Decode intervals until all of them are taken, staying within max_ahead
+ * intervals of the one being passed to callback.
+ *
+ * \param arg Parallel read data.
+ *
+ * \return NULL.
+ */
+static void* parallel_scan_worker(void *arg)
+{
+    parallel_scan *pr = arg;
+    parallel_scan_unit *unit;
+    int ret;
+
+    pthread_mutex_lock(&pr->lock);
+    while (!pr->stop && pr->next_unit < pr->units_count) {
+        if (pr->next_unit >= pr->delivered + pr->max_ahead) {
+            pthread_cond_wait(&pr->cond, &pr->lock);
+            continue;
+        }
+        unit = &pr->units[pr->next_unit++];
+        pthread_mutex_unlock(&pr->lock);
+        ret = decode_scan_unit(pr, unit, NULL, NULL);
+        pthread_mutex_lock(&pr->lock);
+        unit->ret     = ret;
+        unit->is_done = 1;
+        pthread_cond_broadcast(&pr->cond);
+    }
+    pthread_mutex_unlock(&pr->lock);
+    return NULL;
+}
+
+int zidx_read_parallel(zidx_index* index,
+                       off_t offset,
+                       off_t length,
+                       int num_threads,
+                       zidx_chunk_callback callback,
+                       void *callback_context)
+{
+    /* Return value for this function. */
+    int ret;
+
+    parallel_scan pr;
+    parallel_scan_unit *unit;
+    pthread_t *threads;
+    char *created;
+    off_t end;
+    size_t piece_length;
+    int first;
+    int idx;
+    int slot;
+    int i;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (callback == NULL) {
+        ZX_LOG("ERROR: callback is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (offset < 0) {
+        ZX_LOG("ERROR: offset (%jd) is negative.", (intmax_t)offset);
+        return ZX_ERR_PARAMS;
+    }
+    if (index->async != NULL) {
+        ZX_LOG("ERROR: Index is being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+    if (length == 0) {
+        return ZX_RET_OK;
+    }
+    if (get_pread_pool(index) == NULL) {
+        return ZX_ERR_MEMORY;
+    }
+
+    /* Split range at checkpoints. Range ends at the end of file if length is
+     * negative. */
+    end = length > 0 ? offset + length : -1;
+    if (end < 0 && index->uncompressed_size >= 0) {
+        end = index->uncompressed_size;
+    }
+    first = zidx_get_checkpoint_idx(index, offset);
+    first = first < 0 ? 0 : first + 1;
+    for (idx = first; idx < index->list_count
+           && (end < 0 || index->list[idx].offset.uncomp < end); idx++);
+
+    memset(&pr, 0, sizeof(pr));
+    pr.index       = index;
+    pr.units_count = idx - first + 1;
+    pr.units = index_calloc(index, pr.units_count, sizeof(parallel_scan_unit));
+    if (pr.units == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate memory for intervals.");
+        return ZX_ERR_MEMORY;
+    }
+    for (i = 0; i < pr.units_count; i++) {
+        pr.units[i].start  = i == 0 ? offset
+                                    : index->list[first + i - 1].offset.uncomp;
+        pr.units[i].end    = i + 1 < pr.units_count
+                             ? index->list[first + i].offset.uncomp : end;
+        pr.units[i].offset = pr.units[i].start;
+    }
+
+    if (num_threads <= 0) {
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (num_threads > pr.units_count) {
+        num_threads = pr.units_count;
+    }
+    pr.max_ahead = num_threads;
+    ZX_LOG("Reading %d intervals with %d threads.", pr.units_count,
+           num_threads);
+
+    if (pthread_mutex_init(&pr.lock, NULL) != 0) {
+        index_free(index, pr.units);
+        return ZX_ERR_MEMORY;
+    }
+    if (pthread_cond_init(&pr.cond, NULL) != 0) {
+        pthread_mutex_destroy(&pr.lock);
+        index_free(index, pr.units);
+        return ZX_ERR_MEMORY;
+    }
+
+    /* Calling thread decodes intervals itself if threads can't be created. */
+    threads = index_malloc(index, sizeof(pthread_t) * num_threads);
+    created = index_calloc(index, num_threads, 1);
+    for (i = 0; i < num_threads; i++) {
+        if (threads != NULL && created != NULL
+                && pthread_create(&threads[i], NULL, parallel_scan_worker,
+                                  &pr) == 0) {
+            created[i] = 1;
+        } else {
+            ZX_LOG("WARNING: Couldn't create thread, decoding on caller.");
+        }
+    }
+
+    /* Pass queued pieces of intervals to callback in order. Interval which
+     * isn't taken by a worker is decoded and passed directly. */
+    ret = ZX_RET_OK;
+    pthread_mutex_lock(&pr.lock);
+    for (i = 0; i < pr.units_count && ret == ZX_RET_OK; i++) {
+        unit = &pr.units[i];
+        while (ret == ZX_RET_OK) {
+            if (pr.next_unit == i) {
+                pr.next_unit++;
+                pthread_mutex_unlock(&pr.lock);
+                ret = decode_scan_unit(&pr, unit, callback, callback_context);
+                pthread_mutex_lock(&pr.lock);
+                unit->is_done = 1;
+                break;
+            }
+            if (unit->count > 0) {
+                slot         = unit->head;
+                piece_length = unit->lengths[slot];
+                pthread_mutex_unlock(&pr.lock);
+                ret = callback(callback_context, index, unit->pieces[slot],
+                               piece_length, unit->offset);
+                pthread_mutex_lock(&pr.lock);
+                unit->offset += piece_length;
+                unit->head    = (slot + 1) % ZX_PARALLEL_READ_QUEUE_;
+                unit->count--;
+                pthread_cond_broadcast(&pr.cond);
+                continue;
+            }
+            if (unit->is_done) {
+                ret = unit->ret;
+                break;
+            }
+            pthread_cond_wait(&pr.cond, &pr.lock);
+        }
+
+        /* Buffers of an interval in error are released after its worker. */
+        if (ret == ZX_RET_OK) {
+            release_scan_unit(index, unit);
+        }
+        pr.delivered++;
+        pthread_cond_broadcast(&pr.cond);
+    }
+    pr.stop = 1;
+    pthread_cond_broadcast(&pr.cond);
+    pthread_mutex_unlock(&pr.lock);
+
+    for (i = 0; i < num_threads; i++) {
+        if (created != NULL && created[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    for (i = 0; i < pr.units_count; i++) {
+        release_scan_unit(index, &pr.units[i]);
+    }
+    index_free(index, threads);
+    index_free(index, created);
+    pthread_cond_destroy(&pr.cond);
+    pthread_mutex_destroy(&pr.lock);
+    index_free(index, pr.units);
+
+    return ret;
+}
+
+zidx_checkpoint* zidx_create_checkpoint()
+{
+    zidx_checkpoint *ckp;
+    ckp = calloc(1, sizeof(zidx_checkpoint));
+    return ckp;
+}
+
+/**
+ * Copy header of the current deflate block to checkpoint. Header of a stored
+ * block is rewritten with the number of bytes remaining in the block, so
+ * decoding can be resumed from the checkpoint.
+ *
+ * \param index      Index data.
+ * \param checkpoint Checkpoint to copy header to.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_INVALID_OP if header of the current block is not known.
+ *         ZX_ERR_MEMORY if memory couldn't be allocated.
+ */
+static int copy_block_header(zidx_index *index, zidx_checkpoint *checkpoint)
+{
+    /* See inflateMark() in zlib manual. */
+    long mark;
+
+    /* Header of a stored block with remaining length. */
+    uint8_t stored[5];
+    unsigned int remaining;
+
+    const uint8_t *header;
+    int header_bits;
+
+    /* Aliases. */
+    zidx_block_state *state = &index->block_state;
+
+    mark = index->backend->mark(index->z_stream);
+    if (mark < 0 && mark > -65536) {
+        /* BFINAL and BTYPE bits padded to a byte, then LEN and NLEN. */
+        remaining = mark + 65536;
+        stored[0] = is_last_deflate_block(index->z_stream) ? 1 : 0;
+        stored[1] = remaining & 0xFF;
+        stored[2] = remaining >> 8;
+        stored[3] = ~stored[1];
+        stored[4] = ~stored[2];
+        header      = stored;
+        header_bits = 8 * sizeof(stored);
+    } else if (state->header_bits > 0 && state->is_header_complete) {
+        header      = state->header;
+        header_bits = state->header_bits;
+    } else {
+        ZX_LOG("ERROR: Header of the current block is not known.");
+        return ZX_ERR_INVALID_OP;
+    }
 
-    return ZX_RET_OK;
-}
+    index_free(index, checkpoint->block_header);
+    checkpoint->block_header = index_malloc(index, (header_bits + 7) / 8);
+    if (checkpoint->block_header == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate memory for block header.");
+        checkpoint->block_header_bits = 0;
+        return ZX_ERR_MEMORY;
+    }
+    memcpy(checkpoint->block_header, header, (header_bits + 7) / 8);
+    checkpoint->block_header_bits = header_bits;
 
-zidx_checkpoint* zidx_create_checkpoint()
-{
-    zidx_checkpoint *ckp;
-    ckp = calloc(1, sizeof(zidx_checkpoint));
-    return ckp;
+    return ZX_RET_OK;
 }
 
 int zidx_fill_checkpoint(zidx_index* index,
@@ -1314,6 +9172,9 @@ int zidx_fill_checkpoint(zidx_index* index,
     /* Used for storing return value of zlib calls. */
     int z_ret;
 
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
     /* Length of dictionary, a.k.a. sliding window. */
     unsigned int dict_length;
 
@@ -1335,7 +9196,8 @@ int zidx_fill_checkpoint(zidx_index* index,
     }
 
     /* Read dict_length. This will be used to allocate window space. */
-    z_ret = inflateGetDictionary(index->z_stream, NULL, &dict_length);
+    z_ret = index->backend->get_dictionary(index->z_stream, NULL,
+                                           &dict_length);
     if (z_ret != Z_OK) {
         ZX_LOG("ERROR: inflateGetDictionary returned error (%d).", z_ret);
         ret = ZX_ERR_ZLIB(z_ret);
@@ -1347,7 +9209,8 @@ int zidx_fill_checkpoint(zidx_index* index,
      * its size is enough to hold window. Typically, 32768 is enough for all
      * windows. */
     if (new_checkpoint->window_data == NULL && dict_length > 0) {
-        new_checkpoint->window_data = (uint8_t*)malloc(dict_length);
+        new_checkpoint->window_data = (uint8_t*)index_malloc(index,
+                                                             dict_length);
         if (new_checkpoint->window_data == NULL) {
             ZX_LOG("ERROR: Couldn't allocate memory for window data.");
             ret = ZX_ERR_MEMORY;
@@ -1356,30 +9219,369 @@ int zidx_fill_checkpoint(zidx_index* index,
         window_data_allocated = 1;
     }
 
-    z_ret = inflateGetDictionary(index->z_stream, new_checkpoint->window_data,
-                                 &dict_length);
+    z_ret = index->backend->get_dictionary(index->z_stream,
+                                           new_checkpoint->window_data,
+                                           &dict_length);
     if (z_ret != Z_OK) {
         ZX_LOG("ERROR: inflateGetDictionary returned error (%d).", z_ret);
         ret = ZX_ERR_ZLIB(z_ret);
         goto cleanup;
     }
 
+    /* Checkpoints inside blocks keep header of their block as well. */
+    if (offset->in_block) {
+        zx_ret = copy_block_header(index, new_checkpoint);
+        if (zx_ret != ZX_RET_OK) {
+            ret = zx_ret;
+            goto cleanup;
+        }
+    }
+
     /* Copy current offset to checkpoint offset. */
     memcpy(&new_checkpoint->offset, offset, sizeof(zidx_checkpoint_offset));
 
     /* dict_length can't be more than 32768. */
-    new_checkpoint->window_length = dict_length;
+    new_checkpoint->window_length      = dict_length;
+    new_checkpoint->window_comp_length = 0;
+
+    zx_ret = compress_window(index, new_checkpoint,
+                             index->window_compression);
+    if (zx_ret != ZX_RET_OK) {
+        ZX_LOG("ERROR: Couldn't compress window (%d).", zx_ret);
+        ret = zx_ret;
+        goto cleanup;
+    }
 
     return ZX_RET_OK;
 
 cleanup:
     if (window_data_allocated) {
-        free(new_checkpoint->window_data);
+        index_free(index, new_checkpoint->window_data);
         new_checkpoint->window_data = NULL;
     }
     return ret;
 }
 
+/*
+ * Checkpoint lookup.
+ *
+ * Binary search on list touches a whole checkpoint on each probe. Uncompressed
+ * offsets of checkpoints are also kept Elias-Fano encoded, which takes about
+ * two bits more than log2 of their average distance per checkpoint, instead
+ * of a whole off_t. Lower width bits of each offset are packed in low, and
+ * offset i sets bit (offset >> width) + i of high, so offsets with the same
+ * high part form a run of set bits, and runs are separated by unset bits.
+ * Positions of every ZX_LOOKUP_BLOCK_th set and unset bit are sampled, so
+ * offset i or the run of a high part is found by counting bits from a sample.
+ * Offsets are appended as checkpoints are added, and they are encoded again
+ * with a new width when there's no space left. Lookups don't modify lookup
+ * data, and views borrow it with the list. Index keeps the last checkpoint
+ * found by its own seeks as a hint.
+ */
+
+/** Number of set or unset bits between samples. */
+#define ZX_LOOKUP_BLOCK_ (64)
+
+/**
+ * Count set bits of a word.
+ */
+static int count_lookup_bits(uint64_t bits)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(bits);
+#else
+    int count;
+    for (count = 0; bits != 0; bits &= bits - 1, count++);
+    return count;
+#endif
+}
+
+/**
+ * Find the lowest set bit of a non-zero word.
+ */
+static int find_lookup_bit(uint64_t bits)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(bits);
+#else
+    int pos;
+    for (pos = 0; !(bits & 1); bits >>= 1, pos++);
+    return pos;
+#endif
+}
+
+/**
+ * Free memory of lookup data.
+ *
+ * \param index Index data.
+ */
+static void release_lookup(zidx_index *index)
+{
+    index_free(index, index->lookup.low);
+    index_free(index, index->lookup.high);
+    index_free(index, index->lookup.ones);
+    index_free(index, index->lookup.zeros);
+    memset(&index->lookup, 0, sizeof(index->lookup));
+    index->lookup_hint = 0;
+}
+
+/**
+ * Find the position of a set or unset bit of high, counting from a position.
+ * Whole words are skipped by counting their bits, so it takes a few steps
+ * from a sample.
+ *
+ * \param lookup  Lookup data.
+ * \param pos     Position to start counting from.
+ * \param rank    Number of matching bits to skip from pos.
+ * \param is_zero Whether unset bits are counted instead of set bits.
+ *
+ * \return Position of the matching bit.
+ */
+static size_t select_lookup_bit(const zidx_lookup *lookup,
+                                size_t pos,
+                                int rank,
+                                char is_zero)
+{
+    size_t word = pos / 64;
+    uint64_t bits;
+    int count;
+
+    bits = is_zero ? ~lookup->high[word] : lookup->high[word];
+    bits &= ~(uint64_t)0 << pos % 64;
+    while ((count = count_lookup_bits(bits)) <= rank) {
+        rank -= count;
+        word++;
+        bits = is_zero ? ~lookup->high[word] : lookup->high[word];
+    }
+    for (; rank > 0; rank--) {
+        bits &= bits - 1;
+    }
+    return word * 64 + find_lookup_bit(bits);
+}
+
+/**
+ * Decode lower bits of a lookup key.
+ *
+ * \param lookup Lookup data.
+ * \param i      Index of key.
+ *
+ * \return Lower width bits of uncompressed offset of checkpoint i.
+ */
+static off_t get_lookup_low(const zidx_lookup *lookup, int i)
+{
+    int width = lookup->width;
+    size_t bit = (size_t)i * width;
+    uint64_t low;
+
+    if (width == 0) {
+        return 0;
+    }
+    low = lookup->low[bit / 64] >> bit % 64;
+    if (bit % 64 + width > 64) {
+        low |= lookup->low[bit / 64 + 1] << (64 - bit % 64);
+    }
+    return (off_t)(low & (((uint64_t)1 << width) - 1));
+}
+
+/**
+ * Decode a lookup key, finding its bit from a sample.
+ *
+ * \param lookup Lookup data.
+ * \param i      Index of key.
+ *
+ * \return Uncompressed offset of checkpoint i.
+ */
+static off_t get_lookup_key(const zidx_lookup *lookup, int i)
+{
+    size_t pos;
+
+    pos = select_lookup_bit(lookup, lookup->ones[i / ZX_LOOKUP_BLOCK_],
+                            i % ZX_LOOKUP_BLOCK_, 0);
+    return (off_t)(pos - i) << lookup->width | get_lookup_low(lookup, i);
+}
+
+/**
+ * Append a lookup key. There should be space for it.
+ *
+ * \param lookup Lookup data.
+ * \param key    Uncompressed offset of the next checkpoint.
+ */
+static void append_lookup_key(zidx_lookup *lookup, off_t key)
+{
+    int width  = lookup->width;
+    int i      = lookup->count++;
+    size_t bit = (size_t)i * width;
+    size_t high = (size_t)(key >> width);
+    size_t zero;
+    uint64_t low;
+
+    if (width > 0) {
+        low = (uint64_t)key & (((uint64_t)1 << width) - 1);
+        lookup->low[bit / 64] |= low << bit % 64;
+        if (bit % 64 + width > 64) {
+            lookup->low[bit / 64 + 1] |= low >> (64 - bit % 64);
+        }
+    }
+    lookup->high[(high + i) / 64] |= (uint64_t)1 << (high + i) % 64;
+    if (i % ZX_LOOKUP_BLOCK_ == 0) {
+        lookup->ones[i / ZX_LOOKUP_BLOCK_] = high + i;
+    }
+
+    /* Unset bits between the previous key and this one are those numbered
+     * from high part of previous key, and i keys precede each of them. */
+    zero = (lookup->zeros_count + ZX_LOOKUP_BLOCK_ - 1) / ZX_LOOKUP_BLOCK_
+           * ZX_LOOKUP_BLOCK_;
+    for (; zero < high; zero += ZX_LOOKUP_BLOCK_) {
+        lookup->zeros[zero / ZX_LOOKUP_BLOCK_] = zero + i;
+    }
+    lookup->zeros_count = high;
+}
+
+/**
+ * Encode keys of all checkpoints again, with a width chosen for their average
+ * distance.
+ *
+ * \param index    Index data, with at least one checkpoint.
+ * \param capacity Number of keys to make space for.
+ *
+ * \return ZX_RET_OK if successful, ZX_ERR_MEMORY otherwise.
+ */
+static int encode_lookup(zidx_index *index, int capacity)
+{
+    zidx_lookup lookup;
+    off_t last = index->list[index->list_count - 1].offset.uncomp;
+    off_t gap  = last / index->list_count;
+    int i;
+
+    memset(&lookup, 0, sizeof(lookup));
+    for (lookup.width = 0; lookup.width < 62
+                           && ((off_t)2 << lookup.width) <= gap;
+            lookup.width++);
+
+    /* Leave space for offsets to grow as much as they are. */
+    lookup.capacity  = capacity;
+    lookup.high_bits = 2 * ((size_t)(last >> lookup.width) + capacity) + 64;
+    lookup.low   = index_calloc(index, (size_t)capacity * lookup.width / 64 + 2,
+                                sizeof(uint64_t));
+    lookup.high  = index_calloc(index, lookup.high_bits / 64 + 1,
+                                sizeof(uint64_t));
+    lookup.ones  = index_calloc(index, capacity / ZX_LOOKUP_BLOCK_ + 1,
+                                sizeof(size_t));
+    lookup.zeros = index_calloc(index, lookup.high_bits / ZX_LOOKUP_BLOCK_ + 1,
+                                sizeof(size_t));
+    if (lookup.low == NULL || lookup.high == NULL || lookup.ones == NULL
+            || lookup.zeros == NULL) {
+        ZX_LOG("ERROR: Couldn't allocate memory for lookup keys.");
+        index_free(index, lookup.low);
+        index_free(index, lookup.high);
+        index_free(index, lookup.ones);
+        index_free(index, lookup.zeros);
+        return ZX_ERR_MEMORY;
+    }
+
+    release_lookup(index);
+    for (i = 0; i < index->list_count; i++) {
+        append_lookup_key(&lookup, index->list[i].offset.uncomp);
+    }
+    index->lookup = lookup;
+    ZX_LOG("Encoded %d lookup keys with %d low bits.", index->list_count,
+           lookup.width);
+    return ZX_RET_OK;
+}
+
+/**
+ * Add keys of checkpoints which are not in lookup yet.
+ *
+ * \param index Index data.
+ *
+ * \return ZX_RET_OK if lookup covers the whole list, ZX_ERR_MEMORY otherwise.
+ */
+static int update_lookup(zidx_index *index)
+{
+    zidx_lookup *lookup = &index->lookup;
+    off_t key;
+    int capacity;
+
+    if (lookup->count > index->list_count) {
+        release_lookup(index);
+    }
+    while (lookup->count < index->list_count) {
+        key = index->list[lookup->count].offset.uncomp;
+        if (lookup->count == lookup->capacity
+                || (size_t)(key >> lookup->width) + lookup->count
+                       >= lookup->high_bits) {
+            capacity = lookup->capacity * 2;
+            if (capacity < index->list_count) {
+                capacity = index->list_count;
+            }
+            if (capacity < ZX_LOOKUP_BLOCK_) {
+                capacity = ZX_LOOKUP_BLOCK_;
+            }
+            return encode_lookup(index, capacity);
+        }
+        append_lookup_key(lookup, key);
+    }
+    return ZX_RET_OK;
+}
+
+/**
+ * Find the last checkpoint at or before offset using lookup keys. Lookup keys
+ * are only read, so that lookups on an index can run in parallel.
+ *
+ * \param index  Index data, with lookup covering the whole list.
+ * \param offset Uncompressed offset, not less than that of first checkpoint
+ *               and less than that of last checkpoint.
+ * \param hint   Checkpoint found by the previous lookup of caller, which is
+ *               updated. Can be NULL.
+ *
+ * \return Index of checkpoint.
+ */
+static int search_lookup(const zidx_index *index, off_t offset, int *hint)
+{
+    const zidx_lookup *lookup = &index->lookup;
+    size_t high = (size_t)(offset >> lookup->width);
+    off_t low   = offset & (((off_t)1 << lookup->width) - 1);
+    size_t zero;
+    size_t pos;
+    int last = hint != NULL ? *hint : lookup->count;
+    int found;
+
+    /* Sequential access mostly hits the same or the next checkpoint. */
+    if (last + 1 < lookup->count && get_lookup_key(lookup, last) <= offset) {
+        if (get_lookup_key(lookup, last + 1) > offset) {
+            return last;
+        }
+        if (last + 2 == lookup->count
+                || get_lookup_key(lookup, last + 2) > offset) {
+            *hint = last + 1;
+            return last + 1;
+        }
+    }
+
+    /* Run of keys with the same high part starts after the unset bit
+     * preceding it, and keys before the run are those whose bits precede. */
+    pos = 0;
+    if (high > 0) {
+        zero = high - 1;
+        pos  = select_lookup_bit(lookup, lookup->zeros[zero / ZX_LOOKUP_BLOCK_],
+                                 zero % ZX_LOOKUP_BLOCK_, 1) + 1;
+    }
+    found = (int)(pos - high) - 1;
+
+    /* Keys of run are compared by their lower bits. There is at least one key
+     * after offset, so run ends before the end of bits. */
+    while ((lookup->high[pos / 64] >> pos % 64 & 1)
+               && get_lookup_low(lookup, found + 1) <= low) {
+        found++;
+        pos++;
+    }
+
+    if (hint != NULL) {
+        *hint = found;
+    }
+    return found;
+}
+
 int zidx_add_checkpoint(zidx_index* index, zidx_checkpoint* checkpoint)
 {
     /* Used for storing return value of zidx calls. */
@@ -1401,6 +9603,10 @@ int zidx_add_checkpoint(zidx_index* index, zidx_checkpoint* checkpoint)
         ZX_LOG("ERROR: index is NULL.");
         return ZX_ERR_PARAMS;
     }
+    if (index->readahead != NULL) {
+        ZX_LOG("ERROR: Readahead is enabled.");
+        return ZX_ERR_INVALID_OP;
+    }
     if (checkpoint == NULL) {
         ZX_LOG("ERROR: checkpoint is NULL.");
         return ZX_ERR_PARAMS;
@@ -1439,6 +9645,25 @@ int zidx_add_checkpoint(zidx_index* index, zidx_checkpoint* checkpoint)
     memcpy(&index->list[index->list_count], checkpoint, sizeof(*checkpoint));
     index->list_count++;
 
+    /* Failing to add its lookup key isn't an error, since lookups fall back to
+     * searching the list. */
+    update_lookup(index);
+
+    /* Move its window to arena, unless it's going to be made sparse. */
+    index->list[index->list_count - 1].is_window_in_lru   = 0;
+    index->list[index->list_count - 1].is_window_in_arena = 0;
+    if (!index->is_sparse_windows) {
+        adopt_window(index, index->list_count - 1);
+    }
+
+    /* Count its window in memory usage. Windows aren't evicted while they are
+     * added by a background build, since reader may be using them. They are
+     * evicted when reader needs another window. */
+    touch_window(index, index->list_count - 1);
+    if (index->async == NULL) {
+        enforce_window_budget(index, index->list_count - 1);
+    }
+
     /* TODO: Note in the documentation, that checkpoint can be freed after this
      * call. Not the window_data member of it though. */
 
@@ -1446,6 +9671,22 @@ int zidx_add_checkpoint(zidx_index* index, zidx_checkpoint* checkpoint)
 }
 
 int zidx_get_checkpoint_idx(zidx_index* index, off_t offset)
+{
+    return find_checkpoint_idx(index, offset, NULL);
+}
+
+/**
+ * Find the last checkpoint at or before offset, same as
+ * zidx_get_checkpoint_idx(), starting from a hint of caller.
+ *
+ * \param index  Index data.
+ * \param offset Uncompressed offset.
+ * \param hint   Checkpoint found by the previous lookup of caller, which is
+ *               updated. Can be NULL.
+ *
+ * \return Index of checkpoint, or negative error code.
+ */
+static int find_checkpoint_idx(zidx_index *index, off_t offset, int *hint)
 {
     /* TODO: Return EOF error if EOF is known and offset is beyond it. */
     /* TODO: Add more logging for returns. I don't feel like doing it today. */
@@ -1482,7 +9723,7 @@ int zidx_get_checkpoint_idx(zidx_index* index, off_t offset)
 
     /* Check the last element first. We check it in here so that we don't
      * account for it in every iteartion of the loop below. */
-    if(ZX_OFFSET_(right) < offset) {
+    if(ZX_OFFSET_(right) <= offset) {
         ZX_LOG("Offset (%jd) found at last checkpoint (%d) start at "
                "uncompressed offset (%jd).", (intmax_t)offset, right,
                ZX_OFFSET_(right));
@@ -1497,6 +9738,16 @@ int zidx_get_checkpoint_idx(zidx_index* index, off_t offset)
         return ZX_ERR_NOT_FOUND;
     }
 
+    /* Use compact lookup keys, unless they couldn't be allocated. They are
+     * added with checkpoints. */
+    if (index->lookup.count == index->list_count) {
+        idx = search_lookup(index, offset, hint);
+        ZX_LOG("Offset (%jd) found at checkpoint (%d) start at "
+               "uncompressed offset (%jd).", (intmax_t)offset, idx,
+               ZX_OFFSET_(idx));
+        return idx;
+    }
+
     /* Binary search for a lowerbound index. */
     while (left <= right) {
         idx = (left + right) / 2;
@@ -1544,6 +9795,34 @@ int zidx_checkpoint_count(zidx_index* index) {
     return index->list_count;
 }
 
+int zidx_member_count(zidx_index* index) {
+    return index->members_count;
+}
+
+int zidx_get_member_offsets(zidx_index* index,
+                            int idx,
+                            off_t *comp_offset,
+                            off_t *uncomp_offset)
+{
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (idx < 0 || idx >= index->members_count) {
+        ZX_LOG("ERROR: Member %d is not found.", idx);
+        return ZX_ERR_NOT_FOUND;
+    }
+
+    if (comp_offset != NULL) {
+        *comp_offset = index->members[idx].comp;
+    }
+    if (uncomp_offset != NULL) {
+        *uncomp_offset = index->members[idx].uncomp;
+    }
+    return ZX_RET_OK;
+}
+
 off_t zidx_get_checkpoint_offset(const zidx_checkpoint* ckp) {
     return ckp->offset.uncomp;
 }
@@ -1555,6 +9834,13 @@ size_t zidx_get_checkpoint_window(const zidx_checkpoint* ckp,
         ZX_LOG("ERROR: result pointer is null.");
         return 0;
     }
+    if (ckp->window_comp_length > 0 || ckp->is_window_sparse
+            || ckp->is_window_lazy || ckp->is_window_evicted) {
+        ZX_LOG("ERROR: Window of checkpoint is compressed, sparse or not "
+               "loaded.");
+        *result = NULL;
+        return 0;
+    }
     *result = ckp->window_data;
     return ckp->window_length;
 }
@@ -1570,6 +9856,10 @@ int zidx_extend_index_size(zidx_index* index, int nmembers)
         ZX_LOG("ERROR: index is NULL.");
         return ZX_ERR_PARAMS;
     }
+    if (index->readahead != NULL) {
+        ZX_LOG("ERROR: Readahead is enabled.");
+        return ZX_ERR_INVALID_OP;
+    }
     if (nmembers <= 0) {
         ZX_LOG("ERROR: Number of items to extend (%d) is not positive.",
                nmembers);
@@ -1578,8 +9868,10 @@ int zidx_extend_index_size(zidx_index* index, int nmembers)
 
     /* Allocate memory for nmembers more. index->list can be NULL if the
      * capacity is 0. */
-    new_list = (zidx_checkpoint*)realloc(index->list, sizeof(zidx_checkpoint)
-                                          * (index->list_capacity + nmembers));
+    new_list = (zidx_checkpoint*)index_realloc(index, index->list,
+                                               sizeof(zidx_checkpoint)
+                                                   * (index->list_capacity
+                                                      + nmembers));
     if(!new_list) {
         ZX_LOG("ERROR: Couldn't allocate memory for the extended list.");
         return ZX_ERR_MEMORY;
@@ -1604,6 +9896,10 @@ int zidx_shrink_index_size(zidx_index* index, int nmembers)
         ZX_LOG("ERROR: index is NULL.");
         return ZX_ERR_PARAMS;
     }
+    if (index->readahead != NULL) {
+        ZX_LOG("ERROR: Readahead is enabled.");
+        return ZX_ERR_INVALID_OP;
+    }
     if (nmembers <= 0) {
         ZX_LOG("ERROR: Number of items to shrink (%d) is not positive.",
                nmembers);
@@ -1621,8 +9917,10 @@ int zidx_shrink_index_size(zidx_index* index, int nmembers)
 
     /* Allocate memory for nmembers less. If nmembers is equal to list
      * capacity, this call is equivalent to freeing list. */
-    new_list = (zidx_checkpoint*)realloc(index->list, sizeof(zidx_checkpoint)
-                                          * (index->list_capacity - nmembers));
+    new_list = (zidx_checkpoint*)index_realloc(index, index->list,
+                                               sizeof(zidx_checkpoint)
+                                                   * (index->list_capacity
+                                                      - nmembers));
     if(!new_list) {
         ZX_LOG("ERROR: Couldn't allocate memory for the extended list.");
         return ZX_ERR_MEMORY;
@@ -1645,44 +9943,282 @@ int zidx_fit_index_size(zidx_index* index)
                                   index->list_capacity - index->list_count);
 }
 
-static int commit_temp_index_(zidx_index *index, zidx_index *temp_index)
+static int commit_temp_index_(zidx_index *index, zidx_index *temp_index)
+{
+    int needed_size;
+    int zx_ret;
+    int i;
+    zidx_checkpoint *it;
+    const zidx_checkpoint *end;
+
+    /* Members are facts about the indexed file rather than the index, so
+     * imported ones are merged into those already known. They are added
+     * first, since members added before a failure are still valid. */
+    for (i = 0; i < temp_index->members_count; i++) {
+        zx_ret = add_member(index, temp_index->members[i].comp,
+                            temp_index->members[i].uncomp);
+        if (zx_ret != ZX_RET_OK) {
+            return zx_ret;
+        }
+    }
+
+    /* Extend index if needed. */
+    needed_size = temp_index->list_count - index->list_capacity;
+    if (needed_size > 0) {
+        zx_ret = zidx_extend_index_size(index, needed_size);
+        if (zx_ret != ZX_RET_OK) {
+            ZX_LOG("ERROR: Couldn't extend index size %d more elements.",
+                   needed_size);
+            return zx_ret;
+        }
+    }
+
+    /* Free existing index list members. */
+    end = index->list + index->list_count;
+    for (it = index->list; it < end; it++) {
+        release_window(index, it);
+    }
+    index_free(index, index->list);
+    release_arena(index);
+    if (index->map_data != NULL) {
+        munmap(index->map_data, index->map_length);
+    }
+
+    /* Copy current index. */
+    index->list                  = temp_index->list;
+    index->list_count            = temp_index->list_count;
+    index->sparse_analyzed_count = 0;
+    index->window_stream         = temp_index->window_stream;
+    index->map_data              = temp_index->map_data;
+    index->map_length            = temp_index->map_length;
+    reset_window_lru(index);
+    drop_cache_chunks(index, 0);
+    if (index->pread_pool != NULL) {
+        index->pread_pool->list = NULL;
+    }
+
+    /* Failing to add lookup keys isn't an error, since lookups fall back to
+     * searching the list. */
+    release_lookup(index);
+    update_lookup(index);
+    temp_index->list        = NULL;
+    temp_index->list_count  = 0;
+    temp_index->map_data    = NULL;
+
+    return ZX_RET_OK;
+}
+
+/**
+ * Point window, ranges and block header of checkpoint to mapped index file.
+ *
+ * \param checkpoint Checkpoint with its metadata read.
+ * \param map_data   Mapped index file.
+ * \param map_length Length of mapped index file.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_CORRUPTED if window is out of file, or its ranges are not
+ *         valid or not aligned.
+ */
+static int map_window(zidx_checkpoint *checkpoint,
+                      uint8_t *map_data,
+                      size_t map_length)
+{
+    off_t off = checkpoint->window_offset;
+    size_t length;
+
+    length = 2 * sizeof(uint16_t) * checkpoint->window_ranges_count;
+    if (off > map_length || length > map_length - off) {
+        ZX_LOG("ERROR: Window ranges are out of index file.");
+        return ZX_ERR_CORRUPTED;
+    }
+    if (length > 0) {
+        if (off % sizeof(uint16_t) != 0) {
+            ZX_LOG("ERROR: Window ranges are not aligned.");
+            return ZX_ERR_CORRUPTED;
+        }
+        checkpoint->window_ranges = (uint16_t*)(map_data + off);
+        if (!are_window_ranges_valid(checkpoint)) {
+            ZX_LOG("ERROR: Window ranges are not valid.");
+            checkpoint->window_ranges = NULL;
+            return ZX_ERR_CORRUPTED;
+        }
+    }
+    off += length;
+
+    length = stored_window_length(checkpoint)
+             + (checkpoint->block_header_bits + 7) / 8;
+    if (length > map_length - off) {
+        ZX_LOG("ERROR: Window data is out of index file.");
+        checkpoint->window_ranges = NULL;
+        return ZX_ERR_CORRUPTED;
+    }
+    if (stored_window_length(checkpoint) > 0) {
+        checkpoint->window_data = map_data + off;
+    }
+    if (checkpoint->block_header_bits > 0) {
+        checkpoint->block_header = map_data + off
+                                   + stored_window_length(checkpoint);
+    }
+    checkpoint->is_window_mapped = 1;
+    return ZX_RET_OK;
+}
+
+/**
+ * Get the number of bytes a variable length integer takes.
+ *
+ * \param value Value of integer.
+ *
+ * \return Length of integer in bytes.
+ */
+static int varint_length(uint64_t value)
+{
+    int length;
+
+    for (length = 1; value >= 0x80; value >>= 7, length++);
+    return length;
+}
+
+/**
+ * Write a variable length integer, seven bits in each byte starting from the
+ * least significant ones, with the highest bit set on all bytes but the last.
+ *
+ * \param stream Output stream.
+ * \param value  Value of integer.
+ * \param length Number of bytes to write, which can be more than the length of
+ *               value, so that it can be written before it's known.
+ *
+ * \return ZX_RET_OK if successful, or stream error.
+ */
+static int write_varint(streamlike_t *stream, uint64_t value, int length)
+{
+    uint8_t buf[ZX_VARINT_MAX_LENGTH_];
+    int i;
+
+    for (i = 0; i < length; i++) {
+        buf[i] = (value & 0x7F) | (i + 1 < length ? 0x80 : 0);
+        value >>= 7;
+    }
+    if (sl_write(stream, buf, length) < (size_t)length) {
+        ZX_LOG("ERROR: Couldn't write variable length integer.");
+        /* Short writes without an error are asynchronous writes. */
+        return sl_error(stream) ? sl_error(stream) : ZX_ERR_NOT_IMPLEMENTED;
+    }
+    return ZX_RET_OK;
+}
+
+/**
+ * Read a variable length integer written by write_varint().
+ *
+ * \param stream Input stream.
+ * \param value  Value of integer.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_CORRUPTED if integer is too long.
+ *         ZX_ERR_STREAM_EOF if stream ends before integer.
+ *         Stream error if read fails.
+ */
+static int read_varint(streamlike_t *stream, uint64_t *value)
+{
+    uint8_t byte;
+    int i;
+
+    *value = 0;
+    for (i = 0; i < ZX_VARINT_MAX_LENGTH_; i++) {
+        if (sl_read(stream, &byte, 1) < 1) {
+            ZX_LOG("ERROR: Couldn't read variable length integer.");
+            if (sl_error(stream)) {
+                return sl_error(stream);
+            }
+            return sl_eof(stream) ? ZX_ERR_STREAM_EOF
+                                  : ZX_ERR_NOT_IMPLEMENTED;
+        }
+        *value |= (uint64_t)(byte & 0x7F) << (7 * i);
+        if (!(byte & 0x80)) {
+            return ZX_RET_OK;
+        }
+    }
+    ZX_LOG("ERROR: Variable length integer is too long.");
+    return ZX_ERR_CORRUPTED;
+}
+
+/**
+ * Read offsets of checkpoint from compact metadata. Window offset is relative
+ * to the end of checkpoint metadata section.
+ *
+ * \param stream     Input stream.
+ * \param checkpoint Checkpoint to read offsets of.
+ * \param previous   Previous checkpoint, or NULL if it's the first one.
+ *
+ * \return ZX_RET_OK if successful.
+ *         ZX_ERR_OVERFLOW if an offset doesn't fit to offset type.
+ *         Error of read_varint() if an offset can't be read.
+ */
+static int read_compact_offsets(streamlike_t *stream,
+                                zidx_checkpoint *checkpoint,
+                                const zidx_checkpoint *previous)
 {
-    int needed_size;
+    off_t *offsets[3];
+    int64_t bases[3] = {0, 0, 0};
+    uint64_t delta;
+    int64_t i64;
     int zx_ret;
-    zidx_checkpoint *it;
-    const zidx_checkpoint *end;
+    int i;
+
+    offsets[0] = &checkpoint->offset.uncomp;
+    offsets[1] = &checkpoint->offset.comp;
+    offsets[2] = &checkpoint->window_offset;
+    if (previous != NULL) {
+        bases[0] = previous->offset.uncomp;
+        bases[1] = previous->offset.comp;
+        bases[2] = previous->window_offset;
+    }
 
-    /* Extend index if needed. */
-    needed_size = temp_index->list_count - index->list_capacity;
-    if (needed_size > 0) {
-        zx_ret = zidx_extend_index_size(index, needed_size);
+    for (i = 0; i < 3; i++) {
+        zx_ret = read_varint(stream, &delta);
         if (zx_ret != ZX_RET_OK) {
-            ZX_LOG("ERROR: Couldn't extend index size %d more elements.",
-                   needed_size);
             return zx_ret;
         }
+        if (delta > (uint64_t)(INT64_MAX - bases[i])) {
+            ZX_LOG("ERROR: Offset doesn't fit to offset type.");
+            return ZX_ERR_OVERFLOW;
+        }
+        i64 = bases[i] + (int64_t)delta;
+        *offsets[i] = i64;
+        if (*offsets[i] != i64) {
+            ZX_LOG("ERROR: Offset doesn't fit to offset type.");
+            return ZX_ERR_OVERFLOW;
+        }
     }
-
-    /* Free existing index list members. */
-    end = index->list + index->list_count;
-    for (it = index->list; it < end; it++) {
-        free(it->window_data);
-    }
-    free(index->list);
-
-    /* Copy current index. */
-    index->list       = temp_index->list;
-    index->list_count = temp_index->list_count;
-    temp_index->list        = NULL;
-    temp_index->list_count  = 0;
-
+    ZX_LOG("Imported offsets (%jd, %jd, %jd).",
+           (intmax_t)checkpoint->offset.uncomp,
+           (intmax_t)checkpoint->offset.comp,
+           (intmax_t)checkpoint->window_offset);
     return ZX_RET_OK;
 }
 
-int zidx_import_ex(zidx_index *index,
-                   streamlike_t *stream,
-                   zidx_import_filter_callback filter,
-                   void *filter_context)
+/**
+ * Import index from stream. Windows are read along with checkpoint metadata,
+ * or only their offsets are recorded if import is lazy, to be loaded by
+ * load_window() when they are needed. If index file is mapped, windows point
+ * to the mapping instead, which is owned by index on success.
+ *
+ * \param index          Index data.
+ * \param stream         Stream of index file.
+ * \param filter         Import filter. Not implemented yet.
+ * \param filter_context Context of import filter.
+ * \param is_lazy        Whether loading windows is deferred.
+ * \param map_data       Mapped index file, or NULL.
+ * \param map_length     Length of mapped index file.
+ *
+ * \return ZX_RET_OK if successful, or negative error code.
+ */
+static int import_index_(zidx_index *index,
+                         streamlike_t *stream,
+                         zidx_import_filter_callback filter,
+                         void *filter_context,
+                         char is_lazy,
+                         uint8_t *map_data,
+                         size_t map_length)
 {
     /* Local definition to tidy up cumbersome error check procedures. */
     #define ZX_READ_TEMPLATE_(buf, buflen, name) \
@@ -1738,8 +10274,15 @@ int zidx_import_ex(zidx_index *index,
     /* Fixed length types. Used for reading fixed-length data to int. */
     int64_t i64;
     int32_t i32;
+    uint32_t flags;
     off_t off;
 
+    /* Offset of window data of the next checkpoint in index file. */
+    off_t window_off;
+
+    /* Index of checkpoint. */
+    int idx;
+
     /* General purpose byte buffer. */
     uint8_t buf[8];
 
@@ -1765,12 +10308,20 @@ int zidx_import_ex(zidx_index *index,
         ZX_LOG("ERROR: input stream is NULL.");
         return ZX_ERR_PARAMS;
     }
+    if (index->async != NULL) {
+        ZX_LOG("ERROR: Index is being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
+    if (index->readahead != NULL) {
+        ZX_LOG("ERROR: Readahead is enabled.");
+        return ZX_ERR_INVALID_OP;
+    }
     if (filter != NULL || filter_context != NULL) {
         ZX_LOG("ERROR: import filtering not supported.");
         return ZX_ERR_NOT_IMPLEMENTED;
     }
 
-    temp_index = calloc(1, sizeof(zidx_index));
+    temp_index = index_calloc(index, 1, sizeof(zidx_index));
     if (temp_index == NULL) {
         ZX_LOG("ERROR: Couldn't allocate memory for temporary index.");
         return ZX_ERR_MEMORY;
@@ -1840,10 +10391,12 @@ int zidx_import_ex(zidx_index *index,
     /* Checksum of whole checkpoint metadata. TODO: Not implemented yet. */
     ZX_READ_TEMPLATE_(buf, 4, "checksum of metadata");
 
-    /* Flags. TODO: Not implemented yet. Also it's non-conformant: Current
-     * implementation assumes as if ZX_UNKNOWN_CHECKSUM and
-     * ZX_UNKNOWN_WINDOW_CHECKSUM flags are set. */
-    ZX_READ_TEMPLATE_(buf, 4, "flags");
+    /* Flags. TODO: Only ZX_FLAG_BLOCK_HEADERS_, ZX_FLAG_COMPRESSED_WINDOWS_,
+     * ZX_FLAG_SPARSE_WINDOWS_, ZX_FLAG_COMPACT_OFFSETS_ and ZX_FLAG_MEMBERS_
+     * are implemented. Also it's non-conformant: Current implementation
+     * assumes as if ZX_UNKNOWN_CHECKSUM and ZX_UNKNOWN_WINDOW_CHECKSUM flags
+     * are set. */
+    ZX_READ_TEMPLATE_(&flags, sizeof(flags), "flags");
 
     /* TODO: Implement optional extra data. */
 
@@ -1855,7 +10408,8 @@ int zidx_import_ex(zidx_index *index,
            (intmax_t)sl_tell(stream));
 
     /* Allocate space for list. */
-    temp_index->list = calloc(temp_index->list_count, sizeof(zidx_checkpoint));
+    temp_index->list = index_calloc(index, temp_index->list_count,
+                                    sizeof(zidx_checkpoint));
     if (temp_index->list == NULL) {
         ZX_LOG("ERROR: Couldn't allocate space for list.");
         ret = ZX_ERR_MEMORY;
@@ -1866,25 +10420,35 @@ int zidx_import_ex(zidx_index *index,
     /* Iterate over checkpoints for writing checkpoint metadata. */
     for(it = temp_index->list; it < end; it++)
     {
-        /* Read uncompressed offset. */
-        ZX_READ_TEMPLATE_(&i64, sizeof(i64), "uncompressed offset");
-        if (sizeof(i64) > sizeof(it->offset.uncomp)) {
-            if (i64 > 0x7FFFFFFF) {
-                ret = ZX_ERR_OVERFLOW;
+        /* Offsets of compact metadata precede the rest of it. */
+        if (flags & ZX_FLAG_COMPACT_OFFSETS_) {
+            zx_ret = read_compact_offsets(stream, it, it == temp_index->list
+                                                      ? NULL : it - 1);
+            if (zx_ret != ZX_RET_OK) {
+                ret = zx_ret;
                 goto end;
             }
-        }
-        it->offset.uncomp = i64;
-
-        /* Read compressed offset. */
-        ZX_READ_TEMPLATE_(&i64, sizeof(i64), "compressed offset");
-        if (sizeof(i64) > sizeof(it->offset.comp)) {
-            if (i64 > 0x7FFFFFFF) {
-                ret = ZX_ERR_OVERFLOW;
-                goto end;
+        } else {
+            /* Read uncompressed offset. */
+            ZX_READ_TEMPLATE_(&i64, sizeof(i64), "uncompressed offset");
+            if (sizeof(i64) > sizeof(it->offset.uncomp)) {
+                if (i64 > 0x7FFFFFFF) {
+                    ret = ZX_ERR_OVERFLOW;
+                    goto end;
+                }
+            }
+            it->offset.uncomp = i64;
+
+            /* Read compressed offset. */
+            ZX_READ_TEMPLATE_(&i64, sizeof(i64), "compressed offset");
+            if (sizeof(i64) > sizeof(it->offset.comp)) {
+                if (i64 > 0x7FFFFFFF) {
+                    ret = ZX_ERR_OVERFLOW;
+                    goto end;
+                }
             }
+            it->offset.comp = i64;
         }
-        it->offset.comp = i64;
 
         /* Read block boundary bits offset and boundary byte. */
         ZX_READ_TEMPLATE_(&it->offset.comp_bits_count, 1,
@@ -1896,38 +10460,188 @@ int zidx_import_ex(zidx_index *index,
             goto end;
         }
 
-        /* Read offset of window data. TODO: Verify this data. */
-        ZX_READ_TEMPLATE_(buf, 8, "window offset");
+        /* Read offset of window data. It's verified below. */
+        if (!(flags & ZX_FLAG_COMPACT_OFFSETS_)) {
+            ZX_READ_TEMPLATE_(&i64, sizeof(i64), "window offset");
+            it->window_offset = i64;
+            if (it->window_offset != i64) {
+                ZX_LOG("ERROR: Window offset doesn't fit to offset type.");
+                ret = ZX_ERR_OVERFLOW;
+                goto end;
+            }
+        }
 
         /* Write length of window data. TODO: Non-conformant. Has a length of 2
          * bytes instead of 4 bytes. Need to update file specification. */
         ZX_READ_TEMPLATE_(&it->window_length, sizeof(it->window_length),
                           "window length");
+
+        /* Read length of block header in bits, if checkpoint is inside a
+         * block. */
+        if (flags & ZX_FLAG_BLOCK_HEADERS_) {
+            ZX_READ_TEMPLATE_(&it->block_header_bits,
+                              sizeof(it->block_header_bits),
+                              "block header length");
+            if (it->block_header_bits >= 8 * ZX_BLOCK_HEADER_CAPACITY_) {
+                ZX_LOG("ERROR: Block header is too long (%d bits).",
+                       (int)it->block_header_bits);
+                ret = ZX_ERR_CORRUPTED;
+                goto end;
+            }
+            it->offset.in_block = it->block_header_bits > 0;
+        }
+
+        /* Read length of compressed window. */
+        if (flags & ZX_FLAG_COMPRESSED_WINDOWS_) {
+            ZX_READ_TEMPLATE_(&it->window_comp_length,
+                              sizeof(it->window_comp_length),
+                              "compressed window length");
+            if (it->window_comp_length > 0 && it->window_length == 0) {
+                ZX_LOG("ERROR: Compressed window of an empty window.");
+                ret = ZX_ERR_CORRUPTED;
+                goto end;
+            }
+        }
+
+        /* Read whether window is sparse and number of its ranges. */
+        if (flags & ZX_FLAG_SPARSE_WINDOWS_) {
+            ZX_READ_TEMPLATE_(&it->is_window_sparse, 1, "sparse window flag");
+            ZX_READ_TEMPLATE_(&it->window_ranges_count,
+                              sizeof(it->window_ranges_count),
+                              "number of window ranges");
+            if ((it->is_window_sparse && it->window_length == 0)
+                    || (!it->is_window_sparse
+                            && it->window_ranges_count > 0)) {
+                ZX_LOG("ERROR: Sparse window metadata is not valid.");
+                ret = ZX_ERR_CORRUPTED;
+                goto end;
+            }
+        }
+    }
+
+    /* Read offsets of members. */
+    if (flags & ZX_FLAG_MEMBERS_) {
+        ZX_READ_TEMPLATE_(&i32, sizeof(i32), "number of members");
+        if (i32 < 0) {
+            ZX_LOG("ERROR: Number of members should be nonnegative (%d).",
+                   i32);
+            ret = ZX_ERR_CORRUPTED;
+            goto end;
+        }
+        temp_index->members = index_calloc(index, i32, sizeof(zidx_member));
+        if (temp_index->members == NULL && i32 > 0) {
+            ZX_LOG("ERROR: Couldn't allocate space for members.");
+            ret = ZX_ERR_MEMORY;
+            goto end;
+        }
+        temp_index->members_capacity = i32;
+        for (idx = 0; idx < i32; idx++) {
+            ZX_READ_TEMPLATE_(&i64, sizeof(i64), "member compressed offset");
+            off = i64;
+            if (off != i64 || off < 0) {
+                ZX_LOG("ERROR: Member offset is not valid.");
+                ret = ZX_ERR_CORRUPTED;
+                goto end;
+            }
+            temp_index->members[idx].comp = off;
+            ZX_READ_TEMPLATE_(&i64, sizeof(i64), "member uncompressed offset");
+            off = i64;
+            if (off != i64 || off < 0) {
+                ZX_LOG("ERROR: Member offset is not valid.");
+                ret = ZX_ERR_CORRUPTED;
+                goto end;
+            }
+            temp_index->members[idx].uncomp = off;
+            temp_index->members_count++;
+        }
     }
 
-    /* TODO: Verify window data start offset. */
+    /* Window data starts right after checkpoint metadata and members. TODO:
+     * Extra space is assumed to be zero. */
+    window_off = sl_tell(stream);
+    if (window_off < 0) {
+        ZX_LOG("ERROR: Couldn't tell stream offset (%jd).",
+               (intmax_t)window_off);
+        ret = ZX_ERR_STREAM_SEEK;
+        goto end;
+    }
+
+    /* Index files written before window offsets were used had them computed
+     * as if checkpoint metadata took 24 bytes instead of 28, so they are
+     * shifted by 4 bytes for each checkpoint. Current files never have a
+     * window before the end of metadata, so these are told apart. */
+    if (flags == 0 && temp_index->list_count > 0
+            && temp_index->list[0].window_offset
+                   == window_off - 4 * (off_t)temp_index->list_count) {
+        ZX_LOG("Window offsets are in the old layout.");
+        for (it = temp_index->list; it < end; it++) {
+            it->window_offset += 4 * (off_t)temp_index->list_count;
+        }
+    }
+
+    /* Window offsets of compact metadata are relative to its end. */
+    if (flags & ZX_FLAG_COMPACT_OFFSETS_) {
+        for (it = temp_index->list; it < end; it++) {
+            if (it->window_offset > INT64_MAX - (int64_t)window_off) {
+                ZX_LOG("ERROR: Window offset doesn't fit to offset type.");
+                ret = ZX_ERR_OVERFLOW;
+                goto end;
+            }
+            i64 = (int64_t)it->window_offset + window_off;
+            it->window_offset = i64;
+            if (it->window_offset != i64) {
+                ZX_LOG("ERROR: Window offset doesn't fit to offset type.");
+                ret = ZX_ERR_OVERFLOW;
+                goto end;
+            }
+        }
+    }
 
-    /* Iterate over checkpoints for writing checkpoint window data. */
+    /* Iterate over checkpoints for reading checkpoint window data. Offsets of
+     * window data are verified to be in order, since they are seeked to.
+     * Window data may be padded for alignment. */
     for(it = temp_index->list; it < end; it++)
     {
-        if (it->window_length > 0) {
-            /* Allocate space. */
-            it->window_data = malloc(it->window_length);
-            if (it->window_data == NULL) {
-                ZX_LOG("ERROR: Couldn't allocate space for window data.");
-                ret = ZX_ERR_MEMORY;
+        if (it->window_offset < window_off) {
+            ZX_LOG("ERROR: Window offset (%jd) is less than expected (%jd).",
+                   (intmax_t)it->window_offset, (intmax_t)window_off);
+            ret = ZX_ERR_CORRUPTED;
+            goto end;
+        }
+        window_off = it->window_offset;
+        if (map_data != NULL) {
+            zx_ret = map_window(it, map_data, map_length);
+            if (zx_ret != ZX_RET_OK) {
+                ret = zx_ret;
                 goto end;
             }
-            /* Write window data. */
-            ZX_READ_TEMPLATE_(it->window_data, it->window_length,
-                              "window data");
-        } else {
-            /* This might be unnecessary, given we used calloc above while
-             * populating list, but let's keep it. */
-            it->window_data = NULL;
-            ZX_LOG("No window data.");
+            continue;
+        }
+        if (is_lazy) {
+            it->is_window_lazy = it->window_length > 0
+                                     || it->block_header_bits > 0;
+            it->is_window_stored = 1;
+            continue;
+        }
+        if (sl_tell(stream) != window_off
+                && sl_seek(stream, window_off, SL_SEEK_SET) != 0) {
+            ZX_LOG("ERROR: Couldn't seek to window data (%jd).",
+                   (intmax_t)window_off);
+            ret = ZX_ERR_STREAM_SEEK;
+            goto end;
         }
+        zx_ret = read_checkpoint_window(index, stream, it);
+        if (zx_ret != ZX_RET_OK) {
+            ret = zx_ret;
+            goto end;
+        }
+        window_off += 2 * sizeof(uint16_t) * it->window_ranges_count
+                      + stored_window_length(it)
+                      + (it->block_header_bits + 7) / 8;
     }
+    temp_index->window_stream = is_lazy && map_data == NULL ? stream : NULL;
+    temp_index->map_data      = map_data;
+    temp_index->map_length    = map_length;
 
     /* Now that we are good, copy temporary index to main index. */
     zx_ret = commit_temp_index_(index, temp_index);
@@ -1936,6 +10650,13 @@ int zidx_import_ex(zidx_index *index,
         return zx_ret;
     }
 
+    /* Move windows read to memory to arena, or count them in memory usage.
+     * Lazy ones are counted when loaded. */
+    for (idx = 0; idx < index->list_count; idx++) {
+        adopt_window(index, idx);
+        touch_window(index, idx);
+    }
+    enforce_window_budget(index, -1);
 
     ret = ZX_RET_OK;
     // fallthrough
@@ -1944,18 +10665,191 @@ end:
     if (temp_index) {
         if (temp_index->list) {
             for (it = temp_index->list; it < end; it++) {
-                free(it->window_data);
+                release_window(index, it);
             }
         }
-        free(temp_index->list);
+        index_free(index, temp_index->list);
+        index_free(index, temp_index->members);
     }
-    free(temp_index);
+    index_free(index, temp_index);
 
     return ret;
     #undef ZX_READ_TEMPLATE_
 
 }
 
+int zidx_import_ex(zidx_index *index,
+                   streamlike_t *stream,
+                   zidx_import_filter_callback filter,
+                   void *filter_context)
+{
+    return import_index_(index, stream, filter, filter_context, 0, NULL, 0);
+}
+
+int zidx_import_lazy(zidx_index *index, streamlike_t *stream)
+{
+    return import_index_(index, stream, NULL, NULL, 1, NULL, 0);
+}
+
+/**
+ * Context of stream reading from mapped index file.
+ */
+typedef struct map_stream_context_s
+{
+    const uint8_t *data;
+    size_t length;
+    size_t pos;
+} map_stream_context;
+
+/** Read callback of mapped index file stream. */
+static size_t map_stream_read(void *context, void *buf, size_t size)
+{
+    map_stream_context *ctx = context;
+    if (size > ctx->length - ctx->pos) {
+        size = ctx->length - ctx->pos;
+    }
+    memcpy(buf, ctx->data + ctx->pos, size);
+    ctx->pos += size;
+    return size;
+}
+
+/** Seek callback of mapped index file stream. */
+static int map_stream_seek(void *context, off_t offset, int whence)
+{
+    map_stream_context *ctx = context;
+    if (whence == SL_SEEK_CUR) {
+        offset += ctx->pos;
+    } else if (whence == SL_SEEK_END) {
+        offset += ctx->length;
+    }
+    if (offset < 0 || offset > ctx->length) {
+        return -1;
+    }
+    ctx->pos = offset;
+    return 0;
+}
+
+/** Tell callback of mapped index file stream. */
+static off_t map_stream_tell(void *context)
+{
+    return ((map_stream_context*)context)->pos;
+}
+
+/** End-of-file callback of mapped index file stream. */
+static int map_stream_eof(void *context)
+{
+    map_stream_context *ctx = context;
+    return ctx->pos == ctx->length;
+}
+
+/** Error callback of mapped index file stream. */
+static int map_stream_error(void *context)
+{
+    return 0;
+}
+
+int zidx_import_mmap(zidx_index *index, int fd)
+{
+    /* Return value for this function. */
+    int ret;
+
+    struct stat st;
+    uint8_t *map_data;
+    map_stream_context ctx;
+    streamlike_t stream;
+
+    /* Sanity checks. */
+    if (index == NULL) {
+        ZX_LOG("ERROR: index is NULL.");
+        return ZX_ERR_PARAMS;
+    }
+    if (fd < 0) {
+        ZX_LOG("ERROR: File descriptor (%d) is not valid.", fd);
+        return ZX_ERR_PARAMS;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ZX_LOG("ERROR: Couldn't get size of index file.");
+        return ZX_ERR_STREAM_READ;
+    }
+    if ((size_t)st.st_size != st.st_size) {
+        ZX_LOG("ERROR: Index file doesn't fit to address space.");
+        return ZX_ERR_OVERFLOW;
+    }
+
+    /* Mapping is shared, so page cache is shared by all processes mapping
+     * the same index file. */
+    map_data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map_data == MAP_FAILED) {
+        ZX_LOG("ERROR: Couldn't map index file.");
+        return ZX_ERR_STREAM_READ;
+    }
+
+    /* Metadata is read through a stream on mapping. */
+    ctx.data   = map_data;
+    ctx.length = st.st_size;
+    ctx.pos    = 0;
+    memset(&stream, 0, sizeof(stream));
+    stream.context = &ctx;
+    stream.read    = map_stream_read;
+    stream.seek    = map_stream_seek;
+    stream.tell    = map_stream_tell;
+    stream.eof     = map_stream_eof;
+    stream.error   = map_stream_error;
+
+    ret = import_index_(index, &stream, NULL, NULL, 1, map_data, st.st_size);
+    if (ret != ZX_RET_OK) {
+        munmap(map_data, st.st_size);
+    }
+    return ret;
+}
+
+/**
+ * Write offsets of checkpoint to compact metadata.
+ *
+ * \param stream        Output stream.
+ * \param checkpoint    Checkpoint to write offsets of.
+ * \param previous      Previous checkpoint, or NULL if it's the first one.
+ * \param window_delta  Difference of window offset from that of previous
+ *                      checkpoint, or from the end of metadata section.
+ * \param window_length Number of bytes to write window_delta in.
+ *
+ * \return ZX_RET_OK if successful, or stream error.
+ */
+static int write_compact_offsets(streamlike_t *stream,
+                                 const zidx_checkpoint *checkpoint,
+                                 const zidx_checkpoint *previous,
+                                 uint64_t window_delta,
+                                 int window_length)
+{
+    uint64_t deltas[3];
+    int lengths[3];
+    int zx_ret;
+    int i;
+
+    deltas[0] = checkpoint->offset.uncomp;
+    deltas[1] = checkpoint->offset.comp;
+    deltas[2] = window_delta;
+    if (previous != NULL) {
+        deltas[0] -= previous->offset.uncomp;
+        deltas[1] -= previous->offset.comp;
+    }
+    lengths[0] = varint_length(deltas[0]);
+    lengths[1] = varint_length(deltas[1]);
+    lengths[2] = window_length;
+
+    for (i = 0; i < 3; i++) {
+        zx_ret = write_varint(stream, deltas[i], lengths[i]);
+        if (zx_ret != ZX_RET_OK) {
+            return zx_ret;
+        }
+    }
+    ZX_LOG("Exported offsets (%jd, %jd, +%ju).",
+           (intmax_t)checkpoint->offset.uncomp,
+           (intmax_t)checkpoint->offset.comp, (uintmax_t)window_delta);
+    return ZX_RET_OK;
+}
+
 int zidx_export_ex(zidx_index *index,
                    streamlike_t *stream,
                    zidx_export_filter_callback filter,
@@ -1988,6 +10882,9 @@ int zidx_export_ex(zidx_index *index,
     int s_ret;
     int s_err;
 
+    /* Used for storing return value of zidx calls. */
+    int zx_ret;
+
     /* Used for writing 0 as default for some values. */
     const uint64_t zero = 0;
 
@@ -2001,6 +10898,37 @@ int zidx_export_ex(zidx_index *index,
     /* Window data offset. Keeps track of where to write next window data. */
     int64_t window_off;
 
+    /* Offset where window data section starts, after padding. */
+    int64_t window_start;
+
+    /* Zero bytes used for padding window data. */
+    static const uint8_t padding[64] = {0};
+    int64_t padding_length;
+
+    /* Length of window data written to metadata. */
+    unsigned int stored_length;
+
+    /* Flags of index file. */
+    uint32_t flags = 0;
+
+    /* Length of metadata of a checkpoint. */
+    int metadata_length = 28;
+
+    /* Length of member section following checkpoint metadata. */
+    int64_t members_length = 0;
+
+    /* Index of member. */
+    int idx;
+
+    /* Whether offsets in metadata are compact, where metadata section ends,
+     * and length of window offset of the first checkpoint in that case. */
+    char is_compact;
+    int64_t metadata_end = 0;
+    int first_length = 0;
+    int64_t window_rel;
+    int64_t prev_rel;
+    int64_t prev_window_off = 0;
+
     /* Sanity checks. */
     if (index == NULL) {
         ZX_LOG("ERROR: index is NULL.");
@@ -2016,11 +10944,35 @@ int zidx_export_ex(zidx_index *index,
         ZX_LOG("ERROR: output stream is NULL.");
         return ZX_ERR_PARAMS;
     }
+    if (index->async != NULL) {
+        ZX_LOG("ERROR: Index is being built in background.");
+        return ZX_ERR_INVALID_OP;
+    }
     if (filter != NULL || filter_context != NULL) {
         ZX_LOG("ERROR: export filtering not supported.");
         return ZX_ERR_NOT_IMPLEMENTED;
     }
 
+    /* List iterator and end point. */
+    zidx_checkpoint *it;
+    zidx_checkpoint *end = index->list + index->list_count;
+
+    if (stream == index->window_stream) {
+        ZX_LOG("ERROR: Windows are loaded from output stream.");
+        return ZX_ERR_INVALID_OP;
+    }
+
+    /* Ranges of windows of lazily imported index are needed for metadata. */
+    for (it = index->list; it < end; it++) {
+        if (it->is_window_lazy) {
+            zx_ret = ensure_window(index, it - index->list);
+            if (zx_ret != ZX_RET_OK) {
+                ZX_LOG("ERROR: Couldn't load window to export (%d).", zx_ret);
+                return zx_ret;
+            }
+        }
+    }
+
     /*
      * Header section.
      */
@@ -2062,10 +11014,63 @@ int zidx_export_ex(zidx_index *index,
     /* Checksum of whole checkpoint metadata. TODO: Not implemented yet. */
     ZX_WRITE_TEMPLATE_(&zero, 4, "checksum of metadata");
 
-    /* Flags. TODO: Not implemented yet. Also it's non-conformant: Current
-     * implementation assumes as if ZX_UNKNOWN_CHECKSUM and
-     * ZX_UNKNOWN_WINDOW_CHECKSUM flags are set. */
-    ZX_WRITE_TEMPLATE_(&zero, 4, "flags");
+    /* Block headers are written only if there are checkpoints inside
+     * blocks, so other index files are readable by older versions. */
+    for (it = index->list; it < end; it++) {
+        if (it->offset.in_block) {
+            flags |= ZX_FLAG_BLOCK_HEADERS_;
+            metadata_length += sizeof(it->block_header_bits);
+            break;
+        }
+    }
+
+    /* Same for lengths of compressed windows. */
+    for (it = index->list; it < end; it++) {
+        if (it->window_comp_length > 0) {
+            flags |= ZX_FLAG_COMPRESSED_WINDOWS_;
+            metadata_length += sizeof(it->window_comp_length);
+            break;
+        }
+    }
+
+    /* Same for ranges of sparse windows. */
+    for (it = index->list; it < end; it++) {
+        if (it->is_window_sparse) {
+            flags |= ZX_FLAG_SPARSE_WINDOWS_;
+            metadata_length += 1 + sizeof(it->window_ranges_count);
+            break;
+        }
+    }
+
+    /* Offsets are written as differences if enabled, which need them to be in
+     * order. */
+    is_compact = index->is_export_compact;
+    for (it = index->list + 1; is_compact && it < end; it++) {
+        if (it->offset.uncomp < (it - 1)->offset.uncomp
+                || it->offset.comp < (it - 1)->offset.comp) {
+            ZX_LOG("WARNING: Offsets are not in order, not compacting them.");
+            is_compact = 0;
+        }
+    }
+    if (is_compact) {
+        flags |= ZX_FLAG_COMPACT_OFFSETS_;
+        metadata_length -= 3 * sizeof(int64_t);
+    }
+
+    /* Members are written if any is known. Window offsets stay absolute, so
+     * older versions skip them. */
+    if (index->members_count > 0) {
+        flags |= ZX_FLAG_MEMBERS_;
+        members_length = sizeof(i32)
+                         + 2 * sizeof(i64) * (int64_t)index->members_count;
+    }
+
+    /* Flags. TODO: Only ZX_FLAG_BLOCK_HEADERS_, ZX_FLAG_COMPRESSED_WINDOWS_,
+     * ZX_FLAG_SPARSE_WINDOWS_, ZX_FLAG_COMPACT_OFFSETS_ and ZX_FLAG_MEMBERS_
+     * are implemented. Also it's non-conformant: Current implementation
+     * assumes as if ZX_UNKNOWN_CHECKSUM and ZX_UNKNOWN_WINDOW_CHECKSUM flags
+     * are set. */
+    ZX_WRITE_TEMPLATE_(&flags, sizeof(flags), "flags");
 
     /* TODO: Implement optional extra data. */
 
@@ -2083,23 +11088,83 @@ int zidx_export_ex(zidx_index *index,
         ZX_LOG("ERROR: Couldn't tell stream offset (%ld).", window_off);
         return ZX_ERR_STREAM_SEEK;
     }
-    /* Skip checkpoint headers section. */
-    window_off += 24 * index->list_count;
+    /* Skip checkpoint headers and member sections. Window data section is
+     * aligned so it can be mapped to pages by zidx_import_mmap(). */
+    window_off += metadata_length * index->list_count + members_length;
+    window_start = ZX_ALIGN_(window_off, index->export_alignment);
+
+    /* Lengths of compact offsets are summed up. Window data section starts at
+     * an even offset in that case, so differences of window offsets don't
+     * depend on where it starts. */
+    if (is_compact) {
+        window_rel = 0;
+        prev_rel   = 0;
+        for (it = index->list; it < end; it++) {
+            if (it->window_ranges_count > 0) {
+                window_rel = ZX_ALIGN_(window_rel, sizeof(uint16_t));
+            }
+            if (it > index->list) {
+                window_off += varint_length(it->offset.uncomp
+                                            - (it - 1)->offset.uncomp)
+                              + varint_length(it->offset.comp
+                                              - (it - 1)->offset.comp)
+                              + varint_length(window_rel - prev_rel);
+            } else {
+                window_off += varint_length(it->offset.uncomp)
+                              + varint_length(it->offset.comp);
+            }
+            prev_rel    = window_rel;
+            window_rel += 2 * sizeof(uint16_t) * it->window_ranges_count
+                          + stored_window_length(it)
+                          + (it->block_header_bits + 7) / 8;
+        }
 
-    /* List iterator and end point. */
-    zidx_checkpoint *it;
-    zidx_checkpoint *end = index->list + index->list_count;
+        /* Window offset of the first checkpoint is the length of padding
+         * after metadata, so it's written long enough to hold it. */
+        metadata_end = window_off;
+        window_start = ZX_ALIGN_(metadata_end, index->export_alignment < 2
+                                               ? 2 : index->export_alignment);
+        while (index->list_count > 0
+                && varint_length(window_start - metadata_end)
+                       > first_length) {
+            first_length++;
+            metadata_end = window_off + first_length;
+            window_start = ZX_ALIGN_(metadata_end,
+                                     index->export_alignment < 2
+                                     ? 2 : index->export_alignment);
+        }
+    }
+    window_off = window_start;
 
     /* Iterate over checkpoints for writing checkpoint metadata. */
     for(it = index->list; it < end; it++)
     {
-        /* Write uncompressed offset. */
-        i64 = it->offset.uncomp;
-        ZX_WRITE_TEMPLATE_(&i64, sizeof(i64), "uncompressed offset");
+        /* Ranges of sparse windows are aligned, so they can be mapped. */
+        if (it->window_ranges_count > 0) {
+            window_off = ZX_ALIGN_(window_off, sizeof(uint16_t));
+        }
+
+        /* Offsets of compact metadata precede the rest of it. */
+        if (is_compact) {
+            zx_ret = write_compact_offsets(
+                         stream, it, it == index->list ? NULL : it - 1,
+                         it == index->list ? window_off - metadata_end
+                                           : window_off - prev_window_off,
+                         it == index->list ? first_length
+                             : varint_length(window_off - prev_window_off));
+            if (zx_ret != ZX_RET_OK) {
+                return zx_ret;
+            }
+            prev_window_off = window_off;
+        } else {
+            /* Write uncompressed offset. */
+            i64 = it->offset.uncomp;
+            ZX_WRITE_TEMPLATE_(&i64, sizeof(i64), "uncompressed offset");
 
-        /* Write compressed offset. */
-        i64 = it->offset.comp;
-        ZX_WRITE_TEMPLATE_(&i64, sizeof(i64), "compressed offset");
+            /* Write compressed offset. */
+            i64 = it->offset.comp;
+            ZX_WRITE_TEMPLATE_(&i64, sizeof(i64), "compressed offset");
+        }
 
         /* Write block boundary bits offset and boundary byte. */
         ZX_WRITE_TEMPLATE_(&it->offset.comp_bits_count, 1,
@@ -2111,25 +11176,109 @@ int zidx_export_ex(zidx_index *index,
         }
 
         /* Write offset of window data. */
-        ZX_WRITE_TEMPLATE_(&window_off, sizeof(window_off), "window offset");
+        if (!is_compact) {
+            ZX_WRITE_TEMPLATE_(&window_off, sizeof(window_off),
+                               "window offset");
+        }
 
         /* Write length of window data. TODO: Non-conformant. Has a length of 2
          * bytes instead of 4 bytes. Need to update file specification. */
         ZX_WRITE_TEMPLATE_(&it->window_length, sizeof(it->window_length),
                            "window length");
 
+        /* Write length of block header in bits. */
+        if (flags & ZX_FLAG_BLOCK_HEADERS_) {
+            ZX_WRITE_TEMPLATE_(&it->block_header_bits,
+                               sizeof(it->block_header_bits),
+                               "block header length");
+        }
+
+        /* Write length of compressed window. */
+        if (flags & ZX_FLAG_COMPRESSED_WINDOWS_) {
+            ZX_WRITE_TEMPLATE_(&it->window_comp_length,
+                               sizeof(it->window_comp_length),
+                               "compressed window length");
+        }
+
+        /* Write whether window is sparse and number of its ranges. */
+        if (flags & ZX_FLAG_SPARSE_WINDOWS_) {
+            ZX_WRITE_TEMPLATE_(&it->is_window_sparse, 1, "sparse window flag");
+            ZX_WRITE_TEMPLATE_(&it->window_ranges_count,
+                               sizeof(it->window_ranges_count),
+                               "number of window ranges");
+        }
+
         /* Update window offset for next checkpoint. */
-        window_off += it->window_length;
+        window_off += 2 * sizeof(uint16_t) * it->window_ranges_count
+                      + stored_window_length(it)
+                      + (it->block_header_bits + 7) / 8;
+    }
+
+    /* Write offsets of members. */
+    if (flags & ZX_FLAG_MEMBERS_) {
+        i32 = index->members_count;
+        ZX_WRITE_TEMPLATE_(&i32, sizeof(i32), "number of members");
+        for (idx = 0; idx < index->members_count; idx++) {
+            i64 = index->members[idx].comp;
+            ZX_WRITE_TEMPLATE_(&i64, sizeof(i64), "member compressed offset");
+            i64 = index->members[idx].uncomp;
+            ZX_WRITE_TEMPLATE_(&i64, sizeof(i64),
+                               "member uncompressed offset");
+        }
     }
 
-    /* Iterate over checkpoints for writing checkpoint window data. */
+    /* Iterate over checkpoints for writing checkpoint window data. Padding
+     * is written up to the offsets written in checkpoint metadata. */
+    padding_length = window_start - sl_tell(stream);
+    window_off = window_start;
     for(it = index->list; it < end; it++)
     {
-        if (it->window_length > 0) {
+        if (it->window_ranges_count > 0) {
+            padding_length += ZX_ALIGN_(window_off, sizeof(uint16_t))
+                              - window_off;
+            window_off = ZX_ALIGN_(window_off, sizeof(uint16_t));
+        }
+        while (padding_length > 0) {
+            s_ret = padding_length < sizeof(padding) ? padding_length
+                                                     : sizeof(padding);
+            ZX_WRITE_TEMPLATE_(padding, s_ret, "padding");
+            padding_length -= s_ret;
+        }
+        window_off += 2 * sizeof(uint16_t) * it->window_ranges_count
+                      + stored_window_length(it)
+                      + (it->block_header_bits + 7) / 8;
+
+        /* Evicted windows are restored one at a time. */
+        if (it->is_window_lazy || it->is_window_evicted) {
+            stored_length = stored_window_length(it);
+            zx_ret = ensure_window(index, it - index->list);
+            if (zx_ret != ZX_RET_OK) {
+                ZX_LOG("ERROR: Couldn't load window to export (%d).", zx_ret);
+                return zx_ret;
+            }
+            if (stored_window_length(it) != stored_length) {
+                ZX_LOG("ERROR: Length of regenerated window changed.");
+                return ZX_ERR_INVALID_OP;
+            }
+        }
+
+        if (it->window_ranges_count > 0) {
+            /* Write ranges of sparse window. */
+            ZX_WRITE_TEMPLATE_(it->window_ranges,
+                               2 * sizeof(uint16_t) * it->window_ranges_count,
+                               "window ranges");
+        }
+        if (stored_window_length(it) > 0) {
             /* Write window data. */
-            ZX_WRITE_TEMPLATE_(it->window_data, it->window_length,
+            ZX_WRITE_TEMPLATE_(it->window_data, stored_window_length(it),
                                "window data");
         }
+        if (it->offset.in_block) {
+            /* Write block header. */
+            ZX_WRITE_TEMPLATE_(it->block_header,
+                               (it->block_header_bits + 7) / 8,
+                               "block header");
+        }
     }
 
     return ZX_RET_OK;
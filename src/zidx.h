@@ -38,6 +38,52 @@ extern "C" {
  */
 #define ZX_DEFAULT_SEEKING_DATA_BUFFER_SIZE (32768)
 
+/**
+ * Default value for the minimum length of compressed data decoded by each
+ * thread while building index in parallel.
+ */
+#define ZX_DEFAULT_PARALLEL_MIN_CHUNK_SIZE (1048576)
+
+/**
+ * Default weight of a compressed byte in decoding cost used by
+ * ZX_SPACING_DECODE_COST. Compressed bytes mostly account for literals, which
+ * are more expensive to decode than bytes copied by matches.
+ */
+#define ZX_DEFAULT_SPACING_COMP_WEIGHT (3)
+
+/**
+ * Default weight of an uncompressed byte in decoding cost used by
+ * ZX_SPACING_DECODE_COST.
+ */
+#define ZX_DEFAULT_SPACING_UNCOMP_WEIGHT (1)
+
+/**
+ * Default weight of a deflate block in decoding cost used by
+ * ZX_SPACING_DECODE_COST. It accounts for building decoding tables of a block.
+ */
+#define ZX_DEFAULT_SPACING_BLOCK_WEIGHT (2048)
+
+/**
+ * Suggested distance in uncompressed bytes between checkpoint candidates
+ * inside deflate blocks. See zidx_set_intra_block_checkpoints().
+ */
+#define ZX_DEFAULT_INTRA_BLOCK_STEP (65536)
+
+/**
+ * Default compression level of checkpoint windows. See
+ * zidx_set_window_compression().
+ */
+#define ZX_DEFAULT_WINDOW_COMPRESSION_LEVEL (1)
+
+/**
+ * Default inflate backend. zlib-ng is used if libzidx is built with it.
+ */
+#ifdef HAVE_ZLIB_NG
+#define ZX_DEFAULT_INFLATE_BACKEND (ZX_BACKEND_ZLIB_NG)
+#else
+#define ZX_DEFAULT_INFLATE_BACKEND (ZX_BACKEND_ZLIB)
+#endif
+
 /** }@ */
 
 /**
@@ -68,6 +114,7 @@ extern "C" {
 #define ZX_ERR_OVERFLOW    (-9) /**< Data does not fit to the given data
                                   structure. */
 #define ZX_ERR_NOT_IMPLEMENTED (-10)       /**< Feature is not implemented. */
+#define ZX_ERR_CANCELED        (-11)       /**< Operation is canceled. */
 #define ZX_ERR_ZLIB(err)       (-64 + err) /**< Error caused by zlib. */
 
 /** @} */
@@ -100,6 +147,12 @@ typedef struct zidx_checkpoint_s zidx_checkpoint;
  */
 typedef struct zidx_checkpoint_offset_s zidx_checkpoint_offset;
 
+/**
+ * Keeps decoding state for reading an index from one thread, while checkpoints
+ * are shared with other cursors of the same index.
+ */
+typedef struct zidx_cursor_s zidx_cursor;
+
 /** @} */
 
 /**
@@ -139,15 +192,96 @@ typedef enum zidx_checksum_option
     ZX_CHECKSUM_FORCE_ADLER32 = 3  /**< Force using Adler-32. */
 } zidx_checksum_option;
 
+/**
+ * Spacing policy for placing checkpoints. It's passed as is_uncompressed
+ * argument of index building functions.
+ */
+typedef enum zidx_spacing_option
+{
+    ZX_SPACING_COMPRESSED   = 0, /**< Space checkpoints by compressed bytes. */
+    ZX_SPACING_UNCOMPRESSED = 1, /**< Space checkpoints by uncompressed
+                                   bytes. */
+    ZX_SPACING_DECODE_COST  = 2  /**< Space checkpoints by decoding cost,
+                                   weighing compressed bytes, uncompressed
+                                   bytes and deflate blocks. See
+                                   zidx_set_spacing_cost(). */
+} zidx_spacing_option;
+
+/**
+ * Inflate implementation used for decoding. Backends other than zlib are only
+ * available if libzidx is built with them.
+ */
+typedef enum zidx_inflate_backend_type
+{
+    ZX_BACKEND_ZLIB    = 0, /**< zlib. */
+    ZX_BACKEND_ZLIB_NG = 1, /**< Native API of zlib-ng. */
+    ZX_BACKEND_ISAL    = 2  /**< ISA-L igzip. Not supported, since it can't
+                              stop at block boundaries or resume from a bit
+                              offset. */
+} zidx_inflate_backend_type;
+
+/**
+ * Compression of checkpoint windows, which are kept as is in memory and in
+ * exported index files. Windows are decompressed when seeking.
+ */
+typedef enum zidx_window_compression
+{
+    ZX_WINDOW_RAW     = 0, /**< Keep windows uncompressed. */
+    ZX_WINDOW_DEFLATE = 1  /**< Compress windows with raw deflate. */
+} zidx_window_compression;
+
 /** @} */
 
+/**
+ * Allocator used for memory allocated by an index, including the index itself
+ * and internal state of z_streams it initializes. Functions have the same
+ * semantics with their standard library counterparts, except that they receive
+ * opaque as the first argument. They should be thread-safe if index is built
+ * in parallel or in background. Memory handed over to index, such as z_stream
+ * passed to zidx_index_init_ex() and window of an added checkpoint, is
+ * released with free_func(), so it should be allocated with the same
+ * allocator. Index is released with free_func() after zidx_index_destroy().
+ */
+typedef struct zidx_allocator_s
+{
+    void* (*malloc_func)(void *opaque, size_t size);
+    void* (*realloc_func)(void *opaque, void *ptr, size_t size);
+    void (*free_func)(void *opaque, void *ptr);
+    void *opaque;
+} zidx_allocator;
+
+/**
+ * A range to be read by zidx_read_batch(). result is set to the number of
+ * bytes read, which is less than length only at the end of file, or to a
+ * negative error code.
+ */
+typedef struct zidx_read_request_s
+{
+    off_t offset;
+    int length;
+    void *buffer;
+    int result;
+} zidx_read_request;
+
 typedef
 int (*zidx_block_callback)(void *context,
                            zidx_index *index,
                            zidx_checkpoint_offset *offset,
                            int is_last_block);
 
+typedef
+int (*zidx_follow_callback)(void *context,
+                            zidx_index *index);
+
+typedef
+int (*zidx_chunk_callback)(void *context,
+                           zidx_index *index,
+                           const void *data,
+                           size_t length,
+                           off_t offset);
+
 zidx_index* zidx_index_create();
+zidx_index* zidx_index_create_ex(const zidx_allocator *allocator);
 int zidx_index_init(zidx_index* index,
                     streamlike_t* comp_stream);
 int zidx_index_init_ex(zidx_index* index,
@@ -176,13 +310,94 @@ int zidx_rewind(zidx_index* index);
 int zidx_eof(zidx_index* index);
 int zidx_error(zidx_index* index);
 int zidx_uncomp_size(zidx_index* index);
-
+int zidx_is_bgzf(zidx_index* index);
+int zidx_set_inflate_backend(zidx_index* index,
+                             zidx_inflate_backend_type backend_type);
+zidx_inflate_backend_type zidx_get_inflate_backend(zidx_index* index);
+
+int zidx_set_auto_checkpoint(zidx_index* index,
+                             off_t spacing_length,
+                             char is_uncompressed);
+int zidx_set_spacing_cost(zidx_index* index,
+                          unsigned int comp_weight,
+                          unsigned int uncomp_weight,
+                          unsigned int block_weight);
+int zidx_set_intra_block_checkpoints(zidx_index* index, int step_length);
+int zidx_set_window_compression(zidx_index* index,
+                                zidx_window_compression compression,
+                                int level);
+int zidx_set_sparse_windows(zidx_index* index, char is_sparse);
+int zidx_set_export_alignment(zidx_index* index, unsigned int alignment);
+int zidx_set_export_compact_offsets(zidx_index* index, char is_compact);
+int zidx_set_window_budget(zidx_index* index, size_t budget);
+int zidx_set_window_arena(zidx_index* index,
+                          size_t chunk_size,
+                          char use_huge_pages);
+int zidx_get_window_stats(zidx_index* index,
+                          size_t *memory_usage,
+                          unsigned long *evictions);
+int zidx_set_read_cache(zidx_index* index,
+                        size_t budget,
+                        unsigned int chunk_size);
+int zidx_set_seek_snapshots(zidx_index* index,
+                            int count,
+                            off_t spacing_length);
+int zidx_get_read_cache_stats(zidx_index* index,
+                              size_t *memory_usage,
+                              unsigned long *hits,
+                              unsigned long *misses);
 int zidx_build_index(zidx_index* index,
                      off_t spacing_length,
                      char is_uncompressed);
 int zidx_build_index_ex(zidx_index* index,
                         zidx_block_callback block_callback,
                         void *callback_context);
+int zidx_update_index(zidx_index* index,
+                      off_t spacing_length,
+                      char is_uncompressed);
+/**
+ * Keep indexing a growing file until the end of its deflate stream. Stream is
+ * polled every poll_interval milliseconds, and follow_callback is called after
+ * each poll. Polling interval can be zero only if there is a callback, which
+ * is then responsible for waiting, otherwise ZX_ERR_PARAMS is returned.
+ */
+int zidx_follow_index(zidx_index* index,
+                      off_t spacing_length,
+                      char is_uncompressed,
+                      unsigned int poll_interval,
+                      zidx_follow_callback follow_callback,
+                      void *callback_context);
+int zidx_build_index_parallel(zidx_index* index,
+                              off_t spacing_length,
+                              char is_uncompressed,
+                              int num_threads);
+int zidx_build_index_async(zidx_index* index,
+                           off_t spacing_length,
+                           char is_uncompressed);
+int zidx_build_index_async_progress(zidx_index* index,
+                                    off_t *comp_offset,
+                                    off_t *uncomp_offset);
+int zidx_build_index_async_wait(zidx_index* index);
+int zidx_build_index_async_cancel(zidx_index* index);
+
+zidx_cursor* zidx_cursor_create(zidx_index* index, streamlike_t* comp_stream);
+int zidx_cursor_destroy(zidx_cursor* cursor);
+int zidx_cursor_read(zidx_cursor* cursor, void *buffer, int nbytes);
+int zidx_cursor_seek(zidx_cursor* cursor, off_t offset);
+off_t zidx_cursor_tell(zidx_cursor* cursor);
+int zidx_cursor_eof(zidx_cursor* cursor);
+int zidx_pread(zidx_index* index, void *buffer, int nbytes, off_t offset);
+int zidx_read_batch(zidx_index* index,
+                    zidx_read_request *requests,
+                    int count,
+                    int num_threads);
+int zidx_set_readahead(zidx_index* index, size_t buffer_size);
+int zidx_read_parallel(zidx_index* index,
+                       off_t offset,
+                       off_t length,
+                       int num_threads,
+                       zidx_chunk_callback callback,
+                       void *callback_context);
 
 zidx_checkpoint* zidx_create_checkpoint();
 int zidx_fill_checkpoint(zidx_index* index,
@@ -192,6 +407,11 @@ int zidx_add_checkpoint(zidx_index* index, zidx_checkpoint* checkpoint);
 int zidx_get_checkpoint_idx(zidx_index* index, off_t offset);
 zidx_checkpoint* zidx_get_checkpoint(zidx_index* index, int idx);
 int zidx_checkpoint_count(zidx_index* index);
+int zidx_member_count(zidx_index* index);
+int zidx_get_member_offsets(zidx_index* index,
+                            int idx,
+                            off_t *comp_offset,
+                            off_t *uncomp_offset);
 /* TODO: Consider dropping consts before release. */
 off_t zidx_get_checkpoint_offset(const zidx_checkpoint* ckp);
 size_t zidx_get_checkpoint_window(const zidx_checkpoint* ckp,
@@ -224,6 +444,8 @@ int zidx_export_ex(zidx_index *index,
                    void *filter_context);
 
 int zidx_import(zidx_index *index, streamlike_t *stream);
+int zidx_import_lazy(zidx_index *index, streamlike_t *stream);
+int zidx_import_mmap(zidx_index *index, int fd);
 int zidx_export(zidx_index *index, streamlike_t* output_index_file);
 
 #ifdef __cplusplus
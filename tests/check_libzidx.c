@@ -434,6 +434,3206 @@ START_TEST(test_export_import)
 }
 END_TEST
 
+/** Ways of importing an index file in tests. */
+enum import_mode
+{
+    IMPORT_EAGER,
+    IMPORT_LAZY,
+    IMPORT_MMAP
+};
+
+/**
+ * Creates two indices of the same compressed file. The first one is to be
+ * built, and the second one is to be imported from its index file.
+ */
+static void create_index_pair(FILE *file, zidx_index *indices[2],
+                              streamlike_t *streams[2])
+{
+    int zx_ret;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        streams[i] = sl_fopen2(file);
+        ck_assert_msg(streams[i], "Couldn't create new stream.");
+        indices[i] = zidx_index_create();
+        ck_assert_msg(indices[i], "Couldn't create new index.");
+        zx_ret = zidx_index_init(indices[i], streams[i]);
+        ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                           zx_ret);
+    }
+}
+
+/** Destroys indices created by create_index_pair(). */
+static void destroy_index_pair(zidx_index *indices[2],
+                               streamlike_t *streams[2])
+{
+    int zx_ret;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        zx_ret = zidx_index_destroy(indices[i]);
+        ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).",
+                      zx_ret);
+        free(indices[i]);
+        sl_fclose(streams[i]);
+    }
+}
+
+/**
+ * Exports index to a temporary file. Stream of the file is left at the end of
+ * index file.
+ */
+static FILE* export_index_file(zidx_index *index, streamlike_t **index_stream)
+{
+    int zx_ret;
+    FILE *index_file;
+
+    index_file = tmpfile();
+    ck_assert_msg(index_file, "Couldn't open index file.");
+    *index_stream = sl_fopen2(index_file);
+    ck_assert_msg(*index_stream, "Couldn't create index stream.");
+
+    zx_ret = zidx_export(index, *index_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't export index (%d).", zx_ret);
+    ck_assert_msg(fflush(index_file) == 0, "Couldn't flush index file.");
+    return index_file;
+}
+
+/**
+ * Imports index file to an index, and checks that it has as many checkpoints
+ * as the index it's exported from.
+ */
+static void import_index_file(zidx_index *new_index,
+                              const zidx_index *old_index,
+                              FILE *index_file,
+                              streamlike_t *index_stream,
+                              enum import_mode mode)
+{
+    int zx_ret;
+
+    ck_assert_msg(sl_seek(index_stream, 0, SL_SEEK_SET) == 0,
+                  "Couldn't rewind file.");
+    if (mode == IMPORT_EAGER) {
+        zx_ret = zidx_import(new_index, index_stream);
+    } else if (mode == IMPORT_LAZY) {
+        zx_ret = zidx_import_lazy(new_index, index_stream);
+    } else {
+        zx_ret = zidx_import_mmap(new_index, fileno(index_file));
+    }
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't import from file (%d) in "
+                  "mode %d.", zx_ret, mode);
+    ck_assert_msg(new_index->list_count == old_index->list_count,
+                  "Couldn't match the number of checkpoints on new (%d) and "
+                  "old (%d) list.", new_index->list_count,
+                  old_index->list_count);
+}
+
+/**
+ * Exports index to a temporary file and imports it to another index. Index
+ * file is kept open, since lazy and mapped windows are loaded from it.
+ */
+static FILE* round_trip_index(zidx_index *old_index, zidx_index *new_index,
+                              enum import_mode mode,
+                              streamlike_t **index_stream)
+{
+    FILE *index_file;
+
+    index_file = export_index_file(old_index, index_stream);
+    import_index_file(new_index, old_index, index_file, *index_stream, mode);
+    return index_file;
+}
+
+/**
+ * Seeks to an offset relative to every stride-th checkpoint of index, starting
+ * from the second one, and checks data read there. Seeks go backwards, so
+ * data decoded for a seek isn't reused by the next one.
+ */
+static void check_checkpoint_seeks(zidx_index *index, int stride, long delta)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[1024];
+    int i;
+    long offset;
+    long length;
+
+    for (i = 1; i + stride < index->list_count; i += stride);
+    for (; i > 0 && i < index->list_count; i -= stride) {
+        offset = index->list[i].offset.uncomp + delta;
+        zx_ret = zidx_seek(index, offset);
+        ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld", zx_ret,
+                      offset);
+        length = index->uncompressed_size - offset < (long)sizeof(buffer)
+                 ? index->uncompressed_size - offset : (long)sizeof(buffer);
+        r_len = zidx_read(index, buffer, sizeof(buffer));
+        ck_assert_msg(r_len == length, "Read returned %d at offset %ld",
+                      r_len, offset);
+        ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                      "Incorrect data at offset %ld.", offset);
+    }
+}
+
+/**
+ * Writes index in the layout of index files written before optional
+ * checkpoint metadata was added. Those computed window offsets as if metadata
+ * of a checkpoint took 24 bytes, whereas it takes 28 bytes.
+ *
+ * \param index Index with raw windows.
+ * \param file  File to write to.
+ */
+static void write_legacy_index(zidx_index *index, FILE *file)
+{
+    const uint8_t zero[8] = {0};
+    int16_t type_of_file = 1;
+    int64_t i64;
+    int32_t i32;
+    int64_t window_off;
+    int i;
+    zidx_checkpoint *ckp;
+
+    #define WRITE_(buf, len) \
+        ck_assert_msg(fwrite(buf, 1, len, file) == (size_t)(len), \
+                      "Couldn't write legacy index.")
+
+    WRITE_(zx_magic_prefix, sizeof(zx_magic_prefix));
+    WRITE_(zx_version_prefix, sizeof(zx_version_prefix));
+    WRITE_(zero, 2);
+    WRITE_(zero, 4);
+    WRITE_(&type_of_file, 2);
+    i64 = index->compressed_size;
+    WRITE_(&i64, 8);
+    i64 = index->uncompressed_size;
+    WRITE_(&i64, 8);
+    WRITE_(zero, 4);
+    i32 = index->list_count;
+    WRITE_(&i32, 4);
+    WRITE_(zero, 4);
+    WRITE_(zero, 4);
+
+    window_off = ftell(file) + 24 * (int64_t)index->list_count;
+    for (i = 0; i < index->list_count; i++) {
+        ckp = &index->list[i];
+        i64 = ckp->offset.uncomp;
+        WRITE_(&i64, 8);
+        i64 = ckp->offset.comp;
+        WRITE_(&i64, 8);
+        WRITE_(&ckp->offset.comp_bits_count, 1);
+        WRITE_(ckp->offset.comp_bits_count ? &ckp->offset.comp_byte : zero, 1);
+        WRITE_(&window_off, 8);
+        WRITE_(&ckp->window_length, 2);
+        window_off += ckp->window_length;
+    }
+    for (i = 0; i < index->list_count; i++) {
+        ckp = &index->list[i];
+        if (ckp->window_length > 0) {
+            WRITE_(ckp->window_data, ckp->window_length);
+        }
+    }
+    ck_assert_msg(fflush(file) == 0, "Couldn't flush legacy index.");
+
+    #undef WRITE_
+}
+
+START_TEST(test_import_legacy)
+{
+    int zx_ret;
+    int j;
+
+    FILE *index_file;
+    streamlike_t *index_stream;
+    zidx_index *indices[2];
+    streamlike_t *streams[2];
+
+    ZX_LOG("TEST: Importing index file with the original layout.");
+
+    create_index_pair(comp_file, indices, streams);
+    zx_ret = zidx_build_index(indices[0], 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    index_file = tmpfile();
+    ck_assert_msg(index_file, "Couldn't open index file.");
+    write_legacy_index(indices[0], index_file);
+    index_stream = sl_fopen2(index_file);
+    ck_assert_msg(index_stream, "Couldn't create index stream.");
+
+    /* Imported eagerly, lazily and by mapping. */
+    for (j = IMPORT_EAGER; j <= IMPORT_MMAP; j++) {
+        import_index_file(indices[1], indices[0], index_file, index_stream,
+                          j);
+        check_checkpoint_seeks(indices[1], 1, 100);
+    }
+
+    destroy_index_pair(indices, streams);
+    sl_fclose(index_stream);
+    fclose(index_file);
+}
+END_TEST
+
+START_TEST(test_build_index_parallel)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[1024];
+    int i;
+    long offset;
+    long step = 1048573;
+
+    zidx_index *new_index;
+    streamlike_t *new_stream;
+    zidx_checkpoint *new_ckp;
+    zidx_checkpoint *old_ckp;
+
+    ZX_LOG("TEST: Building index in parallel.");
+
+    zx_ret = zidx_build_index(zx_index, 262144, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    new_index = zidx_index_create();
+    ck_assert_msg(new_index, "Couldn't create new index.");
+
+    new_stream = sl_fopen2(comp_file);
+    ck_assert_msg(new_stream, "Couldn't create new stream.");
+
+    zx_ret = zidx_index_init(new_index, new_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+
+    zx_ret = zidx_build_index_parallel(new_index, 262144, 1, 4);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index in "
+                  "parallel (%d).", zx_ret);
+
+    ck_assert_msg(new_index->list_count == zx_index->list_count,
+                  "Couldn't match the number of elements on new (%d) and old "
+                  "(%d) list.", new_index->list_count, zx_index->list_count);
+
+    ck_assert_msg(new_index->compressed_size == zx_index->compressed_size,
+                  "Couldn't match compressed sizes on new (%jd) and old (%jd) "
+                  "list.", (intmax_t)new_index->compressed_size,
+                  (intmax_t)zx_index->compressed_size);
+
+    ck_assert_msg(new_index->uncompressed_size == zx_index->uncompressed_size,
+                  "Couldn't match uncompressed sizes on new (%jd) and old "
+                  "(%jd) list.", (intmax_t)new_index->uncompressed_size,
+                  (intmax_t)zx_index->uncompressed_size);
+
+    for (i = 0; i < new_index->list_count; i++)
+    {
+        new_ckp = &new_index->list[i];
+        old_ckp = &zx_index->list[i];
+        ck_assert_msg(new_ckp->offset.uncomp == old_ckp->offset.uncomp
+                        && new_ckp->offset.comp == old_ckp->offset.comp
+                        && new_ckp->offset.comp_bits_count
+                            == old_ckp->offset.comp_bits_count
+                        && new_ckp->offset.comp_byte
+                            == old_ckp->offset.comp_byte,
+                      "Couldn't match offsets at checkpoint %d.", i);
+        ck_assert_msg(new_ckp->window_length == old_ckp->window_length,
+                      "Couldn't match window lengths at checkpoint %d.", i);
+        ck_assert_msg(!memcmp(new_ckp->window_data, old_ckp->window_data,
+                              new_ckp->window_length),
+                      "Couldn't match window data at checkpoint %d.", i);
+    }
+
+    for (offset = ZX_TEST_COMP_FILE_LENGTH - sizeof(buffer); offset > 0;
+            offset -= step) {
+        zx_ret = zidx_seek(new_index, offset);
+        ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                                   zx_ret, offset);
+
+        r_len = zidx_read(new_index, buffer, sizeof(buffer));
+        ck_assert_msg(r_len == sizeof(buffer), "Read returned %d at offset "
+                      "%ld", r_len, offset);
+
+        ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                      "Incorrect data at offset %ld.", offset);
+    }
+
+    zx_ret = zidx_index_destroy(new_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).", zx_ret);
+    free(new_index);
+    sl_fclose(new_stream);
+}
+END_TEST
+
+START_TEST(test_build_index_async)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[1024];
+    int i;
+    long offset;
+    long step = 1048573;
+    off_t comp_progress;
+    off_t uncomp_progress;
+
+    zidx_index *new_index;
+    streamlike_t *new_stream;
+    zidx_checkpoint *new_ckp;
+    zidx_checkpoint *old_ckp;
+
+    ZX_LOG("TEST: Building index in background.");
+
+    zx_ret = zidx_build_index(zx_index, 262144, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    new_index = zidx_index_create();
+    ck_assert_msg(new_index, "Couldn't create new index.");
+
+    new_stream = sl_fopen2(comp_file);
+    ck_assert_msg(new_stream, "Couldn't create new stream.");
+
+    zx_ret = zidx_index_init(new_index, new_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+
+    zx_ret = zidx_build_index_async(new_index, 262144, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't start building index in "
+                  "background (%d).", zx_ret);
+
+    zx_ret = zidx_build_index_async(new_index, 262144, 1);
+    ck_assert_msg(zx_ret == ZX_ERR_INVALID_OP, "Started building index in "
+                  "background twice (%d).", zx_ret);
+
+    /* Read while index is being built. */
+    for (offset = ZX_TEST_COMP_FILE_LENGTH - sizeof(buffer); offset > 0;
+            offset -= step) {
+        zx_ret = zidx_seek(new_index, offset);
+        ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                                   zx_ret, offset);
+
+        r_len = zidx_read(new_index, buffer, sizeof(buffer));
+        ck_assert_msg(r_len == sizeof(buffer), "Read returned %d at offset "
+                      "%ld", r_len, offset);
+
+        ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                      "Incorrect data at offset %ld.", offset);
+
+        zx_ret = zidx_build_index_async_progress(new_index, &comp_progress,
+                                                 &uncomp_progress);
+        ck_assert_msg(zx_ret >= 0, "Background build failed (%d).", zx_ret);
+    }
+
+    zx_ret = zidx_build_index_async_wait(new_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index in "
+                  "background (%d).", zx_ret);
+
+    ck_assert_msg(new_index->list_count == zx_index->list_count,
+                  "Couldn't match the number of elements on new (%d) and old "
+                  "(%d) list.", new_index->list_count, zx_index->list_count);
+
+    ck_assert_msg(new_index->uncompressed_size == zx_index->uncompressed_size,
+                  "Couldn't match uncompressed sizes on new (%jd) and old "
+                  "(%jd) list.", (intmax_t)new_index->uncompressed_size,
+                  (intmax_t)zx_index->uncompressed_size);
+
+    for (i = 0; i < new_index->list_count; i++)
+    {
+        new_ckp = &new_index->list[i];
+        old_ckp = &zx_index->list[i];
+        ck_assert_msg(new_ckp->offset.uncomp == old_ckp->offset.uncomp
+                        && new_ckp->offset.comp == old_ckp->offset.comp,
+                      "Couldn't match offsets at checkpoint %d.", i);
+        ck_assert_msg(new_ckp->window_length == old_ckp->window_length,
+                      "Couldn't match window lengths at checkpoint %d.", i);
+        ck_assert_msg(!memcmp(new_ckp->window_data, old_ckp->window_data,
+                              new_ckp->window_length),
+                      "Couldn't match window data at checkpoint %d.", i);
+    }
+
+    /* Reading should continue from where it's left. */
+    r_len = zidx_read(new_index, buffer, sizeof(buffer));
+    ck_assert_msg(r_len == sizeof(buffer), "Read returned %d at offset %ld",
+                  r_len, offset + step + (long)sizeof(buffer));
+    ck_assert_msg(memcmp(buffer, uncomp_data + offset + step + sizeof(buffer),
+                         r_len) == 0, "Incorrect data after background build.");
+
+    /* Cancel a build on a fresh index. */
+    zx_ret = zidx_index_destroy(new_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).", zx_ret);
+    zx_ret = zidx_index_init(new_index, new_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+
+    zx_ret = zidx_build_index_async(new_index, 262144, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't start building index in "
+                  "background (%d).", zx_ret);
+
+    zx_ret = zidx_build_index_async_cancel(new_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't cancel building index in "
+                  "background (%d).", zx_ret);
+
+    ck_assert_msg(new_index->list_count <= zx_index->list_count,
+                  "Canceled build has too many checkpoints (%d).",
+                  new_index->list_count);
+
+    zx_ret = zidx_build_index_async_progress(new_index, NULL, NULL);
+    ck_assert_msg(zx_ret == ZX_ERR_INVALID_OP, "Progress is reported after "
+                  "cancel (%d).", zx_ret);
+
+    zx_ret = zidx_index_destroy(new_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).", zx_ret);
+    free(new_index);
+    sl_fclose(new_stream);
+}
+END_TEST
+
+START_TEST(test_auto_checkpoint)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[1024];
+    int i;
+    int count;
+    long offset;
+    long step = 1048573;
+
+    zidx_index *new_index;
+    streamlike_t *new_stream;
+    zidx_checkpoint *new_ckp;
+    zidx_checkpoint *old_ckp;
+
+    ZX_LOG("TEST: Capturing checkpoints while reading.");
+
+    zx_ret = zidx_build_index(zx_index, 262144, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    new_index = zidx_index_create();
+    ck_assert_msg(new_index, "Couldn't create new index.");
+
+    new_stream = sl_fopen2(comp_file);
+    ck_assert_msg(new_stream, "Couldn't create new stream.");
+
+    zx_ret = zidx_index_init(new_index, new_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+
+    zx_ret = zidx_set_auto_checkpoint(new_index, 262144, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set automatic checkpoints "
+                  "(%d).", zx_ret);
+
+    /* Seek to the middle, then read the rest of file. */
+    zx_ret = zidx_seek(new_index, ZX_TEST_COMP_FILE_LENGTH / 2);
+    ck_assert_msg(zx_ret == 0, "Seek returned %d.", zx_ret);
+
+    count = new_index->list_count;
+    ck_assert_msg(count > 0, "No checkpoints captured while seeking.");
+
+    do {
+        r_len = zidx_read(new_index, buffer, sizeof(buffer));
+        ck_assert_msg(r_len >= 0, "Read returned %d.", r_len);
+    } while (r_len > 0);
+
+    ck_assert_msg(new_index->list_count == zx_index->list_count,
+                  "Couldn't match the number of elements on new (%d) and old "
+                  "(%d) list.", new_index->list_count, zx_index->list_count);
+
+    for (i = 0; i < new_index->list_count; i++)
+    {
+        new_ckp = &new_index->list[i];
+        old_ckp = &zx_index->list[i];
+        ck_assert_msg(new_ckp->offset.uncomp == old_ckp->offset.uncomp
+                        && new_ckp->offset.comp == old_ckp->offset.comp,
+                      "Couldn't match offsets at checkpoint %d.", i);
+        ck_assert_msg(new_ckp->window_length == old_ckp->window_length,
+                      "Couldn't match window lengths at checkpoint %d.", i);
+    }
+
+    /* Seeking in indexed region shouldn't add checkpoints. */
+    count = new_index->list_count;
+    for (offset = ZX_TEST_COMP_FILE_LENGTH - sizeof(buffer); offset > 0;
+            offset -= step) {
+        zx_ret = zidx_seek(new_index, offset);
+        ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                                   zx_ret, offset);
+
+        r_len = zidx_read(new_index, buffer, sizeof(buffer));
+        ck_assert_msg(r_len == sizeof(buffer), "Read returned %d at offset "
+                      "%ld", r_len, offset);
+
+        ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                      "Incorrect data at offset %ld.", offset);
+    }
+    ck_assert_msg(new_index->list_count == count, "Checkpoints are added "
+                  "while seeking in indexed region.");
+
+    zx_ret = zidx_index_destroy(new_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).", zx_ret);
+    free(new_index);
+    sl_fclose(new_stream);
+}
+END_TEST
+
+START_TEST(test_build_index_decode_cost)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[1024];
+    int i;
+    long offset;
+    long step = 1048573;
+
+    zidx_index *new_index;
+    streamlike_t *new_stream;
+
+    ZX_LOG("TEST: Building index with decoding cost spacing.");
+
+    zx_ret = zidx_build_index(zx_index, 262144, ZX_SPACING_UNCOMPRESSED);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    new_index = zidx_index_create();
+    ck_assert_msg(new_index, "Couldn't create new index.");
+
+    new_stream = sl_fopen2(comp_file);
+    ck_assert_msg(new_stream, "Couldn't create new stream.");
+    ck_assert_msg(sl_seek(new_stream, 0, SL_SEEK_SET) == 0,
+                  "Couldn't rewind stream.");
+
+    zx_ret = zidx_index_init(new_index, new_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+
+    /* Cost of uncompressed bytes only should be same as uncompressed
+     * spacing. */
+    zx_ret = zidx_set_spacing_cost(new_index, 0, 1, 0);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set cost weights (%d).",
+                  zx_ret);
+
+    zx_ret = zidx_build_index(new_index, 262144, ZX_SPACING_DECODE_COST);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    ck_assert_msg(new_index->list_count == zx_index->list_count,
+                  "Couldn't match the number of elements on new (%d) and old "
+                  "(%d) list.", new_index->list_count, zx_index->list_count);
+    for (i = 0; i < new_index->list_count; i++) {
+        ck_assert_msg(new_index->list[i].offset.uncomp
+                        == zx_index->list[i].offset.uncomp,
+                      "Couldn't match offsets at checkpoint %d.", i);
+    }
+
+    /* Build again with default weights. */
+    zx_ret = zidx_index_destroy(new_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).", zx_ret);
+    ck_assert_msg(sl_seek(new_stream, 0, SL_SEEK_SET) == 0,
+                  "Couldn't rewind stream.");
+    zx_ret = zidx_index_init(new_index, new_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+
+    zx_ret = zidx_build_index(new_index, 1048576, ZX_SPACING_DECODE_COST);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+    ck_assert_msg(new_index->list_count > 0, "No checkpoints are added.");
+
+    for (offset = ZX_TEST_COMP_FILE_LENGTH - sizeof(buffer); offset > 0;
+            offset -= step) {
+        zx_ret = zidx_seek(new_index, offset);
+        ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                                   zx_ret, offset);
+
+        r_len = zidx_read(new_index, buffer, sizeof(buffer));
+        ck_assert_msg(r_len == sizeof(buffer), "Read returned %d at offset "
+                      "%ld", r_len, offset);
+
+        ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                      "Incorrect data at offset %ld.", offset);
+    }
+
+    zx_ret = zidx_index_destroy(new_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).", zx_ret);
+    free(new_index);
+    sl_fclose(new_stream);
+}
+END_TEST
+
+typedef struct growing_file_s
+{
+    FILE *file;
+    uint8_t *data;
+    long length;
+    long written;
+    long step;
+} growing_file;
+
+static
+int grow_file(growing_file *growing)
+{
+    long len = growing->step;
+
+    if (growing->written + len > growing->length) {
+        len = growing->length - growing->written;
+    }
+    if (fseek(growing->file, 0, SEEK_END) != 0) return -1;
+    if (fwrite(growing->data + growing->written, 1, len, growing->file)
+            != (size_t)len) {
+        return -1;
+    }
+    if (fflush(growing->file) != 0) return -1;
+    growing->written += len;
+    return 0;
+}
+
+static
+int grow_file_callback(void *context, zidx_index *index)
+{
+    return grow_file((growing_file*)context);
+}
+
+START_TEST(test_update_index)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[1024];
+    int i;
+    int count;
+    long offset;
+    long step = 1048573;
+
+    growing_file growing;
+    FILE *index_file;
+    streamlike_t *index_stream;
+    zidx_index *new_index;
+    streamlike_t *new_stream;
+
+    ZX_LOG("TEST: Updating index of a growing file.");
+
+    zx_ret = zidx_build_index(zx_index, 262144, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    /* Copy compressed file to memory. */
+    growing.length = zx_index->compressed_size;
+    growing.data = malloc(growing.length);
+    ck_assert_msg(growing.data, "Couldn't allocate memory.");
+    ck_assert_msg(fseek(comp_file, 0, SEEK_SET) == 0,
+                  "Couldn't rewind compressed file.");
+    ck_assert_msg(fread(growing.data, 1, growing.length, comp_file)
+                    == (size_t)growing.length,
+                  "Couldn't read compressed file.");
+
+    growing.file = tmpfile();
+    ck_assert_msg(growing.file, "Couldn't create growing file.");
+    growing.written = 0;
+    growing.step = growing.length * 2 / 5;
+    ck_assert_msg(grow_file(&growing) == 0, "Couldn't grow file.");
+
+    new_stream = sl_fopen2(growing.file);
+    ck_assert_msg(new_stream, "Couldn't create new stream.");
+
+    new_index = zidx_index_create();
+    ck_assert_msg(new_index, "Couldn't create new index.");
+
+    zx_ret = zidx_index_init(new_index, new_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+
+    /* Index partial file. */
+    zx_ret = zidx_update_index(new_index, 262144, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't update index (%d).", zx_ret);
+    ck_assert_msg(!zidx_eof(new_index), "Partial file is indexed to EOF.");
+
+    count = new_index->list_count;
+    ck_assert_msg(count > 0, "No checkpoints are added.");
+
+    /* Export and import partial index. */
+    index_file = tmpfile();
+    ck_assert_msg(index_file, "Couldn't create index file.");
+    index_stream = sl_fopen2(index_file);
+    ck_assert_msg(index_stream, "Couldn't create index stream.");
+
+    zx_ret = zidx_export(new_index, index_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't export index (%d).", zx_ret);
+
+    zx_ret = zidx_index_destroy(new_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).", zx_ret);
+    zx_ret = zidx_index_init(new_index, new_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+
+    ck_assert_msg(sl_seek(index_stream, 0, SL_SEEK_SET) == 0,
+                  "Couldn't rewind index stream.");
+    zx_ret = zidx_import(new_index, index_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't import index (%d).", zx_ret);
+    ck_assert_msg(new_index->list_count == count, "Imported %d checkpoints "
+                  "instead of %d.", new_index->list_count, count);
+
+    sl_fclose(index_stream);
+    fclose(index_file);
+
+    /* Grow file, and resume indexing. */
+    ck_assert_msg(grow_file(&growing) == 0, "Couldn't grow file.");
+    zx_ret = zidx_update_index(new_index, 262144, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't update index (%d).", zx_ret);
+    ck_assert_msg(new_index->list_count > count, "No checkpoints are added "
+                  "after growing file.");
+
+    /* Follow the rest of file. Polling without interval needs a callback. */
+    zx_ret = zidx_follow_index(new_index, 262144, 1, 0, NULL, NULL);
+    ck_assert_msg(zx_ret == ZX_ERR_PARAMS, "Polling without interval and "
+                  "callback is accepted (%d).", zx_ret);
+    growing.step = growing.length / 20;
+    zx_ret = zidx_follow_index(new_index, 262144, 1, 0, grow_file_callback,
+                               &growing);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't follow index (%d).", zx_ret);
+    ck_assert_msg(zidx_eof(new_index), "File is not indexed to EOF.");
+    ck_assert_msg(growing.written == growing.length, "File is not grown to "
+                  "the end.");
+
+    ck_assert_msg(new_index->list_count == zx_index->list_count,
+                  "Couldn't match the number of elements on new (%d) and old "
+                  "(%d) list.", new_index->list_count, zx_index->list_count);
+    for (i = 0; i < new_index->list_count; i++) {
+        ck_assert_msg(new_index->list[i].offset.uncomp
+                        == zx_index->list[i].offset.uncomp
+                        && new_index->list[i].offset.comp
+                            == zx_index->list[i].offset.comp,
+                      "Couldn't match offsets at checkpoint %d.", i);
+    }
+    ck_assert_msg(new_index->uncompressed_size == zx_index->uncompressed_size,
+                  "Couldn't match uncompressed sizes on new (%jd) and old "
+                  "(%jd) list.", (intmax_t)new_index->uncompressed_size,
+                  (intmax_t)zx_index->uncompressed_size);
+
+    for (offset = ZX_TEST_COMP_FILE_LENGTH - sizeof(buffer); offset > 0;
+            offset -= step) {
+        zx_ret = zidx_seek(new_index, offset);
+        ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                                   zx_ret, offset);
+
+        r_len = zidx_read(new_index, buffer, sizeof(buffer));
+        ck_assert_msg(r_len == sizeof(buffer), "Read returned %d at offset "
+                      "%ld", r_len, offset);
+
+        ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                      "Incorrect data at offset %ld.", offset);
+    }
+
+    zx_ret = zidx_index_destroy(new_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).", zx_ret);
+    free(new_index);
+    sl_fclose(new_stream);
+    fclose(growing.file);
+    free(growing.data);
+}
+END_TEST
+
+static
+FILE* get_multi_member_file(const uint8_t *data, long length, int members)
+{
+    FILE *file;
+    gzFile gzf;
+    long start;
+    long end;
+    int fd;
+    int i;
+
+    file = tmpfile();
+    if (!file) return NULL;
+
+    /* Each member is written by a separate gzip stream appended to file. */
+    for (i = 0, start = 0; i < members; i++, start = end) {
+        end = (i == members - 1) ? length
+                                 : length / members * (i + 1) + 12345 * i;
+        fd = dup(fileno(file));
+        if (fd < 0) goto fail;
+        gzf = gzdopen(fd, "ab");
+        if (!gzf) {
+            close(fd);
+            goto fail;
+        }
+        if (gzwrite(gzf, data + start, end - start) != end - start) {
+            gzclose(gzf);
+            goto fail;
+        }
+        if (gzclose(gzf) != Z_OK) goto fail;
+    }
+
+    if (fseek(file, 0, SEEK_SET) != 0) goto fail;
+    return file;
+
+fail:
+    fclose(file);
+    return NULL;
+}
+
+START_TEST(test_multi_member)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[1024];
+    int i;
+    int j;
+    long offset;
+    long step = 1048573;
+    const int members = 5;
+    off_t comp;
+    off_t uncomp;
+    off_t imp_comp;
+    off_t imp_uncomp;
+
+    FILE *file;
+    FILE *index_file;
+    zidx_index *new_index;
+    zidx_index *par_index;
+    zidx_index *imp_index;
+    streamlike_t *new_stream;
+    streamlike_t *index_stream;
+    zidx_checkpoint *new_ckp;
+    zidx_checkpoint *par_ckp;
+    zidx_cursor *cursor;
+
+    ZX_LOG("TEST: Indexing concatenated gzip members.");
+
+    file = get_multi_member_file(uncomp_data, ZX_TEST_COMP_FILE_LENGTH,
+                                 members);
+    ck_assert_msg(file, "Couldn't create multi-member file.");
+
+    new_stream = sl_fopen2(file);
+    ck_assert_msg(new_stream, "Couldn't create new stream.");
+
+    new_index = zidx_index_create();
+    ck_assert_msg(new_index, "Couldn't create new index.");
+    zx_ret = zidx_index_init(new_index, new_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+
+    /* Read the whole file sequentially. */
+    template_comp_file_read(zidx_read, new_index);
+    ck_assert_msg(zidx_member_count(new_index) == members, "Read %d members "
+                  "instead of %d.", zidx_member_count(new_index), members);
+
+    zx_ret = zidx_rewind(new_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't rewind index (%d).", zx_ret);
+
+    zx_ret = zidx_build_index(new_index, 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+    ck_assert_msg(new_index->uncompressed_size == ZX_TEST_COMP_FILE_LENGTH,
+                  "Uncompressed size (%jd) is not correct.",
+                  (intmax_t)new_index->uncompressed_size);
+    ck_assert_msg(zidx_member_count(new_index) == members, "Found %d members "
+                  "instead of %d.", zidx_member_count(new_index), members);
+
+    /* Each member except the first one starts with a windowless checkpoint. */
+    for (i = 1; i < members; i++) {
+        zx_ret = zidx_get_member_offsets(new_index, i, &comp, &uncomp);
+        ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't get member %d (%d).", i,
+                      zx_ret);
+        ck_assert_msg(uncomp == ZX_TEST_COMP_FILE_LENGTH / members * i
+                                    + 12345 * (i - 1),
+                      "Member %d starts at wrong offset (%jd).", i,
+                      (intmax_t)uncomp);
+
+        j = zidx_get_checkpoint_idx(new_index, uncomp);
+        ck_assert_msg(j >= 0, "Checkpoint of member %d is not found.", i);
+        new_ckp = zidx_get_checkpoint(new_index, j);
+        ck_assert_msg(new_ckp->offset.uncomp == uncomp
+                        && new_ckp->window_length == 0,
+                      "Member %d doesn't start with a windowless checkpoint.",
+                      i);
+    }
+
+    for (offset = ZX_TEST_COMP_FILE_LENGTH - sizeof(buffer); offset > 0;
+            offset -= step) {
+        zx_ret = zidx_seek(new_index, offset);
+        ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                                   zx_ret, offset);
+
+        r_len = zidx_read(new_index, buffer, sizeof(buffer));
+        ck_assert_msg(r_len == sizeof(buffer), "Read returned %d at offset "
+                      "%ld", r_len, offset);
+
+        ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                      "Incorrect data at offset %ld.", offset);
+    }
+
+    /* Build the same index in parallel. */
+    par_index = zidx_index_create();
+    ck_assert_msg(par_index, "Couldn't create new index.");
+    zx_ret = zidx_index_init(par_index, new_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+
+    zx_ret = zidx_build_index_parallel(par_index, 1048576, 1, 4);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index in "
+                  "parallel (%d).", zx_ret);
+
+    ck_assert_msg(zidx_member_count(par_index) == members, "Found %d members "
+                  "in parallel instead of %d.", zidx_member_count(par_index),
+                  members);
+    ck_assert_msg(par_index->list_count == new_index->list_count,
+                  "Couldn't match the number of elements on parallel (%d) and "
+                  "serial (%d) list.", par_index->list_count,
+                  new_index->list_count);
+    for (i = 0; i < par_index->list_count; i++) {
+        par_ckp = &par_index->list[i];
+        new_ckp = &new_index->list[i];
+        ck_assert_msg(par_ckp->offset.uncomp == new_ckp->offset.uncomp
+                        && par_ckp->offset.comp == new_ckp->offset.comp
+                        && par_ckp->window_length == new_ckp->window_length,
+                      "Couldn't match checkpoint %d.", i);
+    }
+
+    zx_ret = zidx_index_destroy(par_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).", zx_ret);
+    free(par_index);
+
+    /* Members are exported along with checkpoints. */
+    imp_index = zidx_index_create();
+    ck_assert_msg(imp_index, "Couldn't create new index.");
+    zx_ret = zidx_index_init(imp_index, new_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+    index_file = round_trip_index(new_index, imp_index, IMPORT_EAGER,
+                                  &index_stream);
+    ck_assert_msg(zidx_member_count(imp_index) == members, "Imported %d "
+                  "members instead of %d.", zidx_member_count(imp_index),
+                  members);
+    for (i = 0; i < members; i++) {
+        zidx_get_member_offsets(new_index, i, &comp, &uncomp);
+        zx_ret = zidx_get_member_offsets(imp_index, i, &imp_comp,
+                                         &imp_uncomp);
+        ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't get member %d (%d).", i,
+                      zx_ret);
+        ck_assert_msg(imp_comp == comp && imp_uncomp == uncomp,
+                      "Couldn't match member %d.", i);
+    }
+
+    /* Cursors get members of imported index. */
+    cursor = zidx_cursor_create(imp_index, new_stream);
+    ck_assert_msg(cursor, "Couldn't create cursor.");
+    ck_assert_msg(cursor->view.members_count == members,
+                  "Cursor has %d members instead of %d.",
+                  cursor->view.members_count, members);
+    offset = ZX_TEST_COMP_FILE_LENGTH / members * 3 + 1000;
+    zx_ret = zidx_cursor_seek(cursor, offset);
+    ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld", zx_ret,
+                  offset);
+    r_len = zidx_cursor_read(cursor, buffer, sizeof(buffer));
+    ck_assert_msg(r_len == sizeof(buffer), "Read returned %d at offset %ld",
+                  r_len, offset);
+    ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                  "Incorrect data at offset %ld.", offset);
+    zx_ret = zidx_cursor_destroy(cursor);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy cursor (%d).",
+                  zx_ret);
+
+    zx_ret = zidx_index_destroy(imp_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).", zx_ret);
+    free(imp_index);
+    sl_fclose(index_stream);
+    fclose(index_file);
+
+    zx_ret = zidx_index_destroy(new_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).", zx_ret);
+    free(new_index);
+    sl_fclose(new_stream);
+    fclose(file);
+}
+END_TEST
+
+static
+FILE* get_bgzf_file(const uint8_t *data, long length, int *members)
+{
+    /* Empty member marking the end of a BGZF file. */
+    static const uint8_t eof_member[28] = {
+        0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+        0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00
+    };
+    const long max_block = 65280;
+    uint8_t member[65536];
+    z_stream zs;
+    FILE *file;
+    long start;
+    long len;
+    long size;
+    uLong crc;
+
+    file = tmpfile();
+    if (!file) return NULL;
+
+    *members = 0;
+    for (start = 0; start < length; start += len) {
+        len = length - start < max_block ? length - start : max_block;
+
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            goto fail;
+        }
+        zs.next_in   = (uint8_t*)data + start;
+        zs.avail_in  = len;
+        zs.next_out  = member + 18;
+        zs.avail_out = sizeof(member) - 26;
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+            deflateEnd(&zs);
+            goto fail;
+        }
+        size = 18 + zs.total_out + 8;
+        deflateEnd(&zs);
+
+        /* Header with BC subfield keeping size of member minus one. */
+        memcpy(member, eof_member, 18);
+        member[16] = (size - 1) & 0xff;
+        member[17] = (size - 1) >> 8;
+
+        /* Trailer. */
+        crc = crc32(0L, data + start, len);
+        member[size - 8] = crc & 0xff;
+        member[size - 7] = (crc >> 8) & 0xff;
+        member[size - 6] = (crc >> 16) & 0xff;
+        member[size - 5] = (crc >> 24) & 0xff;
+        member[size - 4] = len & 0xff;
+        member[size - 3] = (len >> 8) & 0xff;
+        member[size - 2] = (len >> 16) & 0xff;
+        member[size - 1] = (len >> 24) & 0xff;
+
+        if (fwrite(member, 1, size, file) != (size_t)size) goto fail;
+        (*members)++;
+    }
+    if (fwrite(eof_member, 1, sizeof(eof_member), file)
+            != sizeof(eof_member)) {
+        goto fail;
+    }
+    (*members)++;
+
+    if (fseek(file, 0, SEEK_SET) != 0) goto fail;
+    return file;
+
+fail:
+    fclose(file);
+    return NULL;
+}
+
+START_TEST(test_bgzf)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[1024];
+    int i;
+    int members;
+    long offset;
+    long step = 1048573;
+    off_t comp;
+    off_t uncomp;
+
+    FILE *file;
+    zidx_index *new_index;
+    streamlike_t *new_stream;
+    zidx_checkpoint *ckp;
+
+    ZX_LOG("TEST: Building index of a BGZF file.");
+
+    file = get_bgzf_file(uncomp_data, ZX_TEST_COMP_FILE_LENGTH, &members);
+    ck_assert_msg(file, "Couldn't create BGZF file.");
+
+    new_stream = sl_fopen2(file);
+    ck_assert_msg(new_stream, "Couldn't create new stream.");
+
+    /* Stream isn't read by initialization, and it's positioned back after
+     * format is detected. */
+    ck_assert_msg(sl_seek(new_stream, 100, SL_SEEK_SET) == 0,
+                  "Couldn't seek stream.");
+    new_index = zidx_index_create();
+    ck_assert_msg(new_index, "Couldn't create new index.");
+    zx_ret = zidx_index_init(new_index, new_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+    ck_assert_msg(sl_tell(new_stream) == 100, "Stream is moved to %jd.",
+                  (intmax_t)sl_tell(new_stream));
+    ck_assert_msg(zidx_is_bgzf(new_index), "BGZF file is not detected.");
+    ck_assert_msg(!zidx_is_bgzf(zx_index), "Gzip file is detected as BGZF.");
+    ck_assert_msg(sl_tell(new_stream) == 100, "Stream is moved to %jd.",
+                  (intmax_t)sl_tell(new_stream));
+    ck_assert_msg(sl_seek(new_stream, 0, SL_SEEK_SET) == 0,
+                  "Couldn't rewind stream.");
+
+    zx_ret = zidx_build_index(new_index, 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+    ck_assert_msg(zidx_eof(new_index), "Index is not built to EOF.");
+    ck_assert_msg(new_index->uncompressed_size == ZX_TEST_COMP_FILE_LENGTH,
+                  "Uncompressed size (%jd) is not correct.",
+                  (intmax_t)new_index->uncompressed_size);
+    ck_assert_msg(zidx_member_count(new_index) == members, "Found %d members "
+                  "instead of %d.", zidx_member_count(new_index), members);
+
+    /* Every member except the first one and the empty one at the end starts
+     * with a windowless checkpoint. */
+    ck_assert_msg(new_index->list_count == members - 1, "Added %d checkpoints "
+                  "instead of %d.", new_index->list_count, members - 1);
+    for (i = 0; i < new_index->list_count; i++) {
+        ckp = zidx_get_checkpoint(new_index, i);
+        zx_ret = zidx_get_member_offsets(new_index, i + 1, &comp, &uncomp);
+        ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't get member %d (%d).",
+                      i + 1, zx_ret);
+        ck_assert_msg(ckp->offset.uncomp == uncomp
+                        && ckp->offset.comp == comp + 18
+                        && ckp->window_length == 0,
+                      "Checkpoint %d doesn't match member %d.", i, i + 1);
+    }
+
+    for (offset = ZX_TEST_COMP_FILE_LENGTH - sizeof(buffer); offset > 0;
+            offset -= step) {
+        zx_ret = zidx_seek(new_index, offset);
+        ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                                   zx_ret, offset);
+
+        r_len = zidx_read(new_index, buffer, sizeof(buffer));
+        ck_assert_msg(r_len == sizeof(buffer), "Read returned %d at offset "
+                      "%ld", r_len, offset);
+
+        ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                      "Incorrect data at offset %ld.", offset);
+    }
+
+    zx_ret = zidx_index_destroy(new_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).", zx_ret);
+    free(new_index);
+    sl_fclose(new_stream);
+    fclose(file);
+}
+END_TEST
+
+START_TEST(test_inflate_backend)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[1024];
+    long offset;
+    long step = 1048573;
+
+    zidx_index *new_index;
+    streamlike_t *new_stream;
+
+    ZX_LOG("TEST: Selecting inflate backend.");
+
+    new_index = zidx_index_create();
+    ck_assert_msg(new_index, "Couldn't create new index.");
+
+    new_stream = sl_fopen2(comp_file);
+    ck_assert_msg(new_stream, "Couldn't create new stream.");
+
+    zx_ret = zidx_index_init(new_index, new_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+    ck_assert_msg(zidx_get_inflate_backend(new_index)
+                    == ZX_DEFAULT_INFLATE_BACKEND,
+                  "Default inflate backend is not selected.");
+
+    zx_ret = zidx_set_inflate_backend(new_index, ZX_BACKEND_ISAL);
+    ck_assert_msg(zx_ret == ZX_ERR_NOT_IMPLEMENTED, "Unavailable backend is "
+                  "selected (%d).", zx_ret);
+
+    zx_ret = zidx_set_inflate_backend(new_index, ZX_BACKEND_ZLIB);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't select zlib backend (%d).",
+                  zx_ret);
+    ck_assert_msg(zidx_get_inflate_backend(new_index) == ZX_BACKEND_ZLIB,
+                  "zlib backend is not selected.");
+
+#ifdef HAVE_ZLIB_NG
+    zx_ret = zidx_set_inflate_backend(new_index, ZX_BACKEND_ZLIB_NG);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't select zlib-ng backend (%d).",
+                  zx_ret);
+#endif
+
+    zx_ret = zidx_build_index(new_index, 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    zx_ret = zidx_set_inflate_backend(new_index, ZX_BACKEND_ZLIB);
+    ck_assert_msg(zx_ret == ZX_ERR_INVALID_OP, "Backend is changed after "
+                  "inflate is initialized (%d).", zx_ret);
+
+    for (offset = ZX_TEST_COMP_FILE_LENGTH - sizeof(buffer); offset > 0;
+            offset -= step) {
+        zx_ret = zidx_seek(new_index, offset);
+        ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                                   zx_ret, offset);
+
+        r_len = zidx_read(new_index, buffer, sizeof(buffer));
+        ck_assert_msg(r_len == sizeof(buffer), "Read returned %d at offset "
+                      "%ld", r_len, offset);
+
+        ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                      "Incorrect data at offset %ld.", offset);
+    }
+
+    zx_ret = zidx_index_destroy(new_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).", zx_ret);
+    free(new_index);
+    sl_fclose(new_stream);
+}
+END_TEST
+
+FILE* get_stored_file(const uint8_t *data, long length)
+{
+    FILE *file;
+    gzFile gzf;
+    int fd;
+
+    file = tmpfile();
+    if (!file) return NULL;
+
+    /* Compression level 0 produces stored blocks only. */
+    fd = dup(fileno(file));
+    if (fd < 0) goto fail;
+    gzf = gzdopen(fd, "wb0");
+    if (!gzf) {
+        close(fd);
+        goto fail;
+    }
+    if (gzwrite(gzf, data, length) != length) {
+        gzclose(gzf);
+        goto fail;
+    }
+    if (gzclose(gzf) != Z_OK) goto fail;
+
+    if (fseek(file, 0, SEEK_SET) != 0) goto fail;
+    return file;
+
+fail:
+    fclose(file);
+    return NULL;
+}
+
+/* Builds index with checkpoints inside blocks, checks spacing, and seeks to
+ * offsets on both built index and its imported copy. */
+void template_intra_block(FILE *file, off_t spacing_length, int step_length)
+{
+    int zx_ret;
+    int i;
+    int in_block;
+    off_t last_uncomp;
+
+    FILE *index_file;
+    streamlike_t *index_stream;
+    zidx_index *indices[2];
+    streamlike_t *streams[2];
+    zidx_checkpoint *new_ckp;
+    zidx_checkpoint *old_ckp;
+
+    create_index_pair(file, indices, streams);
+    zx_ret = zidx_set_intra_block_checkpoints(indices[0], step_length);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't enable checkpoints inside "
+                  "blocks (%d).", zx_ret);
+
+    zx_ret = zidx_build_index(indices[0], spacing_length, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    /* Checkpoints shouldn't be further apart than spacing, plus the distance
+     * decoded until the next candidate. */
+    in_block = 0;
+    last_uncomp = 0;
+    for (i = 0; i < indices[0]->list_count; i++) {
+        new_ckp = &indices[0]->list[i];
+        ck_assert_msg(new_ckp->offset.uncomp - last_uncomp
+                        <= spacing_length + 2 * step_length,
+                      "Checkpoint %d is %jd bytes after the previous one.", i,
+                      (intmax_t)(new_ckp->offset.uncomp - last_uncomp));
+        ck_assert_msg(!new_ckp->offset.in_block
+                        || new_ckp->block_header_bits > 0,
+                      "Checkpoint %d inside block doesn't have block header.",
+                      i);
+        in_block += new_ckp->offset.in_block;
+        last_uncomp = new_ckp->offset.uncomp;
+    }
+    ck_assert_msg(in_block > 0, "No checkpoints are placed inside blocks.");
+
+    index_file = round_trip_index(indices[0], indices[1], IMPORT_EAGER,
+                                  &index_stream);
+    for (i = 0; i < indices[1]->list_count; i++) {
+        new_ckp = &indices[1]->list[i];
+        old_ckp = &indices[0]->list[i];
+        ck_assert_msg(new_ckp->offset.in_block == old_ckp->offset.in_block
+                        && new_ckp->block_header_bits
+                               == old_ckp->block_header_bits,
+                      "Couldn't match block headers at checkpoint %d.", i);
+        if (new_ckp->offset.in_block) {
+            ck_assert_msg(!memcmp(new_ckp->block_header,
+                                  old_ckp->block_header,
+                                  (new_ckp->block_header_bits + 7) / 8),
+                          "Couldn't match block header at checkpoint %d.", i);
+        }
+    }
+
+    /* Seeks land inside blocks, between checkpoints. */
+    for (i = 0; i < 2; i++) {
+        check_checkpoint_seeks(indices[i], 1, -spacing_length / 2);
+    }
+
+    destroy_index_pair(indices, streams);
+    sl_fclose(index_stream);
+    fclose(index_file);
+}
+
+START_TEST(test_intra_block)
+{
+    FILE *file;
+    long length = ZX_TEST_COMP_FILE_LENGTH / 4;
+
+    ZX_LOG("TEST: Placing checkpoints inside deflate blocks.");
+
+    /* Spacing is larger than compressed blocks of test file, but not a
+     * multiple of their length. */
+    template_intra_block(comp_file, 40000, 4096);
+
+    /* Stored blocks. */
+    file = get_stored_file(uncomp_data, length);
+    ck_assert_msg(file, "Couldn't create file with stored blocks.");
+    template_intra_block(file, 20000, 4096);
+    fclose(file);
+}
+END_TEST
+
+START_TEST(test_window_compression)
+{
+    int zx_ret;
+    int i;
+    long raw_length;
+    long stored_length;
+    const void *window;
+
+    FILE *index_file;
+    streamlike_t *index_stream;
+    zidx_index *indices[2];
+    streamlike_t *streams[2];
+    zidx_checkpoint *new_ckp;
+    zidx_checkpoint *old_ckp;
+
+    ZX_LOG("TEST: Compressing checkpoint windows.");
+
+    create_index_pair(comp_file, indices, streams);
+    zx_ret = zidx_set_window_compression(indices[0],
+                                         (zidx_window_compression)2,
+                                         ZX_DEFAULT_WINDOW_COMPRESSION_LEVEL);
+    ck_assert_msg(zx_ret == ZX_ERR_PARAMS, "Unknown window compression is "
+                  "accepted (%d).", zx_ret);
+    zx_ret = zidx_set_window_compression(indices[0], ZX_WINDOW_DEFLATE,
+                                         ZX_DEFAULT_WINDOW_COMPRESSION_LEVEL);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't enable window compression "
+                  "(%d).", zx_ret);
+
+    zx_ret = zidx_build_index(indices[0], 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    /* Windows of test file are compressible, since it consists of bytes less
+     * than 100. */
+    raw_length = 0;
+    stored_length = 0;
+    for (i = 0; i < indices[0]->list_count; i++) {
+        old_ckp = &indices[0]->list[i];
+        raw_length += old_ckp->window_length;
+        stored_length += old_ckp->window_comp_length > 0
+                            ? old_ckp->window_comp_length
+                            : old_ckp->window_length;
+        if (old_ckp->window_comp_length > 0) {
+            ck_assert_msg(zidx_get_checkpoint_window(old_ckp, &window) == 0,
+                          "Compressed window is returned as is.");
+        }
+    }
+    ck_assert_msg(stored_length < raw_length, "Windows are not compressed "
+                  "(%ld/%ld).", stored_length, raw_length);
+
+    index_file = round_trip_index(indices[0], indices[1], IMPORT_EAGER,
+                                  &index_stream);
+    for (i = 0; i < indices[1]->list_count; i++) {
+        new_ckp = &indices[1]->list[i];
+        old_ckp = &indices[0]->list[i];
+        ck_assert_msg(new_ckp->window_comp_length
+                        == old_ckp->window_comp_length,
+                      "Couldn't match compressed window length at checkpoint "
+                      "%d.", i);
+        ck_assert_msg(!memcmp(new_ckp->window_data, old_ckp->window_data,
+                              new_ckp->window_comp_length > 0
+                                ? new_ckp->window_comp_length
+                                : new_ckp->window_length),
+                      "Couldn't match window at checkpoint %d.", i);
+    }
+
+    for (i = 0; i < 2; i++) {
+        check_checkpoint_seeks(indices[i], 1, -524288);
+    }
+
+    destroy_index_pair(indices, streams);
+    sl_fclose(index_stream);
+    fclose(index_file);
+}
+END_TEST
+
+START_TEST(test_sparse_windows)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t *buffer;
+    long buffer_size = 3 * (1 << 20);
+    int i;
+    long offset;
+    long raw_length;
+    long stored_length;
+    int sparse_count;
+
+    FILE *index_file;
+    streamlike_t *index_stream;
+    zidx_index *indices[2];
+    streamlike_t *streams[2];
+    zidx_checkpoint *new_ckp;
+    zidx_checkpoint *old_ckp;
+
+    ZX_LOG("TEST: Building index with sparse windows.");
+
+    buffer = malloc(buffer_size);
+    ck_assert_msg(buffer, "Couldn't allocate buffer.");
+
+    create_index_pair(comp_file, indices, streams);
+    zx_ret = zidx_set_sparse_windows(indices[0], 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't enable sparse windows (%d).",
+                  zx_ret);
+
+    zx_ret = zidx_build_index(indices[0], 262144, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    raw_length = 0;
+    stored_length = 0;
+    sparse_count = 0;
+    for (i = 0; i < indices[0]->list_count; i++) {
+        old_ckp = &indices[0]->list[i];
+        raw_length += old_ckp->window_length;
+        stored_length += old_ckp->is_window_sparse
+                            ? 4 * old_ckp->window_ranges_count
+                                  + window_content_length(old_ckp)
+                            : old_ckp->window_length;
+        sparse_count += old_ckp->is_window_sparse;
+    }
+    ck_assert_msg(sparse_count > 0, "No windows are sparse.");
+    ck_assert_msg(stored_length < raw_length, "Sparse windows are not smaller "
+                  "(%ld/%ld).", stored_length, raw_length);
+
+    index_file = round_trip_index(indices[0], indices[1], IMPORT_EAGER,
+                                  &index_stream);
+    for (i = 0; i < indices[1]->list_count; i++) {
+        new_ckp = &indices[1]->list[i];
+        old_ckp = &indices[0]->list[i];
+        ck_assert_msg(new_ckp->is_window_sparse == old_ckp->is_window_sparse
+                        && new_ckp->window_ranges_count
+                               == old_ckp->window_ranges_count,
+                      "Couldn't match sparse window at checkpoint %d.", i);
+        ck_assert_msg(!memcmp(new_ckp->window_ranges, old_ckp->window_ranges,
+                              4 * new_ckp->window_ranges_count),
+                      "Couldn't match window ranges at checkpoint %d.", i);
+    }
+
+    /* Reads crossing checkpoints continue from the next checkpoint, since
+     * sparse windows are valid only until then. */
+    for (i = 0; i < 2; i++) {
+        check_checkpoint_seeks(indices[i], 3, -512);
+
+        offset = 1000;
+        zx_ret = zidx_seek(indices[i], offset);
+        ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld", zx_ret,
+                                   offset);
+        r_len = zidx_read(indices[i], buffer, buffer_size);
+        ck_assert_msg(r_len == buffer_size, "Read returned %d at offset %ld",
+                      r_len, offset);
+        ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                      "Incorrect data at offset %ld.", offset);
+    }
+
+    destroy_index_pair(indices, streams);
+    sl_fclose(index_stream);
+    fclose(index_file);
+    free(buffer);
+}
+END_TEST
+
+START_TEST(test_lazy_import)
+{
+    int zx_ret;
+    int i;
+    int loaded_count;
+
+    FILE *index_file;
+    streamlike_t *index_stream;
+    zidx_index *indices[2];
+    streamlike_t *streams[2];
+    zidx_checkpoint *new_ckp;
+    zidx_checkpoint *old_ckp;
+
+    ZX_LOG("TEST: Importing index lazily.");
+
+    create_index_pair(comp_file, indices, streams);
+    zx_ret = zidx_set_intra_block_checkpoints(indices[0], 65536);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set intra block step (%d).",
+                  zx_ret);
+    zx_ret = zidx_set_window_compression(indices[0], ZX_WINDOW_DEFLATE, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set window compression (%d).",
+                  zx_ret);
+    zx_ret = zidx_build_index(indices[0], 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    index_file = round_trip_index(indices[0], indices[1], IMPORT_LAZY,
+                                  &index_stream);
+    for (i = 0; i < indices[1]->list_count; i++) {
+        new_ckp = &indices[1]->list[i];
+        ck_assert_msg(new_ckp->window_data == NULL
+                          && new_ckp->block_header == NULL,
+                      "Window of checkpoint %d is loaded on import.", i);
+    }
+
+    /* Only windows of checkpoints jumped to are loaded. */
+    check_checkpoint_seeks(indices[1], 4, 100);
+
+    loaded_count = 0;
+    for (i = 0; i < indices[1]->list_count; i++) {
+        new_ckp = &indices[1]->list[i];
+        old_ckp = &indices[0]->list[i];
+        if (new_ckp->is_window_lazy) {
+            ck_assert_msg(new_ckp->window_data == NULL,
+                          "Lazy window of checkpoint %d has data.", i);
+            continue;
+        }
+        loaded_count++;
+        ck_assert_msg(i % 4 == 1, "Window of checkpoint %d is loaded.", i);
+        ck_assert_msg(!memcmp(new_ckp->window_data, old_ckp->window_data,
+                              stored_window_length(old_ckp)),
+                      "Couldn't match window at checkpoint %d.", i);
+        ck_assert_msg(new_ckp->block_header_bits == 0
+                          || !memcmp(new_ckp->block_header,
+                                     old_ckp->block_header,
+                                     (new_ckp->block_header_bits + 7) / 8),
+                      "Couldn't match block header at checkpoint %d.", i);
+    }
+    ck_assert_msg(loaded_count > 0 && loaded_count < indices[1]->list_count,
+                  "Unexpected number of loaded windows (%d/%d).",
+                  loaded_count, indices[1]->list_count);
+
+    destroy_index_pair(indices, streams);
+    sl_fclose(index_stream);
+    fclose(index_file);
+}
+END_TEST
+
+START_TEST(test_mmap_import)
+{
+    int zx_ret;
+    int i, j;
+
+    FILE *index_file;
+    streamlike_t *index_stream;
+    zidx_index *indices[2];
+    streamlike_t *streams[2];
+    zidx_checkpoint *new_ckp;
+    zidx_checkpoint *old_ckp;
+
+    ZX_LOG("TEST: Importing index by mapping it to memory.");
+
+    create_index_pair(comp_file, indices, streams);
+    zx_ret = zidx_set_intra_block_checkpoints(indices[0], 65536);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set intra block step (%d).",
+                  zx_ret);
+    zx_ret = zidx_set_sparse_windows(indices[0], 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't enable sparse windows (%d).",
+                  zx_ret);
+    zx_ret = zidx_set_export_alignment(indices[0], 3000);
+    ck_assert_msg(zx_ret == ZX_ERR_PARAMS, "Alignment should be a power of "
+                  "two (%d).", zx_ret);
+    zx_ret = zidx_set_export_alignment(indices[0], 4096);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set export alignment (%d).",
+                  zx_ret);
+    zx_ret = zidx_build_index(indices[0], 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    /* Windows are mapped, then read again from the same file, which releases
+     * the mapping. */
+    index_file = export_index_file(indices[0], &index_stream);
+    for (j = 0; j < 2; j++) {
+        import_index_file(indices[1], indices[0], index_file, index_stream,
+                          j == 0 ? IMPORT_MMAP : IMPORT_EAGER);
+        ck_assert_msg(indices[1]->list[0].window_offset % 4096 == 0,
+                      "Window data is not aligned (%ld).",
+                      (long)indices[1]->list[0].window_offset);
+        ck_assert_msg((indices[1]->map_data != NULL) == (j == 0),
+                      "Unexpected mapping of index file.");
+
+        for (i = 0; i < indices[1]->list_count; i++) {
+            new_ckp = &indices[1]->list[i];
+            old_ckp = &indices[0]->list[i];
+            ck_assert_msg(new_ckp->is_window_mapped == (j == 0),
+                          "Unexpected mapping of checkpoint %d.", i);
+            ck_assert_msg(j != 0 || new_ckp->window_data == NULL
+                              || new_ckp->window_data == indices[1]->map_data
+                                     + new_ckp->window_offset
+                                     + 4 * new_ckp->window_ranges_count,
+                          "Window of checkpoint %d is not in mapping.", i);
+            ck_assert_msg(new_ckp->window_ranges_count
+                              == old_ckp->window_ranges_count
+                              && !memcmp(new_ckp->window_ranges,
+                                         old_ckp->window_ranges,
+                                         4 * new_ckp->window_ranges_count),
+                          "Couldn't match window ranges at checkpoint %d.", i);
+            ck_assert_msg(!memcmp(new_ckp->window_data, old_ckp->window_data,
+                                  stored_window_length(old_ckp)),
+                          "Couldn't match window at checkpoint %d.", i);
+            ck_assert_msg(new_ckp->block_header_bits == 0
+                              || !memcmp(new_ckp->block_header,
+                                         old_ckp->block_header,
+                                         (new_ckp->block_header_bits + 7) / 8),
+                          "Couldn't match block header at checkpoint %d.", i);
+        }
+
+        check_checkpoint_seeks(indices[1], 3, -512);
+    }
+
+    destroy_index_pair(indices, streams);
+    sl_fclose(index_stream);
+    fclose(index_file);
+}
+END_TEST
+
+START_TEST(test_window_budget)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[1024];
+    int i, j;
+    long offset;
+    size_t memory_usage;
+    unsigned long evictions;
+
+    FILE *index_file;
+    streamlike_t *index_stream;
+    zidx_index *indices[2];
+    streamlike_t *streams[2];
+    zidx_cursor *cursor;
+
+    ZX_LOG("TEST: Limiting memory used by windows.");
+
+    create_index_pair(comp_file, indices, streams);
+    for (i = 0; i < 2; i++) {
+        zx_ret = zidx_set_window_budget(indices[i], 65536);
+        ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set window budget (%d).",
+                      zx_ret);
+    }
+
+    zx_ret = zidx_set_intra_block_checkpoints(indices[0], 65536);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set intra block step (%d).",
+                  zx_ret);
+    zx_ret = zidx_set_window_compression(indices[0], ZX_WINDOW_DEFLATE, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set window compression (%d).",
+                  zx_ret);
+    zx_ret = zidx_set_sparse_windows(indices[0], 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't enable sparse windows (%d).",
+                  zx_ret);
+    zx_ret = zidx_build_index(indices[0], 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    zx_ret = zidx_get_window_stats(indices[0], &memory_usage, &evictions);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't get window stats (%d).",
+                  zx_ret);
+    ck_assert_msg(memory_usage <= 65536, "Window memory (%zu) is over "
+                  "budget.", memory_usage);
+    ck_assert_msg(evictions > 0, "No window is evicted while building.");
+
+    /* Evicted windows are regenerated for export. */
+    index_file = round_trip_index(indices[0], indices[1], IMPORT_LAZY,
+                                  &index_stream);
+
+    /* Windows are regenerated on the first index and reloaded from index file
+     * on the second one. Seeks go backwards to avoid reusing decoded data. */
+    for (j = 0; j < 2; j++) {
+        for (i = indices[j]->list_count - 1; i > 0; i--) {
+            offset = indices[j]->list[i].offset.uncomp + 100;
+            zx_ret = zidx_seek(indices[j], offset);
+            ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                                       zx_ret, offset);
+            r_len = zidx_read(indices[j], buffer, sizeof(buffer));
+            ck_assert_msg(r_len == sizeof(buffer),
+                          "Read returned %d at offset %ld", r_len, offset);
+            ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                          "Incorrect data at offset %ld.", offset);
+
+            zx_ret = zidx_get_window_stats(indices[j], &memory_usage,
+                                           &evictions);
+            ck_assert_msg(zx_ret == ZX_RET_OK,
+                          "Couldn't get window stats (%d).", zx_ret);
+            ck_assert_msg(memory_usage <= 65536, "Window memory (%zu) is "
+                          "over budget.", memory_usage);
+        }
+        ck_assert_msg(evictions > 0, "No window is evicted on index %d.", j);
+    }
+
+    /* Budget can't be set while windows are shared by cursors or by pool of
+     * positional reads. */
+    zx_ret = zidx_set_window_budget(indices[1], 0);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't unset window budget (%d).",
+                  zx_ret);
+    cursor = zidx_cursor_create(indices[1], streams[1]);
+    ck_assert_msg(cursor, "Couldn't create cursor.");
+    zx_ret = zidx_set_window_budget(indices[1], 65536);
+    ck_assert_msg(zx_ret == ZX_ERR_INVALID_OP, "Budget is set while index has "
+                  "a cursor (%d).", zx_ret);
+    zx_ret = zidx_cursor_destroy(cursor);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy cursor (%d).",
+                  zx_ret);
+    zx_ret = zidx_set_window_budget(indices[1], 65536);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set window budget (%d).",
+                  zx_ret);
+
+    zx_ret = zidx_set_window_budget(indices[1], 0);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't unset window budget (%d).",
+                  zx_ret);
+    offset = 3 * 1048576 + 100;
+    r_len = zidx_pread(indices[1], buffer, sizeof(buffer), offset);
+    ck_assert_msg(r_len == sizeof(buffer), "Read returned %d at offset %ld",
+                  r_len, offset);
+    ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                  "Incorrect data at offset %ld.", offset);
+    zx_ret = zidx_set_window_budget(indices[1], 65536);
+    ck_assert_msg(zx_ret == ZX_ERR_INVALID_OP, "Budget is set while index has "
+                  "cursors for positional reads (%d).", zx_ret);
+
+    destroy_index_pair(indices, streams);
+    sl_fclose(index_stream);
+    fclose(index_file);
+}
+END_TEST
+
+START_TEST(test_window_arena)
+{
+    int zx_ret;
+    int i, j;
+
+    FILE *index_file;
+    streamlike_t *index_stream;
+    zidx_index *indices[2];
+    streamlike_t *streams[2];
+    zidx_checkpoint *new_ckp;
+    zidx_checkpoint *old_ckp;
+
+    ZX_LOG("TEST: Allocating windows from arena.");
+
+    create_index_pair(comp_file, indices, streams);
+    for (i = 0; i < 2; i++) {
+        zx_ret = zidx_set_window_arena(indices[i], 65536, i == 1);
+        ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set window arena (%d).",
+                      zx_ret);
+    }
+
+    zx_ret = zidx_set_intra_block_checkpoints(indices[0], 65536);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set intra block step (%d).",
+                  zx_ret);
+    zx_ret = zidx_set_sparse_windows(indices[0], 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't enable sparse windows (%d).",
+                  zx_ret);
+    zx_ret = zidx_build_index(indices[0], 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    index_file = round_trip_index(indices[0], indices[1], IMPORT_EAGER,
+                                  &index_stream);
+
+    /* Windows are moved to arena after they are made sparse while building,
+     * and after they are read while importing. */
+    for (i = 0; i < indices[1]->list_count; i++) {
+        new_ckp = &indices[1]->list[i];
+        old_ckp = &indices[0]->list[i];
+        for (j = 0; j < 2; j++) {
+            ck_assert_msg(indices[j]->list[i].is_window_in_arena
+                              == (indices[j]->list[i].window_data != NULL
+                                  || indices[j]->list[i].block_header != NULL),
+                          "Window of checkpoint %d is not in arena of index "
+                          "%d.", i, j);
+        }
+        ck_assert_msg(new_ckp->window_ranges_count
+                          == old_ckp->window_ranges_count
+                          && !memcmp(new_ckp->window_ranges,
+                                     old_ckp->window_ranges,
+                                     4 * new_ckp->window_ranges_count),
+                      "Couldn't match window ranges at checkpoint %d.", i);
+        ck_assert_msg(!memcmp(new_ckp->window_data, old_ckp->window_data,
+                              stored_window_length(old_ckp)),
+                      "Couldn't match window at checkpoint %d.", i);
+        ck_assert_msg(new_ckp->block_header_bits == 0
+                          || !memcmp(new_ckp->block_header,
+                                     old_ckp->block_header,
+                                     (new_ckp->block_header_bits + 7) / 8),
+                      "Couldn't match block header at checkpoint %d.", i);
+    }
+    ck_assert_msg(indices[0]->arena != NULL && indices[1]->arena != NULL,
+                  "Windows are not allocated from arena.");
+
+    for (j = 0; j < 2; j++) {
+        check_checkpoint_seeks(indices[j], 1, 100);
+    }
+
+    for (i = 0; i < 2; i++) {
+        zx_ret = zidx_index_destroy(indices[i]);
+        ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).",
+                      zx_ret);
+        ck_assert_msg(indices[i]->arena == NULL, "Arena is not released.");
+        free(indices[i]);
+        sl_fclose(streams[i]);
+    }
+    sl_fclose(index_stream);
+    fclose(index_file);
+}
+END_TEST
+
+/* Counts memory blocks allocated by an index, to check that everything is
+ * allocated and released with allocator of index. */
+typedef struct counting_allocator_s
+{
+    pthread_mutex_t lock;
+    long live_count;
+    long total_count;
+} counting_allocator;
+
+static void* counting_malloc(void *opaque, size_t size)
+{
+    counting_allocator *counter = opaque;
+    void *ptr = malloc(size);
+    if (ptr != NULL) {
+        pthread_mutex_lock(&counter->lock);
+        counter->live_count++;
+        counter->total_count++;
+        pthread_mutex_unlock(&counter->lock);
+    }
+    return ptr;
+}
+
+static void* counting_realloc(void *opaque, void *ptr, size_t size)
+{
+    counting_allocator *counter = opaque;
+    void *new_ptr = realloc(ptr, size);
+    if (ptr == NULL && new_ptr != NULL) {
+        pthread_mutex_lock(&counter->lock);
+        counter->live_count++;
+        counter->total_count++;
+        pthread_mutex_unlock(&counter->lock);
+    }
+    return new_ptr;
+}
+
+static void counting_free(void *opaque, void *ptr)
+{
+    counting_allocator *counter = opaque;
+    if (ptr != NULL) {
+        pthread_mutex_lock(&counter->lock);
+        counter->live_count--;
+        pthread_mutex_unlock(&counter->lock);
+    }
+    free(ptr);
+}
+
+START_TEST(test_allocator)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[1024];
+    int i, j;
+    long offset;
+
+    FILE *index_file;
+    streamlike_t *index_stream;
+    zidx_index *index;
+    streamlike_t *stream;
+    counting_allocator counter;
+    zidx_allocator allocator = {
+        counting_malloc,
+        counting_realloc,
+        NULL,
+        &counter
+    };
+
+    ZX_LOG("TEST: Allocating memory with custom allocator.");
+
+    memset(&counter, 0, sizeof(counter));
+    pthread_mutex_init(&counter.lock, NULL);
+
+    index = zidx_index_create_ex(&allocator);
+    ck_assert_msg(index == NULL, "Index is created without free function.");
+    allocator.free_func = counting_free;
+
+    /* Index is built serially with compressed and sparse windows, exported and
+     * imported back at first, then it's built in parallel. */
+    for (j = 0; j < 2; j++) {
+        stream = sl_fopen2(comp_file);
+        ck_assert_msg(stream, "Couldn't create new stream.");
+        index = zidx_index_create_ex(&allocator);
+        ck_assert_msg(index, "Couldn't create new index.");
+        zx_ret = zidx_index_init(index, stream);
+        ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                           zx_ret);
+        ck_assert_msg(index->z_stream->zalloc == index_zalloc
+                          && index->z_stream->opaque == index,
+                      "z_stream doesn't use allocator of index.");
+
+        if (j == 0) {
+            zx_ret = zidx_set_window_compression(index, ZX_WINDOW_DEFLATE, 1);
+            ck_assert_msg(zx_ret == ZX_RET_OK,
+                          "Couldn't set window compression (%d).", zx_ret);
+            zx_ret = zidx_set_sparse_windows(index, 1);
+            ck_assert_msg(zx_ret == ZX_RET_OK,
+                          "Couldn't enable sparse windows (%d).", zx_ret);
+            zx_ret = zidx_build_index(index, 1048576, 1);
+            ck_assert_msg(zx_ret == ZX_RET_OK,
+                          "Error while building index (%d).", zx_ret);
+
+            index_file = tmpfile();
+            ck_assert_msg(index_file, "Couldn't open index file.");
+            index_stream = sl_fopen2(index_file);
+            ck_assert_msg(index_stream, "Couldn't create index stream.");
+            zx_ret = zidx_export(index, index_stream);
+            ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't export index (%d).",
+                          zx_ret);
+            ck_assert_msg(sl_seek(index_stream, 0, SL_SEEK_SET) == 0,
+                          "Couldn't rewind file.");
+            zx_ret = zidx_import(index, index_stream);
+            ck_assert_msg(zx_ret == ZX_RET_OK,
+                          "Couldn't import from file (%d).", zx_ret);
+            sl_fclose(index_stream);
+            fclose(index_file);
+        } else {
+            zx_ret = zidx_build_index_parallel(index, 1048576, 1, 4);
+            ck_assert_msg(zx_ret == ZX_RET_OK,
+                          "Error while building index (%d).", zx_ret);
+        }
+
+        for (i = index->list_count - 1; i > 0; i--) {
+            offset = index->list[i].offset.uncomp + 100;
+            zx_ret = zidx_seek(index, offset);
+            ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                                       zx_ret, offset);
+            r_len = zidx_read(index, buffer, sizeof(buffer));
+            ck_assert_msg(r_len == sizeof(buffer),
+                          "Read returned %d at offset %ld", r_len, offset);
+            ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                          "Incorrect data at offset %ld.", offset);
+        }
+
+        zx_ret = zidx_index_destroy(index);
+        ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).",
+                      zx_ret);
+        allocator.free_func(allocator.opaque, index);
+        sl_fclose(stream);
+
+        ck_assert_msg(counter.live_count == 0, "%ld blocks are not released.",
+                      counter.live_count);
+    }
+    ck_assert_msg(counter.total_count > 0, "Allocator is not used.");
+
+    pthread_mutex_destroy(&counter.lock);
+}
+END_TEST
+
+START_TEST(test_read_cache)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t *buffer;
+    int i, j;
+    long offset;
+    long hot[4];
+    size_t memory_usage;
+    unsigned long hits;
+    unsigned long misses;
+
+    zidx_index *index;
+    streamlike_t *comp_stream;
+
+    ZX_LOG("TEST: Caching decoded chunks for repeated reads.");
+
+    buffer = malloc(262144);
+    ck_assert_msg(buffer, "Couldn't allocate buffer.");
+
+    comp_stream = sl_fopen2(comp_file);
+    ck_assert_msg(comp_stream, "Couldn't create new stream.");
+    index = zidx_index_create();
+    ck_assert_msg(index, "Couldn't create new index.");
+    zx_ret = zidx_index_init(index, comp_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+
+    zx_ret = zidx_set_read_cache(index, 65536, 0);
+    ck_assert_msg(zx_ret == ZX_ERR_PARAMS, "Zero chunk size is accepted.");
+    zx_ret = zidx_set_read_cache(index, 65536, 131072);
+    ck_assert_msg(zx_ret == ZX_ERR_PARAMS,
+                  "Chunk size larger than budget is accepted.");
+    zx_ret = zidx_set_read_cache(index, 262144, 16384);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set read cache (%d).",
+                  zx_ret);
+
+    zx_ret = zidx_build_index(index, 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    /* Small reads clustered around a few offsets are served from cache. */
+    for (i = 0; i < 4; i++) {
+        hot[i] = (ZX_TEST_COMP_FILE_LENGTH - 65536) / 4 * (3 - i) + 1000;
+    }
+    for (j = 0; j < 64; j++) {
+        for (i = 0; i < 4; i++) {
+            offset = hot[i] + (j * 4099) % 32768;
+            zx_ret = zidx_seek(index, offset);
+            ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                                       zx_ret, offset);
+            ck_assert_msg(zidx_tell(index) == offset,
+                          "Tell returned %jd instead of %ld.",
+                          (intmax_t)zidx_tell(index), offset);
+            r_len = zidx_read(index, buffer, 512);
+            ck_assert_msg(r_len == 512, "Read returned %d at offset %ld",
+                                        r_len, offset);
+            ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                          "Incorrect data at offset %ld.", offset);
+        }
+    }
+    zx_ret = zidx_get_read_cache_stats(index, &memory_usage, &hits, &misses);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't get cache stats (%d).",
+                  zx_ret);
+    ck_assert_msg(hits > misses, "Cache hits (%lu) are not more than misses "
+                  "(%lu).", hits, misses);
+    ck_assert_msg(memory_usage <= 262144, "Cache memory (%zu) is over budget.",
+                  memory_usage);
+
+    /* Long read spans over several chunks and checkpoints. */
+    offset = 1048576 - 100000;
+    zx_ret = zidx_seek(index, offset);
+    ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                               zx_ret, offset);
+    r_len = zidx_read(index, buffer, 262144);
+    ck_assert_msg(r_len == 262144, "Read returned %d at offset %ld",
+                                   r_len, offset);
+    ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                  "Incorrect data at offset %ld.", offset);
+    ck_assert_msg(zidx_tell(index) == offset + r_len,
+                  "Tell returned %jd after read.",
+                  (intmax_t)zidx_tell(index));
+
+    /* Reading at the end of file. */
+    offset = ZX_TEST_COMP_FILE_LENGTH - 1000;
+    zx_ret = zidx_seek(index, offset);
+    ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                               zx_ret, offset);
+    ck_assert_msg(!zidx_eof(index), "EOF is reported before the end.");
+    r_len = zidx_read(index, buffer, 4096);
+    ck_assert_msg(r_len == 1000, "Read returned %d at offset %ld",
+                                 r_len, offset);
+    ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                  "Incorrect data at offset %ld.", offset);
+    ck_assert_msg(zidx_eof(index), "EOF is not reported at the end.");
+    r_len = zidx_read(index, buffer, 4096);
+    ck_assert_msg(r_len == 0, "Read returned %d at the end.", r_len);
+
+    zx_ret = zidx_seek(index, ZX_TEST_COMP_FILE_LENGTH + 1000);
+    ck_assert_msg(zx_ret == ZX_ERR_STREAM_EOF,
+                  "Seek beyond the end returned %d.", zx_ret);
+
+    /* Disabling cache continues from reading position. */
+    offset = 3 * 1048576 + 12345;
+    zx_ret = zidx_seek(index, offset);
+    ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                               zx_ret, offset);
+    zx_ret = zidx_set_read_cache(index, 0, 0);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't disable read cache (%d).",
+                  zx_ret);
+    r_len = zidx_read(index, buffer, 4096);
+    ck_assert_msg(r_len == 4096, "Read returned %d at offset %ld",
+                                 r_len, offset);
+    ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                  "Incorrect data at offset %ld.", offset);
+
+    zx_ret = zidx_index_destroy(index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).",
+                  zx_ret);
+    free(index);
+    sl_fclose(comp_stream);
+    free(buffer);
+}
+END_TEST
+
+START_TEST(test_seek_snapshots)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[4096];
+    int i;
+    long offset;
+    const zidx_checkpoint *snapshot;
+
+    zidx_index *index;
+    streamlike_t *comp_stream;
+
+    ZX_LOG("TEST: Seeking from decoder snapshots.");
+
+    comp_stream = sl_fopen2(comp_file);
+    ck_assert_msg(comp_stream, "Couldn't create new stream.");
+    index = zidx_index_create();
+    ck_assert_msg(index, "Couldn't create new index.");
+    zx_ret = zidx_index_init(index, comp_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+
+    zx_ret = zidx_set_seek_snapshots(index, -1, 65536);
+    ck_assert_msg(zx_ret == ZX_ERR_PARAMS, "Negative count is accepted.");
+    zx_ret = zidx_set_seek_snapshots(index, 8, 0);
+    ck_assert_msg(zx_ret == ZX_ERR_PARAMS, "Zero spacing is accepted.");
+    zx_ret = zidx_set_seek_snapshots(index, 8, 131072);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set snapshots (%d).",
+                  zx_ret);
+
+    zx_ret = zidx_build_index(index, 4 * 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    /* Reading forward snapshots decoder, and the ring wraps around. */
+    offset = 4 * 1048576 + 1000;
+    zx_ret = zidx_seek(index, offset);
+    ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                               zx_ret, offset);
+    for (i = 0; i < 512; i++) {
+        r_len = zidx_read(index, buffer, sizeof(buffer));
+        ck_assert_msg(r_len == sizeof(buffer), "Read returned %d.", r_len);
+    }
+    ck_assert_msg(index->snapshots_count == 8,
+                  "Number of snapshots is %d.", index->snapshots_count);
+
+    /* Seeking back and forth in the recently read region starts from
+     * snapshots rather than the checkpoint. */
+    for (i = 0; i < 32; i++) {
+        offset = 5 * 1048576 + 524288 + ((i * 7) % 16) * 32768 + 123;
+        snapshot = find_snapshot(index, offset, 4 * 1048576);
+        ck_assert_msg(snapshot != NULL, "No snapshot for offset %ld.",
+                      offset);
+        ck_assert_msg(offset - snapshot->offset.uncomp < 262144,
+                      "Snapshot at %jd is far from offset %ld.",
+                      (intmax_t)snapshot->offset.uncomp, offset);
+
+        zx_ret = zidx_seek(index, offset);
+        ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                                   zx_ret, offset);
+        r_len = zidx_read(index, buffer, sizeof(buffer));
+        ck_assert_msg(r_len == sizeof(buffer),
+                      "Read returned %d at offset %ld", r_len, offset);
+        ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                      "Incorrect data at offset %ld.", offset);
+    }
+
+    zx_ret = zidx_set_seek_snapshots(index, 0, 0);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't disable snapshots (%d).",
+                  zx_ret);
+    offset = 5 * 1048576;
+    zx_ret = zidx_seek(index, offset);
+    ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                               zx_ret, offset);
+    r_len = zidx_read(index, buffer, sizeof(buffer));
+    ck_assert_msg(r_len == sizeof(buffer),
+                  "Read returned %d at offset %ld", r_len, offset);
+    ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                  "Incorrect data at offset %ld.", offset);
+
+    zx_ret = zidx_index_destroy(index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).",
+                  zx_ret);
+    free(index);
+    sl_fclose(comp_stream);
+}
+END_TEST
+
+START_TEST(test_window_budget_caches)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[4096];
+    int i;
+    long offset;
+    size_t memory_usage;
+    size_t cache_usage;
+    unsigned long evictions;
+
+    zidx_index *index;
+    streamlike_t *comp_stream;
+
+    ZX_LOG("TEST: Counting decoding caches in window budget.");
+
+    comp_stream = sl_fopen2(comp_file);
+    ck_assert_msg(comp_stream, "Couldn't create new stream.");
+    index = zidx_index_create();
+    ck_assert_msg(index, "Couldn't create new index.");
+    zx_ret = zidx_index_init(index, comp_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+
+    zx_ret = zidx_set_read_cache(index, 65536, 16384);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set read cache (%d).",
+                  zx_ret);
+    zx_ret = zidx_set_seek_snapshots(index, 2, 131072);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set snapshots (%d).",
+                  zx_ret);
+    zx_ret = zidx_set_window_budget(index, 262144);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set window budget (%d).",
+                  zx_ret);
+    zx_ret = zidx_build_index(index, 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    /* Reading forward fills read cache and snapshots, and seeks going
+     * backwards load windows, which are evicted to leave room for caches. */
+    for (i = index->list_count - 1; i > 0; i--) {
+        offset = index->list[i].offset.uncomp + 1000;
+        zx_ret = zidx_seek(index, offset);
+        ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                                   zx_ret, offset);
+        while (offset < index->list[i].offset.uncomp + 393216
+                && offset + (long)sizeof(buffer) <= ZX_TEST_COMP_FILE_LENGTH) {
+            r_len = zidx_read(index, buffer, sizeof(buffer));
+            ck_assert_msg(r_len == sizeof(buffer),
+                          "Read returned %d at offset %ld", r_len, offset);
+            ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                          "Incorrect data at offset %ld.", offset);
+            offset += r_len;
+        }
+
+        zx_ret = zidx_get_window_stats(index, &memory_usage, &evictions);
+        ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't get window stats (%d).",
+                      zx_ret);
+        zx_ret = zidx_get_read_cache_stats(index, &cache_usage, NULL, NULL);
+        ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't get cache stats (%d).",
+                      zx_ret);
+        ck_assert_msg(memory_usage <= 262144, "Window memory (%zu) is over "
+                      "budget.", memory_usage);
+        ck_assert_msg(memory_usage >= cache_usage + index->snapshot_memory,
+                      "Window memory (%zu) doesn't include caches.",
+                      memory_usage);
+    }
+    ck_assert_msg(cache_usage > 0, "Read cache is empty.");
+    ck_assert_msg(index->snapshots_count > 0, "No snapshot is taken.");
+    ck_assert_msg(evictions > 0, "No window is evicted.");
+
+    /* Caches aren't evicted for budget, only windows are. */
+    zx_ret = zidx_set_window_budget(index, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set window budget (%d).",
+                  zx_ret);
+    ck_assert_msg(index->window_memory == 0,
+                  "Windows (%zu) are kept over budget.", index->window_memory);
+    zx_ret = zidx_get_read_cache_stats(index, &memory_usage, NULL, NULL);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't get cache stats (%d).",
+                  zx_ret);
+    ck_assert_msg(memory_usage == cache_usage, "Read cache is changed.");
+
+    /* Readahead keeps windows loaded, so it's not used with a budget. */
+    zx_ret = zidx_set_window_budget(index, 0);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't remove window budget (%d).",
+                  zx_ret);
+    zx_ret = zidx_set_readahead(index, 65536);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't enable readahead (%d).",
+                  zx_ret);
+    zx_ret = zidx_set_window_budget(index, 262144);
+    ck_assert_msg(zx_ret == ZX_ERR_INVALID_OP,
+                  "Window budget is set while readahead is enabled (%d).",
+                  zx_ret);
+    zx_ret = zidx_set_readahead(index, 0);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't disable readahead (%d).",
+                  zx_ret);
+
+    zx_ret = zidx_index_destroy(index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).",
+                  zx_ret);
+    free(index);
+    sl_fclose(comp_stream);
+}
+END_TEST
+
+/* Reads random ranges with a cursor and counts mismatches. */
+typedef struct cursor_reader_s
+{
+    zidx_index *index;
+    unsigned int seed;
+    int errors;
+} cursor_reader;
+
+static void* read_with_cursor(void *arg)
+{
+    cursor_reader *reader = arg;
+    streamlike_t *stream;
+    zidx_cursor *cursor;
+    uint8_t buffer[2048];
+    long offset;
+    int r_len;
+    int i;
+
+    stream = sl_fopen("cursor_file.tmp", "rb");
+    if (stream == NULL) {
+        reader->errors++;
+        return NULL;
+    }
+    cursor = zidx_cursor_create(reader->index, stream);
+    if (cursor == NULL) {
+        reader->errors++;
+        sl_fclose(stream);
+        return NULL;
+    }
+
+    for (i = 0; i < 40; i++) {
+        reader->seed = reader->seed * 1103515245 + 12345;
+        offset = (reader->seed >> 4)
+                 % (ZX_TEST_COMP_FILE_LENGTH - sizeof(buffer));
+        if (zidx_cursor_seek(cursor, offset) != ZX_RET_OK
+                || zidx_cursor_tell(cursor) != offset) {
+            reader->errors++;
+            continue;
+        }
+        r_len = zidx_cursor_read(cursor, buffer, sizeof(buffer));
+        if (r_len != sizeof(buffer)
+                || memcmp(buffer, uncomp_data + offset, r_len) != 0) {
+            reader->errors++;
+        }
+    }
+
+    if (zidx_cursor_destroy(cursor) != ZX_RET_OK) {
+        reader->errors++;
+    }
+    sl_fclose(stream);
+    return NULL;
+}
+
+START_TEST(test_cursors)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[4096];
+    size_t length;
+    int i;
+
+    FILE *file;
+    zidx_index *index;
+    streamlike_t *stream;
+    zidx_cursor *cursor;
+    pthread_t threads[4];
+    cursor_reader readers[4];
+
+    ZX_LOG("TEST: Reading concurrently with cursors.");
+
+    /* Each cursor opens the file on its own. */
+    file = fopen("cursor_file.tmp", "wb");
+    ck_assert_msg(file, "Couldn't open file.");
+    ck_assert_msg(fseek(comp_file, 0, SEEK_SET) == 0, "Couldn't rewind file.");
+    while ((length = fread(buffer, 1, sizeof(buffer), comp_file)) > 0) {
+        ck_assert_msg(fwrite(buffer, 1, length, file) == length,
+                      "Couldn't copy file.");
+    }
+    fclose(file);
+
+    stream = sl_fopen("cursor_file.tmp", "rb");
+    ck_assert_msg(stream, "Couldn't create new stream.");
+    index = zidx_index_create();
+    ck_assert_msg(index, "Couldn't create new index.");
+    zx_ret = zidx_index_init(index, stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+    zx_ret = zidx_build_index(index, 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    ck_assert_msg(zidx_cursor_create(NULL, stream) == NULL,
+                  "Cursor is created without index.");
+    ck_assert_msg(zidx_cursor_create(index, NULL) == NULL,
+                  "Cursor is created without stream.");
+
+    for (i = 0; i < 4; i++) {
+        readers[i].index  = index;
+        readers[i].seed   = i + 1;
+        readers[i].errors = 0;
+        ck_assert_msg(pthread_create(&threads[i], NULL, read_with_cursor,
+                                     &readers[i]) == 0,
+                      "Couldn't create thread.");
+    }
+    for (i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        ck_assert_msg(readers[i].errors == 0, "Cursor %d had %d errors.", i,
+                      readers[i].errors);
+    }
+
+    /* Cursor reaches the end of file on its own. */
+    cursor = zidx_cursor_create(index, stream);
+    ck_assert_msg(cursor, "Couldn't create cursor.");
+    zx_ret = zidx_cursor_seek(cursor, ZX_TEST_COMP_FILE_LENGTH - 100);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Seek returned %d.", zx_ret);
+    r_len = zidx_cursor_read(cursor, buffer, sizeof(buffer));
+    ck_assert_msg(r_len == 100, "Read returned %d.", r_len);
+    ck_assert_msg(memcmp(buffer, uncomp_data + ZX_TEST_COMP_FILE_LENGTH - 100,
+                         r_len) == 0, "Incorrect data at the end.");
+    ck_assert_msg(zidx_cursor_eof(cursor), "EOF is not reported.");
+    zx_ret = zidx_cursor_destroy(cursor);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy cursor (%d).",
+                  zx_ret);
+
+    zx_ret = zidx_index_destroy(index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).",
+                  zx_ret);
+    free(index);
+    sl_fclose(stream);
+    remove("cursor_file.tmp");
+}
+END_TEST
+
+/* Reads random ranges with zidx_pread() and counts mismatches. */
+static void* pread_randomly(void *arg)
+{
+    cursor_reader *reader = arg;
+    uint8_t buffer[2048];
+    long offset;
+    int r_len;
+    int i;
+
+    for (i = 0; i < 40; i++) {
+        reader->seed = reader->seed * 1103515245 + 12345;
+        offset = (reader->seed >> 4)
+                 % (ZX_TEST_COMP_FILE_LENGTH - sizeof(buffer));
+        r_len = zidx_pread(reader->index, buffer, sizeof(buffer), offset);
+        if (r_len != sizeof(buffer)
+                || memcmp(buffer, uncomp_data + offset, r_len) != 0) {
+            reader->errors++;
+        }
+    }
+    return NULL;
+}
+
+START_TEST(test_pread)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[4096];
+    int i;
+    long offset;
+
+    zidx_index *index;
+    streamlike_t *stream;
+    pthread_t threads[4];
+    cursor_reader readers[4];
+
+    ZX_LOG("TEST: Reading at offsets from multiple threads.");
+
+    stream = sl_fopen2(comp_file);
+    ck_assert_msg(stream, "Couldn't create new stream.");
+    index = zidx_index_create();
+    ck_assert_msg(index, "Couldn't create new index.");
+    zx_ret = zidx_index_init(index, stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+    zx_ret = zidx_build_index(index, 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    zx_ret = zidx_pread(index, NULL, 10, 0);
+    ck_assert_msg(zx_ret == ZX_ERR_PARAMS, "NULL buffer is accepted.");
+    zx_ret = zidx_pread(index, buffer, 10, -1);
+    ck_assert_msg(zx_ret == ZX_ERR_PARAMS, "Negative offset is accepted.");
+
+    for (i = 0; i < 4; i++) {
+        readers[i].index  = index;
+        readers[i].seed   = i + 1;
+        readers[i].errors = 0;
+        ck_assert_msg(pthread_create(&threads[i], NULL, pread_randomly,
+                                     &readers[i]) == 0,
+                      "Couldn't create thread.");
+    }
+    for (i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        ck_assert_msg(readers[i].errors == 0, "Reader %d had %d errors.", i,
+                      readers[i].errors);
+    }
+    ck_assert_msg(index->pread_pool->idle_count > 0
+                      && index->pread_pool->idle_count <= 4,
+                  "Pool has %d cursors.", index->pread_pool->idle_count);
+
+    /* Sequential reads continue with the cursor left there. */
+    offset = 2 * 1048576 + 100;
+    for (i = 0; i < 16; i++) {
+        r_len = zidx_pread(index, buffer, sizeof(buffer), offset);
+        ck_assert_msg(r_len == sizeof(buffer),
+                      "Read returned %d at offset %ld", r_len, offset);
+        ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                      "Incorrect data at offset %ld.", offset);
+        offset += r_len;
+    }
+
+    /* Reading at the end of file. */
+    offset = ZX_TEST_COMP_FILE_LENGTH - 100;
+    r_len = zidx_pread(index, buffer, sizeof(buffer), offset);
+    ck_assert_msg(r_len == 100, "Read returned %d at offset %ld",
+                                r_len, offset);
+    ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                  "Incorrect data at offset %ld.", offset);
+    r_len = zidx_pread(index, buffer, sizeof(buffer),
+                       ZX_TEST_COMP_FILE_LENGTH);
+    ck_assert_msg(r_len == 0, "Read returned %d at the end.", r_len);
+
+    /* Index still reads on its own. */
+    offset = 5 * 1048576 + 7;
+    zx_ret = zidx_seek(index, offset);
+    ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                               zx_ret, offset);
+    r_len = zidx_read(index, buffer, sizeof(buffer));
+    ck_assert_msg(r_len == sizeof(buffer),
+                  "Read returned %d at offset %ld", r_len, offset);
+    ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                  "Incorrect data at offset %ld.", offset);
+
+    zx_ret = zidx_index_destroy(index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).",
+                  zx_ret);
+    free(index);
+    sl_fclose(stream);
+}
+END_TEST
+
+START_TEST(test_read_batch)
+{
+    int zx_ret;
+    int i, j;
+    unsigned int seed;
+    uint8_t *data;
+    zidx_read_request *requests;
+    int count = 2000;
+    int threads[] = {1, 4};
+
+    zidx_index *index;
+    streamlike_t *stream;
+
+    ZX_LOG("TEST: Reading batches of ranges.");
+
+    requests = malloc(sizeof(zidx_read_request) * count);
+    ck_assert_msg(requests, "Couldn't allocate requests.");
+    data = malloc(count * 512);
+    ck_assert_msg(data, "Couldn't allocate buffers.");
+
+    stream = sl_fopen2(comp_file);
+    ck_assert_msg(stream, "Couldn't create new stream.");
+    index = zidx_index_create();
+    ck_assert_msg(index, "Couldn't create new index.");
+    zx_ret = zidx_index_init(index, stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+    zx_ret = zidx_build_index(index, 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    for (j = 0; j < 2; j++) {
+        /* Small ranges around a few offsets, overlapping each other, and a
+         * range at the end of file. */
+        seed = j + 1;
+        for (i = 0; i < count; i++) {
+            seed = seed * 1103515245 + 12345;
+            requests[i].offset = (seed >> 8) % 8 * 1048576
+                                 + (seed >> 4) % 65536;
+            requests[i].length = (seed >> 12) % 512;
+            requests[i].buffer = data + i * 512;
+            requests[i].result = -1;
+        }
+        requests[0].offset = ZX_TEST_COMP_FILE_LENGTH - 100;
+        requests[0].length = 200;
+
+        zx_ret = zidx_read_batch(index, requests, count, threads[j]);
+        ck_assert_msg(zx_ret == ZX_RET_OK, "Batch read returned %d.", zx_ret);
+        ck_assert_msg(requests[0].result == 100,
+                      "Read at the end returned %d.", requests[0].result);
+        for (i = 0; i < count; i++) {
+            ck_assert_msg(requests[i].result == requests[i].length || i == 0,
+                          "Request %d returned %d.", i, requests[i].result);
+            ck_assert_msg(memcmp(requests[i].buffer,
+                                 uncomp_data + requests[i].offset,
+                                 requests[i].result) == 0,
+                          "Incorrect data for request %d.", i);
+        }
+    }
+
+    /* Invalid requests fail on their own. */
+    requests[1].length = -1;
+    zx_ret = zidx_read_batch(index, requests, 3, 1);
+    ck_assert_msg(zx_ret == ZX_ERR_PARAMS, "Batch read returned %d.", zx_ret);
+    ck_assert_msg(requests[1].result == ZX_ERR_PARAMS,
+                  "Invalid request returned %d.", requests[1].result);
+    ck_assert_msg(requests[2].result == requests[2].length,
+                  "Request returned %d.", requests[2].result);
+
+    zx_ret = zidx_index_destroy(index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).",
+                  zx_ret);
+    free(index);
+    sl_fclose(stream);
+    free(data);
+    free(requests);
+}
+END_TEST
+
+START_TEST(test_readahead)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[10000];
+    long offset;
+    int i;
+
+    zidx_index *index;
+    streamlike_t *stream;
+
+    ZX_LOG("TEST: Reading sequentially with readahead.");
+
+    stream = sl_fopen2(comp_file);
+    ck_assert_msg(stream, "Couldn't create new stream.");
+    index = zidx_index_create();
+    ck_assert_msg(index, "Couldn't create new index.");
+    zx_ret = zidx_index_init(index, stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+    zx_ret = zidx_build_index(index, 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    zx_ret = zidx_set_readahead(index, 262144);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't enable readahead (%d).",
+                  zx_ret);
+
+    /* Read the whole file, jumping back and forth from time to time. */
+    offset = 0;
+    zx_ret = zidx_seek(index, offset);
+    ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                               zx_ret, offset);
+    for (i = 1; ; i++) {
+        if (i == 300) {
+            offset = 1048576 + 123;
+            zx_ret = zidx_seek(index, offset);
+            ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                                       zx_ret, offset);
+        } else if (i % 100 == 0) {
+            offset += i % 200 == 0 ? 5000 : 500000;
+            zx_ret = zidx_seek(index, offset);
+            ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                                       zx_ret, offset);
+        }
+        ck_assert_msg(zidx_tell(index) == offset,
+                      "Tell returned %jd instead of %ld.",
+                      (intmax_t)zidx_tell(index), offset);
+
+        r_len = zidx_read(index, buffer, sizeof(buffer));
+        ck_assert_msg(r_len >= 0, "Read returned %d at offset %ld",
+                                  r_len, offset);
+        ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                      "Incorrect data at offset %ld.", offset);
+        offset += r_len;
+        if (r_len < sizeof(buffer)) {
+            break;
+        }
+    }
+    ck_assert_msg(offset == ZX_TEST_COMP_FILE_LENGTH,
+                  "Reading stopped at %ld.", offset);
+    ck_assert_msg(zidx_eof(index), "EOF is not reported at the end.");
+    r_len = zidx_read(index, buffer, sizeof(buffer));
+    ck_assert_msg(r_len == 0, "Read returned %d at the end.", r_len);
+
+    zx_ret = zidx_seek(index, ZX_TEST_COMP_FILE_LENGTH + 1000);
+    ck_assert_msg(zx_ret == ZX_ERR_STREAM_EOF,
+                  "Seek beyond the end returned %d.", zx_ret);
+
+    /* Reading continues from the same position without readahead. */
+    offset = 7 * 1048576 + 99;
+    zx_ret = zidx_seek(index, offset);
+    ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld",
+                               zx_ret, offset);
+    r_len = zidx_read(index, buffer, 100);
+    ck_assert_msg(r_len == 100, "Read returned %d at offset %ld",
+                                r_len, offset);
+    zx_ret = zidx_set_readahead(index, 0);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't disable readahead (%d).",
+                  zx_ret);
+    offset += r_len;
+    r_len = zidx_read(index, buffer, sizeof(buffer));
+    ck_assert_msg(r_len == sizeof(buffer), "Read returned %d at offset %ld",
+                                           r_len, offset);
+    ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                  "Incorrect data at offset %ld.", offset);
+
+    zx_ret = zidx_index_destroy(index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).",
+                  zx_ret);
+    free(index);
+    sl_fclose(stream);
+}
+END_TEST
+
+START_TEST(test_readahead_growing)
+{
+    int zx_ret;
+    int r_len;
+    uint8_t buffer[1024];
+    int count;
+    long offset;
+
+    growing_file growing;
+    zidx_index *new_index;
+    streamlike_t *new_stream;
+    zidx_checkpoint ckp;
+
+    ZX_LOG("TEST: Updating index of a growing file with readahead.");
+
+    zx_ret = zidx_build_index(zx_index, 262144, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    growing.length = zx_index->compressed_size;
+    growing.data = malloc(growing.length);
+    ck_assert_msg(growing.data, "Couldn't allocate memory.");
+    ck_assert_msg(fseek(comp_file, 0, SEEK_SET) == 0,
+                  "Couldn't rewind compressed file.");
+    ck_assert_msg(fread(growing.data, 1, growing.length, comp_file)
+                    == (size_t)growing.length,
+                  "Couldn't read compressed file.");
+
+    growing.file = tmpfile();
+    ck_assert_msg(growing.file, "Couldn't create growing file.");
+    growing.written = 0;
+    growing.step = growing.length * 2 / 5;
+    ck_assert_msg(grow_file(&growing) == 0, "Couldn't grow file.");
+
+    new_stream = sl_fopen2(growing.file);
+    ck_assert_msg(new_stream, "Couldn't create new stream.");
+    new_index = zidx_index_create();
+    ck_assert_msg(new_index, "Couldn't create new index.");
+    zx_ret = zidx_index_init(new_index, new_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+
+    zx_ret = zidx_update_index(new_index, 262144, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't update index (%d).", zx_ret);
+    count = new_index->list_count;
+    ck_assert_msg(count > 1, "Not enough checkpoints are added.");
+
+    zx_ret = zidx_set_readahead(new_index, 262144);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't enable readahead (%d).",
+                  zx_ret);
+    offset = new_index->list[count - 1].offset.uncomp + 100;
+    zx_ret = zidx_seek(new_index, offset);
+    ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld", zx_ret,
+                  offset);
+    r_len = zidx_read(new_index, buffer, sizeof(buffer));
+    ck_assert_msg(r_len == sizeof(buffer), "Read returned %d at offset %ld",
+                  r_len, offset);
+
+    /* Checkpoint list can't be changed under the worker. */
+    growing.step = growing.length;
+    ck_assert_msg(grow_file(&growing) == 0, "Couldn't grow file.");
+    zx_ret = zidx_update_index(new_index, 262144, 1);
+    ck_assert_msg(zx_ret == ZX_ERR_INVALID_OP, "Updated index with readahead "
+                  "(%d).", zx_ret);
+    zx_ret = zidx_build_index(new_index, 262144, 1);
+    ck_assert_msg(zx_ret == ZX_ERR_INVALID_OP, "Built index with readahead "
+                  "(%d).", zx_ret);
+    memcpy(&ckp, &zx_index->list[zx_index->list_count - 1], sizeof(ckp));
+    ckp.window_data = NULL;
+    zx_ret = zidx_add_checkpoint(new_index, &ckp);
+    ck_assert_msg(zx_ret == ZX_ERR_INVALID_OP, "Added checkpoint with "
+                  "readahead (%d).", zx_ret);
+    ck_assert_msg(new_index->list_count == count, "Checkpoints are added.");
+
+    /* Readahead is disabled while updating. */
+    zx_ret = zidx_set_readahead(new_index, 0);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't disable readahead (%d).",
+                  zx_ret);
+    zx_ret = zidx_update_index(new_index, 262144, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't update index (%d).", zx_ret);
+    ck_assert_msg(zidx_eof(new_index), "File is not indexed to EOF.");
+    ck_assert_msg(new_index->list_count == zx_index->list_count,
+                  "Couldn't match the number of elements on new (%d) and old "
+                  "(%d) list.", new_index->list_count, zx_index->list_count);
+    zx_ret = zidx_set_readahead(new_index, 262144);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't enable readahead (%d).",
+                  zx_ret);
+
+    /* Seek backwards, then to appended data. */
+    offset = 1048576 + 77;
+    zx_ret = zidx_seek(new_index, offset);
+    ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld", zx_ret,
+                  offset);
+    r_len = zidx_read(new_index, buffer, sizeof(buffer));
+    ck_assert_msg(r_len == sizeof(buffer), "Read returned %d at offset %ld",
+                  r_len, offset);
+    ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                  "Incorrect data at offset %ld.", offset);
+    offset = ZX_TEST_COMP_FILE_LENGTH - sizeof(buffer);
+    zx_ret = zidx_seek(new_index, offset);
+    ck_assert_msg(zx_ret == 0, "Seek returned %d at offset %ld", zx_ret,
+                  offset);
+    r_len = zidx_read(new_index, buffer, sizeof(buffer));
+    ck_assert_msg(r_len == sizeof(buffer), "Read returned %d at offset %ld",
+                  r_len, offset);
+    ck_assert_msg(memcmp(buffer, uncomp_data + offset, r_len) == 0,
+                  "Incorrect data at offset %ld.", offset);
+
+    zx_ret = zidx_index_destroy(new_index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).", zx_ret);
+    free(new_index);
+    sl_fclose(new_stream);
+    fclose(growing.file);
+    free(growing.data);
+}
+END_TEST
+
+/* Checks chunks passed by zidx_read_parallel() against uncompressed data. */
+typedef struct parallel_checker_s
+{
+    off_t next;
+    int errors;
+    int calls;
+    size_t max_length;
+} parallel_checker;
+
+static int check_parallel_chunk(void *context, zidx_index *index,
+                                const void *data, size_t length, off_t offset)
+{
+    parallel_checker *checker = context;
+    (void)index;
+
+    checker->calls++;
+    if (length > checker->max_length) {
+        checker->max_length = length;
+    }
+    if (offset != checker->next
+            || memcmp(data, uncomp_data + offset, length) != 0) {
+        checker->errors++;
+    }
+    checker->next = offset + length;
+    return checker->calls == 1000 ? ZX_ERR_CORRUPTED : ZX_RET_OK;
+}
+
+START_TEST(test_read_parallel)
+{
+    int zx_ret;
+    int i;
+    int threads[] = {1, 4, 0};
+    parallel_checker checker;
+
+    zidx_index *index;
+    streamlike_t *stream;
+
+    ZX_LOG("TEST: Reading in parallel from checkpoints.");
+
+    stream = sl_fopen2(comp_file);
+    ck_assert_msg(stream, "Couldn't create new stream.");
+    index = zidx_index_create();
+    ck_assert_msg(index, "Couldn't create new index.");
+    zx_ret = zidx_index_init(index, stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+    zx_ret = zidx_build_index(index, 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    /* Whole file, and a range not aligned to checkpoints. */
+    for (i = 0; i < 3; i++) {
+        memset(&checker, 0, sizeof(checker));
+        zx_ret = zidx_read_parallel(index, 0, -1, threads[i],
+                                    check_parallel_chunk, &checker);
+        ck_assert_msg(zx_ret == ZX_RET_OK, "Parallel read returned %d.",
+                      zx_ret);
+        ck_assert_msg(checker.errors == 0, "%d chunks were incorrect.",
+                      checker.errors);
+        ck_assert_msg(checker.next == ZX_TEST_COMP_FILE_LENGTH,
+                      "Parallel read stopped at %jd.", (intmax_t)checker.next);
+
+        memset(&checker, 0, sizeof(checker));
+        checker.next = 1500000;
+        zx_ret = zidx_read_parallel(index, 1500000, 3000000, threads[i],
+                                    check_parallel_chunk, &checker);
+        ck_assert_msg(zx_ret == ZX_RET_OK, "Parallel read returned %d.",
+                      zx_ret);
+        ck_assert_msg(checker.errors == 0, "%d chunks were incorrect.",
+                      checker.errors);
+        ck_assert_msg(checker.next == 4500000,
+                      "Parallel read stopped at %jd.", (intmax_t)checker.next);
+    }
+
+    /* Errors from callback stop reading. */
+    memset(&checker, 0, sizeof(checker));
+    checker.calls = 997;
+    zx_ret = zidx_read_parallel(index, 0, -1, 4, check_parallel_chunk,
+                                &checker);
+    ck_assert_msg(zx_ret == ZX_ERR_CORRUPTED, "Parallel read returned %d.",
+                  zx_ret);
+    ck_assert_msg(checker.calls == 1000, "Callback was called %d times.",
+                  checker.calls - 997);
+
+    /* Long intervals of a sparse index are passed in pieces. */
+    zx_ret = zidx_index_destroy(index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).",
+                  zx_ret);
+    ck_assert_msg(sl_seek(stream, 0, SL_SEEK_SET) == 0,
+                  "Couldn't rewind file.");
+    zx_ret = zidx_index_init(index, stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+    zx_ret = zidx_build_index(index, 4 * ZX_TEST_COMP_FILE_LENGTH, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+    memset(&checker, 0, sizeof(checker));
+    zx_ret = zidx_read_parallel(index, 0, -1, 4, check_parallel_chunk,
+                                &checker);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Parallel read returned %d.", zx_ret);
+    ck_assert_msg(checker.errors == 0, "%d chunks were incorrect.",
+                  checker.errors);
+    ck_assert_msg(checker.next == ZX_TEST_COMP_FILE_LENGTH,
+                  "Parallel read stopped at %jd.", (intmax_t)checker.next);
+    ck_assert_msg(checker.max_length == ZX_PARALLEL_READ_BUFFER_,
+                  "Chunk of %zu bytes is passed.", checker.max_length);
+
+    zx_ret = zidx_index_destroy(index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).",
+                  zx_ret);
+    free(index);
+    sl_fclose(stream);
+}
+END_TEST
+
+/* Counts checkpoint lookups, with and without a hint, which differ from a
+ * linear search on list. */
+static int count_lookup_errors(zidx_index *index, unsigned int seed)
+{
+    long offset;
+    int expected;
+    int errors;
+    int hint;
+    int i;
+
+    errors = 0;
+    hint   = 0;
+
+    for (i = 0; i < 20000; i++) {
+        if (i < 10000) {
+            offset = i * 1049L;
+        } else {
+            seed   = seed * 1103515245 + 12345;
+            offset = (seed >> 4) % ZX_TEST_COMP_FILE_LENGTH;
+        }
+        for (expected = 0; expected + 1 < index->list_count
+                           && index->list[expected + 1].offset.uncomp
+                                  <= offset; expected++);
+        if (index->list[0].offset.uncomp > offset) {
+            expected = ZX_ERR_NOT_FOUND;
+        }
+        if (zidx_get_checkpoint_idx(index, offset) != expected
+                || find_checkpoint_idx(index, offset, &hint) != expected) {
+            ZX_LOG("Lookup of %ld didn't return %d.", offset, expected);
+            errors++;
+        }
+    }
+    return errors;
+}
+
+/* Lookups of a thread on a shared index. */
+typedef struct lookup_checker_s
+{
+    zidx_index *index;
+    unsigned int seed;
+    int errors;
+} lookup_checker;
+
+static void* check_lookups_in_thread(void *arg)
+{
+    lookup_checker *checker = arg;
+
+    checker->errors = count_lookup_errors(checker->index, checker->seed);
+    return NULL;
+}
+
+START_TEST(test_checkpoint_lookup)
+{
+    int zx_ret;
+    int i;
+    size_t bits;
+
+    pthread_t threads[4];
+    lookup_checker checkers[4];
+
+    zidx_index *index;
+    streamlike_t *stream;
+    streamlike_t *index_stream;
+
+    ZX_LOG("TEST: Looking up checkpoints.");
+
+    stream = sl_fopen2(comp_file);
+    ck_assert_msg(stream, "Couldn't create new stream.");
+    index = zidx_index_create();
+    ck_assert_msg(index, "Couldn't create new index.");
+    zx_ret = zidx_index_init(index, stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+    zx_ret = zidx_build_index(index, 32768, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+    ck_assert_msg(index->list_count > 2 * ZX_LOOKUP_BLOCK_,
+                  "Index has only %d checkpoints.", index->list_count);
+    ck_assert_msg(count_lookup_errors(index, 1) == 0,
+                  "Lookups returned wrong checkpoints.");
+
+    /* Each key is selected from encoded bits, which take much less than a
+     * whole offset. */
+    for (i = 0; i < index->list_count; i++) {
+        ck_assert_msg(get_lookup_key(&index->lookup, i)
+                          == index->list[i].offset.uncomp,
+                      "Lookup key %d doesn't match its checkpoint.", i);
+    }
+    bits = (size_t)index->lookup.capacity * index->lookup.width
+           + index->lookup.high_bits;
+    ck_assert_msg(bits < (size_t)index->lookup.capacity * 32,
+                  "Lookup keys take %zu bits for %d checkpoints.", bits,
+                  index->lookup.capacity);
+
+    /* Lookups don't modify index, so they can be run in parallel. */
+    for (i = 0; i < 4; i++) {
+        checkers[i].index = index;
+        checkers[i].seed  = i + 10;
+        ck_assert_msg(pthread_create(&threads[i], NULL,
+                                     check_lookups_in_thread,
+                                     &checkers[i]) == 0,
+                      "Couldn't create thread.");
+    }
+    for (i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        ck_assert_msg(checkers[i].errors == 0, "Lookups of thread %d returned "
+                      "%d wrong checkpoints.", i, checkers[i].errors);
+    }
+
+    index_stream = sl_fopen("lookup_index.tmp", "wb+");
+    ck_assert_msg(index_stream, "Couldn't open index file.");
+    zx_ret = zidx_export(index, index_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't export index (%d).", zx_ret);
+
+    /* Lookup keys are rebuilt when list is replaced by import. */
+    zx_ret = zidx_index_destroy(index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).",
+                  zx_ret);
+    ck_assert_msg(sl_seek(stream, 0, SL_SEEK_SET) == 0,
+                  "Couldn't rewind file.");
+    zx_ret = zidx_index_init(index, stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't initialize index (%d).",
+                                       zx_ret);
+    zx_ret = zidx_build_index(index, 1048576, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+    ck_assert_msg(count_lookup_errors(index, 2) == 0,
+                  "Lookups returned wrong checkpoints.");
+
+    ck_assert_msg(sl_seek(index_stream, 0, SL_SEEK_SET) == 0,
+                  "Couldn't rewind file.");
+    zx_ret = zidx_import(index, index_stream);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't import from file (%d).",
+                                       zx_ret);
+    ck_assert_msg(count_lookup_errors(index, 3) == 0,
+                  "Lookups returned wrong checkpoints.");
+
+    zx_ret = zidx_index_destroy(index);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't destroy index (%d).",
+                  zx_ret);
+    free(index);
+    sl_fclose(index_stream);
+    sl_fclose(stream);
+    remove("lookup_index.tmp");
+}
+END_TEST
+
+START_TEST(test_compact_offsets)
+{
+    int zx_ret;
+    unsigned int alignments[] = {1, 4096};
+    long lengths[2];
+    int i, j, k;
+
+    FILE *index_files[2];
+    streamlike_t *index_streams[2];
+    zidx_index *indices[2];
+    streamlike_t *streams[2];
+    zidx_checkpoint *new_ckp;
+    zidx_checkpoint *old_ckp;
+
+    ZX_LOG("TEST: Exporting compact offsets.");
+
+    create_index_pair(comp_file, indices, streams);
+    zx_ret = zidx_set_intra_block_checkpoints(indices[0], 65536);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set intra block step (%d).",
+                  zx_ret);
+    zx_ret = zidx_set_sparse_windows(indices[0], 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't enable sparse windows (%d).",
+                  zx_ret);
+    zx_ret = zidx_build_index(indices[0], 65536, 1);
+    ck_assert_msg(zx_ret == ZX_RET_OK, "Error while building index (%d).",
+                  zx_ret);
+
+    for (k = 0; k < 2; k++) {
+        zx_ret = zidx_set_export_alignment(indices[0], alignments[k]);
+        ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set export alignment "
+                      "(%d).", zx_ret);
+
+        /* Same index is exported with fixed and compact offsets. */
+        for (i = 0; i < 2; i++) {
+            zx_ret = zidx_set_export_compact_offsets(indices[0], i);
+            ck_assert_msg(zx_ret == ZX_RET_OK, "Couldn't set compact offsets "
+                          "(%d).", zx_ret);
+            index_files[i] = export_index_file(indices[0], &index_streams[i]);
+            lengths[i] = sl_tell(index_streams[i]);
+        }
+        ck_assert_msg(lengths[1] + 16 * indices[0]->list_count
+                          <= lengths[0] + alignments[k],
+                      "Compact index file (%ld) isn't smaller than %ld.",
+                      lengths[1], lengths[0]);
+
+        /* Compact index file is read, read lazily, and mapped. */
+        for (j = IMPORT_EAGER; j <= IMPORT_MMAP; j++) {
+            import_index_file(indices[1], indices[0], index_files[1],
+                              index_streams[1], j);
+            ck_assert_msg(indices[1]->list[0].window_offset % alignments[k]
+                              == 0,
+                          "Window data is not aligned (%ld).",
+                          (long)indices[1]->list[0].window_offset);
+
+            for (i = 0; i < indices[1]->list_count; i++) {
+                new_ckp = &indices[1]->list[i];
+                old_ckp = &indices[0]->list[i];
+                ck_assert_msg(new_ckp->offset.uncomp == old_ckp->offset.uncomp
+                                  && new_ckp->offset.comp
+                                         == old_ckp->offset.comp
+                                  && new_ckp->offset.comp_bits_count
+                                         == old_ckp->offset.comp_bits_count,
+                              "Couldn't match offsets at checkpoint %d.", i);
+                ck_assert_msg(new_ckp->window_ranges_count
+                                  == old_ckp->window_ranges_count,
+                              "Couldn't match window ranges at checkpoint "
+                              "%d.", i);
+            }
+
+            check_checkpoint_seeks(indices[1], 7, -512);
+        }
+
+        for (i = 0; i < 2; i++) {
+            sl_fclose(index_streams[i]);
+            fclose(index_files[i]);
+        }
+    }
+
+    destroy_index_pair(indices, streams);
+}
+END_TEST
+
 Suite* libzidx_test_suite()
 {
     Suite *s;
@@ -460,6 +3660,34 @@ Suite* libzidx_test_suite()
     tcase_add_test(tc_core, test_comp_file_seek_uncomp_space);
     tcase_add_test(tc_core, test_comp_file_sl_seek_uncomp_space);
     tcase_add_test(tc_core, test_export_import);
+    tcase_add_test(tc_core, test_import_legacy);
+    tcase_add_test(tc_core, test_build_index_parallel);
+    tcase_add_test(tc_core, test_build_index_async);
+    tcase_add_test(tc_core, test_auto_checkpoint);
+    tcase_add_test(tc_core, test_build_index_decode_cost);
+    tcase_add_test(tc_core, test_update_index);
+    tcase_add_test(tc_core, test_multi_member);
+    tcase_add_test(tc_core, test_bgzf);
+    tcase_add_test(tc_core, test_inflate_backend);
+    tcase_add_test(tc_core, test_intra_block);
+    tcase_add_test(tc_core, test_window_compression);
+    tcase_add_test(tc_core, test_sparse_windows);
+    tcase_add_test(tc_core, test_lazy_import);
+    tcase_add_test(tc_core, test_mmap_import);
+    tcase_add_test(tc_core, test_window_budget);
+    tcase_add_test(tc_core, test_window_arena);
+    tcase_add_test(tc_core, test_allocator);
+    tcase_add_test(tc_core, test_read_cache);
+    tcase_add_test(tc_core, test_seek_snapshots);
+    tcase_add_test(tc_core, test_window_budget_caches);
+    tcase_add_test(tc_core, test_cursors);
+    tcase_add_test(tc_core, test_pread);
+    tcase_add_test(tc_core, test_read_batch);
+    tcase_add_test(tc_core, test_readahead);
+    tcase_add_test(tc_core, test_readahead_growing);
+    tcase_add_test(tc_core, test_read_parallel);
+    tcase_add_test(tc_core, test_checkpoint_lookup);
+    tcase_add_test(tc_core, test_compact_offsets);
 
     suite_add_tcase(s, tc_core);
 